@@ -0,0 +1,231 @@
+#include "access_tracker.h"
+#include "logger.h"
+#include <stdatomic.h>
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    char username[MAX_USERNAME];
+    long long stamp_ns;     // Realtime stamp, used for last-writer-wins ordering
+    int hits;               // Accesses merged into this record
+} AccessRecord;
+
+// One ring per producer thread. The owning thread only writes `head`,
+// the flusher only writes `tail`, so no lock is needed between them.
+typedef struct AccessBuffer {
+    AccessRecord slots[ACCESS_BUFFER_SLOTS];
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int retired;     // Set when the owning thread exits
+    struct AccessBuffer *next;
+} AccessBuffer;
+
+static AccessBuffer *buffers = NULL;  // Registry of all live rings
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;  // One consumer at a time
+static pthread_key_t buffer_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread AccessBuffer *my_buffer = NULL;
+
+static AccessApplyFn apply_fn = NULL;
+static void *apply_ctx = NULL;
+static pthread_t flusher_tid;
+static volatile int flusher_running = 0;
+
+// Coalescing table, only touched while holding flush_mutex
+static AccessRecord *batch = NULL;
+static int *batch_index = NULL;   // Open-addressing slots into `batch`, -1 = empty
+static int batch_count = 0;
+#define BATCH_TABLE_SIZE (ACCESS_BATCH_MAX * 2)
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned int hash_name(const char *str) {
+    unsigned int hash = 5381;
+    int c;
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+static void retire_buffer(void *arg) {
+    AccessBuffer *buf = arg;
+    atomic_store_explicit(&buf->retired, 1, memory_order_release);
+}
+
+static void make_key() {
+    pthread_key_create(&buffer_key, retire_buffer);
+}
+
+static AccessBuffer* get_my_buffer() {
+    if (my_buffer) return my_buffer;
+
+    pthread_once(&key_once, make_key);
+
+    AccessBuffer *buf = calloc(1, sizeof(AccessBuffer));
+    if (!buf) return NULL;
+    atomic_init(&buf->head, 0);
+    atomic_init(&buf->tail, 0);
+    atomic_init(&buf->retired, 0);
+
+    pthread_mutex_lock(&registry_mutex);
+    buf->next = buffers;
+    buffers = buf;
+    pthread_mutex_unlock(&registry_mutex);
+
+    pthread_setspecific(buffer_key, buf);
+    my_buffer = buf;
+    return buf;
+}
+
+static void apply_batch() {
+    for (int i = 0; i < batch_count; i++) {
+        time_t accessed = (time_t)(batch[i].stamp_ns / 1000000000LL);
+        apply_fn(batch[i].filename, accessed, batch[i].username, batch[i].hits, apply_ctx);
+    }
+    if (batch_count > 0) {
+        log_formatted(LOG_DEBUG, "Applied %d coalesced access-time updates", batch_count);
+    }
+    batch_count = 0;
+    for (int i = 0; i < BATCH_TABLE_SIZE; i++) batch_index[i] = -1;
+}
+
+// Merge one record into the batch, keeping the newest access per file and
+// adding up the hits
+static void coalesce(const AccessRecord *rec) {
+    if (batch_count >= ACCESS_BATCH_MAX) {
+        apply_batch();
+    }
+
+    unsigned int slot = hash_name(rec->filename) % BATCH_TABLE_SIZE;
+    while (batch_index[slot] != -1) {
+        AccessRecord *existing = &batch[batch_index[slot]];
+        if (strcmp(existing->filename, rec->filename) == 0) {
+            int hits = existing->hits + rec->hits;
+            if (rec->stamp_ns >= existing->stamp_ns) {
+                memcpy(existing, rec, sizeof(AccessRecord));
+            }
+            existing->hits = hits;
+            return;
+        }
+        slot = (slot + 1) % BATCH_TABLE_SIZE;
+    }
+
+    batch_index[slot] = batch_count;
+    memcpy(&batch[batch_count++], rec, sizeof(AccessRecord));
+}
+
+static void drain_buffer(AccessBuffer *buf) {
+    unsigned int tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&buf->head, memory_order_acquire);
+
+    while (tail != head) {
+        coalesce(&buf->slots[tail % ACCESS_BUFFER_SLOTS]);
+        tail++;
+    }
+    atomic_store_explicit(&buf->tail, tail, memory_order_release);
+}
+
+void access_tracker_flush() {
+    if (!apply_fn || !batch) return;
+
+    pthread_mutex_lock(&flush_mutex);
+
+    pthread_mutex_lock(&registry_mutex);
+    AccessBuffer **link = &buffers;
+    while (*link) {
+        AccessBuffer *buf = *link;
+        int retired = atomic_load_explicit(&buf->retired, memory_order_acquire);
+        drain_buffer(buf);
+
+        // The owner is gone and everything it wrote has been drained
+        if (retired) {
+            *link = buf->next;
+            free(buf);
+            continue;
+        }
+        link = &buf->next;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    apply_batch();
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+void access_tracker_record(const char *filename, const char *username) {
+    AccessRecord rec;
+    strncpy(rec.filename, filename, MAX_FILENAME - 1);
+    rec.filename[MAX_FILENAME - 1] = '\0';
+    strncpy(rec.username, username, MAX_USERNAME - 1);
+    rec.username[MAX_USERNAME - 1] = '\0';
+    rec.stamp_ns = now_ns();
+    rec.hits = 1;
+
+    AccessBuffer *buf = flusher_running ? get_my_buffer() : NULL;
+    if (!buf) {
+        // Flusher not running (or out of memory): apply synchronously
+        if (apply_fn) apply_fn(rec.filename, (time_t)(rec.stamp_ns / 1000000000LL), rec.username, 1, apply_ctx);
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+
+    if (head - tail >= ACCESS_BUFFER_SLOTS) {
+        // Ring is full: fall back to a direct update rather than dropping it
+        apply_fn(rec.filename, (time_t)(rec.stamp_ns / 1000000000LL), rec.username, 1, apply_ctx);
+        return;
+    }
+
+    memcpy(&buf->slots[head % ACCESS_BUFFER_SLOTS], &rec, sizeof(AccessRecord));
+    atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+static void* flusher_thread(void *arg) {
+    (void)arg;
+
+    while (flusher_running) {
+        usleep(ACCESS_FLUSH_INTERVAL_MS * 1000);
+        access_tracker_flush();
+    }
+
+    return NULL;
+}
+
+int access_tracker_init(AccessApplyFn apply, void *ctx) {
+    apply_fn = apply;
+    apply_ctx = ctx;
+
+    batch = malloc(sizeof(AccessRecord) * ACCESS_BATCH_MAX);
+    batch_index = malloc(sizeof(int) * BATCH_TABLE_SIZE);
+    if (!batch || !batch_index) {
+        free(batch);
+        free(batch_index);
+        batch = NULL;
+        batch_index = NULL;
+        return -1;
+    }
+    for (int i = 0; i < BATCH_TABLE_SIZE; i++) batch_index[i] = -1;
+    batch_count = 0;
+    flusher_running = 1;
+
+    if (pthread_create(&flusher_tid, NULL, flusher_thread, NULL) != 0) {
+        flusher_running = 0;
+        return -1;
+    }
+
+    log_formatted(LOG_INFO, "Access tracker started (flush every %d ms)", ACCESS_FLUSH_INTERVAL_MS);
+    return 0;
+}
+
+void access_tracker_shutdown() {
+    if (!flusher_running) return;
+
+    flusher_running = 0;
+    pthread_join(flusher_tid, NULL);
+    access_tracker_flush();
+}
@@ -0,0 +1,32 @@
+#ifndef ACCESS_TRACKER_H
+#define ACCESS_TRACKER_H
+
+#include "common.h"
+
+// Access-time updates are recorded into a per-thread single-producer ring
+// and applied in batches by a background flusher, so the routing path never
+// needs the trie write lock just to bump `accessed`/`last_accessed_by`.
+// Each batch also carries how many accesses it merged per file.
+
+#define ACCESS_BUFFER_SLOTS 128          // Per-thread ring size (power of two)
+#define ACCESS_FLUSH_INTERVAL_MS 200     // How often the flusher drains rings
+#define ACCESS_BATCH_MAX 4096            // Distinct files coalesced per flush
+
+// Called by the flusher once per distinct file in a batch (last writer wins);
+// `hits` is the number of accesses merged into this update
+typedef void (*AccessApplyFn)(const char *filename, time_t accessed,
+                              const char *username, int hits, void *ctx);
+
+// Start the background flusher
+int access_tracker_init(AccessApplyFn apply, void *ctx);
+
+// Record an access from the calling thread (lock-free on the fast path)
+void access_tracker_record(const char *filename, const char *username);
+
+// Drain every ring and apply pending updates now
+void access_tracker_flush();
+
+// Stop the flusher after a final drain
+void access_tracker_shutdown();
+
+#endif // ACCESS_TRACKER_H
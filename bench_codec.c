@@ -0,0 +1,295 @@
+// Message codec benchmark.
+//
+// Encodes and decodes the messages that make up most traffic, one kind at a
+// time and then as a weighted mix:
+//
+//   ack        - a bare reply: type and status
+//   request    - a client request to the NM: sender and file name
+//   route      - the NM's READ/WRITE route reply: address, SS id and lease
+//   read-N     - an SS READ reply carrying N bytes of text
+//   token      - one STREAM word with its indexes
+//
+// For each it reports the encoded size, messages and MB per second, and
+// cycles per message (the time stamp counter, where the CPU has one) to
+// encode, to decode, and for init_message alone, which every decode and
+// most senders run on the whole Message. It also counts heap allocations per
+// message by wrapping the allocators at link time, and checks that every
+// kind survives the round trip before timing it.
+//
+// A codec is an entry in `codecs` below: an encoder that fills a buffer and
+// returns the frame length, and a decoder from that frame. The text codec
+// (serialize_message/deserialize_message) is the one the servers use; add
+// a new one there and pick it with --codec to compare.
+//
+// Usage: ./bench_codec [--codec NAME] [--ms MS]
+
+#include "common.h"
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define FRAME_BYTES (MAX_BUFFER * 2)
+
+typedef struct {
+    const char *name;
+    int (*encode)(Message *msg, char *frame, int size);    // Returns the frame length
+    void (*decode)(char *frame, int len, Message *msg);
+} Codec;
+
+static int text_encode(Message *msg, char *frame, int size) {
+    (void)size;
+    serialize_message(msg, frame);
+    return strlen(frame);
+}
+
+static void text_decode(char *frame, int len, Message *msg) {
+    (void)len;
+    deserialize_message(frame, msg);
+}
+
+static const Codec codecs[] = {
+    { "text", text_encode, text_decode },
+};
+
+typedef enum { KIND_ACK, KIND_REQUEST, KIND_ROUTE, KIND_READ_64, KIND_READ_1K, KIND_READ_4K,
+               KIND_READ_8K, KIND_TOKEN, KIND_COUNT } MessageKind;
+
+static const char *kind_names[KIND_COUNT] = { "ack", "request", "route", "read-64", "read-1K",
+                                              "read-4K", "read-8K", "token" };
+
+// The mix: mostly stream tokens and short request/reply pairs
+static const int kind_weights[KIND_COUNT] = { 20, 15, 15, 4, 4, 1, 1, 40 };
+
+static long alloc_blocks = 0;
+static long alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    alloc_bytes += size;
+    alloc_blocks++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    alloc_bytes += count * size;
+    alloc_blocks++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_bytes += size;
+    alloc_blocks++;
+    return __real_realloc(ptr, size);
+}
+
+static int case_ms = 300;
+static const Codec *codec = &codecs[0];
+
+static Message samples[KIND_COUNT];
+static char frames[KIND_COUNT][FRAME_BYTES];
+static int frame_lens[KIND_COUNT];
+
+static const char *filler[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot",
+                                "golf", "hotel", "india", "juliet", "kilo", "lima" };
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles() {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void fill_text(char *out, int len) {
+    int pos = 0, words = 0;
+    while (pos < len) {
+        const char *word = filler[words % 12];
+        words++;
+        pos += snprintf(out + pos, len - pos + 1, "%s%s", word, words % 9 == 0 ? ". " : " ");
+    }
+    out[len] = '\0';
+}
+
+static void make_samples() {
+    Message *m;
+
+    m = &samples[KIND_ACK];
+    init_message(m);
+    m->type = MSG_ACK;
+
+    m = &samples[KIND_REQUEST];
+    init_message(m);
+    m->type = MSG_INFO;
+    strcpy(m->sender, "alice");
+    strcpy(m->filename, "quarterly_report.txt");
+
+    m = &samples[KIND_ROUTE];
+    init_message(m);
+    m->type = MSG_READ;
+    strcpy(m->sender, "alice");
+    strcpy(m->filename, "quarterly_report.txt");
+    strcpy(m->data, "127.0.0.1:9001");
+    m->ss_id = 3;
+    m->access = ACCESS_READ;
+    strcpy(m->lease, "3.1760781234567.1.9f3c2a7b5e1d0c44");
+
+    int read_sizes[] = { 64, 1024, 4096, MAX_BUFFER - 1 };
+    for (int i = 0; i < 4; i++) {
+        m = &samples[KIND_READ_64 + i];
+        init_message(m);
+        m->type = MSG_READ;
+        fill_text(m->data, read_sizes[i]);
+    }
+
+    m = &samples[KIND_TOKEN];
+    init_message(m);
+    m->type = MSG_DATA;
+    m->status = 1;
+    strcpy(m->data, "charlie");
+    m->sentence_index = 12;
+    m->word_index = 4;
+}
+
+static int same_message(const Message *a, const Message *b) {
+    return a->type == b->type && a->status == b->status && a->sentence_index == b->sentence_index &&
+           a->word_index == b->word_index && a->ss_id == b->ss_id && a->access == b->access &&
+           strcmp(a->sender, b->sender) == 0 && strcmp(a->filename, b->filename) == 0 &&
+           strcmp(a->lease, b->lease) == 0 && strcmp(a->data, b->data) == 0;
+}
+
+typedef struct {
+    double ns;
+    double cycles;
+    long ops;
+} Timing;
+
+typedef enum { PHASE_ENCODE, PHASE_DECODE, PHASE_INIT } Phase;
+
+// Runs `phase` on the kinds drawn from `sequence` for case_ms
+static Timing run_phase(Phase phase, const int *sequence, int sequence_len, long *allocs) {
+    static char frame[FRAME_BYTES];
+    static Message msg;
+    long ops = 0;
+    long before = alloc_blocks;
+    double start = now_ns(), end;
+    unsigned long long start_cycles = cycles();
+    do {
+        for (int i = 0; i < 256; i++) {
+            int kind = sequence[(ops + i) % sequence_len];
+            switch (phase) {
+                case PHASE_ENCODE:
+                    codec->encode(&samples[kind], frame, sizeof(frame));
+                    break;
+                case PHASE_DECODE:
+                    codec->decode(frames[kind], frame_lens[kind], &msg);
+                    break;
+                case PHASE_INIT:
+                    init_message(&msg);
+                    break;
+            }
+        }
+        ops += 256;
+        end = now_ns();
+    } while (end - start < case_ms * 1e6);
+    Timing t = { end - start, (double)(cycles() - start_cycles), ops };
+    *allocs = alloc_blocks - before;
+    return t;
+}
+
+static void report(const char *name, const int *sequence, int sequence_len) {
+    long bytes = 0;
+    for (int i = 0; i < sequence_len; i++) bytes += frame_lens[sequence[i]];
+    double frame_avg = (double)bytes / sequence_len;
+
+    long enc_allocs, dec_allocs, init_allocs;
+    Timing enc = run_phase(PHASE_ENCODE, sequence, sequence_len, &enc_allocs);
+    Timing dec = run_phase(PHASE_DECODE, sequence, sequence_len, &dec_allocs);
+    Timing init = run_phase(PHASE_INIT, sequence, sequence_len, &init_allocs);
+
+    double enc_rate = enc.ops / (enc.ns / 1e9);
+    double dec_rate = dec.ops / (dec.ns / 1e9);
+#ifdef HAVE_TSC
+    printf("%-10s %8.0f %11.0f %9.1f %11.0f %9.1f %9.0f %9.0f %9.0f %7.2f\n", name, frame_avg,
+           enc_rate, enc_rate * frame_avg / (1024 * 1024), dec_rate, dec_rate * frame_avg / (1024 * 1024),
+           enc.cycles / enc.ops, dec.cycles / dec.ops, init.cycles / init.ops,
+           (double)(enc_allocs + dec_allocs) / (enc.ops + dec.ops));
+#else
+    printf("%-10s %8.0f %11.0f %9.1f %11.0f %9.1f %9s %9s %9s %7.2f\n", name, frame_avg,
+           enc_rate, enc_rate * frame_avg / (1024 * 1024), dec_rate, dec_rate * frame_avg / (1024 * 1024),
+           "-", "-", "-", (double)(enc_allocs + dec_allocs) / (enc.ops + dec.ops));
+#endif
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--codec") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            codec = NULL;
+            for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+                if (strcmp(codecs[c].name, name) == 0) codec = &codecs[c];
+            }
+            if (!codec) {
+                fprintf(stderr, "Unknown codec: %s\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--ms") == 0 && i + 1 < argc) {
+            case_ms = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--codec NAME] [--ms MS]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (case_ms < 1) {
+        fprintf(stderr, "Need a positive --ms\n");
+        return 1;
+    }
+
+    make_samples();
+    int result = 0;
+    for (int k = 0; k < KIND_COUNT; k++) {
+        frame_lens[k] = codec->encode(&samples[k], frames[k], FRAME_BYTES);
+        Message decoded;
+        codec->decode(frames[k], frame_lens[k], &decoded);
+        if (!same_message(&samples[k], &decoded)) {
+            fprintf(stderr, "%s: %s does not survive the round trip\n", codec->name, kind_names[k]);
+            result = 1;
+        }
+    }
+    if (result) return result;
+
+    printf("=== Codec '%s': %d ms per phase, Message is %zu bytes ===\n", codec->name, case_ms, sizeof(Message));
+    printf("%-10s %8s %11s %9s %11s %9s %9s %9s %9s %7s\n", "message", "bytes", "enc msg/s", "enc MB/s",
+           "dec msg/s", "dec MB/s", "enc cyc", "dec cyc", "init cyc", "allocs");
+    for (int k = 0; k < KIND_COUNT; k++) report(kind_names[k], &k, 1);
+
+    // The mix, in a fixed shuffled order so no kind runs in long streaks
+    int sequence[100];
+    int len = 0;
+    for (int k = 0; k < KIND_COUNT; k++) {
+        for (int w = 0; w < kind_weights[k]; w++) sequence[len++] = k;
+    }
+    unsigned int seed = 2463534242u;
+    for (int i = len - 1; i > 0; i--) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int j = seed % (i + 1);
+        int swap = sequence[i];
+        sequence[i] = sequence[j];
+        sequence[j] = swap;
+    }
+    report("mix", sequence, len);
+    return 0;
+}
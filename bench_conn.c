@@ -0,0 +1,262 @@
+// Connection-scaling benchmark for the name server.
+//
+// Opens a large number of idle, registered client sessions against the NM,
+// then drives READ routing requests from a few active sessions and reports
+// throughput, latency percentiles and (with --nm-pid) the NM's memory and
+// thread count while all sessions are held open.
+//
+// Usage: ./bench_conn [--host IP] [--idle N] [--active M] [--duration SEC] [--nm-pid PID]
+
+#include "common.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+
+typedef struct {
+    int id;
+    double *samples;      // Round-trip latencies in microseconds
+    int sample_count;
+    int sample_cap;
+    int errors;
+    int routed;           // Replies that carried an SS address
+} ActiveWorker;
+
+static char nm_host[INET_ADDRSTRLEN] = "127.0.0.1";
+static int idle_count = 1000;
+static int active_count = 4;
+static int duration_sec = 10;
+static int nm_pid = 0;
+static volatile int bench_running = 1;
+
+static double now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static int connect_nm() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(NM_CLIENT_PORT);
+    inet_pton(AF_INET, nm_host, &addr.sin_addr);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Connect and complete the MSG_REG_CLIENT handshake
+static int open_session(const char *username) {
+    int sock = connect_nm();
+    if (sock < 0) return -1;
+
+    // Don't hang if the NM sheds the connection at its descriptor limit
+    set_socket_timeouts(sock, 5, 5);
+
+    Message msg;
+    init_message(&msg);
+    msg.type = MSG_REG_CLIENT;
+    strcpy(msg.sender, username);
+    strcpy(msg.data, "127.0.0.1");
+
+    Message response;
+    if (send_message(sock, &msg) < 0 || recv_message(sock, &response) < 0 ||
+        response.status != SUCCESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int simple_request(int sock, MessageType type, const char *username, const char *filename) {
+    Message msg;
+    init_message(&msg);
+    msg.type = type;
+    strcpy(msg.sender, username);
+    strcpy(msg.filename, filename);
+
+    Message response;
+    if (send_message(sock, &msg) < 0 || recv_message(sock, &response) < 0) {
+        return -1;
+    }
+    return response.status;
+}
+
+static void add_sample(ActiveWorker *w, double value) {
+    if (w->sample_count == w->sample_cap) {
+        w->sample_cap = w->sample_cap ? w->sample_cap * 2 : 4096;
+        w->samples = realloc(w->samples, sizeof(double) * w->sample_cap);
+    }
+    w->samples[w->sample_count++] = value;
+}
+
+static void* active_worker(void *arg) {
+    ActiveWorker *w = arg;
+
+    char username[MAX_USERNAME];
+    char filename[MAX_FILENAME];
+    snprintf(username, sizeof(username), "bench_act_%d_%d", getpid(), w->id);
+    snprintf(filename, sizeof(filename), "bench_conn_%d_%d.txt", getpid(), w->id);
+
+    int sock = open_session(username);
+    if (sock < 0) {
+        fprintf(stderr, "Active session %d failed to register\n", w->id);
+        w->errors++;
+        return NULL;
+    }
+
+    // Own file so the READ path exercises the full access check and routing;
+    // without a storage server this measures the not-found path instead
+    int created = simple_request(sock, MSG_CREATE, username, filename) == SUCCESS;
+
+    while (bench_running) {
+        Message msg;
+        init_message(&msg);
+        msg.type = MSG_READ;
+        strcpy(msg.sender, username);
+        strcpy(msg.filename, filename);
+
+        Message response;
+        double start = now_us();
+        if (send_message(sock, &msg) < 0 || recv_message(sock, &response) < 0) {
+            w->errors++;
+            break;
+        }
+        add_sample(w, now_us() - start);
+        if (response.status == SUCCESS) w->routed++;
+    }
+
+    if (created) simple_request(sock, MSG_DELETE, username, filename);
+    close(sock);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_nm_status() {
+    if (nm_pid <= 0) return;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", nm_pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("NM status:        unavailable (pid %d)\n", nm_pid);
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0 || strncmp(line, "Threads:", 8) == 0) {
+            printf("NM %s", line);
+        }
+    }
+    fclose(f);
+}
+
+static void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            strncpy(nm_host, argv[++i], sizeof(nm_host) - 1);
+        } else if (strcmp(argv[i], "--idle") == 0 && i + 1 < argc) {
+            idle_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--active") == 0 && i + 1 < argc) {
+            active_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--nm-pid") == 0 && i + 1 < argc) {
+            nm_pid = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--host IP] [--idle N] [--active M] [--duration SEC] [--nm-pid PID]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    raise_fd_limit();
+
+    // Phase 1: hold idle sessions open
+    int *idle_socks = malloc(sizeof(int) * (idle_count > 0 ? idle_count : 1));
+    int idle_open = 0;
+    double start = now_us();
+    for (int i = 0; i < idle_count; i++) {
+        char username[MAX_USERNAME];
+        snprintf(username, sizeof(username), "bench_idle_%d_%d", getpid(), i);
+        int sock = open_session(username);
+        if (sock < 0) {
+            fprintf(stderr, "Idle session %d failed (errno: %d), continuing with %d\n", i, errno, idle_open);
+            break;
+        }
+        idle_socks[idle_open++] = sock;
+    }
+    double connect_secs = (now_us() - start) / 1000000.0;
+
+    printf("=== NM connection scaling ===\n");
+    printf("Idle sessions:    %d/%d in %.2f s (%.0f sessions/s)\n", idle_open, idle_count,
+           connect_secs, connect_secs > 0 ? idle_open / connect_secs : 0.0);
+    print_nm_status();
+
+    // Phase 2: drive requests while the idle sessions stay connected
+    ActiveWorker *workers = calloc(active_count, sizeof(ActiveWorker));
+    pthread_t *tids = malloc(sizeof(pthread_t) * active_count);
+    for (int i = 0; i < active_count; i++) {
+        workers[i].id = i;
+        pthread_create(&tids[i], NULL, active_worker, &workers[i]);
+    }
+
+    sleep(duration_sec);
+    bench_running = 0;
+    for (int i = 0; i < active_count; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    int total = 0, errors = 0, routed = 0;
+    for (int i = 0; i < active_count; i++) {
+        total += workers[i].sample_count;
+        errors += workers[i].errors;
+        routed += workers[i].routed;
+    }
+
+    double *all = malloc(sizeof(double) * (total > 0 ? total : 1));
+    int pos = 0;
+    for (int i = 0; i < active_count; i++) {
+        memcpy(all + pos, workers[i].samples, sizeof(double) * workers[i].sample_count);
+        pos += workers[i].sample_count;
+        free(workers[i].samples);
+    }
+    qsort(all, total, sizeof(double), compare_double);
+
+    printf("Active sessions:  %d for %d s\n", active_count, duration_sec);
+    printf("Requests:         %d (%d routed to an SS, %d errors)\n", total, routed, errors);
+    printf("Throughput:       %.0f req/s\n", duration_sec > 0 ? (double)total / duration_sec : 0.0);
+    if (total > 0) {
+        printf("Latency (us):     p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+               all[(int)(total * 0.50)], all[(int)(total * 0.90)],
+               all[(int)(total * 0.99)], all[total - 1]);
+    }
+    print_nm_status();
+
+    for (int i = 0; i < idle_open; i++) {
+        close(idle_socks[i]);
+    }
+
+    free(all);
+    free(idle_socks);
+    free(workers);
+    free(tids);
+    return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,372 @@
+// Write contention benchmark.
+//
+// Starts a name server and one storage server on this machine, in a scratch
+// directory, and has --sessions users edit one shared document at the same
+// time. For each document size in --sentences, the first user creates the
+// file, fills it with that many sentences and gives the others write access.
+// Then, for --rounds rounds, every user at once opens a write session
+// (LOCK_SENTENCE), inserts --words words one at a time (WRITE) and commits
+// (UNLOCK_SENTENCE); a round ends when all have committed.
+//
+// By default each user locks a sentence of its own, spread through the
+// document, so sessions only meet in the SS's per-file commit queue. With
+// --same they all want sentence 0 and queue on its lock: a user refused
+// with ERR_SENTENCE_LOCKED retries every --backoff-us.
+//
+// Reports per document size:
+//   lock     - from the first LOCK_SENTENCE to the granted one, retries included
+//   retries  - LOCK_SENTENCE refusals per session
+//   insert   - one WRITE
+//   commit   - the UNLOCK_SENTENCE that merges the session into the file
+// as p50/p99 (and max for commits), with --json for the record. Commit time
+// growing with the document is the cost of merging into the whole file.
+//
+// Run from the build directory (it execs ./nm and ./ss), with no other name
+// server on this machine.
+//
+// Usage: ./bench_contend [--sessions K] [--words W] [--rounds R] [--sentences N,N,...]
+//                        [--same] [--backoff-us US] [--json FILE|-] [--bin-dir DIR]
+
+#include "bench_util.h"
+#include "docs.h"
+
+#define BASE_SS_PORT 9650
+#define MAX_SESSIONS 64
+#define MAX_DOC_SIZES 16
+#define SENTENCES_PER_FILL 100   // Sentences appended per preload WRITE session
+#define LOCK_GIVE_UP_MS 30000    // A session that cannot lock for this long counts as an error
+
+typedef struct {
+    Histogram lock;
+    Histogram insert;
+    Histogram commit;
+    long sessions;
+    long retries;
+    long errors;
+} SizeStats;
+
+typedef struct {
+    int id;
+    char username[MAX_USERNAME];
+    DocsClient *docs;
+    SizeStats stats;             // This size's figures; merged after each size
+    pthread_t thread;
+} Editor;
+
+static int session_count = 4;
+static int words = 4;
+static int rounds = 20;
+static int same_sentence = 0;
+static int backoff_us = 1000;
+static int doc_sizes[MAX_DOC_SIZES] = { 10, 100, 1000 };
+static int doc_size_count = 3;
+static char json_path[MAX_PATH] = "";
+static char bin_dir[MAX_PATH] = ".";
+
+static BenchCluster cluster;
+
+static Editor editors[MAX_SESSIONS];
+static pthread_barrier_t round_start;
+static char current_file[MAX_FILENAME];
+static int current_sentences = 0;
+
+static const char *filler[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot",
+                                "golf", "hotel", "india", "juliet", "kilo", "lima" };
+
+static void add_sample(Histogram *h, double start_ms) {
+    hist_add(h, (long)((now_ms() - start_ms) * 1000.0));
+}
+
+// ---------------------------------------------------------------------------
+// The document
+// ---------------------------------------------------------------------------
+
+static int name_request(DocsClient *docs, Message *msg) {
+    Message response;
+    return docs_call(docs, msg, &response);
+}
+
+// Create `filename` as the first editor, append `sentences` sentences and
+// give every other editor write access. Returns the status, with the bytes
+// written in `bytes`.
+static int prepare_document(const char *filename, int sentences, long *bytes) {
+    DocsClient *owner = editors[0].docs;
+    Message msg;
+    init_message(&msg);
+    msg.type = MSG_CREATE;
+    strcpy(msg.filename, filename);
+    int status = name_request(owner, &msg);
+    if (status != SUCCESS) return status;
+
+    *bytes = 0;
+    int written = 0, word = 0;
+    while (written < sentences) {
+        char chunk[MAX_BUFFER];
+        int len = 0, batch = 0;
+        while (batch < SENTENCES_PER_FILL && written + batch < sentences) {
+            for (int w = 0; w < 5; w++) {
+                len += snprintf(chunk + len, sizeof(chunk) - len, "%s%s%s", len > 0 ? " " : "",
+                                filler[word++ % 12], w == 4 ? "." : "");
+            }
+            batch++;
+        }
+        DocsWriteSession *session;
+        status = docs_write_open(owner, filename, written, &session);
+        if (status != SUCCESS) return status;
+        status = docs_write_word(session, 1, chunk);
+        int closed = docs_write_close(session, status == SUCCESS);
+        if (status == SUCCESS) status = closed;
+        if (status != SUCCESS) return status;
+        written += batch;
+        *bytes += len + 1;
+    }
+
+    for (int i = 1; i < session_count; i++) {
+        init_message(&msg);
+        msg.type = MSG_ADDACCESS;
+        strcpy(msg.filename, filename);
+        strcpy(msg.target_user, editors[i].username);
+        msg.access = ACCESS_READWRITE;
+        status = name_request(owner, &msg);
+        if (status != SUCCESS) return status;
+    }
+    return SUCCESS;
+}
+
+// One write session: lock (retrying while another user holds the
+// sentence), insert, commit
+static void edit_once(Editor *e, int round) {
+    int sentence = 0;
+    if (!same_sentence && current_sentences > 0) {
+        sentence = (int)((long)e->id * current_sentences / session_count);
+    }
+
+    double lock_start = now_ms();
+    DocsWriteSession *session = NULL;
+    int status;
+    while ((status = docs_write_open(e->docs, current_file, sentence, &session)) == ERR_SENTENCE_LOCKED &&
+           now_ms() - lock_start < LOCK_GIVE_UP_MS) {
+        e->stats.retries++;
+        if (backoff_us > 0) usleep(backoff_us);
+    }
+    if (status != SUCCESS) {
+        e->stats.errors++;
+        return;
+    }
+    add_sample(&e->stats.lock, lock_start);
+
+    for (int w = 0; w < words; w++) {
+        char word[32];
+        snprintf(word, sizeof(word), "u%dr%dw%d", e->id, round, w);
+        double start = now_ms();
+        if (docs_write_word(session, 1, word) != SUCCESS) {
+            e->stats.errors++;
+            docs_write_close(session, 0);
+            return;
+        }
+        add_sample(&e->stats.insert, start);
+    }
+
+    double start = now_ms();
+    if (docs_write_close(session, 1) != SUCCESS) {
+        e->stats.errors++;
+        return;
+    }
+    add_sample(&e->stats.commit, start);
+    e->stats.sessions++;
+}
+
+static void* editor_main(void *arg) {
+    Editor *e = arg;
+    for (int r = 0; r < rounds; r++) {
+        pthread_barrier_wait(&round_start);
+        edit_once(e, r);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Cluster
+// ---------------------------------------------------------------------------
+
+static int start_cluster(const char *workdir) {
+    BenchClusterSpec spec = {
+        .bin_dir = bin_dir,
+        .workdir = workdir,
+        .ss_count = 1,
+        .base_ss_port = BASE_SS_PORT,
+        .settle_sec = 1,
+    };
+    return bench_start_cluster(&cluster, &spec);
+}
+
+// ---------------------------------------------------------------------------
+// Results
+// ---------------------------------------------------------------------------
+
+static void print_row(int sentences, long bytes, const SizeStats *s, double elapsed_s) {
+    printf("%9d %8ld %8ld %8.1f %8.2f %8.2f %7.2f %8.2f %8.2f %8.2f %8.2f %8.2f %6ld\n",
+           sentences, bytes, s->sessions, s->sessions / elapsed_s,
+           hist_percentile_ms(&s->lock, 0.50), hist_percentile_ms(&s->lock, 0.99),
+           s->sessions ? (double)s->retries / s->sessions : 0.0,
+           hist_percentile_ms(&s->insert, 0.50), hist_percentile_ms(&s->insert, 0.99),
+           hist_percentile_ms(&s->commit, 0.50), hist_percentile_ms(&s->commit, 0.99),
+           s->commit.max_us / 1000.0, s->errors);
+    fflush(stdout);
+}
+
+static void json_row(FILE *out, int first, int sentences, long bytes, const SizeStats *s, double elapsed_s) {
+    fprintf(out, "%s    {\"sentences\": %d, \"bytes\": %ld, \"sessions\": %ld, \"errors\": %ld, "
+                 "\"sessions_per_s\": %.1f, \"lock_p50_ms\": %.3f, \"lock_p99_ms\": %.3f, "
+                 "\"retries_per_session\": %.2f, \"insert_p50_ms\": %.3f, \"insert_p99_ms\": %.3f, "
+                 "\"commit_p50_ms\": %.3f, \"commit_p99_ms\": %.3f, \"commit_max_ms\": %.3f}",
+            first ? "" : ",\n", sentences, bytes, s->sessions, s->errors, s->sessions / elapsed_s,
+            hist_percentile_ms(&s->lock, 0.50), hist_percentile_ms(&s->lock, 0.99),
+            s->sessions ? (double)s->retries / s->sessions : 0.0,
+            hist_percentile_ms(&s->insert, 0.50), hist_percentile_ms(&s->insert, 0.99),
+            hist_percentile_ms(&s->commit, 0.50), hist_percentile_ms(&s->commit, 0.99), s->commit.max_us / 1000.0);
+}
+
+static int parse_sizes(char *spec) {
+    int parsed[MAX_DOC_SIZES];
+    int count = 0;
+    for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+        if (count == MAX_DOC_SIZES || atoi(item) < 1) return -1;
+        parsed[count++] = atoi(item);
+    }
+    if (count == 0) return -1;
+    memcpy(doc_sizes, parsed, sizeof(int) * count);
+    doc_size_count = count;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int bad = 0;
+    for (int i = 1; i < argc && !bad; i++) {
+        if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            session_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--words") == 0 && i + 1 < argc) {
+            words = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sentences") == 0 && i + 1 < argc) {
+            bad = parse_sizes(argv[++i]) != 0;
+        } else if (strcmp(argv[i], "--same") == 0) {
+            same_sentence = 1;
+        } else if (strcmp(argv[i], "--backoff-us") == 0 && i + 1 < argc) {
+            backoff_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            strncpy(json_path, argv[++i], sizeof(json_path) - 1);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            strncpy(bin_dir, argv[++i], sizeof(bin_dir) - 1);
+        } else {
+            bad = 1;
+        }
+    }
+    if (bad || session_count < 1 || session_count > MAX_SESSIONS || words < 0 || rounds < 1 || backoff_us < 0) {
+        fprintf(stderr, "Usage: %s [--sessions K] [--words W] [--rounds R] [--sentences N,N,...]\n"
+                        "       [--same] [--backoff-us US] [--json FILE|-] [--bin-dir DIR]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // Each editor drives its own session on its own thread; libdocs' pool is not used
+    setenv("DOCS_WORKERS", "1", 0);
+
+    // The JSON takes stdout if asked to; everything else goes to stderr then
+    int json_stdout = strcmp(json_path, "-") == 0;
+    if (json_stdout) {
+        int saved = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        json_stdout = saved;
+    }
+
+    char workdir[] = "/tmp/docs_contend_XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (start_cluster(workdir) != 0) {
+        bench_stop_cluster(&cluster);
+        return 1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < session_count && result == 0; i++) {
+        editors[i].id = i;
+        snprintf(editors[i].username, sizeof(editors[i].username), "editor%d", i);
+        int status;
+        editors[i].docs = docs_connect("127.0.0.1", NM_CLIENT_PORT, editors[i].username, &status);
+        if (!editors[i].docs) {
+            fprintf(stderr, "%s could not register: %d\n", editors[i].username, status);
+            result = 1;
+        }
+    }
+
+    SizeStats totals[MAX_DOC_SIZES];
+    long bytes[MAX_DOC_SIZES];
+    double elapsed[MAX_DOC_SIZES];
+    memset(totals, 0, sizeof(totals));
+    if (result == 0) {
+        printf("=== Contention: %d sessions on %s, %d words each, %d rounds, %ld cores ===\n",
+               session_count, same_sentence ? "the same sentence" : "their own sentences", words, rounds,
+               sysconf(_SC_NPROCESSORS_ONLN));
+        printf("%9s %8s %8s %8s %8s %8s %7s %8s %8s %8s %8s %8s %6s\n", "sentences", "bytes", "sessions",
+               "sess/s", "lock p50", "lock p99", "retries", "ins p50", "ins p99", "com p50", "com p99",
+               "com max", "errors");
+    }
+    for (int d = 0; d < doc_size_count && result == 0; d++) {
+        snprintf(current_file, sizeof(current_file), "contend_%d.txt", doc_sizes[d]);
+        current_sentences = doc_sizes[d];
+        int status = prepare_document(current_file, doc_sizes[d], &bytes[d]);
+        if (status != SUCCESS) {
+            fprintf(stderr, "Could not prepare %s: %d\n", current_file, status);
+            result = 1;
+            break;
+        }
+
+        pthread_barrier_init(&round_start, NULL, session_count);
+        double start = now_ms();
+        for (int i = 0; i < session_count; i++) {
+            memset(&editors[i].stats, 0, sizeof(SizeStats));
+            pthread_create(&editors[i].thread, NULL, editor_main, &editors[i]);
+        }
+        for (int i = 0; i < session_count; i++) pthread_join(editors[i].thread, NULL);
+        elapsed[d] = (now_ms() - start) / 1000.0;
+        pthread_barrier_destroy(&round_start);
+
+        SizeStats *t = &totals[d];
+        for (int i = 0; i < session_count; i++) {
+            hist_merge(&t->lock, &editors[i].stats.lock);
+            hist_merge(&t->insert, &editors[i].stats.insert);
+            hist_merge(&t->commit, &editors[i].stats.commit);
+            t->sessions += editors[i].stats.sessions;
+            t->retries += editors[i].stats.retries;
+            t->errors += editors[i].stats.errors;
+        }
+        print_row(doc_sizes[d], bytes[d], t, elapsed[d]);
+    }
+
+    for (int i = 0; i < session_count; i++) {
+        if (editors[i].docs) docs_close(editors[i].docs);
+    }
+    bench_stop_cluster(&cluster);
+
+    if (result == 0 && json_path[0]) {
+        FILE *out = json_stdout ? fdopen(json_stdout, "w") : fopen(json_path, "w");
+        if (!out) {
+            perror(json_path);
+            result = 1;
+        } else {
+            fprintf(out, "{\n  \"config\": {\"sessions\": %d, \"words\": %d, \"rounds\": %d, \"same_sentence\": %d, "
+                         "\"backoff_us\": %d, \"cores\": %ld},\n  \"sizes\": [\n",
+                    session_count, words, rounds, same_sentence, backoff_us, sysconf(_SC_NPROCESSORS_ONLN));
+            for (int d = 0; d < doc_size_count; d++) {
+                json_row(out, d == 0, doc_sizes[d], bytes[d], &totals[d], elapsed[d]);
+            }
+            fprintf(out, "\n  ]\n}\n");
+            fclose(out);
+        }
+    }
+    printf("Logs:    %s\n", workdir);
+    return result;
+}
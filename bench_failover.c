@@ -0,0 +1,249 @@
+// Replica failover benchmark.
+//
+// Starts a name server and several storage servers in a scratch directory,
+// creates a replicated file, then SIGKILLs the file's primary and measures
+// how long until the file can be read again and until it can be written
+// again (a backup has been promoted). Before the kill it also checks that
+// reads are spread over the file's replicas.
+//
+// Run from the build directory (it execs ./nm and ./ss), with no other
+// name server on this machine.
+//
+// Usage: ./bench_failover [--servers N] [--replicas N] [--bin-dir DIR]
+
+#include "bench_util.h"
+
+#define BASE_CLIENT_PORT 9300
+#define FAILOVER_FILE "failover.txt"
+#define BENCH_USER "bench_failover"
+#define FAILOVER_DEADLINE_MS 30000.0
+
+static int server_count = 3;
+static int replica_count = 2;
+static char bin_dir[MAX_PATH] = ".";
+
+static BenchCluster cluster;
+
+static int request(int sock, Message *msg, Message *response) {
+    if (send_message(sock, msg) < 0 || recv_message(sock, response) < 0) return -1;
+    return response->status;
+}
+
+static int open_nm_session() {
+    int sock = connect_to("127.0.0.1", NM_CLIENT_PORT, 2, 2);
+    if (sock < 0) return -1;
+
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_REG_CLIENT;
+    strcpy(msg.sender, BENCH_USER);
+    strcpy(msg.data, "127.0.0.1");
+    if (request(sock, &msg, &response) != SUCCESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Ask the NM where to send `type` for the failover file; fills "ip:port"
+// and, if `lease` is not NULL, the route lease the SS wants to see
+static int route(int nm_sock, MessageType type, char *address, char *lease) {
+    Message msg, response;
+    init_message(&msg);
+    msg.type = type;
+    strcpy(msg.sender, BENCH_USER);
+    strcpy(msg.filename, FAILOVER_FILE);
+    int status = request(nm_sock, &msg, &response);
+    if (status == SUCCESS) {
+        strcpy(address, response.data);
+        if (lease) strcpy(lease, response.lease);
+    }
+    return status;
+}
+
+static int connect_ss(const char *address) {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    if (sscanf(address, "%15[^:]:%d", ip, &port) != 2) return -1;
+    return connect_to(ip, port, 2, 2);
+}
+
+// One routed READ; returns 1 if the content contains `expect`
+static int try_read(int nm_sock, const char *expect) {
+    char address[64], lease[MAX_LEASE];
+    if (route(nm_sock, MSG_READ, address, lease) != SUCCESS) return 0;
+
+    int sock = connect_ss(address);
+    if (sock < 0) return 0;
+
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_READ;
+    strcpy(msg.sender, BENCH_USER);
+    strcpy(msg.filename, FAILOVER_FILE);
+    strcpy(msg.lease, lease);
+    int ok = request(sock, &msg, &response) == SUCCESS && strstr(response.data, expect) != NULL;
+    close(sock);
+    return ok;
+}
+
+// One routed write of a whole sentence (lock, write, commit)
+static int try_write(int nm_sock, int sentence, const char *text) {
+    char address[64], lease[MAX_LEASE];
+    if (route(nm_sock, MSG_WRITE, address, lease) != SUCCESS) return 0;
+
+    int sock = connect_ss(address);
+    if (sock < 0) return 0;
+
+    Message msg, response;
+    init_message(&msg);
+    strcpy(msg.sender, BENCH_USER);
+    strcpy(msg.filename, FAILOVER_FILE);
+    strcpy(msg.lease, lease);
+    msg.sentence_index = sentence;
+
+    msg.type = MSG_LOCK_SENTENCE;
+    int ok = request(sock, &msg, &response) == SUCCESS;
+    if (ok) {
+        msg.type = MSG_WRITE;
+        msg.word_index = 1;
+        strcpy(msg.data, text);
+        ok = request(sock, &msg, &response) == SUCCESS;
+
+        msg.type = ok ? MSG_UNLOCK_SENTENCE : MSG_CANCEL_WRITE;
+        msg.data[0] = '\0';
+        ok = request(sock, &msg, &response) == SUCCESS && ok;
+    }
+    close(sock);
+    return ok;
+}
+
+static int start_cluster(const char *workdir) {
+    char replicas[32];
+    snprintf(replicas, sizeof(replicas), "NM_REPLICAS=%d", replica_count);
+    char *nm_env[] = { replicas, NULL };
+    BenchClusterSpec spec = {
+        .bin_dir = bin_dir,
+        .workdir = workdir,
+        .ss_count = server_count,
+        .base_ss_port = BASE_CLIENT_PORT,
+        .nm_env = nm_env,
+        .settle_sec = 2,
+    };
+    return bench_start_cluster(&cluster, &spec);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--servers") == 0 && i + 1 < argc) {
+            server_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replicas") == 0 && i + 1 < argc) {
+            replica_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            strncpy(bin_dir, argv[++i], sizeof(bin_dir) - 1);
+        } else {
+            fprintf(stderr, "Usage: %s [--servers N] [--replicas N] [--bin-dir DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (server_count < 2 || server_count > MAX_SS || replica_count < 1 || replica_count > MAX_REPLICAS) {
+        fprintf(stderr, "Need 2..%d servers and 1..%d replicas\n", MAX_SS, MAX_REPLICAS);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char workdir[] = "/tmp/docs_failover_XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (start_cluster(workdir) != 0) {
+        bench_stop_cluster(&cluster);
+        return 1;
+    }
+
+    int result = 1;
+    int nm_sock = open_nm_session();
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_CREATE;
+    strcpy(msg.sender, BENCH_USER);
+    strcpy(msg.filename, FAILOVER_FILE);
+    if (nm_sock < 0 || request(nm_sock, &msg, &response) != SUCCESS ||
+        !try_write(nm_sock, 0, "Before the failure.")) {
+        fprintf(stderr, "Could not create and write %s\n", FAILOVER_FILE);
+        goto done;
+    }
+
+    // Reads should rotate over every in-sync replica
+    char seen[MAX_REPLICAS][64];
+    int seen_count = 0;
+    for (int i = 0; i < 50; i++) {
+        char address[64];
+        if (route(nm_sock, MSG_READ, address, NULL) != SUCCESS) continue;
+        int known = 0;
+        for (int j = 0; j < seen_count; j++) {
+            if (strcmp(seen[j], address) == 0) known = 1;
+        }
+        if (!known && seen_count < MAX_REPLICAS) strcpy(seen[seen_count++], address);
+    }
+
+    char primary[64];
+    if (route(nm_sock, MSG_WRITE, primary, NULL) != SUCCESS) {
+        fprintf(stderr, "No primary for %s\n", FAILOVER_FILE);
+        goto done;
+    }
+    int primary_port = 0;
+    sscanf(primary, "%*[^:]:%d", &primary_port);
+    int victim = primary_port - BASE_CLIENT_PORT;
+    if (victim < 0 || victim >= server_count) {
+        fprintf(stderr, "Primary %s is not one of ours\n", primary);
+        goto done;
+    }
+
+    printf("=== Replica failover: %d servers, %d replicas ===\n", server_count, replica_count);
+    printf("Read replicas:    %d distinct server(s) over 50 routed reads\n", seen_count);
+    printf("Killing primary:  SS %d (%s)\n", victim + 1, primary);
+
+    double killed = now_ms();
+    bench_reap(&cluster.ss_pids[victim]);
+
+    int read_failures = 0;
+    double read_ms = -1, write_ms = -1;
+    while (now_ms() - killed < FAILOVER_DEADLINE_MS) {
+        if (try_read(nm_sock, "Before the failure.")) {
+            read_ms = now_ms() - killed;
+            break;
+        }
+        read_failures++;
+        usleep(5000);
+    }
+    while (now_ms() - killed < FAILOVER_DEADLINE_MS) {
+        if (try_write(nm_sock, 1, "After the failure.")) {
+            write_ms = now_ms() - killed;
+            break;
+        }
+        usleep(5000);
+    }
+
+    if (read_ms >= 0) {
+        printf("Reads restored:   %.1f ms (%d failed attempts)\n", read_ms, read_failures);
+    } else {
+        printf("Reads restored:   not within %.0f ms\n", FAILOVER_DEADLINE_MS);
+    }
+    if (write_ms >= 0) {
+        printf("Writes restored:  %.1f ms\n", write_ms);
+    } else {
+        printf("Writes restored:  not within %.0f ms\n", FAILOVER_DEADLINE_MS);
+    }
+
+    int consistent = write_ms >= 0 && try_read(nm_sock, "After the failure.");
+    printf("Post-failover:    %s\n", consistent ? "new write readable" : "new write NOT readable");
+    printf("Logs:             %s\n", workdir);
+    result = (read_ms >= 0 && write_ms >= 0 && consistent) ? 0 : 1;
+
+done:
+    if (nm_sock >= 0) close(nm_sock);
+    bench_stop_cluster(&cluster);
+    return result;
+}
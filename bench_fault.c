@@ -0,0 +1,555 @@
+// Fault injection benchmark.
+//
+// For each fault, starts a fresh name server and --ss storage servers on
+// this machine, in a scratch directory, and runs --users libdocs users
+// against them: each creates --files files of its own and then loops over
+// READ, whole WRITE sessions and INFO on them. After --before seconds it
+// injects the fault into SS 1 and keeps the load running for --after
+// seconds:
+//
+//   kill            - SIGKILL; the server stays down
+//   stop            - SIGSTOP (frozen, sockets open), SIGCONT after --stop-ms
+//                     (0: at the end of the run)
+//   drop-heartbeat  - the SS drops its heartbeat channel to the NM and
+//                     registers again (SS_FAULT=drop-heartbeat, SIGUSR2)
+//   slow-io         - every request on the SS takes --slow-us longer, until
+//                     the end of the run (SS_FAULT=slow-io:US, SIGUSR2)
+//
+// Reports for each fault:
+//   detected  - when the NM logged SS 1 as dead (heartbeat lost or timed out)
+//   rejoined  - when SS 1 registered with the NM again
+// and per operation, before and after the fault: operations, errors, p99
+// latency, operations that took over a second, and the unavailable window:
+// the longest stretch after the fault in which no operation of that kind
+// succeeded on a file whose primary was SS 1. Users run a closed loop, so
+// one stuck on a slow operation issues nothing else meanwhile; that shows
+// as gaps in the other kinds too.
+//
+// The servers inherit the environment, so detection follows the heartbeat
+// tunables (NM_HEARTBEAT_TIMEOUT_MS, NM_HEARTBEAT_CHECK_MS, SS_HEARTBEAT_MS);
+// with their defaults a frozen SS takes 15-20 s to detect. Hot-file
+// balancing is turned off (NM_MIGRATE_INTERVAL=0) so that files stay where
+// they were placed.
+//
+// Run from the build directory (it execs ./nm and ./ss), with no other name
+// server on this machine.
+//
+// Usage: ./bench_fault [--fault kill|stop|drop-heartbeat|slow-io|all] [--ss N]
+//                      [--users N] [--files N] [--before SEC] [--after SEC]
+//                      [--stop-ms MS] [--slow-us US] [--think-ms MS]
+//                      [--json FILE|-] [--bin-dir DIR]
+
+#include "bench_util.h"
+#include "docs.h"
+
+#define BASE_SS_PORT 9550
+#define MAX_BENCH_SS 16
+#define MAX_BENCH_USERS 64
+#define MAX_USER_FILES 32
+#define VICTIM 0                 // Index of the SS the fault goes into (SS id 1)
+#define STALL_MS 1000.0
+
+
+typedef enum { FAULT_KILL, FAULT_STOP, FAULT_DROP_HEARTBEAT, FAULT_SLOW_IO, FAULT_COUNT } FaultKind;
+
+static const char *fault_names[FAULT_COUNT] = { "kill", "stop", "drop-heartbeat", "slow-io" };
+
+typedef enum { OP_READ, OP_WRITE, OP_INFO, OP_COUNT } BenchOp;
+
+static const char *op_type_names[OP_COUNT] = { "MSG_READ", "MSG_WRITE", "MSG_INFO" };
+static const int op_weights[OP_COUNT] = { 50, 25, 25 };
+
+typedef struct {
+    double start_ms;
+    double end_ms;
+    short op;
+    short status;
+    short affected;              // The file's primary was the faulty SS
+} OpRecord;
+
+typedef struct {
+    int id;
+    unsigned int seed;
+    char files[MAX_USER_FILES][MAX_FILENAME];
+    int affected[MAX_USER_FILES];
+    int file_count;
+    int ready;                   // 1 once set up, -1 if setup failed
+    OpRecord *records;
+    long record_count;
+    long record_capacity;
+    pthread_t thread;
+} FaultUser;
+
+typedef struct {
+    long ops;
+    long errors;
+    long stalled;
+    Histogram latency;           // Successful operations
+} PhaseStats;
+
+typedef struct {
+    PhaseStats before[OP_COUNT];
+    PhaseStats after[OP_COUNT];
+    double unavailable_ms[OP_COUNT];
+    int never_recovered[OP_COUNT];
+    double detected_ms;          // After the injection; < 0 if never
+    double rejoined_ms;
+    int affected_files;
+    int total_files;
+    char workdir[64];
+} FaultResult;
+
+static int ss_count = 3;
+static int user_count = 4;
+static int files_per_user = 4;
+static int before_s = 3;
+static int after_s = 30;
+static int stop_ms = 0;
+static int slow_us = 200000;
+static int think_ms = 5;
+static char json_path[MAX_PATH] = "";
+static char bin_dir[MAX_PATH] = ".";
+static int fault_selected[FAULT_COUNT] = { 1, 1, 1, 1 };
+
+static BenchCluster cluster;
+
+static FaultUser users[MAX_BENCH_USERS];
+static volatile int load_started = 0;
+static volatile int load_running = 0;
+
+static unsigned int next_random(unsigned int *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static double p99_ms(const PhaseStats *s) {
+    return hist_percentile_ms(&s->latency, 0.99);
+}
+
+// ---------------------------------------------------------------------------
+// Load
+// ---------------------------------------------------------------------------
+
+// A whole write session through the worker pool, waited for
+static int write_edits(DocsClient *docs, const char *filename, const DocsEdit *edits, int count) {
+    DocsFuture *future = docs_future_create();
+    if (!future) return ERR_SERVER_ERROR;
+    Message result;
+    int status = ERR_SERVER_ERROR;
+    if (docs_write_async(docs, filename, 0, edits, count, docs_future_complete, future) == 0) {
+        status = docs_future_wait(future, &result);
+    }
+    docs_future_free(future);
+    return status;
+}
+
+static int name_request(DocsClient *docs, MessageType type, const char *filename, Message *response) {
+    Message msg;
+    init_message(&msg);
+    msg.type = type;
+    strncpy(msg.filename, filename, MAX_FILENAME - 1);
+    return docs_call(docs, &msg, response);
+}
+
+// Create the user's files with a sentence each, and note which have their
+// primary on the SS that will fail: the NM routes writes to the primary
+static int prepare_files(FaultUser *u, DocsClient *docs) {
+    char victim[32];
+    snprintf(victim, sizeof(victim), ":%d", BASE_SS_PORT + VICTIM);
+    for (int i = 0; i < files_per_user; i++) {
+        Message response;
+        snprintf(u->files[i], MAX_FILENAME, "fault%d_%d.txt", u->id, i);
+        if (name_request(docs, MSG_CREATE, u->files[i], &response) != SUCCESS) return -1;
+        DocsEdit edit = { 1, "steady state before the fault." };
+        if (write_edits(docs, u->files[i], &edit, 1) != SUCCESS) return -1;
+        if (name_request(docs, MSG_WRITE, u->files[i], &response) != SUCCESS) return -1;
+        const char *port = strrchr(response.data, ':');
+        u->affected[i] = port && strcmp(port, victim) == 0;
+        u->file_count++;
+    }
+    return 0;
+}
+
+static int run_op(FaultUser *u, DocsClient *docs, BenchOp op, int file) {
+    Message response;
+    switch (op) {
+        case OP_READ:
+            return docs_read(docs, u->files[file], &response);
+        case OP_WRITE: {
+            char word[32];
+            snprintf(word, sizeof(word), "edit%u", next_random(&u->seed) % 1000);
+            DocsEdit edit = { 1, word };
+            return write_edits(docs, u->files[file], &edit, 1);
+        }
+        case OP_INFO:
+            return name_request(docs, MSG_INFO, u->files[file], &response);
+        default:
+            return ERR_INVALID_OPERATION;
+    }
+}
+
+static void add_record(FaultUser *u, double start, BenchOp op, int status, int affected) {
+    if (u->record_count == u->record_capacity) {
+        u->record_capacity = u->record_capacity ? u->record_capacity * 2 : 4096;
+        u->records = realloc(u->records, sizeof(OpRecord) * u->record_capacity);
+    }
+    OpRecord *r = &u->records[u->record_count++];
+    r->start_ms = start;
+    r->end_ms = now_ms();
+    r->op = op;
+    r->status = status;
+    r->affected = affected;
+}
+
+static void* fault_user(void *arg) {
+    FaultUser *u = arg;
+    char name[MAX_USERNAME];
+    snprintf(name, sizeof(name), "fault%d", u->id);
+
+    int status;
+    DocsClient *docs = docs_connect("127.0.0.1", NM_CLIENT_PORT, name, &status);
+    if (!docs || prepare_files(u, docs) != 0) {
+        u->ready = -1;
+        if (docs) docs_close(docs);
+        return NULL;
+    }
+    u->ready = 1;
+
+    while (!load_started && load_running) usleep(1000);
+    while (load_running) {
+        int pick = next_random(&u->seed) % 100, op = 0;
+        while (pick >= op_weights[op]) pick -= op_weights[op++];
+        int file = next_random(&u->seed) % u->file_count;
+        double start = now_ms();
+        status = run_op(u, docs, op, file);
+        add_record(u, start, op, status, u->affected[file]);
+        if (think_ms > 0) usleep(think_ms * 1000);
+    }
+    docs_close(docs);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Cluster
+// ---------------------------------------------------------------------------
+
+static int start_cluster(const char *workdir, FaultKind fault) {
+    char victim_fault[48] = "";
+    if (fault == FAULT_DROP_HEARTBEAT) snprintf(victim_fault, sizeof(victim_fault), "SS_FAULT=drop-heartbeat");
+    if (fault == FAULT_SLOW_IO) snprintf(victim_fault, sizeof(victim_fault), "SS_FAULT=slow-io:%d", slow_us);
+    char *victim_env[] = { victim_fault, NULL };
+    BenchClusterSpec spec = {
+        .bin_dir = bin_dir,
+        .workdir = workdir,
+        .ss_count = ss_count,
+        .base_ss_port = BASE_SS_PORT,
+        .first_ss_env = victim_fault[0] ? victim_env : NULL,
+        .settle_sec = 1,
+    };
+    return bench_start_cluster(&cluster, &spec);
+}
+
+// Scan what the NM logged since `*offset` for SS 1 being declared dead and
+// registering again
+static void scan_nm_log(const char *workdir, long *offset, double since_ms, FaultResult *result) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/nm.log", workdir);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    fseek(f, *offset, SEEK_SET);
+    char line[MAX_BUFFER];
+    char dead_lost[64], dead_timeout[64], joined[64];
+    snprintf(dead_lost, sizeof(dead_lost), "SS %d marked INACTIVE", VICTIM + 1);
+    snprintf(dead_timeout, sizeof(dead_timeout), "SS %d heartbeat timeout", VICTIM + 1);
+    snprintf(joined, sizeof(joined), "SS %d registered", VICTIM + 1);
+    while (fgets(line, sizeof(line), f)) {
+        if (line[strlen(line) - 1] != '\n') break;    // Partly written; read it next time
+        *offset = ftell(f);
+        if (result->detected_ms < 0 && (strstr(line, dead_lost) || strstr(line, dead_timeout))) {
+            result->detected_ms = now_ms() - since_ms;
+        } else if (result->detected_ms >= 0 && result->rejoined_ms < 0 && strstr(line, joined)) {
+            result->rejoined_ms = now_ms() - since_ms;
+        }
+    }
+    fclose(f);
+}
+
+static void log_end(const char *workdir, long *offset) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/nm.log", workdir);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    fseek(f, 0, SEEK_END);
+    *offset = ftell(f);
+    fclose(f);
+}
+
+// ---------------------------------------------------------------------------
+// One fault
+// ---------------------------------------------------------------------------
+
+static int by_end(const void *a, const void *b) {
+    double x = ((const OpRecord*)a)->end_ms, y = ((const OpRecord*)b)->end_ms;
+    return x < y ? -1 : x > y;
+}
+
+static void summarize(double inject_ms, double end_ms, FaultResult *result) {
+    long affected_count = 0;
+    for (int u = 0; u < user_count; u++) affected_count += users[u].record_count;
+    OpRecord *affected = malloc(sizeof(OpRecord) * (affected_count > 0 ? affected_count : 1));
+    long n = 0;
+
+    for (int u = 0; u < user_count; u++) {
+        for (long i = 0; i < users[u].record_count; i++) {
+            OpRecord *r = &users[u].records[i];
+            PhaseStats *s = r->start_ms < inject_ms ? &result->before[r->op] : &result->after[r->op];
+            long us = (long)((r->end_ms - r->start_ms) * 1000.0);
+            s->ops++;
+            if (r->end_ms - r->start_ms > STALL_MS) s->stalled++;
+            if (r->status != SUCCESS) {
+                s->errors++;
+            } else {
+                hist_add(&s->latency, us);
+            }
+            if (r->affected && r->status == SUCCESS && r->end_ms >= inject_ms) affected[n++] = *r;
+        }
+    }
+
+    // Longest stretch after the fault without a success on an affected file
+    qsort(affected, n, sizeof(OpRecord), by_end);
+    for (int op = 0; op < OP_COUNT; op++) {
+        double last = inject_ms, longest = 0.0;
+        int any = 0;
+        for (long i = 0; i < n; i++) {
+            if (affected[i].op != op) continue;
+            if (affected[i].end_ms - last > longest) longest = affected[i].end_ms - last;
+            last = affected[i].end_ms;
+            any = 1;
+        }
+        if (end_ms - last > longest) longest = end_ms - last;
+        result->unavailable_ms[op] = longest;
+        result->never_recovered[op] = !any && result->affected_files > 0;
+    }
+    free(affected);
+}
+
+static int run_fault(FaultKind fault, FaultResult *result) {
+    memset(result, 0, sizeof(*result));
+    result->detected_ms = -1.0;
+    result->rejoined_ms = -1.0;
+
+    char *workdir = result->workdir;
+    strcpy(workdir, "/tmp/docs_fault_XXXXXX");
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    if (start_cluster(workdir, fault) != 0) {
+        bench_stop_cluster(&cluster);
+        return -1;
+    }
+
+    memset(users, 0, sizeof(users));
+    load_started = 0;
+    load_running = 1;
+    for (int u = 0; u < user_count; u++) {
+        users[u].id = u;
+        users[u].seed = 2463534242u + u * 7919;
+        pthread_create(&users[u].thread, NULL, fault_user, &users[u]);
+    }
+    int ready = 0, failed = 0;
+    while (ready + failed < user_count) {
+        usleep(10000);
+        ready = failed = 0;
+        for (int u = 0; u < user_count; u++) {
+            if (users[u].ready == 1) ready++;
+            if (users[u].ready == -1) failed++;
+        }
+    }
+    for (int u = 0; u < user_count; u++) {
+        result->total_files += users[u].file_count;
+        for (int f = 0; f < users[u].file_count; f++) result->affected_files += users[u].affected[f];
+    }
+
+    double inject_ms = 0.0, end_ms = 0.0;
+    if (failed == 0) {
+        load_started = 1;
+        sleep(before_s);
+
+        long log_offset = 0;
+        log_end(workdir, &log_offset);
+        inject_ms = now_ms();
+        switch (fault) {
+            case FAULT_KILL:
+                bench_reap(&cluster.ss_pids[VICTIM]);
+                break;
+            case FAULT_STOP:
+                kill(cluster.ss_pids[VICTIM], SIGSTOP);
+                break;
+            case FAULT_DROP_HEARTBEAT:
+            case FAULT_SLOW_IO:
+                kill(cluster.ss_pids[VICTIM], SIGUSR2);
+                break;
+            default:
+                break;
+        }
+
+        int resumed = 0;
+        end_ms = inject_ms + after_s * 1000.0;
+        while (now_ms() < end_ms) {
+            usleep(10000);
+            scan_nm_log(workdir, &log_offset, inject_ms, result);
+            if (fault == FAULT_STOP && !resumed && stop_ms > 0 && now_ms() - inject_ms >= stop_ms) {
+                kill(cluster.ss_pids[VICTIM], SIGCONT);
+                resumed = 1;
+            }
+        }
+        end_ms = now_ms();
+    }
+    load_running = 0;
+    if (fault == FAULT_STOP && cluster.ss_pids[VICTIM] > 0) kill(cluster.ss_pids[VICTIM], SIGCONT);
+    for (int u = 0; u < user_count; u++) pthread_join(users[u].thread, NULL);
+    bench_stop_cluster(&cluster);
+
+    if (failed > 0) {
+        fprintf(stderr, "%d users could not set up their files (logs in %s)\n", failed, workdir);
+    } else {
+        summarize(inject_ms, end_ms, result);
+    }
+    for (int u = 0; u < user_count; u++) free(users[u].records);
+    return failed > 0 ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Results
+// ---------------------------------------------------------------------------
+
+static void print_fault(FaultKind fault, const FaultResult *r) {
+    printf("\n=== Fault: %s on SS %d after %d s (primary for %d of %d files) ===\n",
+           fault_names[fault], VICTIM + 1, before_s, r->affected_files, r->total_files);
+    if (r->detected_ms >= 0) printf("Detected: %.2f s after the fault\n", r->detected_ms / 1000.0);
+    else printf("Detected: not within %d s\n", after_s);
+    if (r->rejoined_ms >= 0) printf("Rejoined: %.2f s after the fault\n", r->rejoined_ms / 1000.0);
+    printf("%-10s %9s %7s %9s | %9s %7s %9s %8s | %12s\n", "type", "ops", "errors", "p99 ms",
+           "ops", "errors", "p99 ms", "over 1s", "unavailable");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const PhaseStats *b = &r->before[op], *a = &r->after[op];
+        printf("%-10s %9ld %7ld %9.2f | %9ld %7ld %9.2f %8ld | %10.2f s%s\n", op_type_names[op],
+               b->ops, b->errors, p99_ms(b), a->ops, a->errors, p99_ms(a), a->stalled,
+               r->unavailable_ms[op] / 1000.0, r->never_recovered[op] ? " (never)" : "");
+    }
+    printf("Logs:    %s\n", r->workdir);
+    fflush(stdout);
+}
+
+static void json_fault(FILE *out, int first, FaultKind fault, const FaultResult *r) {
+    fprintf(out, "%s    \"%s\": {\"affected_files\": %d, \"files\": %d, \"detected_s\": %.3f, \"rejoined_s\": %.3f,\n"
+                 "      \"types\": {",
+            first ? "" : ",\n", fault_names[fault], r->affected_files, r->total_files,
+            r->detected_ms >= 0 ? r->detected_ms / 1000.0 : -1.0,
+            r->rejoined_ms >= 0 ? r->rejoined_ms / 1000.0 : -1.0);
+    for (int op = 0; op < OP_COUNT; op++) {
+        const PhaseStats *b = &r->before[op], *a = &r->after[op];
+        fprintf(out, "%s\n        \"%s\": {\"ops_before\": %ld, \"errors_before\": %ld, \"p99_before_ms\": %.3f, "
+                     "\"ops_after\": %ld, \"errors_after\": %ld, \"p99_after_ms\": %.3f, \"over_1s\": %ld, "
+                     "\"unavailable_s\": %.3f, \"recovered\": %s}",
+                op ? "," : "", op_type_names[op], b->ops, b->errors, p99_ms(b), a->ops, a->errors, p99_ms(a),
+                a->stalled, r->unavailable_ms[op] / 1000.0, r->never_recovered[op] ? "false" : "true");
+    }
+    fprintf(out, "\n      }}");
+}
+
+int main(int argc, char *argv[]) {
+    int bad = 0;
+    for (int i = 1; i < argc && !bad; i++) {
+        if (strcmp(argv[i], "--fault") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            int found = strcmp(name, "all") == 0;
+            for (int f = 0; f < FAULT_COUNT; f++) {
+                fault_selected[f] = found || strcmp(name, fault_names[f]) == 0;
+                if (strcmp(name, fault_names[f]) == 0) found = 1;
+            }
+            bad = !found;
+        } else if (strcmp(argv[i], "--ss") == 0 && i + 1 < argc) {
+            ss_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+            user_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            files_per_user = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--before") == 0 && i + 1 < argc) {
+            before_s = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--after") == 0 && i + 1 < argc) {
+            after_s = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stop-ms") == 0 && i + 1 < argc) {
+            stop_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slow-us") == 0 && i + 1 < argc) {
+            slow_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--think-ms") == 0 && i + 1 < argc) {
+            think_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            strncpy(json_path, argv[++i], sizeof(json_path) - 1);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            strncpy(bin_dir, argv[++i], sizeof(bin_dir) - 1);
+        } else {
+            bad = 1;
+        }
+    }
+    if (bad || ss_count < 2 || ss_count > MAX_BENCH_SS || user_count < 1 || user_count > MAX_BENCH_USERS ||
+        files_per_user < 1 || files_per_user > MAX_USER_FILES || before_s < 1 || after_s < 1 ||
+        stop_ms < 0 || slow_us < 1 || think_ms < 0) {
+        fprintf(stderr, "Usage: %s [--fault kill|stop|drop-heartbeat|slow-io|all] [--ss N]\n"
+                        "       [--users N] [--files N] [--before SEC] [--after SEC]\n"
+                        "       [--stop-ms MS] [--slow-us US] [--think-ms MS]\n"
+                        "       [--json FILE|-] [--bin-dir DIR]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    setenv("DOCS_WORKERS", "1", 0);
+    setenv("NM_MIGRATE_INTERVAL", "0", 0);
+
+    // The JSON takes stdout if asked to; everything else goes to stderr then
+    int json_stdout = strcmp(json_path, "-") == 0;
+    if (json_stdout) {
+        int saved = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        json_stdout = saved;
+    }
+
+    printf("=== Faults: %d storage servers, %d users, %d files each, %d s before and %d s after, %ld cores ===\n",
+           ss_count, user_count, files_per_user, before_s, after_s, sysconf(_SC_NPROCESSORS_ONLN));
+    FaultResult results[FAULT_COUNT];
+    int ran[FAULT_COUNT] = {0};
+    int result = 0;
+    for (int f = 0; f < FAULT_COUNT; f++) {
+        if (!fault_selected[f]) continue;
+        if (run_fault(f, &results[f]) != 0) {
+            result = 1;
+            continue;
+        }
+        ran[f] = 1;
+        print_fault(f, &results[f]);
+    }
+
+    if (json_path[0]) {
+        FILE *out = json_stdout ? fdopen(json_stdout, "w") : fopen(json_path, "w");
+        if (!out) {
+            perror(json_path);
+            return 1;
+        }
+        fprintf(out, "{\n  \"config\": {\"storage_servers\": %d, \"users\": %d, \"files\": %d, \"before_s\": %d, "
+                     "\"after_s\": %d, \"stop_ms\": %d, \"slow_us\": %d, \"cores\": %ld},\n  \"faults\": {\n",
+                ss_count, user_count, files_per_user, before_s, after_s, stop_ms, slow_us,
+                sysconf(_SC_NPROCESSORS_ONLN));
+        int first = 1;
+        for (int f = 0; f < FAULT_COUNT; f++) {
+            if (!ran[f]) continue;
+            json_fault(out, first, f, &results[f]);
+            first = 0;
+        }
+        fprintf(out, "\n  }\n}\n");
+        fclose(out);
+    }
+    return result;
+}
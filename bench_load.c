@@ -0,0 +1,481 @@
+// End-to-end load benchmark.
+//
+// Starts a name server and --ss storage servers on this machine, in a
+// scratch directory, then runs --users simulated users against them through
+// libdocs. Each user registers, creates --files files of its own with sizes
+// drawn from --sizes, and then runs a closed loop of operations picked from
+// --mix until --seconds have passed:
+//
+//   create  - CREATE a new, empty file
+//   read    - READ one of its files
+//   write   - a whole WRITE session: lock a sentence, insert two words, commit
+//   view    - VIEW
+//   info    - INFO on one of its files
+//   stream  - STREAM one of its files
+//
+// Users only touch their own files, so no operation waits on another user's
+// sentence lock. Reports throughput and p50/p95/p99/p99.9 latency per
+// message type, as a table and, with --json, as JSON for comparing runs.
+// Latencies are those of successful operations, measured in the user thread
+// around the blocking libdocs call, so they include routing through the NM.
+//
+// The servers inherit this process's environment, so NM_* and SS_* tunables
+// apply to them. SS_STREAM_DELAY_US is set from --stream-delay-us (0 by
+// default) so that STREAM measures the server rather than the pacing.
+// Every process shares this machine's cores; the header prints how many.
+//
+// Run from the build directory (it execs ./nm and ./ss), with no other name
+// server on this machine.
+//
+// Usage: ./bench_load [--ss N] [--users N] [--seconds SEC] [--files N]
+//                     [--mix create=5,read=40,...] [--sizes 512:40,2048:40,...]
+//                     [--stream-delay-us N] [--json FILE|-] [--bin-dir DIR]
+
+#include "bench_util.h"
+#include "docs.h"
+
+#define BASE_SS_PORT 9600
+#define MAX_BENCH_SS 16
+#define MAX_BENCH_USERS 256
+#define MAX_USER_FILES 64
+#define MAX_SIZE_CLASSES 16
+#define MAX_FILE_BYTES 65536
+#define CHUNK_BYTES 3000         // Content written per preload WRITE session
+#define WORDS_PER_SENTENCE 8
+
+typedef enum { OP_CREATE, OP_READ, OP_WRITE, OP_VIEW, OP_INFO, OP_STREAM, OP_COUNT } BenchOp;
+
+static const char *op_names[OP_COUNT] = { "create", "read", "write", "view", "info", "stream" };
+static const char *op_type_names[OP_COUNT] = { "MSG_CREATE", "MSG_READ", "MSG_WRITE", "MSG_VIEW", "MSG_INFO", "MSG_STREAM" };
+
+typedef struct {
+    long errors;
+    Histogram latency;           // Successful operations
+} OpStats;
+
+typedef struct {
+    char name[MAX_FILENAME];
+    int sentences;
+} UserFile;
+
+typedef struct {
+    int id;
+    unsigned int seed;
+    int ready;                   // 1 once preloaded, -1 if that failed
+    int created;
+    UserFile files[MAX_USER_FILES];
+    int file_count;
+    OpStats stats[OP_COUNT];
+} LoadUser;
+
+typedef struct {
+    int bytes;
+    int weight;
+} SizeClass;
+
+static int ss_count = 2;
+static int user_count = 16;
+static int run_sec = 5;
+static int files_per_user = 4;
+static int stream_delay_us = 0;
+static int mix[OP_COUNT] = { 5, 40, 10, 5, 30, 10 };
+static SizeClass sizes[MAX_SIZE_CLASSES] = { {512, 40}, {2048, 40}, {7000, 20} };
+static int size_count = 3;
+static char json_path[MAX_PATH] = "";
+static char bin_dir[MAX_PATH] = ".";
+
+static BenchCluster cluster;
+
+static volatile int load_started = 0;
+static volatile int load_running = 1;
+
+static const char *filler[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot",
+                                "golf", "hotel", "india", "juliet", "kilo", "lima" };
+
+static unsigned int next_random(unsigned int *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void record(OpStats *stats, int status, double start_ms) {
+    if (status != SUCCESS) {
+        stats->errors++;
+        return;
+    }
+    hist_add(&stats->latency, (long)((now_ms() - start_ms) * 1000.0));
+}
+
+static int pick_size(unsigned int *seed) {
+    int total = 0;
+    for (int i = 0; i < size_count; i++) total += sizes[i].weight;
+    int r = (int)(next_random(seed) % total);
+    for (int i = 0; i < size_count; i++) {
+        if (r < sizes[i].weight) return sizes[i].bytes;
+        r -= sizes[i].weight;
+    }
+    return sizes[0].bytes;
+}
+
+static BenchOp pick_op(unsigned int *seed) {
+    int total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += mix[i];
+    int r = (int)(next_random(seed) % total);
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (r < mix[i]) return i;
+        r -= mix[i];
+    }
+    return OP_READ;
+}
+
+// A whole write session through the worker pool, waited for
+static int write_edits(DocsClient *docs, const char *filename, int sentence,
+                       const DocsEdit *edits, int count) {
+    DocsFuture *future = docs_future_create();
+    if (!future) return ERR_SERVER_ERROR;
+    Message result;
+    int status = ERR_SERVER_ERROR;
+    if (docs_write_async(docs, filename, sentence, edits, count, docs_future_complete, future) == 0) {
+        status = docs_future_wait(future, &result);
+    }
+    docs_future_free(future);
+    return status;
+}
+
+// Fill a new file with about `bytes` of text, appending a chunk of whole
+// sentences per session. Returns the status, with the sentence count set.
+static int fill_file(DocsClient *docs, UserFile *file, int bytes, unsigned int *seed) {
+    char chunk[CHUNK_BYTES + MAX_WORD];
+    int written = 0;
+    file->sentences = 0;
+    while (written < bytes) {
+        int len = 0, words = 0, sentences = 0;
+        while (len < CHUNK_BYTES && written + len < bytes) {
+            const char *word = filler[next_random(seed) % (sizeof(filler) / sizeof(filler[0]))];
+            words++;
+            int end = words % WORDS_PER_SENTENCE == 0;
+            len += snprintf(chunk + len, sizeof(chunk) - len, "%s%s%s", len > 0 ? " " : "", word, end ? "." : "");
+            if (end) sentences++;
+        }
+        if (words % WORDS_PER_SENTENCE != 0) {
+            len += snprintf(chunk + len, sizeof(chunk) - len, ".");
+            sentences++;
+        }
+        DocsEdit edit = { 1, chunk };
+        int status = write_edits(docs, file->name, file->sentences, &edit, 1);
+        if (status != SUCCESS) return status;
+        file->sentences += sentences;
+        written += len + 1;
+    }
+    return SUCCESS;
+}
+
+static int name_request(DocsClient *docs, MessageType type, const char *filename) {
+    Message msg, response;
+    init_message(&msg);
+    msg.type = type;
+    if (filename) strncpy(msg.filename, filename, MAX_FILENAME - 1);
+    return docs_call(docs, &msg, &response);
+}
+
+static void count_token(const char *word, int space, void *arg) {
+    (void)word;
+    (void)space;
+    (*(long*)arg)++;
+}
+
+static int run_op(LoadUser *u, DocsClient *docs, BenchOp op) {
+    UserFile *file = &u->files[next_random(&u->seed) % u->file_count];
+    Message response;
+    switch (op) {
+        case OP_CREATE: {
+            char name[MAX_FILENAME];
+            snprintf(name, sizeof(name), "load%d_new%d.txt", u->id, u->created++);
+            return name_request(docs, MSG_CREATE, name);
+        }
+        case OP_READ:
+            return docs_read(docs, file->name, &response);
+        case OP_WRITE: {
+            char first[32], second[32];
+            snprintf(first, sizeof(first), "edit%u", next_random(&u->seed) % 1000);
+            snprintf(second, sizeof(second), "by%d", u->id);
+            DocsEdit edits[2] = { {1, first}, {2, second} };
+            int sentence = file->sentences > 0 ? (int)(next_random(&u->seed) % file->sentences) : 0;
+            return write_edits(docs, file->name, sentence, edits, 2);
+        }
+        case OP_VIEW:
+            return name_request(docs, MSG_VIEW, NULL);
+        case OP_INFO:
+            return name_request(docs, MSG_INFO, file->name);
+        case OP_STREAM: {
+            long words = 0;
+            return docs_stream(docs, file->name, count_token, &words);
+        }
+        default:
+            return ERR_INVALID_OPERATION;
+    }
+}
+
+static void* load_user(void *arg) {
+    LoadUser *u = arg;
+    char user[MAX_USERNAME];
+    snprintf(user, sizeof(user), "load%d", u->id);
+
+    int status;
+    DocsClient *docs = docs_connect("127.0.0.1", NM_CLIENT_PORT, user, &status);
+    if (!docs) {
+        u->ready = -1;
+        return NULL;
+    }
+    for (int i = 0; i < files_per_user; i++) {
+        UserFile *file = &u->files[i];
+        snprintf(file->name, sizeof(file->name), "load%d_%d.txt", u->id, i);
+        if (name_request(docs, MSG_CREATE, file->name) != SUCCESS ||
+            fill_file(docs, file, pick_size(&u->seed), &u->seed) != SUCCESS) {
+            u->ready = -1;
+            docs_close(docs);
+            return NULL;
+        }
+        u->file_count++;
+    }
+    u->ready = 1;
+
+    while (!load_started && load_running) usleep(1000);
+    while (load_running) {
+        BenchOp op = pick_op(&u->seed);
+        double start = now_ms();
+        record(&u->stats[op], run_op(u, docs, op), start);
+    }
+    docs_close(docs);
+    return NULL;
+}
+
+static int start_cluster(const char *workdir) {
+    char delay[32];
+    snprintf(delay, sizeof(delay), "SS_STREAM_DELAY_US=%d", stream_delay_us);
+    char *ss_env[] = { delay, NULL };
+    BenchClusterSpec spec = {
+        .bin_dir = bin_dir,
+        .workdir = workdir,
+        .ss_count = ss_count,
+        .base_ss_port = BASE_SS_PORT,
+        .ss_env = ss_env,
+        .settle_sec = 1,
+    };
+    return bench_start_cluster(&cluster, &spec);
+}
+
+static int parse_mix(char *spec) {
+    int parsed[OP_COUNT] = {0};
+    int total = 0;
+    for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int found = 0;
+        for (int i = 0; i < OP_COUNT; i++) {
+            if (strcasecmp(item, op_names[i]) == 0) {
+                parsed[i] = atoi(eq + 1);
+                found = 1;
+            }
+        }
+        if (!found || atoi(eq + 1) < 0) return -1;
+        total += atoi(eq + 1);
+    }
+    if (total <= 0) return -1;
+    memcpy(mix, parsed, sizeof(mix));
+    return 0;
+}
+
+static int parse_sizes(char *spec) {
+    SizeClass parsed[MAX_SIZE_CLASSES];
+    int count = 0;
+    for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+        if (count == MAX_SIZE_CLASSES) return -1;
+        char *colon = strchr(item, ':');
+        parsed[count].bytes = atoi(item);
+        parsed[count].weight = colon ? atoi(colon + 1) : 1;
+        if (parsed[count].bytes < 1 || parsed[count].bytes > MAX_FILE_BYTES || parsed[count].weight < 1) return -1;
+        count++;
+    }
+    if (count == 0) return -1;
+    memcpy(sizes, parsed, sizeof(SizeClass) * count);
+    size_count = count;
+    return 0;
+}
+
+static void write_json(FILE *out, const OpStats totals[], double elapsed_s, long cores) {
+    long ops = 0, errors = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        ops += totals[i].latency.count;
+        errors += totals[i].errors;
+    }
+    fprintf(out, "{\n  \"config\": {\"storage_servers\": %d, \"users\": %d, \"seconds\": %d, "
+                 "\"files_per_user\": %d, \"stream_delay_us\": %d, \"cores\": %ld,\n",
+            ss_count, user_count, run_sec, files_per_user, stream_delay_us, cores);
+    fprintf(out, "             \"mix\": {");
+    for (int i = 0; i < OP_COUNT; i++) {
+        fprintf(out, "%s\"%s\": %d", i > 0 ? ", " : "", op_names[i], mix[i]);
+    }
+    fprintf(out, "},\n             \"sizes\": [");
+    for (int i = 0; i < size_count; i++) {
+        fprintf(out, "%s{\"bytes\": %d, \"weight\": %d}", i > 0 ? ", " : "", sizes[i].bytes, sizes[i].weight);
+    }
+    fprintf(out, "]},\n");
+    fprintf(out, "  \"elapsed_s\": %.3f,\n  \"ops\": %ld,\n  \"errors\": %ld,\n  \"ops_per_s\": %.1f,\n",
+            elapsed_s, ops, errors, ops / elapsed_s);
+    fprintf(out, "  \"types\": {\n");
+    int first = 1;
+    for (int i = 0; i < OP_COUNT; i++) {
+        const Histogram *h = &totals[i].latency;
+        if (mix[i] == 0) continue;
+        fprintf(out, "%s    \"%s\": {\"count\": %ld, \"errors\": %ld, \"ops_per_s\": %.1f, "
+                     "\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, "
+                     "\"p999_ms\": %.3f, \"max_ms\": %.3f}",
+                first ? "" : ",\n", op_type_names[i], h->count, totals[i].errors, h->count / elapsed_s,
+                h->count ? h->sum_us / h->count / 1000.0 : 0.0, hist_percentile_ms(h, 0.50),
+                hist_percentile_ms(h, 0.95), hist_percentile_ms(h, 0.99), hist_percentile_ms(h, 0.999),
+                h->max_us / 1000.0);
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        int ok = 1;
+        if (strcmp(argv[i], "--ss") == 0 && i + 1 < argc) {
+            ss_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+            user_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            run_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            files_per_user = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            ok = parse_mix(argv[++i]) == 0;
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            ok = parse_sizes(argv[++i]) == 0;
+        } else if (strcmp(argv[i], "--stream-delay-us") == 0 && i + 1 < argc) {
+            stream_delay_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            strncpy(json_path, argv[++i], sizeof(json_path) - 1);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            strncpy(bin_dir, argv[++i], sizeof(bin_dir) - 1);
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "Usage: %s [--ss N] [--users N] [--seconds SEC] [--files N]\n"
+                            "       [--mix create=5,read=40,write=10,view=5,info=30,stream=10]\n"
+                            "       [--sizes BYTES:WEIGHT,...] [--stream-delay-us N] [--json FILE|-] [--bin-dir DIR]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (ss_count < 1 || ss_count > MAX_BENCH_SS || user_count < 1 || user_count > MAX_BENCH_USERS ||
+        run_sec < 1 || files_per_user < 1 || files_per_user > MAX_USER_FILES || stream_delay_us < 0) {
+        fprintf(stderr, "Need 1..%d storage servers, 1..%d users, 1..%d files per user and at least 1 second\n",
+                MAX_BENCH_SS, MAX_BENCH_USERS, MAX_USER_FILES);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Each user runs one operation at a time, so one worker apiece will do
+    setenv("DOCS_WORKERS", "1", 0);
+
+    char workdir[] = "/tmp/docs_load_XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (start_cluster(workdir) != 0) {
+        bench_stop_cluster(&cluster);
+        return 1;
+    }
+
+    // The table goes to stderr when the JSON takes stdout
+    int json_stdout = strcmp(json_path, "-") == 0;
+    FILE *table = json_stdout ? stderr : stdout;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    fprintf(table, "=== Load: %d storage servers, %d users, %d files each, %d s, %ld cores ===\n",
+            ss_count, user_count, files_per_user, run_sec, cores);
+
+    LoadUser *users = calloc(user_count, sizeof(LoadUser));
+    pthread_t tids[MAX_BENCH_USERS];
+    for (int i = 0; i < user_count; i++) {
+        users[i].id = i;
+        users[i].seed = 2463534242u + i * 7919u;
+        pthread_create(&tids[i], NULL, load_user, &users[i]);
+    }
+
+    // Preload, then start every user together
+    double preload_start = now_ms();
+    int waiting = 1, failed = 0;
+    while (waiting) {
+        usleep(10000);
+        waiting = 0;
+        failed = 0;
+        for (int i = 0; i < user_count; i++) {
+            if (users[i].ready == 0) waiting = 1;
+            if (users[i].ready < 0) failed++;
+        }
+    }
+    fprintf(table, "Preloaded %d files in %.1f s\n", user_count * files_per_user,
+            (now_ms() - preload_start) / 1000.0);
+
+    double start = now_ms();
+    load_started = 1;
+    if (failed == 0) sleep(run_sec);
+    load_running = 0;
+    for (int i = 0; i < user_count; i++) pthread_join(tids[i], NULL);
+    double elapsed_s = (now_ms() - start) / 1000.0;
+    bench_stop_cluster(&cluster);
+
+    if (failed > 0) {
+        fprintf(stderr, "%d users could not register or preload their files\n", failed);
+        fprintf(stderr, "Logs:    %s\n", workdir);
+        free(users);
+        return 1;
+    }
+
+    OpStats totals[OP_COUNT];
+    memset(totals, 0, sizeof(totals));
+    for (int i = 0; i < user_count; i++) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            totals[op].errors += users[i].stats[op].errors;
+            hist_merge(&totals[op].latency, &users[i].stats[op].latency);
+        }
+    }
+
+    long ops = 0, errors = 0;
+    fprintf(table, "%-12s %9s %9s %7s %9s %9s %9s %9s %9s\n", "type", "ops", "ops/s", "errors",
+            "p50 ms", "p95 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const Histogram *h = &totals[op].latency;
+        ops += h->count;
+        errors += totals[op].errors;
+        if (mix[op] == 0) continue;
+        fprintf(table, "%-12s %9ld %9.0f %7ld %9.2f %9.2f %9.2f %9.2f %9.2f\n", op_type_names[op],
+                h->count, h->count / elapsed_s, totals[op].errors, hist_percentile_ms(h, 0.50),
+                hist_percentile_ms(h, 0.95), hist_percentile_ms(h, 0.99), hist_percentile_ms(h, 0.999),
+                h->max_us / 1000.0);
+    }
+    fprintf(table, "%-12s %9ld %9.0f %7ld\n", "total", ops, ops / elapsed_s, errors);
+
+    int result = 0;
+    if (json_path[0]) {
+        FILE *out = json_stdout ? stdout : fopen(json_path, "w");
+        if (!out) {
+            perror(json_path);
+            result = 1;
+        } else {
+            write_json(out, totals, elapsed_s, cores);
+            if (!json_stdout) fclose(out);
+        }
+    }
+    fprintf(table, "Logs:    %s\n", workdir);
+    free(users);
+    return result;
+}
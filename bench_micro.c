@@ -0,0 +1,488 @@
+// Microbenchmarks for the file_ops, trie and cache hot paths.
+//
+// Runs each operation on deterministic synthetic data, first on one thread
+// and then on --threads threads, and reports ns per operation (per thread),
+// operations per second (all threads), MB/s of document where the
+// operation walks one, and the bytes and blocks it allocates per operation.
+//
+//   file_ops - parse_file, file_content_to_string, write_file_content and
+//              insert_word_in_sentence on documents of 1 KB to --max-doc-mb MB
+//   trie     - trie_insert (building the trie), trie_search hits and misses
+//              and trie_get_all_files, for 1k to --max-names names; a size
+//              whose trie would not fit in the memory available is skipped
+//   cache    - cache_get hits and misses and cache_put with eviction, for
+//              the NM's cache size and a larger one
+//
+// Threads share the trie and the cache, as the NM's workers do; each thread
+// works on its own copy of a document. Allocations are counted by wrapping
+// malloc, calloc, realloc and strdup at link time, so they cover the
+// module's own calls but not those inside libc (stdio buffers, for one).
+// The logger is never started, so log calls in these paths return before
+// formatting their message.
+//
+// Usage: ./bench_micro [--threads N] [--ms MS] [--max-doc-mb N] [--max-names N]
+//                      [--only file|trie|cache]
+
+#include "common.h"
+#include "file_ops.h"
+#include "trie.h"
+#include "cache.h"
+#include <time.h>
+
+#define MAX_BENCH_THREADS 64
+#define MAX_CACHE_KEYS 100000
+
+// Allocation counters, per thread, fed by the --wrap'd allocators
+static __thread long alloc_bytes = 0;
+static __thread long alloc_blocks = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) {
+    alloc_bytes += size;
+    alloc_blocks++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    alloc_bytes += count * size;
+    alloc_blocks++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_bytes += size;
+    alloc_blocks++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    alloc_bytes += strlen(s) + 1;
+    alloc_blocks++;
+    return __real_strdup(s);
+}
+
+typedef struct Worker Worker;
+
+// One operation; returns the bytes of document text it handled
+typedef long (*BenchFn)(Worker *w, long i);
+
+typedef struct {
+    const char *name;
+    const char *size;           // Input size, for the report
+    BenchFn fn;
+    int batch;                  // Operations between clock checks
+    long fixed_ops;             // Run exactly this many in total, split across threads
+} BenchCase;
+
+struct Worker {
+    int id;
+    int threads;
+    unsigned int seed;
+    long ops;
+    long bytes;
+    long alloc_bytes;
+    long alloc_blocks;
+    long first;                 // First index for fixed-work cases
+    long limit;
+    const BenchCase *bc;
+    FileContent *fc;            // This thread's document
+    char path[MAX_PATH];        // This thread's scratch file
+    FileMetadata **listing;
+};
+
+static int thread_count = 0;    // Defaults to the core count, at least 2
+static int case_ms = 300;
+static int max_doc_mb = 4;
+static long max_names = 1000000;
+static char only[16] = "";
+
+static char workdir[] = "/tmp/docs_micro_XXXXXX";
+static volatile int bench_running = 0;
+
+// Shared inputs for the case being run
+static char doc_path[MAX_PATH];
+static long doc_bytes;
+static Trie *trie;
+static char (*names)[32];
+static long name_count;
+static LRUCache *cache;
+static int cache_capacity;
+static FileMetadata template_meta;
+
+static const char *filler[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot",
+                                "golf", "hotel", "india", "juliet", "kilo", "lima" };
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int next_random(unsigned int *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// A document of about `bytes`: sentences of 4 to 15 words, ended by '.',
+// '!' or '?', with a line break now and then
+static long make_document(const char *path, long bytes) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    unsigned int seed = 2463534242u;
+    long written = 0;
+    int words_left = 4 + next_random(&seed) % 12;
+    while (written < bytes) {
+        const char *word = filler[next_random(&seed) % (sizeof(filler) / sizeof(filler[0]))];
+        written += fprintf(f, "%s", word);
+        if (--words_left == 0) {
+            static const char ends[] = ".!?";
+            unsigned int r = next_random(&seed);
+            written += fprintf(f, "%c%s", ends[r % 3], r % 16 == 0 ? "\n" : " ");
+            words_left = 4 + next_random(&seed) % 12;
+        } else {
+            written += fprintf(f, " ");
+        }
+    }
+    fputs(".", f);
+    fclose(f);
+    return written + 1;
+}
+
+static void make_meta(FileMetadata *meta, long k) {
+    memcpy(meta, &template_meta, sizeof(FileMetadata));
+    snprintf(meta->filename, sizeof(meta->filename), "%s", names[k]);
+    meta->ss_id = (int)(k % 8) + 1;
+}
+
+static long op_parse(Worker *w, long i) {
+    (void)w;
+    (void)i;
+    FileContent *fc = init_file_content();
+    parse_file(doc_path, fc);
+    free_file_content(fc);
+    return doc_bytes;
+}
+
+static long op_to_string(Worker *w, long i) {
+    (void)i;
+    free(file_content_to_string(w->fc));
+    return doc_bytes;
+}
+
+static long op_write(Worker *w, long i) {
+    (void)i;
+    write_file_content(w->path, w->fc);
+    return doc_bytes;
+}
+
+static long op_insert(Worker *w, long i) {
+    (void)i;
+    int sentence = (int)(next_random(&w->seed) % w->fc->sentence_count);
+    insert_word_in_sentence(w->fc, sentence, 1, "zulu");
+    return 0;
+}
+
+static long op_trie_insert(Worker *w, long i) {
+    (void)w;
+    FileMetadata meta;
+    make_meta(&meta, i);
+    trie_insert(trie, names[i], &meta);
+    return 0;
+}
+
+static long op_trie_hit(Worker *w, long i) {
+    (void)i;
+    FileMetadata *meta = trie_search(trie, names[next_random(&w->seed) % name_count]);
+    free(meta);
+    return 0;
+}
+
+static long op_trie_miss(Worker *w, long i) {
+    (void)i;
+    char name[40];
+    snprintf(name, sizeof(name), "%s~", names[next_random(&w->seed) % name_count]);
+    FileMetadata *meta = trie_search(trie, name);
+    free(meta);
+    return 0;
+}
+
+static long op_trie_list(Worker *w, long i) {
+    (void)i;
+    int count = trie_get_all_files(trie, w->listing, (int)name_count);
+    for (int k = 0; k < count; k++) free(w->listing[k]);
+    return 0;
+}
+
+// Hits come from the half of the keys put in last, which stays cached
+static long op_cache_hit(Worker *w, long i) {
+    (void)i;
+    long k = cache_capacity / 2 + next_random(&w->seed) % (cache_capacity / 2);
+    FileMetadata *meta = cache_get(cache, names[k]);
+    free(meta);
+    return 0;
+}
+
+static long op_cache_miss(Worker *w, long i) {
+    (void)i;
+    long k = cache_capacity + next_random(&w->seed) % (name_count - cache_capacity);
+    FileMetadata *meta = cache_get(cache, names[k]);
+    free(meta);
+    return 0;
+}
+
+// Keys cycle through many times the capacity, so most puts evict
+static long op_cache_put(Worker *w, long i) {
+    (void)i;
+    long k = next_random(&w->seed) % name_count;
+    FileMetadata meta;
+    make_meta(&meta, k);
+    cache_put(cache, names[k], &meta);
+    return 0;
+}
+
+static void* worker_main(void *arg) {
+    Worker *w = arg;
+    const BenchCase *bc = w->bc;
+    alloc_bytes = 0;
+    alloc_blocks = 0;
+    if (w->limit > 0) {
+        for (long i = w->first; i < w->first + w->limit; i++) {
+            w->bytes += bc->fn(w, i);
+        }
+        w->ops = w->limit;
+    } else {
+        while (!bench_running) ;
+        do {
+            for (int b = 0; b < bc->batch; b++) {
+                w->bytes += bc->fn(w, w->ops++);
+            }
+        } while (bench_running);
+    }
+    w->alloc_bytes = alloc_bytes;
+    w->alloc_blocks = alloc_blocks;
+    return NULL;
+}
+
+// Thread-local setup each case needs
+static void prepare_worker(Worker *w, const BenchCase *bc) {
+    if (bc->fn == op_to_string || bc->fn == op_write || bc->fn == op_insert) {
+        w->fc = init_file_content();
+        parse_file(doc_path, w->fc);
+        snprintf(w->path, sizeof(w->path), "%s/out%d.txt", workdir, w->id);
+    }
+    if (bc->fn == op_trie_list) {
+        w->listing = malloc(sizeof(FileMetadata*) * name_count);
+    }
+}
+
+static void release_worker(Worker *w) {
+    if (w->fc) free_file_content(w->fc);
+    free(w->listing);
+}
+
+static void run_case(const BenchCase *bc, int threads) {
+    pthread_t tids[MAX_BENCH_THREADS];
+    Worker workers[MAX_BENCH_THREADS];
+    for (int t = 0; t < threads; t++) {
+        Worker *w = &workers[t];
+        memset(w, 0, sizeof(Worker));
+        w->id = t;
+        w->threads = threads;
+        w->seed = 2463534242u + t * 7919u;
+        w->bc = bc;
+        if (bc->fixed_ops > 0) {
+            w->first = bc->fixed_ops * t / threads;
+            w->limit = bc->fixed_ops * (t + 1) / threads - w->first;
+        }
+        prepare_worker(w, bc);
+    }
+
+    bench_running = 0;
+    for (int t = 0; t < threads; t++) pthread_create(&tids[t], NULL, worker_main, &workers[t]);
+    double start = now_ns();
+    bench_running = 1;
+    if (bc->fixed_ops == 0) usleep(case_ms * 1000);
+    bench_running = 0;
+    long ops = 0, bytes = 0, allocated = 0, blocks = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        ops += workers[t].ops;
+        bytes += workers[t].bytes;
+        allocated += workers[t].alloc_bytes;
+        blocks += workers[t].alloc_blocks;
+        release_worker(&workers[t]);
+    }
+    double elapsed = now_ns() - start;
+
+    char rate[16] = "-";
+    if (bytes > 0) snprintf(rate, sizeof(rate), "%.1f", bytes / (elapsed / 1e9) / (1024.0 * 1024.0));
+    printf("%-24s %8s %7d %12.0f %12.0f %10s %12.0f %10.1f\n", bc->name, bc->size, threads,
+           elapsed * threads / ops, ops / (elapsed / 1e9), rate,
+           (double)allocated / ops, (double)blocks / ops);
+    fflush(stdout);
+}
+
+static void run_both(const BenchCase *bc) {
+    run_case(bc, 1);
+    if (thread_count > 1) run_case(bc, thread_count);
+}
+
+static void format_size(long bytes, char *out, size_t size) {
+    if (bytes >= 1024 * 1024) snprintf(out, size, "%ldM", bytes / (1024 * 1024));
+    else if (bytes >= 1024) snprintf(out, size, "%ldK", bytes / 1024);
+    else snprintf(out, size, "%ld", bytes);
+}
+
+static void bench_file_ops() {
+    for (long size = 1024; size <= (long)max_doc_mb * 1024 * 1024; size *= 16) {
+        snprintf(doc_path, sizeof(doc_path), "%s/doc.txt", workdir);
+        doc_bytes = make_document(doc_path, size);
+        char label[16];
+        format_size(size, label, sizeof(label));
+        BenchCase cases[] = {
+            { "parse_file", label, op_parse, 1, 0 },
+            { "file_content_to_string", label, op_to_string, 1, 0 },
+            { "write_file_content", label, op_write, 1, 0 },
+            { "insert_word_in_sentence", label, op_insert, 16, 0 },
+        };
+        for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) run_both(&cases[c]);
+        if (size < (long)max_doc_mb * 1024 * 1024 && size * 16 > (long)max_doc_mb * 1024 * 1024) {
+            size = (long)max_doc_mb * 1024 * 1024 / 16;
+        }
+    }
+}
+
+static void make_names(long count) {
+    names = malloc(sizeof(*names) * count);
+    for (long k = 0; k < count; k++) {
+        snprintf(names[k], sizeof(names[k]), "%s%ld.txt", filler[k % 12], k);
+    }
+    name_count = count;
+}
+
+// Rough resident size of a trie of `count` names: the metadata, plus about
+// six nodes per name for the digits and extension it does not share
+static int trie_fits(long count) {
+    double needed = (double)count * (sizeof(FileMetadata) + 6 * sizeof(TrieNode));
+    double available = (double)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    return needed < available * 0.7;
+}
+
+static void bench_trie() {
+    for (long count = 1000; count <= max_names; count *= 10) {
+        char label[16];
+        snprintf(label, sizeof(label), "%ldk", count / 1000);
+        if (!trie_fits(count)) {
+            printf("%-24s %8s         skipped: needs about %.0f MB\n", "trie", label,
+                   count * (sizeof(FileMetadata) + 6.0 * sizeof(TrieNode)) / (1024 * 1024));
+            continue;
+        }
+        make_names(count);
+
+        // Building it is the insert benchmark; threads share one trie
+        BenchCase insert = { "trie_insert", label, op_trie_insert, 1, count };
+        trie = init_trie();
+        run_case(&insert, 1);
+        if (thread_count > 1) {
+            free_trie(trie);
+            trie = init_trie();
+            run_case(&insert, thread_count);
+        }
+
+        BenchCase cases[] = {
+            { "trie_search (hit)", label, op_trie_hit, 64, 0 },
+            { "trie_search (miss)", label, op_trie_miss, 64, 0 },
+            { "trie_get_all_files", label, op_trie_list, 1, 0 },
+        };
+        for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) run_both(&cases[c]);
+        free_trie(trie);
+        free(names);
+    }
+}
+
+static void bench_cache() {
+    int capacities[] = { CACHE_SIZE, 10000 };
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        cache_capacity = capacities[c];
+        make_names(cache_capacity * 10 < MAX_CACHE_KEYS ? cache_capacity * 10 : MAX_CACHE_KEYS);
+        char label[16];
+        snprintf(label, sizeof(label), "%d", cache_capacity);
+
+        BenchCase cases[] = {
+            { "cache_get (hit)", label, op_cache_hit, 64, 0 },
+            { "cache_get (miss)", label, op_cache_miss, 64, 0 },
+            { "cache_put (evict)", label, op_cache_put, 64, 0 },
+        };
+        for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+            int variants[] = { 1, thread_count };
+            for (int v = 0; v < (thread_count > 1 ? 2 : 1); v++) {
+                // Fill it in order, so the upper half of the first keys is cached
+                cache = init_cache(cache_capacity);
+                FileMetadata meta;
+                for (long i = 0; i < cache_capacity - 1; i++) {
+                    make_meta(&meta, i + 1);
+                    cache_put(cache, names[i + 1], &meta);
+                }
+                run_case(&cases[k], variants[v]);
+                free_cache(cache);
+            }
+        }
+        free(names);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ms") == 0 && i + 1 < argc) {
+            case_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-doc-mb") == 0 && i + 1 < argc) {
+            max_doc_mb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-names") == 0 && i + 1 < argc) {
+            max_names = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+            strncpy(only, argv[++i], sizeof(only) - 1);
+        } else {
+            fprintf(stderr, "Usage: %s [--threads N] [--ms MS] [--max-doc-mb N] [--max-names N] "
+                            "[--only file|trie|cache]\n", argv[0]);
+            return 1;
+        }
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count == 0) thread_count = cores < 2 ? 2 : (int)cores;
+    if (thread_count < 1 || thread_count > MAX_BENCH_THREADS || case_ms < 1 || max_doc_mb < 1 ||
+        max_names < 1000) {
+        fprintf(stderr, "Need 1..%d threads, positive --ms and --max-doc-mb, and --max-names of at least 1000\n",
+                MAX_BENCH_THREADS);
+        return 1;
+    }
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    memset(&template_meta, 0, sizeof(template_meta));
+    strcpy(template_meta.owner, "bench");
+    strcpy(template_meta.folder_path, "/");
+    template_meta.created = template_meta.modified = template_meta.accessed = 1700000000;
+
+    printf("=== Microbenchmarks: %d ms per case, up to %d threads, %ld cores ===\n",
+           case_ms, thread_count, cores);
+    printf("%-24s %8s %7s %12s %12s %10s %12s %10s\n", "operation", "size", "threads",
+           "ns/op", "ops/s", "MB/s", "alloc B/op", "allocs/op");
+    if (!only[0] || strcmp(only, "file") == 0) bench_file_ops();
+    if (!only[0] || strcmp(only, "trie") == 0) bench_trie();
+    if (!only[0] || strcmp(only, "cache") == 0) bench_cache();
+
+    char command[MAX_PATH + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", workdir);
+    if (system(command) != 0) fprintf(stderr, "Could not remove %s\n", workdir);
+    return 0;
+}
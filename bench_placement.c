@@ -0,0 +1,258 @@
+// Placement balance benchmark.
+//
+// Drives the NM placement engine offline with skewed workloads and reports
+// how evenly each policy spreads files, bytes and request load over the
+// storage servers. As in the NM, the engine only sees what the servers last
+// reported on their heartbeats plus the files it placed since then.
+//
+// Scenarios:
+//   skewed   - one server starts out holding many more files than the rest
+//   sizes    - every Nth file is large, with N a multiple of the server count
+//   zipf     - request popularity follows a Zipf distribution
+//   dead     - like zipf, with one server down for the whole run
+//
+// It then measures what the chash policy moves when a server joins or leaves
+// the ring, against the 1/N a perfect hash would move, for a few ring sizes.
+//
+// Usage: ./bench_placement [--servers N] [--files N] [--report-every N] [--seed N]
+//                          [--replicas N]
+
+#include "placement.h"
+#include <math.h>
+
+typedef struct {
+    int files;
+    long long bytes;
+    double rate;        // Requests per second over the files it holds
+} ServerState;
+
+typedef struct {
+    const char *name;
+    int preload;        // Files already on server 0
+    int large_every;    // Every Nth file is large (0 = all small)
+    double zipf_s;      // Popularity skew (0 = uniform)
+    int dead_server;    // Server index that is down (-1 = none)
+} Scenario;
+
+static int server_count = 8;
+static int file_count = 20000;
+static int report_every = 50;       // Placements between load reports
+static unsigned int base_seed = 42;
+static int replica_count = 2;       // Copies per file in the churn runs
+
+#define SMALL_FILE 2048
+#define LARGE_FILE (512 * 1024)
+#define TOTAL_RATE 10000.0          // Requests per second over all files
+
+// Popularity of the k-th file (1-based) under a Zipf distribution
+static double zipf_weight(int k, double s) {
+    return s > 0.0 ? 1.0 / pow(k, s) : 1.0;
+}
+
+static void report_loads(const ServerState *state, SSLoad *loads, int dead_server) {
+    for (int i = 0; i < server_count; i++) {
+        loads[i].ss_id = i;
+        loads[i].active = (i != dead_server);
+        loads[i].file_count = state[i].files;
+        loads[i].bytes_used = state[i].bytes;
+        loads[i].request_rate = state[i].rate;
+        // Latency grows with the request rate a server is carrying
+        loads[i].p99_ms = 0.5 + state[i].rate / 1000.0;
+        loads[i].locks_held = 0;
+        loads[i].pending = 0;
+    }
+}
+
+static void print_balance(const char *label, const double *values, const SSLoad *loads) {
+    double sum = 0.0, max = 0.0;
+    int live = 0;
+    for (int i = 0; i < server_count; i++) {
+        if (!loads[i].active) continue;
+        sum += values[i];
+        if (values[i] > max) max = values[i];
+        live++;
+    }
+    double mean = live ? sum / live : 0.0;
+
+    double var = 0.0;
+    for (int i = 0; i < server_count; i++) {
+        if (!loads[i].active) continue;
+        var += (values[i] - mean) * (values[i] - mean);
+    }
+    double cov = (live && mean > 0.0) ? sqrt(var / live) / mean : 0.0;
+
+    printf("  %-6s max/mean %5.2f  CoV %5.3f", label, mean > 0.0 ? max / mean : 0.0, cov);
+}
+
+static void run(const Scenario *sc, PlacementPolicy policy) {
+    ServerState *state = calloc(server_count, sizeof(ServerState));
+    SSLoad *loads = calloc(server_count, sizeof(SSLoad));
+
+    double norm = 0.0;
+    for (int k = 1; k <= file_count; k++) {
+        norm += zipf_weight(k, sc->zipf_s);
+    }
+
+    // Files that existed before the run carry no request load
+    state[0].files = sc->preload;
+    state[0].bytes = (long long)sc->preload * SMALL_FILE;
+
+    Placement p;
+    placement_init(&p, policy, base_seed);
+    report_loads(state, loads, sc->dead_server);
+
+    for (int k = 1; k <= file_count; k++) {
+        if ((k - 1) % report_every == 0) {
+            report_loads(state, loads, sc->dead_server);
+        }
+
+        char key[32];
+        snprintf(key, sizeof(key), "file%d.txt", k);
+        int idx;
+        if (placement_choose_key(&p, key, loads, server_count, 1, &idx) != 1) break;
+        loads[idx].pending++;
+
+        // Popular files are created first, as in a new workload warming up
+        long long size = (sc->large_every && k % sc->large_every == 0) ? LARGE_FILE : SMALL_FILE;
+        state[idx].files++;
+        state[idx].bytes += size;
+        state[idx].rate += TOTAL_RATE * zipf_weight(k, sc->zipf_s) / norm;
+    }
+    report_loads(state, loads, sc->dead_server);
+
+    double files[MAX_SS], bytes[MAX_SS], rate[MAX_SS];
+    for (int i = 0; i < server_count; i++) {
+        files[i] = state[i].files;
+        bytes[i] = (double)state[i].bytes;
+        rate[i] = state[i].rate;
+    }
+
+    printf("%-12s", placement_policy_name(policy));
+    print_balance("files", files, loads);
+    print_balance("bytes", bytes, loads);
+    print_balance("rate", rate, loads);
+    printf("\n");
+
+    ring_free(&p.ring);
+    free(state);
+    free(loads);
+}
+
+// Desired copies of every file on a ring of `members` servers, and copies
+// per server
+static void place_on_ring(const int *members, int count, int vnodes, int *desired, double *per_server) {
+    HashRing ring;
+    memset(&ring, 0, sizeof(ring));
+    ring_build(&ring, members, count, vnodes);
+    for (int i = 0; i < MAX_SS; i++) per_server[i] = 0.0;
+
+    for (int k = 0; k < file_count; k++) {
+        char key[32];
+        snprintf(key, sizeof(key), "file%d.txt", k + 1);
+        int *ids = desired + k * replica_count;
+        int n = ring_lookup(&ring, key, replica_count, ids);
+        for (int r = 0; r < n; r++) per_server[ids[r]] += 1.0;
+    }
+    ring_free(&ring);
+}
+
+// Transfers the planner needs to go from one placement to the other
+static void count_transfers(const int *before, const int *after, int *files_moved, int *copies_moved) {
+    *files_moved = 0;
+    *copies_moved = 0;
+    for (int k = 0; k < file_count; k++) {
+        Transfer transfers[MAX_REPLICAS];
+        int n = placement_plan_file(before + k * replica_count, replica_count,
+                                    after + k * replica_count, replica_count, transfers);
+        if (n > 0) (*files_moved)++;
+        *copies_moved += n;
+    }
+}
+
+static void run_churn(int vnodes) {
+    int members[MAX_SS];
+    for (int i = 0; i < server_count; i++) members[i] = i;
+
+    int *base = malloc(sizeof(int) * file_count * replica_count);
+    int *changed = malloc(sizeof(int) * file_count * replica_count);
+    double per_server[MAX_SS];
+    SSLoad loads[MAX_SS];
+    memset(loads, 0, sizeof(loads));
+
+    // Servers 0..N-2 hold the files; N-1 joins, then N-2 leaves
+    int start = server_count - 1;
+    for (int i = 0; i < server_count; i++) loads[i].active = i < start;
+    place_on_ring(members, start, vnodes, base, per_server);
+    printf("%-8d", vnodes);
+    print_balance("copies", per_server, loads);
+
+    int files_moved, copies_moved;
+    place_on_ring(members, server_count, vnodes, changed, per_server);
+    count_transfers(base, changed, &files_moved, &copies_moved);
+    printf("  join %5.1f%% files %5.1f%% copies",
+           100.0 * files_moved / file_count, 100.0 * copies_moved / (file_count * replica_count));
+
+    place_on_ring(members, start - 1, vnodes, changed, per_server);
+    count_transfers(base, changed, &files_moved, &copies_moved);
+    printf("  leave %5.1f%% files %5.1f%% copies\n",
+           100.0 * files_moved / file_count, 100.0 * copies_moved / (file_count * replica_count));
+
+    free(base);
+    free(changed);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--servers") == 0 && i + 1 < argc) {
+            server_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            file_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--report-every") == 0 && i + 1 < argc) {
+            report_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            base_seed = (unsigned int)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replicas") == 0 && i + 1 < argc) {
+            replica_count = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--servers N] [--files N] [--report-every N] [--seed N] [--replicas N]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (server_count < 2 || server_count > MAX_SS || file_count <= 0 || report_every <= 0) {
+        fprintf(stderr, "Need 2..%d servers, and positive --files and --report-every\n", MAX_SS);
+        return 1;
+    }
+    if (replica_count < 1 || replica_count > MAX_REPLICAS || replica_count > server_count - 2) {
+        fprintf(stderr, "Need 1..%d replicas, and at least replicas + 2 servers\n", MAX_REPLICAS);
+        return 1;
+    }
+
+    Scenario scenarios[] = {
+        { "skewed", file_count / 4, 0, 0.0, -1 },
+        { "sizes", 0, server_count * 4, 0.0, -1 },
+        { "zipf", 0, 0, 1.1, -1 },
+        { "dead", 0, 0, 1.1, server_count - 1 },
+    };
+    PlacementPolicy policies[] = { PLACEMENT_ROUND_ROBIN, PLACEMENT_P2C, PLACEMENT_WEIGHTED, PLACEMENT_CHASH };
+
+    printf("=== Placement balance: %d servers, %d files, report every %d placements ===\n",
+           server_count, file_count, report_every);
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+        printf("\n[%s]\n", scenarios[s].name);
+        for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+            run(&scenarios[s], policies[p]);
+        }
+    }
+
+    // A perfect hash moves the joining server's share of the copies, and the
+    // leaving server's
+    printf("\n[churn] %d copies per file on %d servers, then one joins or leaves (ideal: join %.1f%%, leave %.1f%% of copies)\n",
+           replica_count, server_count - 1, 100.0 / server_count, 100.0 / (server_count - 1));
+    printf("vnodes\n");
+    int vnode_counts[] = { 1, 16, PLACEMENT_VNODES, 512 };
+    for (size_t v = 0; v < sizeof(vnode_counts) / sizeof(vnode_counts[0]); v++) {
+        run_churn(vnode_counts[v]);
+    }
+    return 0;
+}
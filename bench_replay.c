@@ -0,0 +1,653 @@
+// Deterministic replay of captured requests.
+//
+// Reads traces written by servers running with NM_CAPTURE / SS_CAPTURE and
+// re-issues every captured request against a fresh cluster on this machine,
+// started in a scratch directory: one name server per NM trace (shards, if
+// the traces came from several) and --ss storage servers (one per SS trace
+// by default). Each captured connection is replayed on its own connection,
+// in order, with each request sent when it arrived in the capture divided by
+// --speed (2 replays twice as fast; 0 sends each as soon as the previous
+// reply is in). Requests within a connection wait for the previous reply,
+// as clients do; how far sends fell behind schedule is reported as lag.
+//
+// Storage server requests go to wherever the fresh name server places their
+// file now: the replayer asks for the route on the replayed NM connection of
+// the same user (or a short-lived one if that user has none open) and
+// presents the fresh lease. These lookups are not timed. Replication traffic
+// between servers is not captured; the fresh cluster produces its own.
+//
+// Reports p50/p95/p99/p99.9 latency per message type in bench_load's format,
+// with --json for the record. --compare OLD.json prints how each type moved
+// against an earlier replay of the same traces, to compare builds.
+//
+// For a faithful replay, capture from a fresh cluster so that every file the
+// trace touches was created within it. Speeds the cluster cannot keep up
+// with (see the lag line) reorder requests across connections, and edits
+// that depended on earlier ones then fail; those show up as errors. The
+// servers inherit the environment, so SS_STREAM_DELAY_US and the like should
+// match the capture.
+//
+// Run from the build directory (it execs ./nm and ./ss), with no other name
+// server on this machine.
+//
+// Usage: ./bench_replay TRACE... [--speed X] [--ss N] [--json FILE|-]
+//                       [--compare FILE] [--bin-dir DIR]
+
+#include "bench_util.h"
+#include "capture.h"
+
+#define BASE_SS_PORT 9700
+#define MAX_TRACES 32
+#define MAX_REPLAY_SS 16
+#define MAX_ROUTES 64
+#define ROUTE_REUSE_MS 3000      // Ask again well before the NM's lease runs out
+#define USER_TABLE 1024
+
+typedef struct {
+    long errors;
+    Histogram latency;           // Successful requests
+} OpStats;
+
+typedef struct {
+    int64_t due_us;              // Since the start of the replay, at 1x
+    char *frame;                 // NULL marks the connection closing
+} ReplayRecord;
+
+typedef struct {
+    int trace;
+    CaptureRole role;
+    int shard;                   // NM shard the connection goes to
+    ReplayRecord *records;
+    int count;
+    int capacity;
+} ReplaySession;
+
+typedef struct {
+    const char *path;
+    CaptureHeader header;
+} TraceInfo;
+
+// A replayed NM connection that has registered, so SS requests from the
+// same user can be routed through it
+typedef struct {
+    char username[MAX_USERNAME];
+    int shard;
+    int sock;
+    pthread_mutex_t *mutex;      // Held for each exchange on `sock`
+} UserSession;
+
+// Where one of a session's files lives in the fresh cluster
+typedef struct {
+    char filename[MAX_FILENAME];
+    AccessType access;
+    char address[INET_ADDRSTRLEN + 8];
+    char lease[MAX_LEASE];
+    double fetched_ms;
+} Route;
+
+typedef struct {
+    char address[INET_ADDRSTRLEN + 8];
+    int sock;
+} SsLink;
+
+static TraceInfo traces[MAX_TRACES];
+static int trace_count = 0;
+static ReplaySession **sessions = NULL;
+static int session_count = 0;
+
+static double speed = 1.0;
+static int ss_count = 0;
+static int nm_shards = 1;
+static char json_path[MAX_PATH] = "";
+static char compare_path[MAX_PATH] = "";
+static char bin_dir[MAX_PATH] = ".";
+
+static BenchCluster cluster;
+
+static double replay_start_ms;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static OpStats stats[MSG_TYPE_COUNT];
+static Histogram lag;
+static long unroutable = 0;
+
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+static UserSession users[USER_TABLE];
+static int user_count = 0;
+
+static pthread_mutex_t active_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t active_cond = PTHREAD_COND_INITIALIZER;
+static int active_sessions = 0;
+
+static void record(int type, int status, double start_ms) {
+    long us = (long)((now_ms() - start_ms) * 1000.0);
+    if (type < 0 || type >= MSG_TYPE_COUNT) return;
+    pthread_mutex_lock(&stats_mutex);
+    if (status == SUCCESS) hist_add(&stats[type].latency, us);
+    else stats[type].errors++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static int connect_address(const char *address) {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    if (sscanf(address, "%15[^:]:%d", ip, &port) != 2) return -1;
+    return connect_to(ip, port, 10, 30);
+}
+
+// ---------------------------------------------------------------------------
+// Loading traces
+// ---------------------------------------------------------------------------
+
+static ReplaySession* find_session(ReplaySession ***by_id, uint32_t *size, uint32_t id) {
+    if (id >= *size) {
+        uint32_t grown = *size ? *size : 1024;
+        while (grown <= id) grown *= 2;
+        *by_id = realloc(*by_id, sizeof(ReplaySession*) * grown);
+        memset(*by_id + *size, 0, sizeof(ReplaySession*) * (grown - *size));
+        *size = grown;
+    }
+    return (*by_id)[id];
+}
+
+static int load_trace(int index, int64_t *first_us) {
+    FILE *f = fopen(traces[index].path, "rb");
+    if (!f) {
+        perror(traces[index].path);
+        return -1;
+    }
+    CaptureHeader *header = &traces[index].header;
+    if (capture_read_header(f, header) != 0) {
+        fprintf(stderr, "%s is not a capture trace\n", traces[index].path);
+        fclose(f);
+        return -1;
+    }
+
+    ReplaySession **by_id = NULL;
+    uint32_t size = 0;
+    CaptureRecord rec;
+    char frame[MAX_BUFFER * 2];
+    int result;
+    long records = 0;
+    while ((result = capture_read_record(f, &rec, frame, sizeof(frame))) == 1) {
+        ReplaySession *s = find_session(&by_id, &size, rec.session);
+        if (!s) {
+            s = calloc(1, sizeof(ReplaySession));
+            s->trace = index;
+            s->role = header->role;
+            s->shard = header->role == CAPTURE_NM ? header->id : 0;
+            by_id[rec.session] = s;
+            sessions = realloc(sessions, sizeof(ReplaySession*) * (session_count + 1));
+            sessions[session_count++] = s;
+        }
+        if (s->count == s->capacity) {
+            s->capacity = s->capacity ? s->capacity * 2 : 16;
+            s->records = realloc(s->records, sizeof(ReplayRecord) * s->capacity);
+        }
+        // Absolute for now; made relative to the earliest record once all are in
+        s->records[s->count].due_us = header->start_us + rec.offset_us;
+        s->records[s->count].frame = rec.length > 0 ? strdup(frame) : NULL;
+        if (*first_us == 0 || s->records[s->count].due_us < *first_us) {
+            *first_us = s->records[s->count].due_us;
+        }
+        s->count++;
+        records++;
+    }
+    fclose(f);
+    free(by_id);
+    if (result < 0) fprintf(stderr, "%s: trace ends in a partial record, ignored\n", traces[index].path);
+    printf("Trace:   %s (%s %d, %ld records)\n", traces[index].path,
+           header->role == CAPTURE_NM ? "NM shard" : "SS", header->id, records);
+    return 0;
+}
+
+static int by_first_record(const void *a, const void *b) {
+    const ReplaySession *x = *(ReplaySession* const*)a, *y = *(ReplaySession* const*)b;
+    int64_t dx = x->count ? x->records[0].due_us : 0, dy = y->count ? y->records[0].due_us : 0;
+    return dx < dy ? -1 : dx > dy;
+}
+
+// ---------------------------------------------------------------------------
+// Replaying
+// ---------------------------------------------------------------------------
+
+// Sleep until `due_us` into the replay, scaled by --speed; returns how late
+// that leaves us, in us
+static long wait_until(int64_t due_us) {
+    if (speed <= 0.0) return 0;
+    double target = replay_start_ms + due_us / 1000.0 / speed;
+    double now = now_ms();
+    if (now < target) {
+        usleep((useconds_t)((target - now) * 1000.0));
+        return 0;
+    }
+    return (long)((now - target) * 1000.0);
+}
+
+static void add_user(const char *username, int shard, int sock, pthread_mutex_t *mutex) {
+    pthread_mutex_lock(&users_mutex);
+    if (user_count < USER_TABLE) {
+        UserSession *u = &users[user_count++];
+        strncpy(u->username, username, MAX_USERNAME - 1);
+        u->username[MAX_USERNAME - 1] = '\0';
+        u->shard = shard;
+        u->sock = sock;
+        u->mutex = mutex;
+    }
+    pthread_mutex_unlock(&users_mutex);
+}
+
+static void remove_user(int sock) {
+    pthread_mutex_lock(&users_mutex);
+    for (int i = 0; i < user_count; i++) {
+        if (users[i].sock == sock) {
+            users[i] = users[--user_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&users_mutex);
+}
+
+// One request and its reply on an NM connection, under `mutex`
+static int nm_exchange(int sock, pthread_mutex_t *mutex, Message *msg, Message *response) {
+    pthread_mutex_lock(mutex);
+    int ok = send_message(sock, msg) == 0 && recv_message(sock, response) == 0;
+    pthread_mutex_unlock(mutex);
+    return ok ? response->status : -1;
+}
+
+// Ask the NM where `filename` lives now, as `username`: on that user's
+// replayed connection to the owning shard if there is one, otherwise on a
+// connection of our own
+static int lookup_route(const char *username, const char *filename, MessageType route_type, Route *route) {
+    Message msg, response;
+    init_message(&msg);
+    msg.type = route_type;
+    strcpy(msg.sender, username);
+    strcpy(msg.filename, filename);
+    int shard = shard_for_message(&msg, nm_shards);
+
+    int status = -1, found = 0;
+    pthread_mutex_lock(&users_mutex);
+    for (int i = 0; i < user_count; i++) {
+        if (users[i].shard == shard && strcmp(users[i].username, username) == 0) {
+            int sock = users[i].sock;
+            pthread_mutex_t *mutex = users[i].mutex;
+            found = 1;
+            pthread_mutex_unlock(&users_mutex);
+            status = nm_exchange(sock, mutex, &msg, &response);
+            break;
+        }
+    }
+    if (!found) {
+        pthread_mutex_unlock(&users_mutex);
+        int sock = connect_to("127.0.0.1", nm_shard_port(NM_CLIENT_PORT, shard), 10, 30);
+        if (sock < 0) return -1;
+        Message reg, reply;
+        init_message(&reg);
+        reg.type = MSG_REG_CLIENT;
+        strcpy(reg.sender, username);
+        strcpy(reg.data, "127.0.0.1");
+        if (send_message(sock, &reg) == 0 && recv_message(sock, &reply) == 0 && reply.status == SUCCESS &&
+            send_message(sock, &msg) == 0 && recv_message(sock, &response) == 0) {
+            status = response.status;
+        }
+        close(sock);
+    }
+    if (status != SUCCESS) return -1;
+
+    strncpy(route->filename, filename, MAX_FILENAME - 1);
+    route->filename[MAX_FILENAME - 1] = '\0';
+    route->access = route_type == MSG_READ ? ACCESS_READ : ACCESS_WRITE;
+    snprintf(route->address, sizeof(route->address), "%s", response.data);
+    snprintf(route->lease, sizeof(route->lease), "%s", response.lease);
+    route->fetched_ms = now_ms();
+    return 0;
+}
+
+static void replay_nm_session(ReplaySession *s) {
+    int sock = connect_to("127.0.0.1", nm_shard_port(NM_CLIENT_PORT, s->shard), 10, 30);
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    int registered = 0;
+    Message msg, response;
+
+    for (int i = 0; i < s->count && sock >= 0; i++) {
+        ReplayRecord *r = &s->records[i];
+        long late = wait_until(r->due_us);
+        if (!r->frame) break;
+        deserialize_message(r->frame, &msg);
+        pthread_mutex_lock(&stats_mutex);
+        hist_add(&lag, late);
+        pthread_mutex_unlock(&stats_mutex);
+
+        double start = now_ms();
+        int status = nm_exchange(sock, &mutex, &msg, &response);
+        record(msg.type, status, start);
+        if (status < 0) break;
+        if (msg.type == MSG_REG_CLIENT && status == SUCCESS && !registered) {
+            add_user(msg.sender, s->shard, sock, &mutex);
+            registered = 1;
+        }
+    }
+    if (registered) remove_user(sock);
+    if (sock >= 0) close(sock);
+}
+
+static int ss_socket(SsLink *links, int *link_count, const char *address) {
+    for (int i = 0; i < *link_count; i++) {
+        if (strcmp(links[i].address, address) == 0) return links[i].sock;
+    }
+    if (*link_count == MAX_ROUTES) return -1;
+    int sock = connect_address(address);
+    if (sock < 0) return -1;
+    snprintf(links[*link_count].address, sizeof(links[*link_count].address), "%s", address);
+    links[(*link_count)++].sock = sock;
+    return sock;
+}
+
+static void drop_ss_socket(SsLink *links, int *link_count, int sock) {
+    for (int i = 0; i < *link_count; i++) {
+        if (links[i].sock == sock) {
+            close(sock);
+            links[i] = links[--*link_count];
+            return;
+        }
+    }
+}
+
+static void replay_ss_session(ReplaySession *s) {
+    Route routes[MAX_ROUTES];
+    int route_count = 0;
+    SsLink links[MAX_ROUTES];
+    int link_count = 0;
+    Message msg, response;
+
+    for (int i = 0; i < s->count; i++) {
+        ReplayRecord *r = &s->records[i];
+        long late = wait_until(r->due_us);
+        if (!r->frame) break;
+        deserialize_message(r->frame, &msg);
+        pthread_mutex_lock(&stats_mutex);
+        hist_add(&lag, late);
+        pthread_mutex_unlock(&stats_mutex);
+
+        // A write session's requests all follow the route its LOCK took
+        MessageType route_type = (msg.type == MSG_READ || msg.type == MSG_STREAM) ? MSG_READ :
+                                 msg.type == MSG_UNDO ? MSG_UNDO : MSG_WRITE;
+        AccessType access = route_type == MSG_READ ? ACCESS_READ : ACCESS_WRITE;
+        int locked = msg.type == MSG_WRITE || msg.type == MSG_UNLOCK_SENTENCE || msg.type == MSG_CANCEL_WRITE;
+        Route *route = NULL;
+        for (int k = 0; k < route_count; k++) {
+            if (strcmp(routes[k].filename, msg.filename) == 0 && routes[k].access >= access &&
+                (locked || now_ms() - routes[k].fetched_ms < ROUTE_REUSE_MS)) {
+                route = &routes[k];
+            }
+        }
+        if (!route) {
+            Route fresh;
+            if (lookup_route(msg.sender, msg.filename, route_type, &fresh) != 0) {
+                pthread_mutex_lock(&stats_mutex);
+                unroutable++;
+                pthread_mutex_unlock(&stats_mutex);
+                record(msg.type, ERR_FILE_NOT_FOUND, now_ms());
+                continue;
+            }
+            int slot = route_count < MAX_ROUTES ? route_count++ : 0;
+            for (int k = 0; k < route_count; k++) {
+                if (strcmp(routes[k].filename, msg.filename) == 0) slot = k;
+            }
+            routes[slot] = fresh;
+            route = &routes[slot];
+        }
+        strcpy(msg.lease, route->lease);
+
+        int sock = ss_socket(links, &link_count, route->address);
+        double start = now_ms();
+        int status = -1;
+        if (sock >= 0 && send_message(sock, &msg) == 0 && recv_message(sock, &response) == 0) {
+            status = response.status;
+            // A stream's words follow its acknowledgement
+            while (msg.type == MSG_STREAM && status == SUCCESS) {
+                if (recv_message(sock, &response) < 0) {
+                    status = -1;
+                    break;
+                }
+                if (response.type == MSG_STOP) break;
+            }
+        }
+        record(msg.type, status, start);
+        if (status < 0 && sock >= 0) drop_ss_socket(links, &link_count, sock);
+    }
+    for (int i = 0; i < link_count; i++) close(links[i].sock);
+}
+
+static void* session_main(void *arg) {
+    ReplaySession *s = arg;
+    if (s->role == CAPTURE_NM) replay_nm_session(s);
+    else replay_ss_session(s);
+
+    pthread_mutex_lock(&active_mutex);
+    active_sessions--;
+    pthread_cond_signal(&active_cond);
+    pthread_mutex_unlock(&active_mutex);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Cluster
+// ---------------------------------------------------------------------------
+
+static int start_cluster(const char *workdir) {
+    // A replay must not capture itself over the trace
+    unsetenv("NM_CAPTURE");
+    unsetenv("SS_CAPTURE");
+
+    BenchClusterSpec spec = {
+        .bin_dir = bin_dir,
+        .workdir = workdir,
+        .shards = nm_shards,
+        .ss_count = ss_count,
+        .base_ss_port = BASE_SS_PORT,
+        .settle_sec = 1,
+    };
+    return bench_start_cluster(&cluster, &spec);
+}
+
+// ---------------------------------------------------------------------------
+// Results
+// ---------------------------------------------------------------------------
+
+static void write_json(FILE *out, double elapsed_s, long records) {
+    fprintf(out, "{\n  \"config\": {\"traces\": %d, \"records\": %ld, \"speed\": %.2f, "
+                 "\"name_servers\": %d, \"storage_servers\": %d},\n",
+            trace_count, records, speed, nm_shards, ss_count);
+    long ops = 0, errors = 0;
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        ops += stats[t].latency.count;
+        errors += stats[t].errors;
+    }
+    fprintf(out, "  \"elapsed_s\": %.3f,\n  \"ops\": %ld,\n  \"errors\": %ld,\n  \"unroutable\": %ld,\n"
+                 "  \"ops_per_s\": %.1f,\n  \"lag_p99_ms\": %.3f,\n",
+            elapsed_s, ops, errors, unroutable, ops / elapsed_s, hist_percentile_ms(&lag, 0.99));
+    fprintf(out, "  \"types\": {\n");
+    int first = 1;
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        const Histogram *h = &stats[t].latency;
+        if (h->count == 0 && stats[t].errors == 0) continue;
+        fprintf(out, "%s    \"%s\": {\"count\": %ld, \"errors\": %ld, \"ops_per_s\": %.1f, "
+                     "\"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, "
+                     "\"p999_ms\": %.3f, \"max_ms\": %.3f}",
+                first ? "" : ",\n", message_type_name(t), h->count, stats[t].errors, h->count / elapsed_s,
+                h->count ? h->sum_us / h->count / 1000.0 : 0.0, hist_percentile_ms(h, 0.50),
+                hist_percentile_ms(h, 0.95), hist_percentile_ms(h, 0.99), hist_percentile_ms(h, 0.999),
+                h->max_us / 1000.0);
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+static double json_field(const char *line, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *at = strstr(line, pattern);
+    return at ? atof(at + strlen(pattern)) : -1.0;
+}
+
+// Per-type lines of an earlier run's JSON, side by side with this run
+static int compare_with(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    printf("\n=== Against %s ===\n", path);
+    printf("%-20s %10s %10s %8s %10s %10s %8s\n", "type", "p50 was", "p50 now", "change",
+           "p99 was", "p99 now", "change");
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        char name[64];
+        if (sscanf(line, " \"%63[A-Z_]\": {", name) != 1 || strncmp(name, "MSG_", 4) != 0) continue;
+        int type = -1;
+        for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+            if (strcmp(message_type_name(t), name) == 0) type = t;
+        }
+        double was50 = json_field(line, "p50_ms"), was99 = json_field(line, "p99_ms");
+        if (type < 0 || stats[type].latency.count == 0) {
+            printf("%-20s %10.2f %10s %8s %10.2f %10s %8s\n", name, was50, "-", "-", was99, "-", "-");
+            continue;
+        }
+        double now50 = hist_percentile_ms(&stats[type].latency, 0.50);
+        double now99 = hist_percentile_ms(&stats[type].latency, 0.99);
+        printf("%-20s %10.2f %10.2f %+7.0f%% %10.2f %10.2f %+7.0f%%\n", name, was50, now50,
+               was50 > 0 ? (now50 / was50 - 1.0) * 100.0 : 0.0, was99, now99,
+               was99 > 0 ? (now99 / was99 - 1.0) * 100.0 : 0.0);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ss") == 0 && i + 1 < argc) {
+            ss_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            strncpy(json_path, argv[++i], sizeof(json_path) - 1);
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            strncpy(compare_path, argv[++i], sizeof(compare_path) - 1);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            strncpy(bin_dir, argv[++i], sizeof(bin_dir) - 1);
+        } else if (argv[i][0] != '-' && trace_count < MAX_TRACES) {
+            traces[trace_count++].path = argv[i];
+        } else {
+            trace_count = 0;
+            break;
+        }
+    }
+    if (trace_count == 0 || speed < 0.0 || ss_count < 0 || ss_count > MAX_REPLAY_SS) {
+        fprintf(stderr, "Usage: %s TRACE... [--speed X] [--ss N] [--json FILE|-] [--compare FILE] [--bin-dir DIR]\n",
+                argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // The JSON takes stdout if asked to; everything else goes to stderr then
+    int json_stdout = strcmp(json_path, "-") == 0;
+    if (json_stdout) {
+        int saved = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        json_stdout = saved;
+    }
+
+    int64_t first_us = 0;
+    int ss_traces = 0;
+    for (int t = 0; t < trace_count; t++) {
+        if (load_trace(t, &first_us) != 0) return 1;
+        if (traces[t].header.role == CAPTURE_NM) {
+            if (traces[t].header.id + 1 > nm_shards) nm_shards = traces[t].header.id + 1;
+        } else {
+            ss_traces++;
+        }
+    }
+    if (nm_shards > MAX_NM_SHARDS) {
+        fprintf(stderr, "Traces name more than %d name server shards\n", MAX_NM_SHARDS);
+        return 1;
+    }
+    if (ss_count == 0) ss_count = ss_traces > 0 ? ss_traces : 2;
+    if (ss_count > MAX_REPLAY_SS) ss_count = MAX_REPLAY_SS;
+
+    long records = 0;
+    for (int i = 0; i < session_count; i++) {
+        for (int r = 0; r < sessions[i]->count; r++) sessions[i]->records[r].due_us -= first_us;
+        records += sessions[i]->count;
+    }
+    qsort(sessions, session_count, sizeof(ReplaySession*), by_first_record);
+
+    char workdir[] = "/tmp/docs_replay_XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (start_cluster(workdir) != 0) {
+        bench_stop_cluster(&cluster);
+        return 1;
+    }
+    printf("=== Replay: %ld records on %d connections, speed %s%.2f, %d name servers, %d storage servers ===\n",
+           records, session_count, speed > 0.0 ? "" : "unpaced ", speed, nm_shards, ss_count);
+
+    replay_start_ms = now_ms();
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    for (int i = 0; i < session_count; i++) {
+        if (sessions[i]->count == 0) continue;
+        wait_until(sessions[i]->records[0].due_us);
+        pthread_mutex_lock(&active_mutex);
+        active_sessions++;
+        pthread_mutex_unlock(&active_mutex);
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, session_main, sessions[i]) != 0) {
+            pthread_mutex_lock(&active_mutex);
+            active_sessions--;
+            pthread_mutex_unlock(&active_mutex);
+            fprintf(stderr, "Could not start a thread for connection %d\n", i);
+        }
+    }
+    pthread_mutex_lock(&active_mutex);
+    while (active_sessions > 0) pthread_cond_wait(&active_cond, &active_mutex);
+    pthread_mutex_unlock(&active_mutex);
+    double elapsed_s = (now_ms() - replay_start_ms) / 1000.0;
+    bench_stop_cluster(&cluster);
+
+    long ops = 0, errors = 0;
+    printf("%-20s %9s %9s %7s %9s %9s %9s %9s %9s\n", "type", "ops", "ops/s", "errors",
+           "p50 ms", "p95 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        const Histogram *h = &stats[t].latency;
+        ops += h->count;
+        errors += stats[t].errors;
+        if (h->count == 0 && stats[t].errors == 0) continue;
+        printf("%-20s %9ld %9.0f %7ld %9.2f %9.2f %9.2f %9.2f %9.2f\n", message_type_name(t), h->count,
+               h->count / elapsed_s, stats[t].errors, hist_percentile_ms(h, 0.50), hist_percentile_ms(h, 0.95),
+               hist_percentile_ms(h, 0.99), hist_percentile_ms(h, 0.999), h->max_us / 1000.0);
+    }
+    printf("%-20s %9ld %9.0f %7ld\n", "total", ops, ops / elapsed_s, errors);
+    printf("Lag:     p50 %.2f ms, p99 %.2f ms behind schedule; %ld requests found no route\n",
+           hist_percentile_ms(&lag, 0.50), hist_percentile_ms(&lag, 0.99), unroutable);
+
+    int result = 0;
+    if (json_path[0]) {
+        FILE *out = json_stdout ? fdopen(json_stdout, "w") : fopen(json_path, "w");
+        if (!out) {
+            perror(json_path);
+            result = 1;
+        } else {
+            write_json(out, elapsed_s, records);
+            fclose(out);
+        }
+    }
+    if (compare_path[0] && compare_with(compare_path) != 0) result = 1;
+    printf("Logs:    %s\n", workdir);
+    return result;
+}
@@ -0,0 +1,225 @@
+// Partitioned name server benchmark.
+//
+// For each shard count K, starts K name servers (NM_SHARDS=K, NM_SHARD=k)
+// with one storage server registered to each, in a scratch directory. Client
+// threads open a session with every shard and route each request with
+// shard_for_message(), as the client does after reading the shard map. The
+// load is metadata only: one create for every three INFO lookups of files
+// the thread created earlier. Reports requests per second for K = 1, 2, 4,
+// ... up to --shards.
+//
+// All processes share this machine's cores, so the speedup from adding shards
+// is bounded by the core count printed in the header.
+//
+// Run from the build directory (it execs ./nm and ./ss), with no other
+// name server on this machine.
+//
+// Usage: ./bench_shard [--shards N] [--clients N] [--seconds SEC] [--bin-dir DIR]
+
+#include "bench_util.h"
+
+#define BASE_CLIENT_PORT 9450
+#define MAX_BENCH_CLIENTS 64
+#define MAX_CREATED 100000
+
+static int max_shards = 4;
+static int client_count = 16;
+static int run_sec = 3;
+static char bin_dir[MAX_PATH] = ".";
+
+static BenchCluster cluster;
+
+static volatile int load_running = 1;
+
+typedef struct {
+    int id;
+    int shards;
+    long ops;
+    long errors;
+    long per_shard[MAX_NM_SHARDS];
+    char (*created)[MAX_FILENAME];
+    int created_count;
+} LoadClient;
+
+static int request(int sock, Message *msg, Message *response) {
+    if (send_message(sock, msg) < 0 || recv_message(sock, response) < 0) return -1;
+    return response->status;
+}
+
+static int open_nm_session(int shard, const char *user) {
+    int sock = connect_to("127.0.0.1", nm_shard_port(NM_CLIENT_PORT, shard), 2, 2);
+    if (sock < 0) return -1;
+
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_REG_CLIENT;
+    strcpy(msg.sender, user);
+    strcpy(msg.data, "127.0.0.1");
+    if (request(sock, &msg, &response) != SUCCESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void* load_client(void *arg) {
+    LoadClient *c = arg;
+    char user[MAX_USERNAME];
+    snprintf(user, sizeof(user), "load%d", c->id);
+    int socks[MAX_NM_SHARDS];
+    for (int k = 0; k < c->shards; k++) socks[k] = -1;
+    int seq = 0;
+
+    while (load_running) {
+        Message msg, response;
+        init_message(&msg);
+        strcpy(msg.sender, user);
+        if (seq % 4 == 0 || c->created_count == 0) {
+            msg.type = MSG_CREATE;
+            snprintf(msg.filename, sizeof(msg.filename), "load%d_%d.txt", c->id, seq);
+        } else {
+            msg.type = MSG_INFO;
+            strcpy(msg.filename, c->created[seq % c->created_count]);
+        }
+
+        int k = shard_for_message(&msg, c->shards);
+        if (socks[k] < 0) {
+            socks[k] = open_nm_session(k, user);
+            if (socks[k] < 0) {
+                c->errors++;
+                usleep(20000);
+                continue;
+            }
+        }
+        int status = request(socks[k], &msg, &response);
+        if (status < 0) {
+            close(socks[k]);
+            socks[k] = -1;
+            c->errors++;
+            continue;
+        }
+        if (status != SUCCESS) c->errors++;
+        else if (msg.type == MSG_CREATE && c->created_count < MAX_CREATED) {
+            strcpy(c->created[c->created_count++], msg.filename);
+        }
+        seq++;
+        c->ops++;
+        c->per_shard[k]++;
+    }
+    for (int k = 0; k < c->shards; k++) {
+        if (socks[k] >= 0) close(socks[k]);
+    }
+    return NULL;
+}
+
+// Shard settings go in the child's environment only
+static int start_cluster(const char *workdir, int shards) {
+    // A fresh directory per run, so no shard recovers the previous run's files
+    char run_dir[MAX_PATH];
+    snprintf(run_dir, sizeof(run_dir), "%s/k%d", workdir, shards);
+    mkdir(run_dir, 0755);
+
+    char *nm_env[] = { "NM_REPLICAS=1", NULL };
+    BenchClusterSpec spec = {
+        .bin_dir = bin_dir,
+        .workdir = run_dir,
+        .shards = shards,
+        .ss_count = shards,
+        .base_ss_port = BASE_CLIENT_PORT,
+        .nm_env = nm_env,
+        .settle_sec = 1,
+    };
+    return bench_start_cluster(&cluster, &spec);
+}
+
+static double run_load(int shards, long *errors_out, long per_shard[]) {
+    LoadClient clients[MAX_BENCH_CLIENTS];
+    pthread_t tids[MAX_BENCH_CLIENTS];
+    load_running = 1;
+    for (int i = 0; i < client_count; i++) {
+        LoadClient *c = &clients[i];
+        memset(c, 0, sizeof(LoadClient));
+        c->id = i;
+        c->shards = shards;
+        c->created = malloc(sizeof(*c->created) * MAX_CREATED);
+        pthread_create(&tids[i], NULL, load_client, c);
+    }
+
+    double start = now_ms();
+    sleep(run_sec);
+    load_running = 0;
+    long ops = 0, errors = 0;
+    for (int i = 0; i < client_count; i++) {
+        pthread_join(tids[i], NULL);
+        ops += clients[i].ops;
+        errors += clients[i].errors;
+        for (int k = 0; k < shards; k++) per_shard[k] += clients[i].per_shard[k];
+        free(clients[i].created);
+    }
+    double elapsed = now_ms() - start;
+    *errors_out = errors;
+    return ops / (elapsed / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            max_shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            client_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            run_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            strncpy(bin_dir, argv[++i], sizeof(bin_dir) - 1);
+        } else {
+            fprintf(stderr, "Usage: %s [--shards N] [--clients N] [--seconds SEC] [--bin-dir DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_shards < 1 || max_shards > MAX_NM_SHARDS || client_count < 1 ||
+        client_count > MAX_BENCH_CLIENTS || run_sec < 1) {
+        fprintf(stderr, "Need 1..%d shards, 1..%d clients and at least 1 second\n",
+                MAX_NM_SHARDS, MAX_BENCH_CLIENTS);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char workdir[] = "/tmp/docs_shard_XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    printf("=== Partitioned name server: %d client threads, %d s per run, %ld cores ===\n",
+           client_count, run_sec, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %10s %10s %10s  %s\n", "shards", "ops/s", "speedup", "errors", "requests per shard");
+
+    int result = 0;
+    double base = 0.0;
+    for (int shards = 1; shards <= max_shards; shards *= 2) {
+        if (start_cluster(workdir, shards) != 0) {
+            bench_stop_cluster(&cluster);
+            result = 1;
+            break;
+        }
+        long errors = 0;
+        long per_shard[MAX_NM_SHARDS] = {0};
+        double rate = run_load(shards, &errors, per_shard);
+        bench_stop_cluster(&cluster);
+        if (shards == 1) base = rate;
+
+        char split[256] = "";
+        for (int k = 0; k < shards; k++) {
+            char part[32];
+            snprintf(part, sizeof(part), "%s%ld", k > 0 ? " / " : "", per_shard[k]);
+            strncat(split, part, sizeof(split) - strlen(split) - 1);
+        }
+        printf("%-8d %10.0f %9.2fx %10ld  %s\n", shards, rate, base > 0.0 ? rate / base : 0.0, errors, split);
+        if (errors > 0) result = 1;
+
+        // Let the listening ports go before the next run binds them
+        usleep(200000);
+    }
+    printf("Logs:    %s\n", workdir);
+    return result;
+}
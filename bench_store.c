@@ -0,0 +1,177 @@
+// Name server metadata store benchmark.
+//
+// Drives the NM's sharded file store offline with synthetic metadata, for
+// shard counts 1, 2, 4, ... up to --shards, with the same threads each time:
+//
+//   create  - threads insert new files, as CREATE does
+//   info    - threads look up random existing files, mostly cache misses
+//   route   - threads look up a small hot set, mostly cache hits, as the
+//             READ/WRITE/STREAM routing does for busy files
+//   list    - one folder listing out of 64, through the ordered index
+//
+// With one shard every operation takes the same locks, as the unsharded NM
+// did; more shards spread them. The speedup is bounded by the core count
+// printed in the header.
+//
+// Usage: ./bench_store [--shards N] [--threads N] [--files N] [--ops N]
+
+#include "common.h"
+#include "file_store.h"
+#include <sys/time.h>
+
+#define MAX_BENCH_THREADS 64
+#define BENCH_FOLDERS 64
+#define HOT_FILES 32
+
+static int max_shards = 16;
+static int thread_count = 0;     // Defaults to the core count
+static int file_count = 20000;
+static int ops_per_thread = 50000;
+
+static FileStore *store;
+
+typedef enum { OP_CREATE, OP_INFO, OP_ROUTE } BenchOp;
+
+typedef struct {
+    int id;
+    BenchOp op;
+    unsigned int seed;
+    long found;
+} Worker;
+
+static double now_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void make_file(FileMetadata *meta, int k) {
+    memset(meta, 0, sizeof(FileMetadata));
+    snprintf(meta->filename, sizeof(meta->filename), "file%d.txt", k);
+    snprintf(meta->folder_path, sizeof(meta->folder_path), "/dir%d", k % BENCH_FOLDERS);
+    snprintf(meta->owner, sizeof(meta->owner), "user%d", k % 100);
+    meta->ss_id = k % 8 + 1;
+    meta->created = meta->modified = meta->accessed = 1700000000 + k;
+}
+
+static unsigned int next_random(unsigned int *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void* worker_main(void *arg) {
+    Worker *w = arg;
+    FileMetadata meta;
+    char name[MAX_FILENAME];
+    for (int i = 0; i < ops_per_thread; i++) {
+        if (w->op == OP_CREATE) {
+            make_file(&meta, file_count + w->id * ops_per_thread + i);
+            file_store_insert(store, meta.filename, &meta);
+            continue;
+        }
+        int k = w->op == OP_INFO ? (int)(next_random(&w->seed) % file_count)
+                                 : (int)(next_random(&w->seed) % HOT_FILES);
+        snprintf(name, sizeof(name), "file%d.txt", k);
+        FileMetadata *found = file_store_get(store, name);
+        if (found) {
+            w->found++;
+            free(found);
+        }
+    }
+    return NULL;
+}
+
+// Returns operations per second, or -1 if a lookup came back empty
+static double run_phase(BenchOp op) {
+    pthread_t tids[MAX_BENCH_THREADS];
+    Worker workers[MAX_BENCH_THREADS];
+    double start = now_ms();
+    for (int t = 0; t < thread_count; t++) {
+        workers[t].id = t;
+        workers[t].op = op;
+        workers[t].seed = 2463534242u + t * 7919u;
+        workers[t].found = 0;
+        pthread_create(&tids[t], NULL, worker_main, &workers[t]);
+    }
+    long found = 0;
+    for (int t = 0; t < thread_count; t++) {
+        pthread_join(tids[t], NULL);
+        found += workers[t].found;
+    }
+    double elapsed = now_ms() - start;
+    long ops = (long)thread_count * ops_per_thread;
+    if (op != OP_CREATE && found != ops) return -1.0;
+    return ops / (elapsed / 1000.0);
+}
+
+static int count_name(const char *name, void *ctx) {
+    (void)name;
+    (*(int*)ctx)++;
+    return 0;
+}
+
+static double run_listing(int *listed) {
+    *listed = 0;
+    double start = now_ms();
+    file_store_list_folder(store, "/dir1", count_name, listed);
+    return now_ms() - start;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            max_shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            file_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops_per_thread = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--shards N] [--threads N] [--files N] [--ops N]\n", argv[0]);
+            return 1;
+        }
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count == 0) thread_count = cores < 2 ? 2 : (int)cores;
+    if (max_shards < 1 || max_shards > FILE_STORE_MAX_SHARDS || thread_count < 1 ||
+        thread_count > MAX_BENCH_THREADS || file_count <= HOT_FILES || ops_per_thread <= 0) {
+        fprintf(stderr, "Need 1..%d shards, 1..%d threads, more than %d files and positive --ops\n",
+                FILE_STORE_MAX_SHARDS, MAX_BENCH_THREADS, HOT_FILES);
+        return 1;
+    }
+
+    printf("=== Metadata store: %d threads, %d files, %d ops per thread, %ld cores ===\n",
+           thread_count, file_count, ops_per_thread, cores);
+    printf("%-8s %12s %12s %12s %12s\n", "shards", "create/s", "info/s", "route/s", "list ms");
+
+    int result = 0;
+    for (int shards = 1; shards <= max_shards; shards *= 2) {
+        store = init_file_store(shards, CACHE_SIZE);
+        FileMetadata meta;
+        for (int k = 0; k < file_count; k++) {
+            make_file(&meta, k);
+            file_store_insert(store, meta.filename, &meta);
+        }
+
+        double info = run_phase(OP_INFO);
+        double route = run_phase(OP_ROUTE);
+        double create = run_phase(OP_CREATE);
+        int listed;
+        double list_ms = run_listing(&listed);
+
+        // Folder 1 holds every 64th file, the created ones included
+        int expected = 0;
+        for (int k = 1; k < file_count + thread_count * ops_per_thread; k += BENCH_FOLDERS) expected++;
+        if (info < 0.0 || route < 0.0 || listed != expected) {
+            printf("%-8d lookups or listing came back incomplete (%d of %d listed)\n", shards, listed, expected);
+            result = 1;
+        } else {
+            printf("%-8d %12.0f %12.0f %12.0f %12.2f\n", shards, create, info, route, list_ms);
+        }
+        free_file_store(store);
+    }
+    return result;
+}
@@ -0,0 +1,343 @@
+// Name server takeover benchmark.
+//
+// Starts a primary name server, a standby following it (nm --standby) and
+// several storage servers in a scratch directory. Client threads keep
+// creating files and looking them up; after a warm-up the primary is
+// SIGKILLed and the benchmark measures how long until the standby answers
+// clients, until every client thread is served again, and until storage
+// servers have re-registered with it (a file written before the kill can be
+// read). Finally it checks that every create acknowledged before or after
+// the kill is known to the new name server.
+//
+// Run from the build directory (it execs ./nm and ./ss), with no other
+// name server on this machine.
+//
+// Usage: ./bench_takeover [--servers N] [--clients N] [--warmup SEC] [--bin-dir DIR]
+
+#include "bench_util.h"
+
+#define BASE_CLIENT_PORT 9350
+#define PROBE_FILE "takeover.txt"
+#define PROBE_TEXT "Written before the takeover."
+#define TAKEOVER_DEADLINE_MS 30000.0
+#define MAX_BENCH_CLIENTS 64
+#define MAX_ACKED 100000
+
+static int server_count = 3;
+static int client_count = 8;
+static int warmup_sec = 2;
+static char bin_dir[MAX_PATH] = ".";
+
+static BenchCluster cluster;     // Its NM is the primary
+static pid_t standby_pid = 0;
+
+static volatile int load_running = 1;
+static volatile double killed_at = 0.0;   // 0 until the primary is killed
+
+typedef struct {
+    int id;
+    long ops;
+    long errors;                 // Failed requests, reconnects included
+    double first_ok_after_kill;  // ms after the kill; -1 until then
+    char (*acked)[MAX_FILENAME]; // Creates the NM acknowledged
+    int acked_count;
+} LoadClient;
+
+static int request(int sock, Message *msg, Message *response) {
+    if (send_message(sock, msg) < 0 || recv_message(sock, response) < 0) return -1;
+    return response->status;
+}
+
+static int open_nm_session(const char *user) {
+    int sock = connect_to("127.0.0.1", NM_CLIENT_PORT, 2, 2);
+    if (sock < 0) return -1;
+
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_REG_CLIENT;
+    strcpy(msg.sender, user);
+    strcpy(msg.data, "127.0.0.1");
+    if (request(sock, &msg, &response) != SUCCESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int nm_op(int sock, MessageType type, const char *user, const char *filename, Message *response) {
+    Message msg;
+    init_message(&msg);
+    msg.type = type;
+    strcpy(msg.sender, user);
+    strcpy(msg.filename, filename);
+    return request(sock, &msg, response);
+}
+
+// Write a whole sentence on the file's primary (lock, write, commit)
+static int write_probe(int nm_sock, const char *user) {
+    Message response;
+    if (nm_op(nm_sock, MSG_WRITE, user, PROBE_FILE, &response) != SUCCESS) return 0;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    if (sscanf(response.data, "%15[^:]:%d", ip, &port) != 2) return 0;
+    int sock = connect_to(ip, port, 2, 2);
+    if (sock < 0) return 0;
+
+    Message msg;
+    init_message(&msg);
+    strcpy(msg.sender, user);
+    strcpy(msg.filename, PROBE_FILE);
+    strcpy(msg.lease, response.lease);
+    msg.sentence_index = 0;
+    msg.type = MSG_LOCK_SENTENCE;
+    int ok = request(sock, &msg, &response) == SUCCESS;
+    if (ok) {
+        msg.type = MSG_WRITE;
+        msg.word_index = 1;
+        strcpy(msg.data, PROBE_TEXT);
+        ok = request(sock, &msg, &response) == SUCCESS;
+        msg.type = ok ? MSG_UNLOCK_SENTENCE : MSG_CANCEL_WRITE;
+        msg.data[0] = '\0';
+        ok = request(sock, &msg, &response) == SUCCESS && ok;
+    }
+    close(sock);
+    return ok;
+}
+
+// A routed read served by a storage server registered with the current NM
+static int read_probe(int nm_sock, const char *user) {
+    Message response;
+    if (nm_op(nm_sock, MSG_READ, user, PROBE_FILE, &response) != SUCCESS) return 0;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    if (sscanf(response.data, "%15[^:]:%d", ip, &port) != 2) return 0;
+    int sock = connect_to(ip, port, 2, 2);
+    if (sock < 0) return 0;
+
+    Message msg;
+    init_message(&msg);
+    msg.type = MSG_READ;
+    strcpy(msg.sender, user);
+    strcpy(msg.filename, PROBE_FILE);
+    strcpy(msg.lease, response.lease);
+    int ok = request(sock, &msg, &response) == SUCCESS && strstr(response.data, PROBE_TEXT) != NULL;
+    close(sock);
+    return ok;
+}
+
+// Creates a file, then looks up a few it created earlier, in a loop
+static void* load_client(void *arg) {
+    LoadClient *c = arg;
+    char user[MAX_USERNAME];
+    snprintf(user, sizeof(user), "load%d", c->id);
+    int sock = -1;
+    int seq = 0;
+
+    while (load_running) {
+        if (sock < 0) {
+            sock = open_nm_session(user);
+            if (sock < 0) {
+                c->errors++;
+                usleep(20000);
+                continue;
+            }
+        }
+
+        char filename[MAX_FILENAME];
+        Message response;
+        int status;
+        if (seq % 4 == 0 || c->acked_count == 0) {
+            snprintf(filename, sizeof(filename), "load%d_%d.txt", c->id, seq);
+            status = nm_op(sock, MSG_CREATE, user, filename, &response);
+            // A create retried after the takeover may already have happened
+            if ((status == SUCCESS || status == ERR_FILE_EXISTS) && c->acked_count < MAX_ACKED) {
+                strcpy(c->acked[c->acked_count++], filename);
+            }
+            if (status == ERR_FILE_EXISTS) status = SUCCESS;
+        } else {
+            status = nm_op(sock, MSG_INFO, user, c->acked[seq % c->acked_count], &response);
+        }
+
+        if (status < 0) {
+            close(sock);
+            sock = -1;
+            c->errors++;
+            continue;
+        }
+        seq++;
+        c->ops++;
+        if (killed_at > 0.0 && c->first_ok_after_kill < 0.0) {
+            c->first_ok_after_kill = now_ms() - killed_at;
+        }
+    }
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+static void stop_all() {
+    bench_stop_cluster(&cluster);
+    bench_reap(&standby_pid);
+}
+
+static int start_cluster(const char *workdir) {
+    // Each name server keeps its own metadata directory and log
+    char primary_dir[MAX_PATH], standby_dir[MAX_PATH];
+    snprintf(primary_dir, sizeof(primary_dir), "%s/primary", workdir);
+    snprintf(standby_dir, sizeof(standby_dir), "%s/standby", workdir);
+    mkdir(primary_dir, 0755);
+    mkdir(standby_dir, 0755);
+
+    BenchClusterSpec spec = {
+        .bin_dir = bin_dir,
+        .workdir = workdir,
+        .nm_dir = primary_dir,
+        .ss_count = server_count,
+        .base_ss_port = BASE_CLIENT_PORT,
+        .settle_sec = 1,
+    };
+    if (bench_start_cluster(&cluster, &spec) != 0) return -1;
+
+    char *standby_argv[] = { cluster.nm_path, "--standby", "127.0.0.1", NULL };
+    standby_pid = bench_spawn(standby_argv, standby_dir, NULL);
+
+    // The standby's first copy
+    sleep(1);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--servers") == 0 && i + 1 < argc) {
+            server_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            client_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bin-dir") == 0 && i + 1 < argc) {
+            strncpy(bin_dir, argv[++i], sizeof(bin_dir) - 1);
+        } else {
+            fprintf(stderr, "Usage: %s [--servers N] [--clients N] [--warmup SEC] [--bin-dir DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (server_count < 1 || server_count > MAX_SS || client_count < 1 ||
+        client_count > MAX_BENCH_CLIENTS || warmup_sec < 0) {
+        fprintf(stderr, "Need 1..%d servers and 1..%d clients\n", MAX_SS, MAX_BENCH_CLIENTS);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char workdir[] = "/tmp/docs_takeover_XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (start_cluster(workdir) != 0) {
+        stop_all();
+        return 1;
+    }
+
+    int result = 1;
+    LoadClient clients[MAX_BENCH_CLIENTS];
+    pthread_t tids[MAX_BENCH_CLIENTS];
+    int started = 0;
+
+    int probe_sock = open_nm_session("takeover_probe");
+    Message response;
+    if (probe_sock < 0 || nm_op(probe_sock, MSG_CREATE, "takeover_probe", PROBE_FILE, &response) != SUCCESS ||
+        !write_probe(probe_sock, "takeover_probe")) {
+        fprintf(stderr, "Could not create and write %s\n", PROBE_FILE);
+        goto done;
+    }
+
+    for (; started < client_count; started++) {
+        LoadClient *c = &clients[started];
+        memset(c, 0, sizeof(LoadClient));
+        c->id = started;
+        c->first_ok_after_kill = -1.0;
+        c->acked = malloc(sizeof(*c->acked) * MAX_ACKED);
+        pthread_create(&tids[started], NULL, load_client, c);
+    }
+    sleep(warmup_sec);
+
+    long ops_before = 0;
+    for (int i = 0; i < started; i++) ops_before += clients[i].ops;
+
+    printf("=== Name server takeover: %d storage servers, %d client threads ===\n", server_count, client_count);
+    printf("Warm-up:          %ld requests in %d s\n", ops_before, warmup_sec);
+
+    killed_at = now_ms();
+    bench_reap(&cluster.nm_pids[0]);
+
+    // First request any client gets through, then every client
+    double first_ms = -1.0, all_ms = -1.0;
+    while (now_ms() - killed_at < TAKEOVER_DEADLINE_MS && all_ms < 0.0) {
+        double first = -1.0, last = 0.0;
+        int served = 0;
+        for (int i = 0; i < started; i++) {
+            double t = clients[i].first_ok_after_kill;
+            if (t < 0.0) continue;
+            served++;
+            if (first < 0.0 || t < first) first = t;
+            if (t > last) last = t;
+        }
+        if (served > 0 && first_ms < 0.0) first_ms = first;
+        if (served == started) all_ms = last;
+        usleep(1000);
+    }
+
+    // Storage servers must register with the new NM before data is reachable
+    double read_ms = -1.0;
+    close(probe_sock);
+    probe_sock = -1;
+    while (now_ms() - killed_at < TAKEOVER_DEADLINE_MS) {
+        if (probe_sock < 0) probe_sock = open_nm_session("takeover_probe");
+        if (probe_sock >= 0 && read_probe(probe_sock, "takeover_probe")) {
+            read_ms = now_ms() - killed_at;
+            break;
+        }
+        usleep(5000);
+    }
+
+    // Let the load run on the new primary for a moment
+    usleep(500000);
+    load_running = 0;
+    long errors = 0, ops_total = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        errors += clients[i].errors;
+        ops_total += clients[i].ops;
+    }
+    started = 0;
+
+    // Every acknowledged create must have survived the takeover
+    int checked = 0, missing = 0;
+    if (probe_sock < 0) probe_sock = open_nm_session("takeover_probe");
+    for (int i = 0; i < client_count && probe_sock >= 0; i++) {
+        char user[MAX_USERNAME];
+        snprintf(user, sizeof(user), "load%d", i);
+        for (int j = 0; j < clients[i].acked_count; j++) {
+            checked++;
+            if (nm_op(probe_sock, MSG_INFO, user, clients[i].acked[j], &response) != SUCCESS) missing++;
+        }
+    }
+
+    if (first_ms >= 0.0) printf("First client:     served %.1f ms after the kill\n", first_ms);
+    else printf("First client:     not served within %.0f ms\n", TAKEOVER_DEADLINE_MS);
+    if (all_ms >= 0.0) printf("All clients:      served %.1f ms after the kill\n", all_ms);
+    else printf("All clients:      not all served within %.0f ms\n", TAKEOVER_DEADLINE_MS);
+    if (read_ms >= 0.0) printf("Data reachable:   %.1f ms (storage servers re-registered)\n", read_ms);
+    else printf("Data reachable:   not within %.0f ms\n", TAKEOVER_DEADLINE_MS);
+    printf("Requests:         %ld total, %ld failed or retried\n", ops_total, errors);
+    printf("Acknowledged:     %d creates, %d missing after the takeover\n", checked, missing);
+    printf("Logs:             %s\n", workdir);
+    result = (first_ms >= 0.0 && all_ms >= 0.0 && read_ms >= 0.0 && missing == 0) ? 0 : 1;
+
+done:
+    load_running = 0;
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    for (int i = 0; i < client_count && i < started; i++) free(clients[i].acked);
+    if (probe_sock >= 0) close(probe_sock);
+    stop_all();
+    return result;
+}
@@ -0,0 +1,181 @@
+#include "bench_util.h"
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+
+#define MAX_BENCH_ENV 16    // Settings one server gets from a spec
+
+double now_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static int hist_index(long us) {
+    if (us < (2 << HIST_SUB_BITS)) return us < 0 ? 0 : (int)us;
+    int shift = 0;
+    while ((us >> shift) >= (2 << HIST_SUB_BITS)) shift++;
+    int index = (shift << HIST_SUB_BITS) + (int)(us >> shift);
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// Largest value that falls in bucket `index`
+static long hist_value(int index) {
+    if (index < (2 << HIST_SUB_BITS)) return index;
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    long sub = (index & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_add(Histogram *hist, long us) {
+    hist->count++;
+    hist->sum_us += us;
+    if (us > hist->max_us) hist->max_us = us;
+    hist->buckets[hist_index(us)]++;
+}
+
+void hist_merge(Histogram *into, const Histogram *from) {
+    into->count += from->count;
+    into->sum_us += from->sum_us;
+    if (from->max_us > into->max_us) into->max_us = from->max_us;
+    for (int i = 0; i < HIST_BUCKETS; i++) into->buckets[i] += from->buckets[i];
+}
+
+double hist_percentile_ms(const Histogram *hist, double p) {
+    if (hist->count == 0) return 0.0;
+    long rank = (long)(p * hist->count + 0.999999);
+    if (rank < 1) rank = 1;
+    long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            long value = hist_value(i);
+            return (value < hist->max_us ? value : hist->max_us) / 1000.0;
+        }
+    }
+    return hist->max_us / 1000.0;
+}
+
+int connect_to(const char *ip, int port, int send_timeout_sec, int recv_timeout_sec) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    set_socket_timeouts(sock, send_timeout_sec, recv_timeout_sec);
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+pid_t bench_spawn(char *const argv[], const char *cwd, char *const env[]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (cwd && chdir(cwd) != 0) _exit(127);
+        for (int i = 0; env && env[i]; i++) putenv(env[i]);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+void bench_reap(pid_t *pid) {
+    if (*pid > 0) {
+        kill(*pid, SIGKILL);
+        waitpid(*pid, NULL, 0);
+        *pid = 0;
+    }
+}
+
+int bench_wait_listening(int port) {
+    for (int i = 0; i < 100; i++) {
+        usleep(50000);
+        int sock = connect_to("127.0.0.1", port, 2, 2);
+        if (sock >= 0) {
+            close(sock);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int find_binary(const char *bin_dir, const char *name, char *path) {
+    char relative[MAX_PATH];
+    snprintf(relative, sizeof(relative), "%s/%s", bin_dir, name);
+    return realpath(relative, path) ? 0 : -1;
+}
+
+// Append the NULL-terminated `extra` (may be NULL) to the `n` settings in
+// `env`, keeping it NULL-terminated; returns the new count
+static int append_env(char **env, int n, char *const *extra) {
+    for (int i = 0; extra && extra[i] && n < MAX_BENCH_ENV; i++) env[n++] = extra[i];
+    env[n] = NULL;
+    return n;
+}
+
+int bench_start_cluster(BenchCluster *cluster, const BenchClusterSpec *spec) {
+    memset(cluster, 0, sizeof(*cluster));
+    if (find_binary(spec->bin_dir, "nm", cluster->nm_path) != 0 ||
+        find_binary(spec->bin_dir, "ss", cluster->ss_path) != 0) {
+        fprintf(stderr, "Cannot find nm/ss in %s\n", spec->bin_dir);
+        return -1;
+    }
+
+    int shards = spec->shards > 1 ? spec->shards : 1;
+    for (int k = 0; k < shards; k++) {
+        char shard_count[32], shard[32];
+        char *env[MAX_BENCH_ENV + 1];
+        int n = append_env(env, 0, spec->nm_env);
+        if (shards > 1) {
+            snprintf(shard_count, sizeof(shard_count), "NM_SHARDS=%d", shards);
+            snprintf(shard, sizeof(shard), "NM_SHARD=%d", k);
+            char *shard_env[] = { shard_count, shard, NULL };
+            append_env(env, n, shard_env);
+        }
+        char *nm_argv[] = { cluster->nm_path, NULL };
+        cluster->nm_pids[k] = bench_spawn(nm_argv, spec->nm_dir ? spec->nm_dir : spec->workdir, env);
+    }
+    for (int k = 0; k < shards; k++) {
+        if (bench_wait_listening(nm_shard_port(NM_CLIENT_PORT, k)) != 0) {
+            if (shards > 1) {
+                fprintf(stderr, "Name server shard %d did not start\n", k);
+            } else {
+                fprintf(stderr, "Name server did not start\n");
+            }
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < spec->ss_count; i++) {
+        char nm_port[16], port[16], id[16];
+        snprintf(nm_port, sizeof(nm_port), "%d", nm_shard_port(NM_SS_PORT, i % shards));
+        snprintf(port, sizeof(port), "%d", spec->base_ss_port + i);
+        snprintf(id, sizeof(id), "%d", i + 1);
+        char *env[MAX_BENCH_ENV + 1];
+        int n = append_env(env, 0, spec->ss_env);
+        if (i == 0) append_env(env, n, spec->first_ss_env);
+        char *ss_argv[] = { cluster->ss_path, "127.0.0.1", nm_port, port, id, NULL };
+        cluster->ss_pids[i] = bench_spawn(ss_argv, spec->workdir, env);
+    }
+
+    sleep(spec->settle_sec);
+    return 0;
+}
+
+void bench_stop_cluster(BenchCluster *cluster) {
+    for (int i = 0; i < MAX_SS; i++) bench_reap(&cluster->ss_pids[i]);
+    for (int k = 0; k < MAX_NM_SHARDS; k++) bench_reap(&cluster->nm_pids[k]);
+}
@@ -0,0 +1,77 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include "common.h"
+
+// Fixture shared by the benchmarks that run a whole cluster on this machine:
+// starting nm and ss from --bin-dir in a scratch directory, waiting for them
+// to listen, and killing them again. The servers' output goes to /dev/null;
+// they log to files in their working directory.
+
+// Latency histogram: exact below 64 us, then 32 buckets per power of two
+// (within about 3%) up to over a minute
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS 768
+
+typedef struct {
+    long count;
+    double sum_us;
+    long max_us;
+    long buckets[HIST_BUCKETS];
+} Histogram;
+
+// A running cluster; a zero pid is a process that is not running
+typedef struct {
+    char nm_path[MAX_PATH];      // Absolute paths of the binaries
+    char ss_path[MAX_PATH];
+    pid_t nm_pids[MAX_NM_SHARDS];
+    pid_t ss_pids[MAX_SS];
+} BenchCluster;
+
+typedef struct {
+    const char *bin_dir;         // Where nm and ss are
+    const char *workdir;         // Every server's working directory
+    const char *nm_dir;          // The NMs' instead, or NULL
+    int shards;                  // Name servers; above 1 each gets NM_SHARDS and NM_SHARD
+    int ss_count;
+    int base_ss_port;            // SS i serves clients on base_ss_port + i, as id i + 1,
+                                 // and registers with shard i % shards
+    char *const *nm_env;         // "NAME=VALUE" settings for the NM, or NULL
+    char *const *ss_env;         // For every SS, or NULL
+    char *const *first_ss_env;   // Also for SS 1 only (a fault to inject), or NULL
+    int settle_sec;              // Wait after starting the SSs (registration, first heartbeats)
+} BenchClusterSpec;
+
+// Wall clock in milliseconds
+double now_ms();
+
+void hist_add(Histogram *hist, long us);
+void hist_merge(Histogram *into, const Histogram *from);
+
+// Latency at quantile `p` (0.99) in ms: the top of the bucket the sample of
+// that rank fell in, but never above the largest sample
+double hist_percentile_ms(const Histogram *hist, double p);
+
+// TCP connection to ip:port with TCP_NODELAY and the given socket
+// timeouts in seconds, or -1
+int connect_to(const char *ip, int port, int send_timeout_sec, int recv_timeout_sec);
+
+// Start argv[0] (an absolute path) in `cwd` (NULL: this directory) with
+// the "NAME=VALUE" strings of the NULL-terminated `env` (may be NULL) added
+// to this process's environment
+pid_t bench_spawn(char *const argv[], const char *cwd, char *const env[]);
+
+// SIGKILL and wait for *pid, if it is running, and clear it
+void bench_reap(pid_t *pid);
+
+// Wait up to 5 s until something accepts on 127.0.0.1:`port`; 0 or -1
+int bench_wait_listening(int port);
+
+// Start the NMs, wait for their client ports, then start the SSs and wait
+// settle_sec. Returns 0, or -1 with the reason printed; stop the cluster
+// either way.
+int bench_start_cluster(BenchCluster *cluster, const BenchClusterSpec *spec);
+
+void bench_stop_cluster(BenchCluster *cluster);
+
+#endif // BENCH_UTIL_H
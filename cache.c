@@ -1,4 +1,7 @@
 #include "cache.h"
+#include "lock_stats.h"
+
+LOCK_STATS_DEFINE(cache_lock_stats, "cache.lock");
 
 unsigned int hash_string(const char *str, int capacity) {
     unsigned int hash = 5381;
@@ -24,6 +27,8 @@ LRUCache* init_cache(int capacity) {
     LRUCache *cache = malloc(sizeof(LRUCache));
     cache->capacity = capacity;
     cache->size = 0;
+    cache->hits = 0;
+    cache->misses = 0;
     
     cache->head = malloc(sizeof(CacheNode));
     cache->tail = malloc(sizeof(CacheNode));
@@ -55,14 +60,53 @@ void move_to_head(LRUCache *cache, CacheNode *node) {
     add_to_head(cache, node);
 }
 
+// Empty a hash slot, pulling later entries of the probe run back so none of
+// them ends up behind the gap (where lookups would stop short of it)
+void clear_slot(LRUCache *cache, unsigned int slot) {
+    unsigned int gap = slot;
+    unsigned int next = slot;
+    cache->hash_table[gap] = NULL;
+
+    while (1) {
+        next = (next + 1) % cache->capacity;
+        CacheNode *node = cache->hash_table[next];
+        if (node == NULL) break;
+
+        // Stays put if its home slot lies cyclically in (gap, next]
+        unsigned int home = hash_string(node->key, cache->capacity);
+        int stays = gap < next ? (home > gap && home <= next) : (home > gap || home <= next);
+        if (!stays) {
+            cache->hash_table[gap] = node;
+            cache->hash_table[next] = NULL;
+            gap = next;
+        }
+    }
+}
+
 CacheNode* remove_tail(LRUCache *cache) {
     CacheNode *node = cache->tail->prev;
     remove_node(node);
     return node;
 }
 
+// Drop the least recently used entry
+void evict_tail(LRUCache *cache) {
+    CacheNode *tail = remove_tail(cache);
+    
+    // Remove from hash table
+    unsigned int tail_hash = hash_string(tail->key, cache->capacity);
+    while (cache->hash_table[tail_hash] != tail) {
+        tail_hash = (tail_hash + 1) % cache->capacity;
+    }
+    clear_slot(cache, tail_hash);
+    
+    free(tail->value);
+    free(tail);
+    cache->size--;
+}
+
 FileMetadata* cache_get(LRUCache *cache, const char *key) {
-    pthread_mutex_lock(&cache->lock);
+    MUTEX_LOCK(&cache->lock, &cache_lock_stats);
     
     unsigned int hash = hash_string(key, cache->capacity);
     CacheNode *node = cache->hash_table[hash];
@@ -73,7 +117,8 @@ FileMetadata* cache_get(LRUCache *cache, const char *key) {
             move_to_head(cache, node);
             FileMetadata *result = malloc(sizeof(FileMetadata));
             memcpy(result, node->value, sizeof(FileMetadata));
-            pthread_mutex_unlock(&cache->lock);
+            cache->hits++;
+            MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
             return result;
         }
         
@@ -82,12 +127,13 @@ FileMetadata* cache_get(LRUCache *cache, const char *key) {
         node = cache->hash_table[hash];
     }
     
-    pthread_mutex_unlock(&cache->lock);
+    cache->misses++;
+    MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
     return NULL;
 }
 
 void cache_put(LRUCache *cache, const char *key, FileMetadata *value) {
-    pthread_mutex_lock(&cache->lock);
+    MUTEX_LOCK(&cache->lock, &cache_lock_stats);
     
     unsigned int hash = hash_string(key, cache->capacity);
     unsigned int original_hash = hash;
@@ -99,7 +145,7 @@ void cache_put(LRUCache *cache, const char *key, FileMetadata *value) {
             // Update existing
             memcpy(node->value, value, sizeof(FileMetadata));
             move_to_head(cache, node);
-            pthread_mutex_unlock(&cache->lock);
+            MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
             return;
         }
         hash = (hash + 1) % cache->capacity;
@@ -107,7 +153,11 @@ void cache_put(LRUCache *cache, const char *key, FileMetadata *value) {
         node = cache->hash_table[hash];
     }
     
-    // Key doesn't exist, create new node
+    // Key doesn't exist. Make room first: probing stops at an empty slot,
+    // so the table must never fill up completely.
+    if (cache->size >= cache->capacity - 1 && cache->size > 0) {
+        evict_tail(cache);
+    }
     node = create_cache_node(key, value);
     
     // Find empty slot
@@ -120,50 +170,56 @@ void cache_put(LRUCache *cache, const char *key, FileMetadata *value) {
     add_to_head(cache, node);
     cache->size++;
     
-    // Evict if over capacity
-    if (cache->size > cache->capacity) {
-        CacheNode *tail = remove_tail(cache);
-        
-        // Remove from hash table
-        unsigned int tail_hash = hash_string(tail->key, cache->capacity);
-        while (cache->hash_table[tail_hash] != tail) {
-            tail_hash = (tail_hash + 1) % cache->capacity;
+    MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
+}
+
+void cache_touch(LRUCache *cache, const char *key, time_t accessed, const char *username) {
+    MUTEX_LOCK(&cache->lock, &cache_lock_stats);
+    
+    unsigned int hash = hash_string(key, cache->capacity);
+    CacheNode *node = cache->hash_table[hash];
+    
+    for (int probes = 0; node != NULL && probes < cache->capacity; probes++) {
+        if (strcmp(node->key, key) == 0) {
+            if (accessed >= node->value->accessed) {
+                node->value->accessed = accessed;
+                strncpy(node->value->last_accessed_by, username, MAX_USERNAME - 1);
+                node->value->last_accessed_by[MAX_USERNAME - 1] = '\0';
+            }
+            break;
         }
-        cache->hash_table[tail_hash] = NULL;
-        
-        free(tail->value);
-        free(tail);
-        cache->size--;
+        hash = (hash + 1) % cache->capacity;
+        node = cache->hash_table[hash];
     }
     
-    pthread_mutex_unlock(&cache->lock);
+    MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
 }
 
 void cache_remove(LRUCache *cache, const char *key) {
-    pthread_mutex_lock(&cache->lock);
+    MUTEX_LOCK(&cache->lock, &cache_lock_stats);
     
     unsigned int hash = hash_string(key, cache->capacity);
     CacheNode *node = cache->hash_table[hash];
     
     while (node != NULL) {
         if (strcmp(node->key, key) == 0) {
-            cache->hash_table[hash] = NULL;
+            clear_slot(cache, hash);
             remove_node(node);
             free(node->value);
             free(node);
             cache->size--;
-            pthread_mutex_unlock(&cache->lock);
+            MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
             return;
         }
         hash = (hash + 1) % cache->capacity;
         node = cache->hash_table[hash];
     }
     
-    pthread_mutex_unlock(&cache->lock);
+    MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
 }
 
 void cache_clear(LRUCache *cache) {
-    pthread_mutex_lock(&cache->lock);
+    MUTEX_LOCK(&cache->lock, &cache_lock_stats);
     
     CacheNode *current = cache->head->next;
     while (current != cache->tail) {
@@ -178,7 +234,7 @@ void cache_clear(LRUCache *cache) {
     memset(cache->hash_table, 0, cache->capacity * sizeof(CacheNode*));
     cache->size = 0;
     
-    pthread_mutex_unlock(&cache->lock);
+    MUTEX_UNLOCK(&cache->lock, &cache_lock_stats);
 }
 
 void free_cache(LRUCache *cache) {
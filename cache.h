@@ -16,6 +16,8 @@ typedef struct {
     CacheNode **hash_table;
     int capacity;
     int size;
+    long hits;                   // cache_get results, under `lock`
+    long misses;
     pthread_mutex_t lock;
 } LRUCache;
 
@@ -31,6 +33,9 @@ FileMetadata* cache_get(LRUCache *cache, const char *key);
 // Put into cache
 void cache_put(LRUCache *cache, const char *key, FileMetadata *value);
 
+// Update access time fields of a cached entry (no-op if not cached)
+void cache_touch(LRUCache *cache, const char *key, time_t accessed, const char *username);
+
 // Remove from cache
 void cache_remove(LRUCache *cache, const char *key);
 
@@ -0,0 +1,121 @@
+#include "capture.h"
+#include "logger.h"
+#include <sys/time.h>
+
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file = NULL;
+static volatile int capturing = 0;
+static int64_t capture_start_us = 0;
+static uint32_t next_session = 0;
+static pthread_t flusher;
+
+static int64_t now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void* flusher_main(void *arg) {
+    (void)arg;
+    while (capturing) {
+        usleep(CAPTURE_FLUSH_MS * 1000);
+        pthread_mutex_lock(&capture_mutex);
+        if (capture_file) fflush(capture_file);
+        pthread_mutex_unlock(&capture_mutex);
+    }
+    return NULL;
+}
+
+int capture_open(const char *pattern, CaptureRole role, int id) {
+    // Servers sharing a directory each get their own trace through "%d"
+    char path[MAX_PATH];
+    const char *at = strstr(pattern, "%d");
+    if (at) {
+        snprintf(path, sizeof(path), "%.*s%d%s", (int)(at - pattern), pattern, id, at + 2);
+    } else {
+        snprintf(path, sizeof(path), "%s", pattern);
+    }
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        log_formatted(LOG_ERROR, "Cannot open capture file %s", path);
+        return -1;
+    }
+    setvbuf(f, NULL, _IOFBF, CAPTURE_BUFFER_BYTES);
+
+    CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.role = role;
+    header.id = id;
+    header.start_us = now_us();
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+
+    pthread_mutex_lock(&capture_mutex);
+    capture_file = f;
+    capture_start_us = header.start_us;
+    capturing = 1;
+    pthread_mutex_unlock(&capture_mutex);
+    pthread_create(&flusher, NULL, flusher_main, NULL);
+    log_formatted(LOG_INFO, "Capturing client requests to %s", path);
+    return 0;
+}
+
+void capture_close() {
+    if (!capturing) return;
+    capturing = 0;
+    pthread_join(flusher, NULL);
+    pthread_mutex_lock(&capture_mutex);
+    fclose(capture_file);
+    capture_file = NULL;
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+uint32_t capture_session() {
+    if (!capturing) return 0;
+    return __sync_add_and_fetch(&next_session, 1);
+}
+
+static void write_record(uint32_t session, const char *frame, uint32_t length) {
+    CaptureRecord record;
+    record.session = session;
+    record.length = length;
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file) {
+        record.offset_us = now_us() - capture_start_us;
+        fwrite(&record, sizeof(record), 1, capture_file);
+        if (length > 0) fwrite(frame, 1, length, capture_file);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_message(uint32_t session, const Message *msg) {
+    if (!capturing || session == 0) return;
+    char frame[MAX_BUFFER * 2];
+    serialize_message((Message*)msg, frame);
+    write_record(session, frame, strlen(frame));
+}
+
+void capture_end(uint32_t session) {
+    if (!capturing || session == 0) return;
+    write_record(session, NULL, 0);
+}
+
+int capture_read_header(FILE *f, CaptureHeader *header) {
+    if (fread(header, sizeof(*header), 1, f) != 1) return -1;
+    return memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) == 0 ? 0 : -1;
+}
+
+int capture_read_record(FILE *f, CaptureRecord *record, char *frame, size_t size) {
+    size_t got = fread(record, 1, sizeof(*record), f);
+    if (got == 0) return 0;
+    if (got != sizeof(*record)) return -1;
+
+    size_t keep = record->length < size - 1 ? record->length : size - 1;
+    if (fread(frame, 1, keep, f) != keep) return -1;
+    frame[keep] = '\0';
+    if (record->length > keep && fseek(f, record->length - keep, SEEK_CUR) != 0) return -1;
+    return 1;
+}
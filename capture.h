@@ -0,0 +1,59 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "common.h"
+#include <stdint.h>
+
+// Request capture: an opt-in trace of every message a server receives on
+// its client port, for replaying the same load against another build
+// (bench_replay). The NM captures to NM_CAPTURE and each SS to SS_CAPTURE
+// when those name a file, e.g. SS_CAPTURE=/tmp/ss%d.cap for one per SS id.
+//
+// A trace is a header followed by records. Each record holds the client
+// connection (session) it arrived on, when it arrived, and the message in
+// the wire encoding; a record with no message marks the connection closing.
+// Records are buffered and written by a flusher thread, so a server that is
+// killed loses at most the last CAPTURE_FLUSH_MS of its trace.
+
+#define CAPTURE_MAGIC "DOCSCAP2"    // Bumped with the wire encoding
+#define CAPTURE_FLUSH_MS 200
+#define CAPTURE_BUFFER_BYTES (1 << 20)
+
+typedef enum { CAPTURE_NM = 1, CAPTURE_SS = 2 } CaptureRole;
+
+typedef struct {
+    char magic[8];
+    int32_t role;            // CaptureRole
+    int32_t id;              // NM shard, or SS id
+    int64_t start_us;        // Wall clock when capture began, us since the epoch
+} CaptureHeader;
+
+typedef struct {
+    uint32_t session;
+    uint32_t length;         // Bytes of encoded message that follow; 0 marks a close
+    int64_t offset_us;       // Since start_us
+} CaptureRecord;
+
+// Start capturing to `pattern` (truncated), with any "%d" in it replaced by
+// `id`. Returns 0, or -1 if it cannot be opened; capture then stays off.
+int capture_open(const char *pattern, CaptureRole role, int id);
+
+// Stop capturing, writing out what is buffered
+void capture_close();
+
+// Id for a new client connection; 0 while capture is off
+uint32_t capture_session();
+
+// Record `msg` as received on `session` now
+void capture_message(uint32_t session, const Message *msg);
+
+// Record that `session` closed
+void capture_end(uint32_t session);
+
+// Reading a trace back. read_header returns 0 or -1; read_record returns 1
+// with the record (and up to `size` - 1 bytes of message in `frame`,
+// NUL-terminated), 0 at the end, or -1 on a truncated record.
+int capture_read_header(FILE *f, CaptureHeader *header);
+int capture_read_record(FILE *f, CaptureRecord *record, char *frame, size_t size);
+
+#endif // CAPTURE_H
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "logger.h"
+#include "docs.h"
 #include <signal.h> // For signal handling - S
 #include <unistd.h> // For signal handling - S
 #include <fcntl.h>  // For pipe fcntl - S
@@ -7,19 +8,19 @@
 #include <sys/select.h> // For select - S
 
 // Add struct elements to store nm server ip and port for connection (8081) - N
+// The protocol itself lives in libdocs (docs.h); this is its interactive shell
 typedef struct {
     char username[MAX_USERNAME];
-    int nm_sock;
-    int connected;
     char nm_ip[INET_ADDRSTRLEN];
     int nm_port;
+    DocsClient *docs;
 } Client;
 
 Client client;
 
 // Signal handling variables - S
-volatile sig_atomic_t current_ss_sock = -1;
-volatile sig_atomic_t current_locked_sentence = -1;
+DocsWriteSession *current_write = NULL;    // Open write session, cancelled on ctrl c
+int current_locked_sentence = -1;
 char current_locked_filename[MAX_FILENAME] = {0};
 int sig_pipe[2] = {-1, -1}; // pipe for signal handling - S
 volatile sig_atomic_t sigint_received = 0; // flag for signal handling - S
@@ -60,31 +61,15 @@ void sigint_handler(int signo) {
 
 // Function to perform unlock if needed on ctrl c - S
 void perform_pending_unlock() {
-    if(current_ss_sock > 0 && current_locked_sentence >= 0) {
-        Message msg;
-        init_message(&msg);
-        msg.type = MSG_CANCEL_WRITE;
-        strncpy(msg.filename, current_locked_filename, MAX_FILENAME - 1);
-        msg.filename[MAX_FILENAME - 1] = '\0';
-        strcpy(msg.sender, client.username);
-        msg.sentence_index = current_locked_sentence;
-
-        if(send_message((int)current_ss_sock, &msg) < 0) {
-            printf("Error sending cancel message\n");
+    if(current_write) {
+        int status = docs_write_close(current_write, 0);
+        current_write = NULL;
+        if(status == SUCCESS)
+        {
+            printf("\n[INFO] Write session cancelled and sentence %d in file %s unlocked due to interrupt signal.\n", current_locked_sentence, current_locked_filename);
         }
         else {
-            Message resp;
-            if(recv_message((int)current_ss_sock, &resp) >= 0) {
-                if(resp.status ==SUCCESS)
-                {
-                    printf("\n[INFO] Write session cancelled and sentence %d in file %s unlocked due to interrupt signal.\n", current_locked_sentence, current_locked_filename);
-                }
-                else {
-                    printf("\n[WARN] Cancel returned status %d\n", resp.status);
-                }
-            } else {
-                printf("[WARN] No response received for cancel message\n");
-            }
+            printf("\n[WARN] Cancel returned status %d\n", status);
         }
 
         current_locked_sentence = -1;
@@ -104,11 +89,11 @@ void handle_delete(char *filename);
 void handle_info(char *filename);
 void handle_stream(char *filename);
 void handle_list();
+void handle_stats();
 void handle_addaccess(char *flag, char *filename, char *username);
 void handle_remaccess(char *filename, char *username);
 void handle_exec(char *filename);
 void handle_undo(char *filename);
-int connect_to_ss(const char *ss_info);
 void print_error(int status);
 
 void init_client() {
@@ -116,7 +101,6 @@ void init_client() {
     fgets(client.username, MAX_USERNAME, stdin);
     trim_whitespace(client.username);
     
-    client.connected = 0;
 
     // Initialize logger for client
     char instance_name[64];
@@ -130,55 +114,24 @@ void init_client() {
     printf("[Client] Username: %s\n", client.username);
 }
 
+// Register with the NM (and every shard it names); the library reconnects
+// on its own later, so only this first attempt can fail the client
 void connect_to_nm() {
-    client.nm_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (client.nm_sock < 0) {
-        perror("Socket creation failed");
-        exit(1);
-    }
-    
-    // Make client connect to NM server using stored ip and port - N
-    struct sockaddr_in nm_addr;
-    nm_addr.sin_family = AF_INET;
-    nm_addr.sin_port = htons(client.nm_port);
-    inet_pton(AF_INET, client.nm_ip, &nm_addr.sin_addr);
-    
-    if (connect(client.nm_sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
+    int status;
+    client.docs = docs_connect(client.nm_ip, client.nm_port, client.username, &status);
+    if (!client.docs && status == ERR_SERVER_ERROR) {
         perror("Connection to NM failed");
         exit(1);
     }
-
-    Message msg;
-    init_message(&msg);
-    
-    struct sockaddr_in local_addr;
-    socklen_t addr_len = sizeof(local_addr);
-    if (getsockname(client.nm_sock, (struct sockaddr*)&local_addr, &addr_len) == 0) {
-        inet_ntop(AF_INET, &local_addr.sin_addr, msg.data, INET_ADDRSTRLEN);
-    } else {
-        // Fallback: use loopback if we can't get the actual IP, continuously stuck here - N
-        //printf("[DEBUG] getsockname failed, using loopback address\n");
-        strcpy(msg.data, "127.0.0.1");
-    }
-    
-    // Send registration
-    msg.type = MSG_REG_CLIENT;
-    strcpy(msg.sender, client.username);
-    
-    send_message(client.nm_sock, &msg);
-    
-    Message response;
-    recv_message(client.nm_sock, &response);
-    
-    if (response.status == SUCCESS) {
-        client.connected = 1;
-        printf("[Client] Connected to Name Server at %s:%d\n", client.nm_ip, client.nm_port);
-        log_formatted(LOG_INFO, "Connected to NM at %s:%d", client.nm_ip, client.nm_port);
-    } else {
+    if (!client.docs) {
         printf("[Client] Registration failed\n");
-        log_formatted(LOG_ERROR, "Registration failed: %s", response.data);
         exit(1);
     }
+
+    printf("[Client] Connected to Name Server at %s:%d\n", client.nm_ip, client.nm_port);
+    if (docs_shard_count(client.docs) > 1) {
+        printf("[Client] Namespace split over %d name servers\n", docs_shard_count(client.docs));
+    }
 }
 
 void print_error(int status) {
@@ -213,39 +166,21 @@ void print_error(int status) {
         case ERR_USER_NOT_FOUND:
             printf("Error: User not found\n");
             break;
+        case ERR_FILE_MOVED:
+            printf("Error: File was just moved to another storage server, please retry\n");
+            break;
+        case ERR_WRONG_SHARD:
+            printf("Error: Sent to the wrong name server shard\n");
+            break;
+        case ERR_LEASE_EXPIRED:
+            printf("Error: Storage server refused the route lease, please retry\n");
+            break;
         default:
             printf("Error: Unknown error (code %d)\n", status);
             break;
     }
 }
 
-int connect_to_ss(const char *ss_info) {
-    char ip[INET_ADDRSTRLEN];
-    int port;
-    
-    //printf("[DEBUG] Connecting to SS with info: %s\n", ss_info); // Debug line
-    sscanf(ss_info, "%[^:]:%d", ip, &port);
-    
-    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (ss_sock < 0) {
-        return -1;
-    }
-    
-    struct sockaddr_in ss_addr;
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &ss_addr.sin_addr);
-    
-    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        close(ss_sock);
-        return -1;
-    }
-
-    log_formatted(LOG_INFO, "Connected to SS at %s:%d", ip, port);
-    
-    return ss_sock;
-}
-
 void handle_createfolder(char *foldername, char *parent_path) {
     Message msg;
     init_message(&msg);
@@ -258,10 +193,8 @@ void handle_createfolder(char *foldername, char *parent_path) {
         msg.target_path[0] = '\0';
     }
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Folder created successfully!\n");
@@ -278,10 +211,8 @@ void handle_move_file(char *filename, char *foldername) {
     strcpy(msg.filename, filename);
     strcpy(msg.target_path, foldername);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("File moved successfully!\n");
@@ -297,10 +228,8 @@ void handle_viewfolder(char *foldername) {
     strcpy(msg.sender, client.username);
     strcpy(msg.target_path, foldername);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
 
     if (response.status == SUCCESS) {
         printf("%s", response.data);
@@ -320,10 +249,8 @@ void handle_view(char *args) {
     }
     
     //printf("[DEBUG] Sending VIEW request with args: %s\n", args ? args : "None");
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("%s", response.data);
@@ -333,45 +260,12 @@ void handle_view(char *args) {
 }
 
 void handle_read(char *filename) {
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_READ;
-    strcpy(msg.sender, client.username);
-    strcpy(msg.filename, filename);
-    
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
-    
-    if (response.status != SUCCESS) {
-        print_error(response.status);
-        return;
-    }
-    
-    // Connect to SS
-    int ss_sock = connect_to_ss(response.data);
-    if (ss_sock < 0) {
-        printf("Error: Could not connect to storage server\n");
-        return;
-    }
-    
-    // Send read request to SS
-    init_message(&msg);
-    msg.type = MSG_READ;
-    strcpy(msg.filename, filename);
-    strcpy(msg.sender, client.username);
-    
-    send_message(ss_sock, &msg);
-    recv_message(ss_sock, &response);
-    
-    if (response.status == SUCCESS) {
+    if (docs_read(client.docs, filename, &response) == SUCCESS) {
         printf("%s\n", response.data);
     } else {
         print_error(response.status);
     }
-    
-    close(ss_sock);
 }
 
 void handle_checkpoint(char *filename, char *tag) {
@@ -382,10 +276,8 @@ void handle_checkpoint(char *filename, char *tag) {
     strcpy(msg.filename, filename);
     strcpy(msg.checkpoint_tag, tag);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Checkpoint '%s' created successfully!\n", tag);
@@ -402,10 +294,8 @@ void handle_viewcheckpoint(char *filename, char *tag) {
     strcpy(msg.filename, filename);
     strcpy(msg.checkpoint_tag, tag);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("%s\n", response.data);
@@ -422,10 +312,8 @@ void handle_revert(char *filename, char *tag) {
     strcpy(msg.filename, filename);
     strcpy(msg.checkpoint_tag, tag);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("File reverted to checkpoint '%s' successfully!\n", tag);
@@ -441,10 +329,8 @@ void handle_listcheckpoints(char *filename) {
     strcpy(msg.sender, client.username);
     strcpy(msg.filename, filename);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Checkpoints for %s:\n%s", filename, response.data);
@@ -462,18 +348,8 @@ void handle_create(char *filename) {
     
     //printf("[DEBUG] Sending CREATE request for: %s\n", filename);
     
-    if (send_message(client.nm_sock, &msg) < 0) {
-        //printf("[DEBUG] Failed to send message\n");
-        return;
-    }
-
-    //printf("[DEBUG] Waiting for response...\n");
-
     Message response;
-    if (recv_message(client.nm_sock, &response) < 0) {
-        //printf("[DEBUG] Failed to receive response\n");
-        return;
-    }
+    docs_call(client.docs, &msg, &response);
 
     //printf("[DEBUG] Received response: type=%d, status=%d\n", response.type, response.status);
 
@@ -541,46 +417,10 @@ void handle_write(char *filename, char *sent_idx_str) {
     current_locked_sentence = -1;   
     current_locked_filename[0] = '\0';
     
-    // Get SS info from NM
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_WRITE;
-    strcpy(msg.sender, client.username);
-    strcpy(msg.filename, filename);
-    
-    send_message(client.nm_sock, &msg);
-    
-    Message response;
-    recv_message(client.nm_sock, &response);
-    
-    if (response.status != SUCCESS) {
-        print_error(response.status);
-        return;
-    }
-    
-    // Connect to SS
-    int ss_sock = connect_to_ss(response.data);
-    if (ss_sock < 0) {
-        printf("Error: Could not connect to storage server\n");
-        return;
-    }
-    
-    current_ss_sock = ss_sock;
-
-    // Lock sentence
-    init_message(&msg);
-    msg.type = MSG_LOCK_SENTENCE;
-    strcpy(msg.filename, filename);
-    strcpy(msg.sender, client.username);
-    msg.sentence_index = sent_idx;
-    
-    send_message(ss_sock, &msg);
-    recv_message(ss_sock, &response);
-    
-    if (response.status != SUCCESS) {
-        print_error(response.status);
-        close(ss_sock);
-        current_ss_sock = -1;
+    // Lock the sentence on the file's primary SS
+    int result = docs_write_open(client.docs, filename, sent_idx, &current_write);
+    if (result != SUCCESS) {
+        print_error(result);
         return;
     }
     
@@ -648,214 +488,35 @@ void handle_write(char *filename, char *sent_idx_str) {
 
         process_escape_sequences(content);
         
-        // Try to send write to SS with retry logic
-        int retry_count = 0;
-        int write_success = 0;
-        
-        while (retry_count < 5 && !write_success) {
-            // Prepare write message
-            init_message(&msg);
-            msg.type = MSG_WRITE;
-            strcpy(msg.filename, filename);
-            strcpy(msg.sender, client.username);
-            msg.sentence_index = sent_idx;
-            msg.word_index = word_idx;
-            strcpy(msg.data, content);
-            
-            // Try to send write
-            if (send_message(ss_sock, &msg) < 0) {
-                // Send failed - connection lost
-                printf("Error: Storage server disconnected during write\n");
-                printf("Attempting to reconnect (attempt %d/5)...\n", retry_count + 1);
-                close(ss_sock);
-                current_ss_sock = -1;
-                retry_count++;
-                
-                // Try to get new SS info from NM
-                init_message(&msg);
-                msg.type = MSG_WRITE;
-                strcpy(msg.sender, client.username);
-                strcpy(msg.filename, filename);
-                
-                if (send_message(client.nm_sock, &msg) < 0) {
-                    printf("Error: Could not contact Name Server for reconnection\n");
-                    sleep(1);
-                    continue;
-                }
-                
-                if (recv_message(client.nm_sock, &response) < 0) {
-                    printf("Error: Lost connection to Name Server\n");
-                    sleep(1);
-                    continue;
-                }
-                
-                if (response.status != SUCCESS) {
-                    printf("Error: File no longer available\n");
-                    print_error(response.status);
-                    sleep(1);
-                    continue;
-                }
-                
-                // Try to reconnect to SS
-                ss_sock = connect_to_ss(response.data);
-                if (ss_sock < 0) {
-                    printf("Error: Could not reconnect to storage server\n");
-                    sleep(1);
-                    continue;
-                }
-                
-                current_ss_sock = ss_sock;
-                printf("Reconnected successfully. Attempting to re-acquire lock...\n");
-                
-                // Try to re-lock the sentence
-                init_message(&msg);
-                msg.type = MSG_LOCK_SENTENCE;
-                strcpy(msg.filename, filename);
-                strcpy(msg.sender, client.username);
-                msg.sentence_index = sent_idx;
-                
-                if (send_message(ss_sock, &msg) < 0 || recv_message(ss_sock, &response) < 0) {
-                    printf("Error: Could not re-acquire lock after reconnection\n");
-                    close(ss_sock);
-                    current_ss_sock = -1;
-                    sleep(1);
-                    continue;
-                }
-                
-                if (response.status != SUCCESS) {
-                    printf("Error: Could not re-acquire lock - ");
-                    print_error(response.status);
-                    close(ss_sock);
-                    current_ss_sock = -1;
-                    sleep(1);
-                    continue;
-                }
-                
-                printf("Lock re-acquired. Retrying write operation...\n");
-                // Loop will retry the send_message at the top
-                continue;
-            }
-            
-            // Send succeeded, now try to receive response
-            if (recv_message(ss_sock, &response) < 0) {
-                // Receive failed - connection lost
-                printf("Error: Storage server disconnected while waiting for response\n");
-                printf("Attempting to reconnect (attempt %d/5)...\n", retry_count + 1);
-                close(ss_sock);
-                current_ss_sock = -1;
-                retry_count++;
-                
-                // Same reconnection logic as above
-                init_message(&msg);
-                msg.type = MSG_WRITE;
-                strcpy(msg.sender, client.username);
-                strcpy(msg.filename, filename);
-                
-                if (send_message(client.nm_sock, &msg) < 0) {
-                    printf("Error: Could not contact Name Server for reconnection\n");
-                    sleep(1);
-                    continue;
-                }
-                
-                if (recv_message(client.nm_sock, &response) < 0) {
-                    printf("Error: Lost connection to Name Server\n");
-                    sleep(1);
-                    continue;
-                }
-                
-                if (response.status != SUCCESS) {
-                    printf("Error: File no longer available\n");
-                    print_error(response.status);
-                    sleep(1);
-                    continue;
-                }
-                
-                ss_sock = connect_to_ss(response.data);
-                if (ss_sock < 0) {
-                    printf("Error: Could not reconnect to storage server\n");
-                    sleep(1);
-                    continue;
-                }
-                
-                current_ss_sock = ss_sock;
-                printf("Reconnected successfully. Attempting to re-acquire lock...\n");
-                
-                init_message(&msg);
-                msg.type = MSG_LOCK_SENTENCE;
-                strcpy(msg.filename, filename);
-                strcpy(msg.sender, client.username);
-                msg.sentence_index = sent_idx;
-                
-                if (send_message(ss_sock, &msg) < 0 || recv_message(ss_sock, &response) < 0) {
-                    printf("Error: Could not re-acquire lock after reconnection\n");
-                    close(ss_sock);
-                    current_ss_sock = -1;
-                    sleep(1);
-                    continue;
-                }
-                
-                if (response.status != SUCCESS) {
-                    printf("Error: Could not re-acquire lock - ");
-                    print_error(response.status);
-                    close(ss_sock);
-                    current_ss_sock = -1;
-                    sleep(1);
-                    continue;
-                }
-                
-                printf("Lock re-acquired. Retrying write operation...\n");
-                continue;
-            }
-            
-            // Both send and receive succeeded
-            if (response.status != SUCCESS) {
-                printf("Write failed: ");
-                print_error(response.status);
-                status = 0;
-                break; // Exit retry loop
-            }
-            
-            // Write was successful!
-            write_success = 1;
-            write_count++;
-            printf("Write successful!\n");
-        }
-        
-        // Check if we exhausted all retries
-        if (retry_count >= 5 && !write_success) {
-            printf("Error: Could not complete write after 5 reconnection attempts\n");
+        // The library locks the sentence again if the storage server goes away
+        result = docs_write_word(current_write, word_idx, content);
+        if (result == ERR_SS_UNAVAILABLE) {
+            printf("Error: Could not complete write after %d reconnection attempts\n", DOCS_WRITE_RETRIES);
             status = 0;
-            break; // Exit main while loop
+            break;
         }
-        
-        // If write failed for non-connection reasons, exit
-        if (!write_success && retry_count == 0) {
+        if (result != SUCCESS) {
+            printf("Write failed: ");
+            print_error(result);
+            status = 0;
             break;
         }
+        
+        write_count++;
+        printf("Write successful!\n");
     }
     
-    // Unlock sentence if we still have a connection
-    if (current_ss_sock > 0) {
-        init_message(&msg);
-        msg.type = MSG_UNLOCK_SENTENCE;
-        strcpy(msg.filename, filename);
-        strcpy(msg.sender, client.username);
-        msg.sentence_index = sent_idx;
-        
-        if (send_message(ss_sock, &msg) < 0) {
-            printf("Error: Could not send unlock (connection lost)\n");
-        } else if (recv_message(ss_sock, &response) < 0) {
-            printf("Error: Could not receive unlock response (connection lost)\n");
-        } else if (response.status != SUCCESS) {
-            printf("Unlock failed: ");
-            print_error(response.status);
-        }
-        
-        close(ss_sock);
+    // Unlock sentence, committing the writes
+    result = docs_write_close(current_write, 1);
+    current_write = NULL;
+    if (result == ERR_SS_UNAVAILABLE) {
+        printf("Error: Could not unlock (connection lost)\n");
+    } else if (result != SUCCESS) {
+        printf("Unlock failed: ");
+        print_error(result);
     }
     
     // Clear signal handling variables
-    current_ss_sock = -1;
     current_locked_sentence = -1;
     current_locked_filename[0] = '\0';
     
@@ -876,10 +537,8 @@ void handle_delete(char *filename) {
     strcpy(msg.sender, client.username);
     strcpy(msg.filename, filename);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("File deleted successfully!\n");
@@ -895,10 +554,8 @@ void handle_info(char *filename) {
     strcpy(msg.sender, client.username);
     strcpy(msg.filename, filename);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("%s", response.data);
@@ -907,125 +564,27 @@ void handle_info(char *filename) {
     }
 }
 
-// void handle_stream(char *filename) {
-//     Message msg;
-//     init_message(&msg);
-//     msg.type = MSG_STREAM;
-//     strcpy(msg.sender, client.username);
-//     strcpy(msg.filename, filename);
-    
-//     send_message(client.nm_sock, &msg);
-    
-//     Message response;
-//     recv_message(client.nm_sock, &response);
-    
-//     if (response.status != SUCCESS) {
-//         print_error(response.status);
-//         return;
-//     }
-    
-//     // Connect to SS
-//     int ss_sock = connect_to_ss(response.data);
-//     if (ss_sock < 0) {
-//         printf("Error: Could not connect to storage server\n");
-//         return;
-//     }
-    
-//     // Send stream request
-//     init_message(&msg);
-//     msg.type = MSG_STREAM;
-//     strcpy(msg.filename, filename);
-//     strcpy(msg.sender, client.username);
-    
-//     send_message(ss_sock, &msg);
-//     recv_message(ss_sock, &response);
-    
-//     if (response.status != SUCCESS) {
-//         print_error(response.status);
-//         close(ss_sock);
-//         return;
-//     }
-    
-//     // Receive and display words
-//     while (1) {
-//         if (recv_message(ss_sock, &response) < 0) {
-//             printf("\nError: Connection to storage server lost\n");
-//             break;
-//         }
-        
-//         if (response.type == MSG_STOP) {
-//             printf("\n");
-//             break;
-//         }
-        
-//         printf("%s ", response.data);
-//         fflush(stdout);
-//     }
-    
-//     close(ss_sock);
-// }
+// /* Print a token, with a trailing space only when the server asked for it */
+void print_stream_word(const char *word, int space, void *arg) {
+    (void)arg;
+    printf("%s", word);
+    if (space) {
+        printf(" ");
+    }
+    fflush(stdout);
+}
 
 void handle_stream(char *filename) {
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_READ;
-    strcpy(msg.sender, client.username);
-    strcpy(msg.filename, filename);
-    
-    send_message(client.nm_sock, &msg);
-    
-    Message response;
-    recv_message(client.nm_sock, &response);
-    
-    if (response.status != SUCCESS) {
-        print_error(response.status);
-        return;
-    }
-    int ss_sock = connect_to_ss(response.data ); /* note: connect_to_ss expects "ip:port"; adjust call if you instead get ss_info elsewhere */
-    if (ss_sock < 0) {
-        printf("Failed to connect to storage server for streaming\n");
+    int status = docs_stream(client.docs, filename, print_stream_word, NULL);
+    if (status == ERR_SS_UNAVAILABLE) {
+        printf("\nStream interrupted\n");
         return;
     }
-
-    Message req;
-    init_message(&req);
-    req.type = MSG_STREAM;
-    strcpy(req.sender, client.username);
-    strncpy(req.filename, filename, MAX_FILENAME - 1);
-    req.filename[MAX_FILENAME - 1] = '\0';
-
-    if (send_message(ss_sock, &req) < 0) {
-        printf("Failed to request stream\n");
-        close(ss_sock);
+    if (status != SUCCESS) {
+        print_error(status);
         return;
     }
-
-    /* Receive stream tokens until MSG_STOP */
-    Message resp;
-    while (1) {
-        if (recv_message(ss_sock, &resp) < 0) {
-            printf("Stream interrupted\n");
-            break;
-        }
-        if (resp.type == MSG_STOP) {
-            break;
-        }
-        if (resp.type != MSG_DATA) {
-            continue;
-        }
-
-        /* Print token */
-        printf("%s", resp.data);
-
-        /* Print trailing space only when server asked for it (resp.status == 1) */
-        if (resp.status == 1) {
-            printf(" ");
-        }
-        fflush(stdout);
-    }
-
     printf("\n");
-    close(ss_sock);
 }
 
 void handle_list() {
@@ -1034,10 +593,25 @@ void handle_list() {
     msg.type = MSG_LIST;
     strcpy(msg.sender, client.username);
     
-    send_message(client.nm_sock, &msg);
+    Message response;
+    docs_call(client.docs, &msg, &response);
+    
+    if (response.status == SUCCESS) {
+        printf("%s", response.data);
+    } else {
+        print_error(response.status);
+    }
+}
+
+// Request counts and latency percentiles from the name server
+void handle_stats() {
+    Message msg;
+    init_message(&msg);
+    msg.type = MSG_STATS;
+    strcpy(msg.sender, client.username);
     
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("%s", response.data);
@@ -1063,10 +637,8 @@ void handle_addaccess(char *flag, char *filename, char *username) {
         return;
     }
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Access granted successfully!\n");
@@ -1083,10 +655,8 @@ void handle_remaccess(char *filename, char *username) {
     strcpy(msg.filename, filename);
     strcpy(msg.target_user, username);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Access removed successfully!\n");
@@ -1102,10 +672,8 @@ void handle_exec(char *filename) {
     strcpy(msg.sender, client.username);
     strcpy(msg.filename, filename);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("%s", response.data);
@@ -1115,45 +683,12 @@ void handle_exec(char *filename) {
 }
 
 void handle_undo(char *filename) {
-    Message msg;
-    init_message(&msg);
-    msg.type = MSG_UNDO;
-    strcpy(msg.sender, client.username);
-    strcpy(msg.filename, filename);
-    
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
-    
-    if (response.status != SUCCESS) {
-        print_error(response.status);
-        return;
-    }
-    
-    // Connect to SS
-    int ss_sock = connect_to_ss(response.data);
-    if (ss_sock < 0) {
-        printf("Error: Could not connect to storage server\n");
-        return;
-    }
-    
-    // Send undo request
-    init_message(&msg);
-    msg.type = MSG_UNDO;
-    strcpy(msg.filename, filename);
-    strcpy(msg.sender, client.username);
-    
-    send_message(ss_sock, &msg);
-    recv_message(ss_sock, &response);
-    
-    if (response.status == SUCCESS) {
+    if (docs_undo(client.docs, filename, &response) == SUCCESS) {
         printf("Undo successful!\n");
     } else {
         print_error(response.status);
     }
-    
-    close(ss_sock);
 }
 
 void handle_requestaccess(char *flag, char *filename) {
@@ -1172,10 +707,8 @@ void handle_requestaccess(char *flag, char *filename) {
         return;
     }
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Access request sent successfully!\n");
@@ -1193,10 +726,8 @@ void handle_viewrequests() {
     msg.type = MSG_VIEWREQUESTS;
     strcpy(msg.sender, client.username);
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Pending Access Requests:\n%s", response.data);
@@ -1214,10 +745,8 @@ void handle_approverequest(char *request_id_str) {
     strcpy(msg.sender, client.username);
     msg.sentence_index = request_id;
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Access request approved successfully!\n");
@@ -1235,10 +764,8 @@ void handle_denyrequest(char *request_id_str) {
     strcpy(msg.sender, client.username);
     msg.sentence_index = request_id;
     
-    send_message(client.nm_sock, &msg);
-    
     Message response;
-    recv_message(client.nm_sock, &response);
+    docs_call(client.docs, &msg, &response);
     
     if (response.status == SUCCESS) {
         printf("Access request denied successfully!\n");
@@ -1360,6 +887,7 @@ void command_loop() {
             printf("  INFO <filename>       - Get file information\n");
             printf("  STREAM <filename>     - Stream file content\n");
             printf("  LIST                  - List all users\n");
+            printf("  STATS                 - Name server request statistics\n");
             printf("  ADDACCESS -R|-W <filename> <username> - Add access\n");
             printf("  REMACCESS <filename> <username> - Remove access\n");
             printf("  EXEC <filename>       - Execute file as commands\n");
@@ -1416,6 +944,8 @@ void command_loop() {
             }
         } else if (strcmp(cmd, "LIST") == 0) {
             handle_list();
+        } else if (strcmp(cmd, "STATS") == 0) {
+            handle_stats();
         } else if (strcmp(cmd, "ADDACCESS") == 0) {
             if (argc_local < 4) {
                 printf("Usage: ADDACCESS -R|-W <filename> <username>\n");
@@ -1553,7 +1083,10 @@ int main(int argc, char *argv[]) {
         printf("Error: Invalid port number. Must be between 1 and 65535.\n");
         return 1;
     }
-    else if (client.nm_port != 8081) {
+    else if ((client.nm_port - NM_CLIENT_PORT) % NM_SHARD_PORT_STRIDE != 0 ||
+             client.nm_port < NM_CLIENT_PORT ||
+             (client.nm_port - NM_CLIENT_PORT) / NM_SHARD_PORT_STRIDE >= MAX_NM_SHARDS) {
+        // 8081, or a name server shard's client port (8091, 8101, ...)
         printf("Error: To register as a user, you must register under port 8081.\n");
         return 1;
     }
@@ -1562,7 +1095,7 @@ int main(int argc, char *argv[]) {
     connect_to_nm();
     command_loop();
     
-    close(client.nm_sock);
+    docs_close(client.docs);
     close_logger();  
 
     if(sig_pipe[0] != -1) close(sig_pipe[0]);
@@ -51,10 +51,12 @@ void serialize_message(Message *msg, char *buffer) {
     // 10: nm_port (NEW)
     // 11: access
     // 12: target_user
-    // 14: checkpoint stuff
-    // 13: data (LAST - can contain anything including |)
+    // 13: checkpoint stuff
+    // 14: route lease
+    // 15: trace id (hex)
+    // 16: data (LAST - can contain anything including |)
     
-    sprintf(buffer, "%d|%d|%s|%s|%s|%s|%d|%d|%d|%d|%d|%d|%s|%s|%s",
+    sprintf(buffer, "%d|%d|%s|%s|%s|%s|%d|%d|%d|%d|%d|%d|%s|%s|%s|%llx|%s",
             msg->type,           // 0
             msg->status,         // 1
             msg->sender,         // 2
@@ -69,7 +71,9 @@ void serialize_message(Message *msg, char *buffer) {
             msg->access,         // 11
             msg->target_user,    // 12
             msg->checkpoint_tag, // 13 (NEW)
-            msg->data);          // 14 (LAST)
+            msg->lease,          // 14
+            msg->trace_id,       // 15
+            msg->data);          // 16 (LAST)
 }
 
 void deserialize_message(char *buffer, Message *msg) {
@@ -77,12 +81,12 @@ void deserialize_message(char *buffer, Message *msg) {
     char *p = buffer;
     int field = 0;
 
-    while (field < 15 && p) {  // Changed from 10 to 12
+    while (field < 17 && p) {
         char *sep;
         size_t len;
         
-        // CRITICAL: For the last field (data at field 11), take everything remaining
-        if (field == 14) {
+        // CRITICAL: For the last field (data at field 16), take everything remaining
+        if (field == 16) {
             sep = NULL;  // No more separators
             len = strlen(p);
         } else {
@@ -130,7 +134,12 @@ void deserialize_message(char *buffer, Message *msg) {
                     strncpy(msg->checkpoint_tag, token_buf, MAX_USERNAME-1); 
                     msg->sender[MAX_USERNAME-1] = '\0'; 
                     break;
-                case 14: 
+                case 14:
+                    strncpy(msg->lease, token_buf, MAX_LEASE-1);
+                    msg->lease[MAX_LEASE-1] = '\0';
+                    break;
+                case 15: msg->trace_id = strtoull(token_buf, NULL, 16); break;
+                case 16: 
                     strncpy(msg->data, token_buf, MAX_BUFFER-1); 
                     msg->data[MAX_BUFFER-1] = '\0'; 
                     break;
@@ -150,47 +159,33 @@ void deserialize_message(char *buffer, Message *msg) {
     }
 }
 
+void (*send_message_hook)(const Message *msg, int frame_bytes) = NULL;
+
 int send_message(int sock, Message *msg) {
-    char buffer[MAX_BUFFER * 2];
-    serialize_message(msg, buffer);
+    // Length prefix and payload go out in one send(): two small writes
+    // followed by a read stall on Nagle + delayed ACK for ~40ms per message
+    char buffer[sizeof(int) + MAX_BUFFER * 2];
+    serialize_message(msg, buffer + sizeof(int));
     
-    int len = strlen(buffer);
+    int len = strlen(buffer + sizeof(int));
+    memcpy(buffer, &len, sizeof(int));
+    int frame_len = sizeof(int) + len;
     int total_sent = 0;
-    
-    // Send length first
-    // if (send(sock, &len, sizeof(int), 0) < 0) {
-    //     return -1;
-    // }
 
-    // Send length first, with MSG_NOSIGNAL to prevent SIGPIPE - S
+    // Send with MSG_NOSIGNAL to prevent SIGPIPE - S
     // if there is no MSG_NOSIGNAL, the program may terminate unexpectedly because of SIGPIPE
     // Reference:
     //Normally, if you try to send on a TCP socket that has been closed by the peer, the kernel detects that the connection is broken and triggers a SIGPIPE signal to your process.
     //By default, SIGPIPE kills your process.
-    int sent = send(sock, &len, sizeof(int), MSG_NOSIGNAL);
-    if (sent<0)
-    {
-        return -1;
-    }
-    
-    // Send data
-    // while (total_sent < len) {
-    //     int sent = send(sock, buffer + total_sent, len - total_sent, 0);
-    //     if (sent < 0) {
-    //         return -1;
-    //     }
-    //     total_sent += sent;
-    // }
-
-    // Send data with MSG_NOSIGNAL to prevent SIGPIPE - S
-    while (total_sent < len) {
-        int s = send(sock, buffer + total_sent, len - total_sent, MSG_NOSIGNAL);
+    while (total_sent < frame_len) {
+        int s = send(sock, buffer + total_sent, frame_len - total_sent, MSG_NOSIGNAL);
         if (s < 0) {
             if(errno == EINTR) continue;
             return -1;
         }
         total_sent += s;
     }
+    if (send_message_hook) send_message_hook(msg, frame_len);
     
     return 0;
 }
@@ -252,3 +247,91 @@ void trim_whitespace(char *str) {
     
     *(end + 1) = '\0';
 }
+
+// Read an integer tunable from the environment, falling back to a default
+int get_env_int(const char *name, int default_value) {
+    const char *value = getenv(name);
+    if (!value || !*value) return default_value;
+
+    char *end;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0') return default_value;
+    return (int)parsed;
+}
+
+const char* nm_failover_ip(const char *primary_ip, int attempt) {
+    const char *standby = getenv("NM_STANDBY_IP");
+    if (standby && *standby && attempt % 2 == 1) return standby;
+    return primary_ip;
+}
+
+int nm_retry_delay_ms(int attempt, int base_ms, int cap_ms) {
+    static __thread unsigned int seed = 0;
+    if (seed == 0) seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16) ^ (unsigned int)(unsigned long)&seed;
+
+    int delay = base_ms;
+    for (int i = 0; i < attempt && delay < cap_ms; i++) delay *= 2;
+    if (delay > cap_ms) delay = cap_ms;
+    return delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+}
+
+int nm_shard_port(int base_port, int shard) {
+    return base_port + shard * NM_SHARD_PORT_STRIDE;
+}
+
+// FNV-1a: cheap, and stable across processes and builds
+int shard_of_key(const char *key, int shards) {
+    if (shards <= 1) return 0;
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return (int)(hash % (unsigned int)shards);
+}
+
+int shard_for_message(const Message *msg, int shards) {
+    if (shards <= 1) return 0;
+
+    switch (msg->type) {
+        case MSG_CREATEFOLDER: {
+            char full_path[MAX_PATH];
+            if (strlen(msg->target_path) > 0) {
+                snprintf(full_path, sizeof(full_path), "%s/%s", msg->target_path, msg->foldername);
+            } else {
+                snprintf(full_path, sizeof(full_path), "/%s", msg->foldername);
+            }
+            return shard_of_key(full_path, shards);
+        }
+        case MSG_VIEWFOLDER:
+            if (strlen(msg->target_path) == 0 || strcmp(msg->target_path, "/") == 0) return 0;
+            return shard_of_key(msg->target_path, shards);
+        case MSG_APPROVEREQUEST:
+        case MSG_DENYREQUEST:
+            // Request ids are numbered local index * shards + shard
+            return msg->sentence_index >= 0 ? msg->sentence_index % shards : 0;
+        case MSG_VIEW:
+        case MSG_LIST:
+        case MSG_VIEWREQUESTS:
+            return 0;
+        default:
+            return msg->filename[0] ? shard_of_key(msg->filename, shards) : 0;
+    }
+}
+
+static const char *message_type_names[MSG_TYPE_COUNT] = {
+    "MSG_REG_SS", "MSG_REG_CLIENT", "MSG_CREATE", "MSG_READ", "MSG_WRITE", "MSG_DELETE", "MSG_INFO",
+    "MSG_VIEW", "MSG_LIST", "MSG_ADDACCESS", "MSG_REMACCESS", "MSG_STREAM", "MSG_EXEC", "MSG_UNDO",
+    "MSG_LOCK_SENTENCE", "MSG_UNLOCK_SENTENCE", "MSG_ACK", "MSG_NACK", "MSG_DATA", "MSG_ERROR",
+    "MSG_STOP", "MSG_CHECK_LOCKS", "MSG_CREATEFOLDER", "MSG_MOVE", "MSG_VIEWFOLDER",
+    "MSG_CHECKPOINT", "MSG_VIEWCHECKPOINT", "MSG_REVERT", "MSG_LISTCHECKPOINTS",
+    "MSG_REQUESTACCESS", "MSG_VIEWREQUESTS", "MSG_APPROVEREQUEST", "MSG_DENYREQUEST", "MSG_SS_INFO",
+    "MSG_CANCEL_WRITE", "MSG_COMMIT_WRITE", "MSG_SS_POOL_CONN", "MSG_REPL_CONFIG", "MSG_REPL_SYNC",
+    "MSG_REPL_DELTA", "MSG_REPL_PUT", "MSG_REPL_STALE", "MSG_REPL_HANDOFF", "MSG_FOLDER_LOOKUP",
+    "MSG_STATS"
+};
+
+const char* message_type_name(int type) {
+    if (type < 0 || type >= MSG_TYPE_COUNT) return "MSG_UNKNOWN";
+    return message_type_names[type];
+}
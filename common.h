@@ -28,8 +28,11 @@
 #define MAX_CLIENTS 100
 #define MAX_SS 50
 #define MAX_ACL_ENTRIES 100
+#define MAX_LEASE 64
 #define CACHE_SIZE 100
 #define STREAM_DELAY 100000  // 0.1 seconds in microseconds
+#define MAX_REPLICAS 3       // Copies of a file, primary included
+#define MAX_BACKUPS MAX_REPLICAS  // Backups of a file, plus one being migrated in
 
 // File System Limits added, lets tune it! - N
 #define MAX_WORDS_PER_SENTENCE 10
@@ -49,11 +52,21 @@
 #define ERR_NOT_OWNER 401
 #define ERR_USER_NOT_FOUND 406
 #define ERR_FILE_LOCKED 424 
+#define ERR_REPLICA_DIVERGED 412  // Backup copy does not match the delta's base
+#define ERR_FILE_MOVED 410        // File handed off to another SS; ask the NM again
+#define ERR_WRONG_SHARD 421       // Name belongs to another name server shard
+#define ERR_LEASE_EXPIRED 419     // Route lease expired or not valid here; ask the NM again
 
 // Ports
 #define NM_SS_PORT 8080          // Existing - commands
 #define NM_SS_HB_PORT 8082       // NEW - heartbeats only
 #define NM_CLIENT_PORT 8081      // Existing
+#define NM_STANDBY_PORT 8083     // Metadata log stream to a standby NM
+#define NM_PEER_PORT 8084        // Requests between name server shards
+
+// Name server shards: shard k listens on each port above plus k * stride
+#define MAX_NM_SHARDS 8
+#define NM_SHARD_PORT_STRIDE 10
 
 // Message Types
 typedef enum {
@@ -92,7 +105,17 @@ typedef enum {
     MSG_DENYREQUEST,      // Deny access request
     MSG_SS_INFO,           // SS requesting file info
     MSG_CANCEL_WRITE,      // Cancel write session without commiting
-    MSG_COMMIT_WRITE      // Explicit commit
+    MSG_COMMIT_WRITE,     // Explicit commit
+    MSG_SS_POOL_CONN,     // Extra SS command connection joining the NM's pool
+    MSG_REPL_CONFIG,      // NM -> primary SS: backups to ship a file's updates to
+    MSG_REPL_SYNC,        // NM -> primary SS: send a full copy to a stale backup
+    MSG_REPL_DELTA,       // Primary -> backup SS: replace a range of sentences
+    MSG_REPL_PUT,         // Primary -> backup SS: one chunk of a full copy
+    MSG_REPL_STALE,       // Primary SS -> NM: a backup missed an update
+    MSG_REPL_HANDOFF,     // NM -> primary SS: stop taking writes, a backup takes over
+    MSG_FOLDER_LOOKUP,    // NM -> NM shard: does a folder exist
+    MSG_STATS,            // Request counters and latency histograms (stats.h)
+    MSG_TYPE_COUNT
 } MessageType;
 
 // Access Types
@@ -114,7 +137,10 @@ typedef struct {
     char filename[MAX_FILENAME];
     char folder_path[MAX_PATH];
     char owner[MAX_USERNAME];
-    int ss_id;  // Storage Server ID
+    int ss_id;  // Storage Server ID (primary copy)
+    int backup_ids[MAX_BACKUPS];  // Storage servers holding backup copies
+    int backup_count;
+    int stale_mask;  // Bit i set: backup_ids[i] has missed updates
     size_t size;
     int word_count;
     int char_count;
@@ -145,7 +171,7 @@ typedef struct {
     int sock;        // Command socket (port 8080)
     int hb_sock;     // ADD THIS: Heartbeat socket (port 8082)
     int active;
-    time_t last_heartbeat;
+    long long last_heartbeat_ms;
     char files[MAX_FILES][MAX_FILENAME];
     int file_count;
 } StorageServerInfo;
@@ -175,6 +201,8 @@ typedef struct {
     int nm_port;         // ADD THIS: For SS registration
     AccessType access;
     char target_user[MAX_USERNAME];
+    char lease[MAX_LEASE];   // Route lease from the NM, presented to the SS
+    unsigned long long trace_id;   // Sampled request this belongs to, 0 if none (trace.h)
 } Message;
 
 // Sentence Lock
@@ -231,12 +259,40 @@ typedef struct {
 // Function declarations
 void init_message(Message *msg);
 int send_message(int sock, Message *msg);
+// Called after each message send_message puts on the wire, with the frame
+// size; servers account their replies with it (stats.c). NULL by default.
+extern void (*send_message_hook)(const Message *msg, int frame_bytes);
 int recv_message(int sock, Message *msg);
 void serialize_message(Message *msg, char *buffer);
 void deserialize_message(char *buffer, Message *msg);
 char* get_timestamp();
 void trim_whitespace(char *str);
 int set_socket_timeouts(int sock, int send_timeout_sec, int recv_timeout_sec); // Added definition - N
+int get_env_int(const char *name, int default_value);
+
+// Name server for the `attempt`-th (re)connection: `primary_ip`, alternating
+// with NM_STANDBY_IP when that is set
+const char* nm_failover_ip(const char *primary_ip, int attempt);
+
+// Pause in ms after the `attempt`-th failed (re)connection: base_ms doubled
+// per attempt up to cap_ms, then a random point in its upper half, so the
+// servers and clients that lost a name server together do not all come back
+// at the same moment
+int nm_retry_delay_ms(int attempt, int base_ms, int cap_ms);
+
+// Port of name server shard `shard` for one of the NM_*_PORT bases
+int nm_shard_port(int base_port, int shard);
+
+// Shard owning a file name or folder path
+int shard_of_key(const char *key, int shards);
+
+// "MSG_READ" and so on; "MSG_UNKNOWN" for anything out of range
+const char* message_type_name(int type);
+
+// Shard a client request goes to: the one owning its file (or folder, for
+// folder commands, or access request, for approve/deny). Listings that span
+// every shard go to shard 0, which gathers them from the others.
+int shard_for_message(const Message *msg, int shards);
 
 
 #endif // COMMON_H
@@ -0,0 +1,1091 @@
+#include "docs.h"
+#include "lease.h"
+#include "logger.h"
+#include "trace.h"
+#include <errno.h>
+#include <netinet/tcp.h>
+
+// A name server request waiting for its reply
+typedef struct PendingCall {
+    Message request;             // Kept to send again after a reconnect
+    long long sent_us;           // Traced calls only
+    int sent;                    // Went out whole; the NM may have carried it out
+    DocsCallback done;
+    void *arg;
+    struct PendingCall *next;
+} PendingCall;
+
+// The connection to one name server shard. Requests are sent as they are
+// submitted, in queue order, and the reader thread matches each reply to
+// the oldest pending call.
+typedef struct {
+    DocsClient *client;
+    int shard;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    int sock;                    // -1 while disconnected
+    pthread_mutex_t mutex;       // Sending and the pending queue
+    pthread_cond_t cond;
+    PendingCall *head;
+    PendingCall *tail;
+    pthread_t reader;
+} NmLink;
+
+typedef enum { JOB_READ, JOB_UNDO, JOB_STREAM, JOB_WRITE } JobType;
+
+// A storage server operation waiting for a worker
+typedef struct FileJob {
+    JobType type;
+    char filename[MAX_FILENAME];
+    int sentence;
+    DocsEdit *edits;             // JOB_WRITE; the job owns the copies
+    int edit_count;
+    DocsTokenFn token;           // JOB_STREAM
+    void *token_arg;
+    DocsCallback done;
+    void *arg;
+    unsigned long long trace_id;
+    long long queued_us;         // Traced jobs only
+    struct FileJob *next;
+} FileJob;
+
+// A route the NM handed out, reused until its lease runs out
+typedef struct {
+    char filename[MAX_FILENAME];
+    AccessType access;
+    char address[INET_ADDRSTRLEN + 8];
+    char lease[MAX_LEASE];
+    long long expires_ms;
+} CachedRoute;
+
+// An idle SS connection, kept so the next operation there skips the handshake
+typedef struct {
+    char address[INET_ADDRSTRLEN + 8];
+    int sock;                    // -1 if the slot is free
+    long long idle_since_ms;
+} IdleConnection;
+
+struct DocsClient {
+    char username[MAX_USERNAME];
+    volatile int accepting;      // New SS operations are taken
+    volatile int running;        // The NM links are up
+
+    int shard_count;
+    NmLink links[MAX_NM_SHARDS];
+
+    pthread_mutex_t jobs_mutex;
+    pthread_cond_t jobs_cond;
+    FileJob *jobs_head;
+    FileJob *jobs_tail;
+    pthread_t workers[DOCS_MAX_WORKERS];
+    int worker_count;
+
+    pthread_mutex_t routes_mutex;
+    CachedRoute routes[DOCS_ROUTE_CACHE];
+    int route_next;              // Replaced round robin
+
+    pthread_mutex_t pool_mutex;
+    IdleConnection pool[DOCS_SS_POOL_MAX];
+    int pool_size;
+    int idle_ms;
+};
+
+struct DocsFuture {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    Message result;
+};
+
+struct DocsWriteSession {
+    DocsClient *client;
+    char filename[MAX_FILENAME];
+    int sentence;
+    int sock;                    // -1 once the SS is lost for good
+    unsigned long long trace_id;
+    long long opened_us;         // Traced sessions only
+};
+
+// ---------------------------------------------------------------------------
+// Name server connections
+// ---------------------------------------------------------------------------
+
+// Connect to `link`'s shard at `ip` and register, setting `sock`; returns
+// 0, -1 if it cannot be reached, or the status it refused the registration
+// with. `reply` (if given) receives the registration reply's data.
+static int open_nm_session(NmLink *link, const char *ip, char *reply, int *nm_sock) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in nm_addr;
+    memset(&nm_addr, 0, sizeof(nm_addr));
+    nm_addr.sin_family = AF_INET;
+    nm_addr.sin_port = htons(link->port);
+    inet_pton(AF_INET, ip, &nm_addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    // Pipelined requests are small writes made before the last reply
+    // arrived; Nagle would hold each one back for an ACK
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    Message msg;
+    init_message(&msg);
+    msg.type = MSG_REG_CLIENT;
+    strcpy(msg.sender, link->client->username);
+    struct sockaddr_in local_addr;
+    socklen_t addr_len = sizeof(local_addr);
+    if (getsockname(sock, (struct sockaddr*)&local_addr, &addr_len) == 0) {
+        inet_ntop(AF_INET, &local_addr.sin_addr, msg.data, INET_ADDRSTRLEN);
+    } else {
+        strcpy(msg.data, "127.0.0.1");
+    }
+
+    Message response;
+    if (send_message(sock, &msg) < 0 || recv_message(sock, &response) < 0) {
+        close(sock);
+        return -1;
+    }
+    if (response.status != SUCCESS) {
+        log_formatted(LOG_ERROR, "Registration failed: %s", response.data);
+        close(sock);
+        return response.status;
+    }
+
+    if (reply) strcpy(reply, response.data);
+    *nm_sock = sock;
+    log_formatted(LOG_INFO, "Connected to NM at %s:%d", ip, link->port);
+    return 0;
+}
+
+// Whether the NM may see `type` twice: it only looks things up, so the
+// second answer is as good as the first
+static int nm_request_idempotent(MessageType type) {
+    switch (type) {
+        case MSG_READ:
+        case MSG_WRITE:
+        case MSG_STREAM:
+        case MSG_UNDO:
+        case MSG_INFO:
+        case MSG_VIEW:
+        case MSG_LIST:
+        case MSG_VIEWFOLDER:
+        case MSG_VIEWCHECKPOINT:
+        case MSG_LISTCHECKPOINTS:
+        case MSG_VIEWREQUESTS:
+        case MSG_STATS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Unlink from `link` (locked) the calls that went out and must not be sent
+// again, and return them as a list
+static PendingCall* take_unrepeatable(NmLink *link) {
+    PendingCall *taken = NULL;
+    PendingCall **taken_tail = &taken;
+    PendingCall **at = &link->head;
+    link->tail = NULL;
+    while (*at) {
+        PendingCall *call = *at;
+        if (call->sent && !nm_request_idempotent(call->request.type)) {
+            *at = call->next;
+            call->next = NULL;
+            *taken_tail = call;
+            taken_tail = &call->next;
+        } else {
+            link->tail = call;
+            at = &call->next;
+        }
+    }
+    return taken;
+}
+
+// Fail and free every call in the list `calls`, with no lock held
+static void fail_calls(PendingCall *calls) {
+    Message failure;
+    init_message(&failure);
+    failure.status = ERR_SERVER_ERROR;
+    while (calls) {
+        PendingCall *call = calls;
+        calls = call->next;
+        call->done(&failure, call->arg);
+        free(call);
+    }
+}
+
+// Reader thread, called with the link locked: reconnect (trying a standby
+// too) and send the pending calls again, in order. A call the NM may have
+// carried out already, such as a CREATE or MOVE, fails with ERR_SERVER_ERROR
+// instead unless it only looks things up. Gives up after DOCS_NM_RETRIES
+// attempts and returns -1.
+static int reconnect_link(NmLink *link) {
+    DocsClient *client = link->client;
+    log_formatted(LOG_WARNING, "Lost the NM for shard %d; reconnecting", link->shard);
+
+    for (int attempt = 0; attempt < DOCS_NM_RETRIES && client->running; attempt++) {
+        // Submitters keep queueing meanwhile, but send nothing until the
+        // calls already queued have gone out again
+        int sock;
+        PendingCall *unrepeatable = take_unrepeatable(link);
+        pthread_mutex_unlock(&link->mutex);
+        fail_calls(unrepeatable);
+        int result = open_nm_session(link, nm_failover_ip(link->ip, attempt), NULL, &sock);
+        if (result != 0) usleep(nm_retry_delay_ms(attempt, DOCS_NM_RETRY_MS, DOCS_NM_RETRY_MAX_MS) * 1000);
+        pthread_mutex_lock(&link->mutex);
+        if (result != 0) continue;
+
+        link->sock = sock;
+        int sent = 1;
+        for (PendingCall *call = link->head; call && sent; call = call->next) {
+            sent = send_message(link->sock, &call->request) == 0;
+            call->sent = sent;
+        }
+        if (sent) return 0;
+        close(link->sock);
+        link->sock = -1;
+    }
+
+    log_formatted(LOG_ERROR, "Name server for shard %d unreachable", link->shard);
+    return -1;
+}
+
+// Fail every pending call on `link`, which is locked
+static void fail_pending(NmLink *link) {
+    Message failure;
+    init_message(&failure);
+    failure.status = ERR_SERVER_ERROR;
+    while (link->head) {
+        PendingCall *call = link->head;
+        link->head = call->next;
+        if (!link->head) link->tail = NULL;
+        pthread_mutex_unlock(&link->mutex);
+        call->done(&failure, call->arg);
+        free(call);
+        pthread_mutex_lock(&link->mutex);
+    }
+}
+
+static void* nm_reader_main(void *arg) {
+    NmLink *link = arg;
+    DocsClient *client = link->client;
+    Message *reply = malloc(sizeof(Message));
+
+    pthread_mutex_lock(&link->mutex);
+    while (client->running || link->head) {
+        // The NM never speaks first, so only read while a call is pending
+        if (!link->head) {
+            pthread_cond_wait(&link->cond, &link->mutex);
+            continue;
+        }
+        if (link->sock < 0 && (!client->running || reconnect_link(link) < 0)) {
+            fail_pending(link);
+            continue;
+        }
+
+        int sock = link->sock;
+        pthread_mutex_unlock(&link->mutex);
+        int received = recv_message(sock, reply) == 0;
+        pthread_mutex_lock(&link->mutex);
+
+        if (!received) {
+            if (link->sock == sock) {
+                close(sock);
+                link->sock = -1;
+            }
+            continue;
+        }
+
+        PendingCall *call = link->head;
+        link->head = call->next;
+        if (!link->head) link->tail = NULL;
+        pthread_mutex_unlock(&link->mutex);
+        if (call->sent_us) trace_record(call->request.trace_id, "NM request", call->sent_us, trace_now_us());
+        call->done(reply, call->arg);
+        free(call);
+        pthread_mutex_lock(&link->mutex);
+    }
+    pthread_mutex_unlock(&link->mutex);
+
+    free(reply);
+    return NULL;
+}
+
+// Take the shard map from a registration reply ("SHARDS <its shard>
+// <ip:port>,<ip:port>,...") and register with the other shards too
+static void load_shard_map(DocsClient *client, const char *map) {
+    int self;
+    char list[MAX_BUFFER];
+    if (sscanf(map, "SHARDS %d %8191s", &self, list) != 2) return;
+
+    int count = 0;
+    char ips[MAX_NM_SHARDS][INET_ADDRSTRLEN];
+    int ports[MAX_NM_SHARDS];
+    char *save = NULL;
+    for (char *entry = strtok_r(list, ",", &save); entry && count < MAX_NM_SHARDS;
+         entry = strtok_r(NULL, ",", &save)) {
+        if (sscanf(entry, "%15[^:]:%d", ips[count], &ports[count]) != 2) return;
+        count++;
+    }
+    if (self < 0 || self >= count) return;
+
+    int sock = client->links[0].sock;
+    client->shard_count = count;
+    for (int k = 0; k < count; k++) {
+        strcpy(client->links[k].ip, ips[k]);
+        client->links[k].port = ports[k];
+        client->links[k].sock = -1;
+    }
+    client->links[self].sock = sock;
+
+    // A shard that is down now is retried on first use
+    for (int k = 0; k < count; k++) {
+        if (k != self && open_nm_session(&client->links[k], ips[k], NULL, &client->links[k].sock) != 0) {
+            log_formatted(LOG_WARNING, "Name server shard %d at %s:%d is not reachable yet", k, ips[k], ports[k]);
+        }
+    }
+    log_formatted(LOG_INFO, "Namespace split over %d name servers", count);
+}
+
+// Queue and send a name server request. One that starts an operation
+// (`sample`) may be traced; one made on behalf of an operation carries the
+// operation's trace id or none.
+static int submit_call(DocsClient *client, const Message *request, DocsCallback done, void *arg, int sample) {
+    if (!client->running) return -1;
+
+    PendingCall *call = malloc(sizeof(PendingCall));
+    call->request = *request;
+    strcpy(call->request.sender, client->username);
+    if (sample && !call->request.trace_id) call->request.trace_id = trace_sample();
+    call->sent_us = call->request.trace_id ? trace_now_us() : 0;
+    call->done = done;
+    call->arg = arg;
+    call->next = NULL;
+
+    NmLink *link = &client->links[shard_for_message(&call->request, client->shard_count)];
+    pthread_mutex_lock(&link->mutex);
+    if (link->tail) {
+        link->tail->next = call;
+    } else {
+        link->head = call;
+    }
+    link->tail = call;
+
+    // A failed send shows up as a failed read: the reader reconnects and
+    // sends the call again
+    call->sent = 0;
+    if (link->sock >= 0) {
+        call->sent = send_message(link->sock, &call->request) == 0;
+        if (!call->sent) shutdown(link->sock, SHUT_RDWR);
+    }
+    pthread_cond_signal(&link->cond);
+    pthread_mutex_unlock(&link->mutex);
+    return 0;
+}
+
+int docs_submit(DocsClient *client, const Message *request, DocsCallback done, void *arg) {
+    return submit_call(client, request, done, arg, 1);
+}
+
+// ---------------------------------------------------------------------------
+// Futures
+// ---------------------------------------------------------------------------
+
+DocsFuture* docs_future_create() {
+    DocsFuture *future = malloc(sizeof(DocsFuture));
+    pthread_mutex_init(&future->mutex, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    future->done = 0;
+    return future;
+}
+
+void docs_future_complete(const Message *result, void *arg) {
+    DocsFuture *future = arg;
+    pthread_mutex_lock(&future->mutex);
+    future->result = *result;
+    future->done = 1;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
+}
+
+int docs_future_wait(DocsFuture *future, Message *result) {
+    pthread_mutex_lock(&future->mutex);
+    while (!future->done) {
+        pthread_cond_wait(&future->cond, &future->mutex);
+    }
+    if (result) *result = future->result;
+    int status = future->result.status;
+    pthread_mutex_unlock(&future->mutex);
+    return status;
+}
+
+void docs_future_free(DocsFuture *future) {
+    if (!future) return;
+    pthread_mutex_destroy(&future->mutex);
+    pthread_cond_destroy(&future->cond);
+    free(future);
+}
+
+// Wait for an operation `submitted` (0 or -1) completes into `future`
+static int wait_for(int submitted, DocsFuture *future, Message *response) {
+    int status;
+    if (submitted == 0) {
+        status = docs_future_wait(future, response);
+    } else {
+        init_message(response);
+        status = response->status = ERR_SERVER_ERROR;
+    }
+    docs_future_free(future);
+    return status;
+}
+
+int docs_call(DocsClient *client, const Message *request, Message *response) {
+    DocsFuture *future = docs_future_create();
+    return wait_for(docs_submit(client, request, docs_future_complete, future), future, response);
+}
+
+// ---------------------------------------------------------------------------
+// Routes and storage server connections
+// ---------------------------------------------------------------------------
+
+// A live cached route granting `needed`, copied out; returns 0 or -1
+static int find_route(DocsClient *client, const char *filename, AccessType needed, CachedRoute *found) {
+    long long now = lease_now_ms();
+    int result = -1;
+    pthread_mutex_lock(&client->routes_mutex);
+    for (int i = 0; i < DOCS_ROUTE_CACHE; i++) {
+        CachedRoute *route = &client->routes[i];
+        if (route->filename[0] == '\0' || strcmp(route->filename, filename) != 0) continue;
+        if (route->expires_ms - LEASE_CLOCK_SLACK_MS <= now) continue;
+        if (needed == ACCESS_WRITE && route->access != ACCESS_WRITE) continue;
+        *found = *route;
+        result = 0;
+        break;
+    }
+    pthread_mutex_unlock(&client->routes_mutex);
+    return result;
+}
+
+static void forget_route_locked(DocsClient *client, const char *filename) {
+    for (int i = 0; i < DOCS_ROUTE_CACHE; i++) {
+        if (strcmp(client->routes[i].filename, filename) == 0) {
+            client->routes[i].filename[0] = '\0';
+        }
+    }
+}
+
+static void forget_route(DocsClient *client, const char *filename) {
+    pthread_mutex_lock(&client->routes_mutex);
+    forget_route_locked(client, filename);
+    pthread_mutex_unlock(&client->routes_mutex);
+}
+
+static void remember_route(DocsClient *client, const char *filename, const char *address,
+                           const char *lease_text) {
+    RouteLease lease;
+    if (lease_parse(lease_text, &lease) < 0) return;   // NM gives no leases
+
+    pthread_mutex_lock(&client->routes_mutex);
+    forget_route_locked(client, filename);
+    CachedRoute *route = &client->routes[client->route_next];
+    client->route_next = (client->route_next + 1) % DOCS_ROUTE_CACHE;
+    strncpy(route->filename, filename, MAX_FILENAME - 1);
+    route->filename[MAX_FILENAME - 1] = '\0';
+    snprintf(route->address, sizeof(route->address), "%s", address);
+    snprintf(route->lease, sizeof(route->lease), "%s", lease_text);
+    route->access = lease.access;
+    route->expires_ms = lease.expires_ms;
+    pthread_mutex_unlock(&client->routes_mutex);
+}
+
+static int connect_to_ss(const char *address) {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    if (sscanf(address, "%15[^:]:%d", ip, &port) != 2) return -1;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in ss_addr;
+    memset(&ss_addr, 0, sizeof(ss_addr));
+    ss_addr.sin_family = AF_INET;
+    ss_addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &ss_addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    log_formatted(LOG_INFO, "Connected to SS at %s:%d", ip, port);
+    return sock;
+}
+
+// An idle connection is fine if reading it would block: the SS neither
+// closed it nor left an unread reply on it
+static int ss_connection_usable(int sock) {
+    char byte;
+    ssize_t got = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// A connection to the SS at `address`, idle from the pool if there is a
+// healthy one (`reused` set), otherwise new. Returns -1 if it cannot connect.
+static int acquire_ss(DocsClient *client, const char *address, int *reused) {
+    long long now = lease_now_ms();
+    int found = -1;
+    *reused = 0;
+
+    pthread_mutex_lock(&client->pool_mutex);
+    for (int i = 0; i < client->pool_size && found < 0; i++) {
+        IdleConnection *idle = &client->pool[i];
+        if (idle->sock < 0) continue;
+
+        int expired = now - idle->idle_since_ms > client->idle_ms;
+        if (!expired && strcmp(idle->address, address) != 0) continue;
+
+        int sock = idle->sock;
+        idle->sock = -1;
+        if (!expired && ss_connection_usable(sock)) {
+            found = sock;
+        } else {
+            close(sock);
+        }
+    }
+    pthread_mutex_unlock(&client->pool_mutex);
+
+    if (found >= 0) {
+        *reused = 1;
+        return found;
+    }
+    return connect_to_ss(address);
+}
+
+// Done with an SS connection that is still in step with the server: keep
+// it for the next operation, replacing the longest idle one if the pool is
+// full. Connections in any other state must be closed instead.
+static void release_ss(DocsClient *client, int sock) {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    char ip[INET_ADDRSTRLEN];
+    if (client->pool_size == 0 || getpeername(sock, (struct sockaddr*)&peer, &len) < 0 ||
+        !inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip))) {
+        close(sock);
+        return;
+    }
+
+    pthread_mutex_lock(&client->pool_mutex);
+    IdleConnection *slot = &client->pool[0];
+    for (int i = 0; i < client->pool_size; i++) {
+        if (client->pool[i].sock < 0) {
+            slot = &client->pool[i];
+            break;
+        }
+        if (client->pool[i].idle_since_ms < slot->idle_since_ms) slot = &client->pool[i];
+    }
+    if (slot->sock >= 0) close(slot->sock);
+
+    snprintf(slot->address, sizeof(slot->address), "%s:%d", ip, ntohs(peer.sin_port));
+    slot->sock = sock;
+    slot->idle_since_ms = lease_now_ms();
+    pthread_mutex_unlock(&client->pool_mutex);
+}
+
+// One request and its reply on an SS connection; returns 0, -1 if the
+// request could not be sent, or -2 if its reply was lost
+static int ss_round_trip(int ss_sock, Message *request, Message *response) {
+    long long start = request->trace_id ? trace_now_us() : 0;
+    int result = 0;
+    if (send_message(ss_sock, request) < 0) {
+        result = -1;
+    } else if (recv_message(ss_sock, response) < 0) {
+        result = -2;
+    }
+    if (start) trace_record(request->trace_id, "SS request", start, trace_now_us());
+    return result;
+}
+
+// Whether the SS may see `type` twice: sent again, it has the same effect.
+// LOCK_SENTENCE is not: the old connection's teardown would release the
+// lock and cancel the write session the resent LOCK opened.
+static int ss_request_idempotent(MessageType type) {
+    return type == MSG_READ || type == MSG_STREAM;
+}
+
+// Send `request` on a connection to `address` and read the reply. An idle
+// connection the SS has just dropped is replaced by a new one, but once the
+// request went out the SS may have acted on it, so only an idempotent one
+// is sent again. Returns the socket, -1 if the request can be tried
+// elsewhere, or -2 if the SS may have applied it and it must not be.
+static int exchange_with_ss(DocsClient *client, const char *address, Message *request, Message *response) {
+    int reused;
+    int ss_sock = acquire_ss(client, address, &reused);
+    if (ss_sock < 0) return -1;
+    int result = ss_round_trip(ss_sock, request, response);
+    if (result == 0) return ss_sock;
+    close(ss_sock);
+    int idempotent = ss_request_idempotent(request->type);
+    if (result == -2 && !idempotent) return -2;
+    if (!reused) return -1;
+
+    ss_sock = connect_to_ss(address);
+    if (ss_sock < 0) return -1;
+    result = ss_round_trip(ss_sock, request, response);
+    if (result == 0) return ss_sock;
+    close(ss_sock);
+    return result == -2 && !idempotent ? -2 : -1;
+}
+
+// Send `request` to the SS holding its file and read the first reply. The
+// route comes from the cache while its lease lasts, otherwise from the NM as
+// a `route_type` request (READ, WRITE or UNDO). A cached route that has gone
+// stale (SS gone, file moved, lease refused) is dropped and the NM asked
+// again; a fresh lease the SS refuses means it has not got the NM's key yet.
+// A non-idempotent request whose reply was lost is never sent again.
+// Returns the SS socket with the SS's reply in `response`, or -1 with
+// response->status saying why.
+static int open_file_on_ss(DocsClient *client, Message *request, MessageType route_type, Message *response) {
+    AccessType needed = (route_type == MSG_WRITE || route_type == MSG_UNDO) ? ACCESS_WRITE : ACCESS_READ;
+    strcpy(request->sender, client->username);
+
+    for (int attempt = 0; attempt < DOCS_ROUTE_ATTEMPTS; attempt++) {
+        CachedRoute route;
+        int cached = find_route(client, request->filename, needed, &route) == 0;
+        if (cached) {
+            strcpy(request->lease, route.lease);
+        } else {
+            Message msg;
+            init_message(&msg);
+            msg.type = route_type;
+            strcpy(msg.filename, request->filename);
+            msg.trace_id = request->trace_id;
+            DocsFuture *future = docs_future_create();
+            if (wait_for(submit_call(client, &msg, docs_future_complete, future, 0), future, response) != SUCCESS) {
+                return -1;
+            }
+
+            snprintf(route.address, sizeof(route.address), "%s", response->data);
+            strcpy(request->lease, response->lease);
+            remember_route(client, request->filename, route.address, response->lease);
+        }
+
+        int ss_sock = exchange_with_ss(client, route.address, request, response);
+        if (ss_sock >= 0) {
+            int stale = response->status == ERR_LEASE_EXPIRED ||
+                        (cached && (response->status == ERR_FILE_NOT_FOUND || response->status == ERR_FILE_MOVED));
+            if (!stale) return ss_sock;
+            release_ss(client, ss_sock);
+        } else {
+            init_message(response);
+            response->status = ERR_SS_UNAVAILABLE;
+            // Sent but unanswered: the caller gets the error, not a second copy
+            if (ss_sock == -2) return -1;
+        }
+
+        forget_route(client, request->filename);
+        log_formatted(LOG_INFO, "Route to %s for %s went stale (status %d)", route.address,
+                      request->filename, response->status);
+        // Only an uncached route that failed is worth waiting on
+        if (!cached) {
+            if (response->status != ERR_LEASE_EXPIRED) return -1;
+            usleep(DOCS_NM_RETRY_MS * 1000);
+        }
+    }
+    return -1;
+}
+
+// ---------------------------------------------------------------------------
+// Write sessions
+// ---------------------------------------------------------------------------
+
+// Lock the session's sentence on wherever its file is now
+static int lock_sentence(DocsWriteSession *session) {
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_LOCK_SENTENCE;
+    strcpy(msg.filename, session->filename);
+    msg.sentence_index = session->sentence;
+    msg.trace_id = session->trace_id;
+
+    session->sock = open_file_on_ss(session->client, &msg, MSG_WRITE, &response);
+    if (session->sock >= 0 && response.status != SUCCESS) {
+        release_ss(session->client, session->sock);
+        session->sock = -1;
+    }
+    return response.status;
+}
+
+static int open_write_session(DocsClient *client, const char *filename, int sentence,
+                              unsigned long long trace_id, DocsWriteSession **session) {
+    DocsWriteSession *opened = malloc(sizeof(DocsWriteSession));
+    opened->client = client;
+    strncpy(opened->filename, filename, MAX_FILENAME - 1);
+    opened->filename[MAX_FILENAME - 1] = '\0';
+    opened->sentence = sentence;
+    opened->trace_id = trace_id;
+    opened->opened_us = trace_id ? trace_now_us() : 0;
+
+    int status = lock_sentence(opened);
+    if (status != SUCCESS) {
+        free(opened);
+        opened = NULL;
+    }
+    *session = opened;
+    return status;
+}
+
+int docs_write_open(DocsClient *client, const char *filename, int sentence, DocsWriteSession **session) {
+    return open_write_session(client, filename, sentence, trace_sample(), session);
+}
+
+int docs_write_word(DocsWriteSession *session, int word_index, const char *content) {
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_WRITE;
+    strcpy(msg.filename, session->filename);
+    strcpy(msg.sender, session->client->username);
+    msg.sentence_index = session->sentence;
+    msg.word_index = word_index;
+    strncpy(msg.data, content, MAX_BUFFER - 1);
+    msg.trace_id = session->trace_id;
+
+    for (int retry = 0; retry <= DOCS_WRITE_RETRIES; retry++) {
+        if (session->sock >= 0 && ss_round_trip(session->sock, &msg, &response) == 0) {
+            return response.status;
+        }
+        if (retry == DOCS_WRITE_RETRIES) break;
+
+        // Lost the SS: lock the sentence again wherever the NM routes it now
+        if (session->sock >= 0) close(session->sock);
+        session->sock = -1;
+        log_formatted(LOG_WARNING, "Write session on %s lost its SS; reconnecting (attempt %d/%d)",
+                      session->filename, retry + 1, DOCS_WRITE_RETRIES);
+        forget_route(session->client, session->filename);
+        if (lock_sentence(session) != SUCCESS) sleep(1);
+    }
+
+    if (session->sock >= 0) close(session->sock);
+    session->sock = -1;
+    return ERR_SS_UNAVAILABLE;
+}
+
+int docs_write_close(DocsWriteSession *session, int commit) {
+    int status = ERR_SS_UNAVAILABLE;
+    if (session->sock >= 0) {
+        Message msg, response;
+        init_message(&msg);
+        msg.type = commit ? MSG_UNLOCK_SENTENCE : MSG_CANCEL_WRITE;
+        strcpy(msg.filename, session->filename);
+        strcpy(msg.sender, session->client->username);
+        msg.sentence_index = session->sentence;
+        msg.trace_id = session->trace_id;
+
+        if (ss_round_trip(session->sock, &msg, &response) == 0) {
+            status = response.status;
+            release_ss(session->client, session->sock);
+        } else {
+            close(session->sock);
+        }
+    }
+    if (session->opened_us) trace_record(session->trace_id, "write session", session->opened_us, trace_now_us());
+    free(session);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Storage server operations
+// ---------------------------------------------------------------------------
+
+// READ or UNDO: one exchange with the file's SS
+static void run_simple_job(DocsClient *client, FileJob *job, Message *result) {
+    Message request;
+    init_message(&request);
+    request.type = job->type == JOB_READ ? MSG_READ : MSG_UNDO;
+    strcpy(request.filename, job->filename);
+    request.trace_id = job->trace_id;
+
+    int ss_sock = open_file_on_ss(client, &request, request.type, result);
+    if (ss_sock >= 0) release_ss(client, ss_sock);
+}
+
+static void run_stream_job(DocsClient *client, FileJob *job, Message *result) {
+    Message request;
+    init_message(&request);
+    request.type = MSG_STREAM;
+    strcpy(request.filename, job->filename);
+    request.trace_id = job->trace_id;
+
+    // The SS acknowledges the request before the first word
+    int ss_sock = open_file_on_ss(client, &request, MSG_READ, result);
+    if (ss_sock < 0) return;
+    if (result->status != SUCCESS) {
+        release_ss(client, ss_sock);
+        return;
+    }
+
+    Message *word = malloc(sizeof(Message));
+    while (1) {
+        if (recv_message(ss_sock, word) < 0) {
+            result->status = ERR_SS_UNAVAILABLE;
+            close(ss_sock);
+            break;
+        }
+        if (word->type == MSG_STOP) {
+            release_ss(client, ss_sock);
+            break;
+        }
+        if (word->type == MSG_DATA && job->token) {
+            job->token(word->data, word->status == 1, job->token_arg);
+        }
+    }
+    free(word);
+}
+
+// A whole write session; the result is the first failure, or SUCCESS with
+// the number of words written
+static void run_write_job(DocsClient *client, FileJob *job, Message *result) {
+    DocsWriteSession *session;
+    init_message(result);
+    result->status = open_write_session(client, job->filename, job->sentence, job->trace_id, &session);
+    if (result->status != SUCCESS) return;
+
+    int written = 0;
+    int status = SUCCESS;
+    for (int i = 0; i < job->edit_count && status == SUCCESS; i++) {
+        status = docs_write_word(session, job->edits[i].word_index, job->edits[i].content);
+        if (status == SUCCESS) written++;
+    }
+
+    // Keep what was written, as the interactive client does
+    int closed = docs_write_close(session, written > 0);
+    result->status = status != SUCCESS ? status : closed;
+    snprintf(result->data, sizeof(result->data), "%d", written);
+}
+
+static void free_job(FileJob *job) {
+    for (int i = 0; i < job->edit_count; i++) {
+        free((char*)job->edits[i].content);
+    }
+    free(job->edits);
+    free(job);
+}
+
+static void* worker_main(void *arg) {
+    DocsClient *client = arg;
+    Message *result = malloc(sizeof(Message));
+
+    while (1) {
+        pthread_mutex_lock(&client->jobs_mutex);
+        while (!client->jobs_head && client->accepting) {
+            pthread_cond_wait(&client->jobs_cond, &client->jobs_mutex);
+        }
+        FileJob *job = client->jobs_head;
+        if (!job) {
+            pthread_mutex_unlock(&client->jobs_mutex);
+            break;
+        }
+        client->jobs_head = job->next;
+        if (!client->jobs_head) client->jobs_tail = NULL;
+        pthread_mutex_unlock(&client->jobs_mutex);
+
+        static const char *job_names[] = { "read", "undo", "stream", "write" };
+        long long started_us = job->trace_id ? trace_now_us() : 0;
+        if (started_us) trace_record(job->trace_id, "client queue", job->queued_us, started_us);
+
+        init_message(result);
+        switch (job->type) {
+            case JOB_READ:
+            case JOB_UNDO:
+                run_simple_job(client, job, result);
+                break;
+            case JOB_STREAM:
+                run_stream_job(client, job, result);
+                break;
+            case JOB_WRITE:
+                run_write_job(client, job, result);
+                break;
+        }
+        if (started_us) trace_record(job->trace_id, job_names[job->type], started_us, trace_now_us());
+        job->done(result, job->arg);
+        free_job(job);
+    }
+
+    free(result);
+    return NULL;
+}
+
+static int queue_job(DocsClient *client, FileJob *job) {
+    pthread_mutex_lock(&client->jobs_mutex);
+    if (!client->accepting) {
+        pthread_mutex_unlock(&client->jobs_mutex);
+        free_job(job);
+        return -1;
+    }
+    if (client->jobs_tail) {
+        client->jobs_tail->next = job;
+    } else {
+        client->jobs_head = job;
+    }
+    client->jobs_tail = job;
+    pthread_cond_signal(&client->jobs_cond);
+    pthread_mutex_unlock(&client->jobs_mutex);
+    return 0;
+}
+
+static FileJob* new_job(JobType type, const char *filename, DocsCallback done, void *arg) {
+    FileJob *job = calloc(1, sizeof(FileJob));
+    job->type = type;
+    strncpy(job->filename, filename, MAX_FILENAME - 1);
+    job->done = done;
+    job->arg = arg;
+    job->trace_id = trace_sample();
+    job->queued_us = job->trace_id ? trace_now_us() : 0;
+    return job;
+}
+
+int docs_read_async(DocsClient *client, const char *filename, DocsCallback done, void *arg) {
+    return queue_job(client, new_job(JOB_READ, filename, done, arg));
+}
+
+int docs_undo_async(DocsClient *client, const char *filename, DocsCallback done, void *arg) {
+    return queue_job(client, new_job(JOB_UNDO, filename, done, arg));
+}
+
+int docs_stream_async(DocsClient *client, const char *filename, DocsTokenFn token,
+                      DocsCallback done, void *arg) {
+    FileJob *job = new_job(JOB_STREAM, filename, done, arg);
+    job->token = token;
+    job->token_arg = arg;
+    return queue_job(client, job);
+}
+
+int docs_write_async(DocsClient *client, const char *filename, int sentence,
+                     const DocsEdit *edits, int edit_count, DocsCallback done, void *arg) {
+    FileJob *job = new_job(JOB_WRITE, filename, done, arg);
+    job->sentence = sentence;
+    job->edits = calloc(edit_count > 0 ? edit_count : 1, sizeof(DocsEdit));
+    for (int i = 0; i < edit_count; i++) {
+        job->edits[i].word_index = edits[i].word_index;
+        job->edits[i].content = strdup(edits[i].content);
+    }
+    job->edit_count = edit_count;
+    return queue_job(client, job);
+}
+
+int docs_read(DocsClient *client, const char *filename, Message *response) {
+    DocsFuture *future = docs_future_create();
+    return wait_for(docs_read_async(client, filename, docs_future_complete, future), future, response);
+}
+
+int docs_undo(DocsClient *client, const char *filename, Message *response) {
+    DocsFuture *future = docs_future_create();
+    return wait_for(docs_undo_async(client, filename, docs_future_complete, future), future, response);
+}
+
+int docs_stream(DocsClient *client, const char *filename, DocsTokenFn token, void *arg) {
+    DocsFuture *future = docs_future_create();
+    FileJob *job = new_job(JOB_STREAM, filename, docs_future_complete, future);
+    job->token = token;
+    job->token_arg = arg;
+
+    Message response;
+    return wait_for(queue_job(client, job), future, &response);
+}
+
+// ---------------------------------------------------------------------------
+// Client lifetime
+// ---------------------------------------------------------------------------
+
+DocsClient* docs_connect(const char *nm_ip, int nm_port, const char *username, int *status) {
+    DocsClient *client = calloc(1, sizeof(DocsClient));
+    strncpy(client->username, username, MAX_USERNAME - 1);
+    client->accepting = 1;
+    client->running = 1;
+
+    char trace_name[MAX_USERNAME + 16];
+    snprintf(trace_name, sizeof(trace_name), "client %s", username);
+    trace_init(trace_name);
+
+    client->shard_count = 1;
+    for (int k = 0; k < MAX_NM_SHARDS; k++) {
+        NmLink *link = &client->links[k];
+        link->client = client;
+        link->shard = k;
+        link->sock = -1;
+        pthread_mutex_init(&link->mutex, NULL);
+        pthread_cond_init(&link->cond, NULL);
+    }
+    strncpy(client->links[0].ip, nm_ip, INET_ADDRSTRLEN - 1);
+    client->links[0].port = nm_port;
+
+    pthread_mutex_init(&client->jobs_mutex, NULL);
+    pthread_cond_init(&client->jobs_cond, NULL);
+    pthread_mutex_init(&client->routes_mutex, NULL);
+    pthread_mutex_init(&client->pool_mutex, NULL);
+    client->pool_size = get_env_int("CLIENT_SS_POOL", DOCS_SS_POOL);
+    if (client->pool_size < 0) client->pool_size = 0;
+    if (client->pool_size > DOCS_SS_POOL_MAX) client->pool_size = DOCS_SS_POOL_MAX;
+    client->idle_ms = get_env_int("CLIENT_SS_IDLE_MS", DOCS_SS_IDLE_MS);
+    for (int i = 0; i < DOCS_SS_POOL_MAX; i++) {
+        client->pool[i].sock = -1;
+    }
+
+    char reply[MAX_BUFFER] = "";
+    int result = open_nm_session(&client->links[0], nm_ip, reply, &client->links[0].sock);
+    if (result != 0) {
+        *status = result < 0 ? ERR_SERVER_ERROR : result;
+        free(client);
+        return NULL;
+    }
+    load_shard_map(client, reply);
+
+    for (int k = 0; k < client->shard_count; k++) {
+        pthread_create(&client->links[k].reader, NULL, nm_reader_main, &client->links[k]);
+    }
+    int workers = get_env_int("DOCS_WORKERS", DOCS_WORKERS);
+    if (workers < 1) workers = 1;
+    if (workers > DOCS_MAX_WORKERS) workers = DOCS_MAX_WORKERS;
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&client->workers[i], NULL, worker_main, client);
+    }
+    client->worker_count = workers;
+
+    *status = SUCCESS;
+    return client;
+}
+
+int docs_shard_count(DocsClient *client) {
+    return client->shard_count;
+}
+
+void docs_close(DocsClient *client) {
+    if (!client) return;
+
+    // Workers drain the queue first; their routing still needs the NM links
+    pthread_mutex_lock(&client->jobs_mutex);
+    client->accepting = 0;
+    pthread_cond_broadcast(&client->jobs_cond);
+    pthread_mutex_unlock(&client->jobs_mutex);
+    for (int i = 0; i < client->worker_count; i++) {
+        pthread_join(client->workers[i], NULL);
+    }
+
+    // Readers finish the calls already sent, then exit
+    for (int k = 0; k < client->shard_count; k++) {
+        NmLink *link = &client->links[k];
+        pthread_mutex_lock(&link->mutex);
+        client->running = 0;
+        pthread_cond_broadcast(&link->cond);
+        pthread_mutex_unlock(&link->mutex);
+        pthread_join(link->reader, NULL);
+        if (link->sock >= 0) close(link->sock);
+    }
+
+    for (int i = 0; i < DOCS_SS_POOL_MAX; i++) {
+        if (client->pool[i].sock >= 0) close(client->pool[i].sock);
+    }
+    free(client);
+}
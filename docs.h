@@ -0,0 +1,94 @@
+#ifndef DOCS_H
+#define DOCS_H
+
+#include "common.h"
+
+// libdocs: the client side of the protocol as a library, for the
+// interactive client and for services that talk to the system directly.
+//
+// Operations are submitted and complete later through a callback, or
+// through a future for callers that want to wait. Name server requests go
+// out as soon as they are submitted and are pipelined on one connection
+// per name server shard; the NM answers a connection's requests in order.
+// Operations on a file's storage server (READ, UNDO, STREAM, whole WRITE
+// sessions) run on a small pool of worker threads, reuse routes while their
+// lease lasts and reuse idle SS connections.
+//
+// Callbacks run on the library's threads. They must not wait for another
+// libdocs operation to complete; submitting one is fine.
+
+#define DOCS_WORKERS 4              // Threads running SS operations (DOCS_WORKERS)
+#define DOCS_MAX_WORKERS 64
+#define DOCS_NM_RETRIES 20          // Attempts to reach a name server again (about 25 s in all)
+#define DOCS_NM_RETRY_MS 200        // First pause between them, doubling up to DOCS_NM_RETRY_MAX_MS
+#define DOCS_NM_RETRY_MAX_MS 2000
+#define DOCS_ROUTE_CACHE 64         // Routes kept while their lease lasts
+#define DOCS_ROUTE_ATTEMPTS 5       // Tries to reach a file's SS before giving up
+#define DOCS_SS_POOL 8              // Idle SS connections kept for reuse (CLIENT_SS_POOL)
+#define DOCS_SS_POOL_MAX 64
+#define DOCS_SS_IDLE_MS 30000       // Idle connections older than this are closed (CLIENT_SS_IDLE_MS)
+#define DOCS_WRITE_RETRIES 5        // Reconnects a write session tries when its SS goes away
+
+typedef struct DocsClient DocsClient;
+typedef struct DocsFuture DocsFuture;
+typedef struct DocsWriteSession DocsWriteSession;
+
+// An operation finished; `result` (status, and data where the operation
+// returns any) is only valid during the call
+typedef void (*DocsCallback)(const Message *result, void *arg);
+
+// One streamed word; `space` is set if a space follows it
+typedef void (*DocsTokenFn)(const char *word, int space, void *arg);
+
+typedef struct {
+    int word_index;
+    const char *content;
+} DocsEdit;
+
+// Register as `username` with the name server at `nm_ip`:`nm_port`, and
+// with every other shard it names. Returns NULL with `status` set to
+// ERR_SERVER_ERROR if the NM cannot be reached, or to its refusal.
+DocsClient* docs_connect(const char *nm_ip, int nm_port, const char *username, int *status);
+
+// Finish the outstanding operations, then disconnect and free the client
+void docs_close(DocsClient *client);
+
+int docs_shard_count(DocsClient *client);
+
+// Send a name server request (the sender is filled in). Returns 0, or -1 if
+// the client is closing.
+int docs_submit(DocsClient *client, const Message *request, DocsCallback done, void *arg);
+
+// Storage server operations. STREAM calls `token` for every word before
+// `done`; WRITE locks the sentence, applies `edits` in order and commits
+// (the edits are copied). Each returns 0, or -1 if the client is closing.
+int docs_read_async(DocsClient *client, const char *filename, DocsCallback done, void *arg);
+int docs_undo_async(DocsClient *client, const char *filename, DocsCallback done, void *arg);
+int docs_stream_async(DocsClient *client, const char *filename, DocsTokenFn token,
+                      DocsCallback done, void *arg);
+int docs_write_async(DocsClient *client, const char *filename, int sentence,
+                     const DocsEdit *edits, int edit_count, DocsCallback done, void *arg);
+
+// A future is completed by passing docs_future_complete as the callback and
+// the future as its argument
+DocsFuture* docs_future_create();
+void docs_future_complete(const Message *result, void *future);
+int docs_future_wait(DocsFuture *future, Message *result);     // Returns the status
+void docs_future_free(DocsFuture *future);
+
+// Blocking forms of the above; each returns the status, with the reply in
+// `response`
+int docs_call(DocsClient *client, const Message *request, Message *response);
+int docs_read(DocsClient *client, const char *filename, Message *response);
+int docs_undo(DocsClient *client, const char *filename, Message *response);
+int docs_stream(DocsClient *client, const char *filename, DocsTokenFn token, void *arg);
+
+// An interactive write session on the calling thread: lock a sentence,
+// write words one at a time, then commit (UNLOCK) or abandon it (CANCEL).
+// A session whose SS goes away locks the sentence again wherever the NM
+// routes it. Close frees the session whatever it returns.
+int docs_write_open(DocsClient *client, const char *filename, int sentence, DocsWriteSession **session);
+int docs_write_word(DocsWriteSession *session, int word_index, const char *content);
+int docs_write_close(DocsWriteSession *session, int commit);
+
+#endif // DOCS_H
@@ -930,4 +930,128 @@ int revert_to_checkpoint(const char *filepath, const char *tag) {
     
     log_formatted(LOG_INFO, "Reverted %s to checkpoint '%s'", filepath, tag);
     return SUCCESS;
-}
\ No newline at end of file
+}
+// Replication deltas carry sentences as raw tokens: words are separated by
+// DELTA_WORD_SEP and sentences by DELTA_SENTENCE_SEP, so space and newline
+// tokens reach the backup exactly as the primary holds them
+#define DELTA_WORD_SEP '\x1f'
+#define DELTA_SENTENCE_SEP '\x1e'
+
+int encode_sentences(Sentence *sentences, int count, char *buffer, int buffer_size) {
+    int pos = 0;
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            if (pos + 1 >= buffer_size) return -1;
+            buffer[pos++] = DELTA_SENTENCE_SEP;
+        }
+        for (int j = 0; j < sentences[i].word_count; j++) {
+            int len = strlen(sentences[i].words[j]);
+            if (pos + len + 1 >= buffer_size) return -1;
+            if (j > 0) buffer[pos++] = DELTA_WORD_SEP;
+            memcpy(buffer + pos, sentences[i].words[j], len);
+            pos += len;
+        }
+    }
+    buffer[pos] = '\0';
+    return pos;
+}
+
+int apply_sentence_delta(FileContent *fc, int start, int replaced, const char *encoded, int count) {
+    if (start < 0 || replaced < 0 || count < 0 || start + replaced > fc->sentence_count) {
+        return -1;
+    }
+
+    Sentence *decoded = malloc(sizeof(Sentence) * (count > 0 ? count : 1));
+    int decoded_count = 0;
+    const char *p = encoded;
+
+    while (decoded_count < count) {
+        Sentence *sent = &decoded[decoded_count++];
+        sent->capacity = 10;
+        sent->word_count = 0;
+        sent->words = malloc(sizeof(char*) * sent->capacity);
+
+        // Tokens are never empty, so an empty segment is a sentence without words
+        while (*p && *p != DELTA_SENTENCE_SEP) {
+            const char *end = p;
+            while (*end && *end != DELTA_WORD_SEP && *end != DELTA_SENTENCE_SEP) end++;
+
+            if (sent->word_count >= sent->capacity) {
+                sent->capacity *= 2;
+                sent->words = realloc(sent->words, sizeof(char*) * sent->capacity);
+            }
+            sent->words[sent->word_count++] = strndup(p, end - p);
+
+            p = (*end == DELTA_WORD_SEP) ? end + 1 : end;
+        }
+        if (*p == DELTA_SENTENCE_SEP) {
+            p++;
+        } else {
+            break;
+        }
+    }
+
+    if (decoded_count != count || *p != '\0') {
+        for (int i = 0; i < decoded_count; i++) {
+            for (int j = 0; j < decoded[i].word_count; j++) {
+                free(decoded[i].words[j]);
+            }
+            free(decoded[i].words);
+        }
+        free(decoded);
+        return -1;
+    }
+
+    int new_total = fc->sentence_count - replaced + count;
+    Sentence *merged = malloc(sizeof(Sentence) * (new_total > 0 ? new_total : 1));
+    int idx = 0;
+
+    for (int i = 0; i < start; i++) {
+        merged[idx++] = fc->sentences[i];
+    }
+    for (int i = 0; i < count; i++) {
+        merged[idx++] = decoded[i];
+    }
+    for (int i = start + replaced; i < fc->sentence_count; i++) {
+        merged[idx++] = fc->sentences[i];
+    }
+
+    for (int i = start; i < start + replaced; i++) {
+        for (int j = 0; j < fc->sentences[i].word_count; j++) {
+            free(fc->sentences[i].words[j]);
+        }
+        free(fc->sentences[i].words);
+    }
+
+    free(decoded);
+    free(fc->sentences);
+    fc->sentences = merged;
+    fc->sentence_count = new_total;
+    fc->capacity = new_total > 0 ? new_total : 1;
+    return 0;
+}
+
+unsigned long long checksum_update(unsigned long long hash, const char *data, size_t len) {
+    // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+unsigned long long file_checksum(const char *filepath) {
+    // A missing file hashes like an empty one
+    unsigned long long hash = CHECKSUM_INIT;
+    FILE *file = fopen(filepath, "r");
+    if (!file) return hash;
+
+    char buffer[MAX_BUFFER];
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        hash = checksum_update(hash, buffer, bytes);
+    }
+
+    fclose(file);
+    return hash;
+}
@@ -61,4 +61,16 @@ int list_checkpoints(const char *filepath, char *buffer, int buffer_size);
 int view_checkpoint(const char *filepath, const char *tag, char *buffer, int buffer_size);
 int revert_to_checkpoint(const char *filepath, const char *tag);
 
+// Replication deltas
+// Encode sentences for shipping; returns the length, or -1 if they don't fit
+int encode_sentences(Sentence *sentences, int count, char *buffer, int buffer_size);
+
+// Replace sentences [start, start + replaced) with `count` encoded sentences
+int apply_sentence_delta(FileContent *fc, int start, int replaced, const char *encoded, int count);
+
+// Content hash used to check that a backup matches a delta's base
+#define CHECKSUM_INIT 1469598103934665603ULL
+unsigned long long checksum_update(unsigned long long hash, const char *data, size_t len);
+unsigned long long file_checksum(const char *filepath);
+
 #endif // FILE_OPS_H
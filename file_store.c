@@ -0,0 +1,257 @@
+#include "file_store.h"
+
+// FNV-1a, then a final mix so the shard does not line up with the cache's
+// slot hash or with which name server shard the file belongs to
+unsigned int store_hash(const char *key) {
+    unsigned int hash = 2166136261u;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// "<folder>|<file>": '|' never appears in a name (it separates message
+// fields), so a folder's own files share the prefix "<folder>|" and files in
+// its subfolders do not
+void folder_key(char *key, size_t size, const char *folder, const char *filename) {
+    snprintf(key, size, "%s|%s", folder, filename);
+}
+
+FileStore* init_file_store(int shards, int cache_capacity) {
+    if (shards < 1) shards = 1;
+    if (shards > FILE_STORE_MAX_SHARDS) shards = FILE_STORE_MAX_SHARDS;
+
+    FileStore *store = malloc(sizeof(FileStore));
+    store->shard_count = shards;
+    store->shards = calloc(shards, sizeof(FileShard));
+    for (int i = 0; i < shards; i++) {
+        store->shards[i].trie = init_trie();
+        store->shards[i].cache = init_cache(cache_capacity);
+        store->shards[i].by_folder = init_name_index();
+        pthread_mutex_init(&store->shards[i].write_lock, NULL);
+        atomic_init(&store->shards[i].generation, 0);
+    }
+    return store;
+}
+
+void free_file_store(FileStore *store) {
+    if (!store) return;
+
+    for (int i = 0; i < store->shard_count; i++) {
+        free_trie(store->shards[i].trie);
+        free_cache(store->shards[i].cache);
+        free_name_index(store->shards[i].by_folder);
+        pthread_mutex_destroy(&store->shards[i].write_lock);
+    }
+    free(store->shards);
+    free(store);
+}
+
+int file_store_shard(FileStore *store, const char *filename) {
+    return (int)(store_hash(filename) % (unsigned int)store->shard_count);
+}
+
+// Keep the folder index in step with a file whose folder went from `old`
+// (NULL if new) to `folder` (NULL if deleted). Caller holds the write lock.
+void reindex_file(FileShard *shard, const char *filename, const FileMetadata *old, const char *folder) {
+    char key[NAME_INDEX_MAX_KEY + 2];
+    if (old && folder && strcmp(old->folder_path, folder) == 0) return;
+    if (old) {
+        folder_key(key, sizeof(key), old->folder_path, filename);
+        name_index_remove(shard->by_folder, key);
+    }
+    if (folder) {
+        folder_key(key, sizeof(key), folder, filename);
+        name_index_insert(shard->by_folder, key);
+    }
+}
+
+int file_store_insert(FileStore *store, const char *filename, FileMetadata *meta) {
+    FileShard *shard = &store->shards[file_store_shard(store, filename)];
+    pthread_mutex_lock(&shard->write_lock);
+
+    FileMetadata *old = trie_search(shard->trie, filename);
+    int result = trie_insert(shard->trie, filename, meta);
+    atomic_fetch_add_explicit(&shard->generation, 1, memory_order_release);
+    if (result == 0) {
+        cache_put(shard->cache, filename, meta);
+        reindex_file(shard, filename, old, meta->folder_path);
+    }
+
+    pthread_mutex_unlock(&shard->write_lock);
+    free(old);
+    return result;
+}
+
+int file_store_update(FileStore *store, const char *filename, FileMetadata *meta) {
+    FileShard *shard = &store->shards[file_store_shard(store, filename)];
+    pthread_mutex_lock(&shard->write_lock);
+
+    FileMetadata *old = trie_search(shard->trie, filename);
+    int result = old ? trie_update(shard->trie, filename, meta) : -1;
+    atomic_fetch_add_explicit(&shard->generation, 1, memory_order_release);
+    if (result == 0) {
+        cache_put(shard->cache, filename, meta);
+        reindex_file(shard, filename, old, meta->folder_path);
+    }
+
+    pthread_mutex_unlock(&shard->write_lock);
+    free(old);
+    return result;
+}
+
+int file_store_delete(FileStore *store, const char *filename) {
+    FileShard *shard = &store->shards[file_store_shard(store, filename)];
+    pthread_mutex_lock(&shard->write_lock);
+
+    FileMetadata *old = trie_search(shard->trie, filename);
+    trie_delete(shard->trie, filename);
+    atomic_fetch_add_explicit(&shard->generation, 1, memory_order_release);
+    cache_remove(shard->cache, filename);
+    if (old) reindex_file(shard, filename, old, NULL);
+
+    pthread_mutex_unlock(&shard->write_lock);
+    free(old);
+    return 0;
+}
+
+int file_store_touch(FileStore *store, const char *filename, time_t accessed, const char *username) {
+    FileShard *shard = &store->shards[file_store_shard(store, filename)];
+    pthread_mutex_lock(&shard->write_lock);
+
+    int result = trie_touch(shard->trie, filename, accessed, username);
+    atomic_fetch_add_explicit(&shard->generation, 1, memory_order_release);
+    if (result == 0) {
+        cache_touch(shard->cache, filename, accessed, username);
+    }
+
+    pthread_mutex_unlock(&shard->write_lock);
+    return result;
+}
+
+FileMetadata* file_store_get(FileStore *store, const char *filename) {
+    FileShard *shard = &store->shards[file_store_shard(store, filename)];
+    FileMetadata *meta = cache_get(shard->cache, filename);
+    if (meta) return meta;
+
+    // Cache it only if no write landed since the trie was read. A writer
+    // holding the lock right now may not have reached the cache yet, so a
+    // busy lock means skip as well.
+    unsigned int seen = atomic_load_explicit(&shard->generation, memory_order_acquire);
+    meta = trie_search(shard->trie, filename);
+    if (meta && pthread_mutex_trylock(&shard->write_lock) == 0) {
+        if (atomic_load_explicit(&shard->generation, memory_order_relaxed) == seen) {
+            cache_put(shard->cache, filename, meta);
+        }
+        pthread_mutex_unlock(&shard->write_lock);
+    }
+    return meta;
+}
+
+int compare_files_by_name(const void *a, const void *b) {
+    const FileMetadata *fa = *(FileMetadata * const *)a;
+    const FileMetadata *fb = *(FileMetadata * const *)b;
+    return strcmp(fa->filename, fb->filename);
+}
+
+int file_store_get_all(FileStore *store, FileMetadata **files, int max_files) {
+    int count = 0;
+    for (int i = 0; i < store->shard_count && count < max_files; i++) {
+        count += trie_get_all_files(store->shards[i].trie, files + count, max_files - count);
+    }
+    qsort(files, count, sizeof(FileMetadata*), compare_files_by_name);
+    return count;
+}
+
+void file_store_for_each(FileStore *store, TrieVisitFn visit, void *ctx) {
+    for (int i = 0; i < store->shard_count; i++) {
+        trie_for_each(store->shards[i].trie, visit, ctx);
+    }
+}
+
+// One shard's part of a folder listing
+typedef struct {
+    char **names;
+    int count;
+    int capacity;
+    int next;            // Merge position
+    size_t prefix_len;
+} FolderRun;
+
+int collect_folder_entry(const char *key, void *ctx) {
+    FolderRun *run = ctx;
+    if (run->count == run->capacity) {
+        run->capacity = run->capacity ? run->capacity * 2 : 16;
+        run->names = realloc(run->names, run->capacity * sizeof(char*));
+    }
+    run->names[run->count++] = strdup(key + run->prefix_len);
+    return 0;
+}
+
+int file_store_list_folder(FileStore *store, const char *folder, NameVisitFn visit, void *ctx) {
+    char prefix[MAX_PATH + 2];
+    snprintf(prefix, sizeof(prefix), "%s|", folder);
+
+    // Each shard's run is already sorted; merge them
+    FolderRun runs[FILE_STORE_MAX_SHARDS];
+    memset(runs, 0, sizeof(runs));
+    for (int i = 0; i < store->shard_count; i++) {
+        runs[i].prefix_len = strlen(prefix);
+        name_index_scan(store->shards[i].by_folder, prefix, collect_folder_entry, &runs[i]);
+    }
+
+    int visited = 0;
+    int stopped = 0;
+    while (!stopped) {
+        FolderRun *best = NULL;
+        for (int i = 0; i < store->shard_count; i++) {
+            FolderRun *run = &runs[i];
+            if (run->next < run->count &&
+                (!best || strcmp(run->names[run->next], best->names[best->next]) < 0)) {
+                best = run;
+            }
+        }
+        if (!best) break;
+        visited++;
+        stopped = visit(best->names[best->next++], ctx);
+    }
+
+    for (int i = 0; i < store->shard_count; i++) {
+        for (int j = 0; j < runs[i].count; j++) {
+            free(runs[i].names[j]);
+        }
+        free(runs[i].names);
+    }
+    return visited;
+}
+
+int file_store_count(FileStore *store) {
+    int count = 0;
+    for (int i = 0; i < store->shard_count; i++) {
+        count += name_index_size(store->shards[i].by_folder);
+    }
+    return count;
+}
+
+void file_store_cache_stats(FileStore *store, long *hits, long *misses) {
+    *hits = *misses = 0;
+    for (int i = 0; i < store->shard_count; i++) {
+        LRUCache *cache = store->shards[i].cache;
+        pthread_mutex_lock(&cache->lock);
+        *hits += cache->hits;
+        *misses += cache->misses;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+void file_store_set_change_hook(FileStore *store, TrieChangeFn fn, void *ctx) {
+    for (int i = 0; i < store->shard_count; i++) {
+        trie_set_change_hook(store->shards[i].trie, fn, ctx);
+    }
+}
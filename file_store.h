@@ -0,0 +1,75 @@
+#ifndef FILE_STORE_H
+#define FILE_STORE_H
+
+#include "common.h"
+#include "trie.h"
+#include "cache.h"
+#include "name_index.h"
+#include <stdatomic.h>
+
+// The name server's file metadata, split into shards by a hash of the file
+// name. Each shard has its own trie, LRU cache and writer lock, so requests
+// for different files rarely wait on each other. Each shard also keeps an
+// ordered index of "<folder>|<file>" keys, so a folder listing is a prefix
+// scan per shard merged in order instead of a copy of every file.
+//
+// Writers on a shard hold its lock across the trie, cache and index updates.
+// A cache miss reads the trie without it and caches what it read only if no
+// writer has been through since, so the cache never holds a stale entry and
+// lookups never wait for writers.
+
+#define FILE_STORE_SHARDS 8         // Default shard count (NM_STORE_SHARDS)
+#define FILE_STORE_MAX_SHARDS 64
+
+typedef struct {
+    Trie *trie;
+    LRUCache *cache;
+    NameIndex *by_folder;
+    pthread_mutex_t write_lock;
+    atomic_uint generation;   // Bumped by every write, under write_lock
+} FileShard;
+
+typedef struct {
+    FileShard *shards;
+    int shard_count;
+} FileStore;
+
+FileStore* init_file_store(int shards, int cache_capacity);
+void free_file_store(FileStore *store);
+
+// Which shard holds `filename`
+int file_store_shard(FileStore *store, const char *filename);
+
+// Insert or replace a file. Returns -1 if the name cannot be stored.
+int file_store_insert(FileStore *store, const char *filename, FileMetadata *meta);
+
+// Replace an existing file's metadata; -1 if there is none
+int file_store_update(FileStore *store, const char *filename, FileMetadata *meta);
+
+int file_store_delete(FileStore *store, const char *filename);
+
+// Move the access time forward; -1 if the file does not exist
+int file_store_touch(FileStore *store, const char *filename, time_t accessed, const char *username);
+
+// Copy of a file's metadata, through the shard's cache; caller frees
+FileMetadata* file_store_get(FileStore *store, const char *filename);
+
+// Copies of every file, sorted by name; caller frees each
+int file_store_get_all(FileStore *store, FileMetadata **files, int max_files);
+
+// Visit every file without copying it out, one shard at a time
+void file_store_for_each(FileStore *store, TrieVisitFn visit, void *ctx);
+
+// Visit the names of the files directly in `folder` ("" for the root), in
+// order. Returns how many were visited.
+int file_store_list_folder(FileStore *store, const char *folder, NameVisitFn visit, void *ctx);
+
+int file_store_count(FileStore *store);
+
+// Cache lookups that found the file, and that went to the trie, over all shards
+void file_store_cache_stats(FileStore *store, long *hits, long *misses);
+
+// Report every later change on any shard to `fn` (see trie_set_change_hook)
+void file_store_set_change_hook(FileStore *store, TrieChangeFn fn, void *ctx);
+
+#endif // FILE_STORE_H
@@ -0,0 +1,139 @@
+#include "lease.h"
+#include <sys/time.h>
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                     \
+    do {                                                             \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                     \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                     \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+static uint64_t load_le64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+uint64_t siphash24(const unsigned char key[LEASE_KEY_BYTES], const void *data, size_t len) {
+    const unsigned char *in = data;
+    uint64_t k0 = load_le64(key);
+    uint64_t k1 = load_le64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t whole = len - (len % 8);
+    for (size_t i = 0; i < whole; i += 8) {
+        uint64_t m = load_le64(in + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Last block: the remaining bytes, with the length in the top byte
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < len % 8; i++) {
+        b |= (uint64_t)in[whole + i] << (8 * i);
+    }
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// The signed text: every field, separated by a byte no name contains
+static uint64_t lease_mac(const unsigned char key[LEASE_KEY_BYTES], const char *user,
+                          const char *filename, const RouteLease *lease) {
+    char text[MAX_USERNAME + MAX_FILENAME + 64];
+    int len = snprintf(text, sizeof(text), "%s\n%s\n%d\n%lld\n%d", user, filename,
+                       lease->ss_id, lease->expires_ms, (int)lease->access);
+    if (len >= (int)sizeof(text)) len = sizeof(text) - 1;
+    return siphash24(key, text, len);
+}
+
+void lease_sign(const unsigned char key[LEASE_KEY_BYTES], const char *user, const char *filename,
+                RouteLease *lease) {
+    lease->mac = lease_mac(key, user, filename, lease);
+}
+
+void lease_format(const RouteLease *lease, char *out, size_t size) {
+    snprintf(out, size, "%d.%lld.%d.%016llx", lease->ss_id, lease->expires_ms,
+             (int)lease->access, (unsigned long long)lease->mac);
+}
+
+int lease_parse(const char *text, RouteLease *lease) {
+    int access;
+    unsigned long long mac;
+    int consumed = 0;
+    if (sscanf(text, "%d.%lld.%d.%16llx%n", &lease->ss_id, &lease->expires_ms, &access, &mac,
+               &consumed) != 4 || text[consumed] != '\0') {
+        return -1;
+    }
+    lease->access = access;
+    lease->mac = mac;
+    return 0;
+}
+
+int lease_verify(const unsigned char key[LEASE_KEY_BYTES], const char *text, const char *user,
+                 const char *filename, int ss_id, AccessType needed, long long now_ms) {
+    RouteLease lease;
+    if (lease_parse(text, &lease) < 0) return ERR_LEASE_EXPIRED;
+    if (lease.ss_id != ss_id || lease.expires_ms <= now_ms) return ERR_LEASE_EXPIRED;
+    if ((lease.access == LEASE_ACCESS_REPLICA) != (needed == LEASE_ACCESS_REPLICA)) return ERR_LEASE_EXPIRED;
+    if (needed == ACCESS_WRITE && lease.access != ACCESS_WRITE) return ERR_LEASE_EXPIRED;
+    if (lease_mac(key, user, filename, &lease) != lease.mac) return ERR_LEASE_EXPIRED;
+    return SUCCESS;
+}
+
+void lease_generate_key(unsigned char key[LEASE_KEY_BYTES]) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    ssize_t got = fd >= 0 ? read(fd, key, LEASE_KEY_BYTES) : -1;
+    if (fd >= 0) close(fd);
+    if (got == LEASE_KEY_BYTES) return;
+
+    // No urandom: still unpredictable enough to tell NM instances apart
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t seed[2] = { ((uint64_t)tv.tv_sec << 20) ^ tv.tv_usec, (uint64_t)getpid() };
+    unsigned char zero[LEASE_KEY_BYTES] = {0};
+    uint64_t a = siphash24(zero, seed, sizeof(seed));
+    uint64_t b = siphash24(zero, &a, sizeof(a));
+    memcpy(key, &a, 8);
+    memcpy(key + 8, &b, 8);
+}
+
+void lease_key_to_hex(const unsigned char key[LEASE_KEY_BYTES], char *hex) {
+    for (int i = 0; i < LEASE_KEY_BYTES; i++) {
+        sprintf(hex + 2 * i, "%02x", key[i]);
+    }
+}
+
+int lease_key_from_hex(const char *hex, unsigned char key[LEASE_KEY_BYTES]) {
+    if (strlen(hex) < 2 * LEASE_KEY_BYTES) return -1;
+    for (int i = 0; i < LEASE_KEY_BYTES; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) return -1;
+        key[i] = (unsigned char)byte;
+    }
+    return 0;
+}
+
+long long lease_now_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
@@ -0,0 +1,59 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include "common.h"
+#include <stdint.h>
+
+// Route leases: when the NM routes a READ, WRITE, STREAM or UNDO it also
+// hands the client a lease naming the SS, the access granted and an expiry,
+// signed with a key the NM shares only with its storage servers. The client
+// reuses the route until the lease expires, presenting the lease to the SS,
+// which checks it locally without asking the NM.
+//
+// A lease travels as text in Message.lease: "<ss_id>.<expires_ms>.<access>.<mac>"
+// with the MAC (SipHash-2-4, 16 hex digits) over the user, file name and the
+// other three fields.
+
+#define LEASE_KEY_BYTES 16
+#define LEASE_TTL_MS 5000          // How long a route lease stays valid (NM_ROUTE_LEASE_MS)
+#define LEASE_CLOCK_SLACK_MS 250   // Clients stop using a lease this long before it expires
+
+// Storage servers sign their replica traffic (MSG_REPL_DELTA, MSG_REPL_PUT)
+// with the same key, as a lease with this access for the backup, which the
+// NM never grants a client; such a lease opens nothing else
+#define LEASE_ACCESS_REPLICA ACCESS_READWRITE
+
+typedef struct {
+    int ss_id;
+    long long expires_ms;    // Wall clock, ms since the epoch
+    AccessType access;
+    uint64_t mac;
+} RouteLease;
+
+uint64_t siphash24(const unsigned char key[LEASE_KEY_BYTES], const void *data, size_t len);
+
+// Fill in the MAC for a lease issued to `user` for `filename`
+void lease_sign(const unsigned char key[LEASE_KEY_BYTES], const char *user, const char *filename,
+                RouteLease *lease);
+
+void lease_format(const RouteLease *lease, char *out, size_t size);
+
+// Returns 0, or -1 if `text` is not a lease
+int lease_parse(const char *text, RouteLease *lease);
+
+// SUCCESS if `text` is a lease from this key for this user, file and SS,
+// unexpired at `now_ms` and granting `needed` (LEASE_ACCESS_REPLICA only
+// matches itself); ERR_LEASE_EXPIRED otherwise
+int lease_verify(const unsigned char key[LEASE_KEY_BYTES], const char *text, const char *user,
+                 const char *filename, int ss_id, AccessType needed, long long now_ms);
+
+// A fresh random key (from /dev/urandom)
+void lease_generate_key(unsigned char key[LEASE_KEY_BYTES]);
+
+// Keys travel between NM and SS as 32 hex digits; decode returns 0 or -1
+void lease_key_to_hex(const unsigned char key[LEASE_KEY_BYTES], char *hex);
+int lease_key_from_hex(const char *hex, unsigned char key[LEASE_KEY_BYTES]);
+
+long long lease_now_ms();
+
+#endif // LEASE_H
@@ -0,0 +1,300 @@
+#include "lock_stats.h"
+#include "logger.h"
+
+#ifdef LOCK_STATS
+
+typedef struct {
+    const void *lock;
+    uint64_t since_ns;
+} HeldLock;
+
+static LockStats *locks = NULL;             // Pushed without a lock, never removed
+static __thread HeldLock held[LOCK_STATS_MAX_HELD];
+static __thread int held_count = 0;
+
+static int report_pipe[2] = { -1, -1 };
+
+#define STAT_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+#define STAT_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void raise_max(uint64_t *max, uint64_t value) {
+    uint64_t seen = STAT_READ(*max);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(max, &seen, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void enlist(LockStats *stats) {
+    int unlisted = 0;
+    if (STAT_READ(stats->listed) ||
+        !__atomic_compare_exchange_n(&stats->listed, &unlisted, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    stats->next = __atomic_load_n(&locks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&locks, &stats->next, stats, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// `lock` was just taken; `wait_start` is when the caller began to block on
+// it, 0 if it was free
+static void acquired(const void *lock, LockStats *stats, uint64_t wait_start) {
+    uint64_t now = now_ns();
+    uint64_t wait = wait_start ? now - wait_start : 0;
+    enlist(stats);
+    STAT_ADD(stats->acquisitions, 1);
+    if (wait_start) {
+        STAT_ADD(stats->contended, 1);
+        STAT_ADD(stats->wait_ns, wait);
+        raise_max(&stats->wait_max_ns, wait);
+    }
+    STAT_ADD(stats->wait_buckets[stats_bucket_index(wait)], 1);
+
+    if (held_count < LOCK_STATS_MAX_HELD) held[held_count++] = (HeldLock){ lock, now };
+}
+
+// `lock` was released at `now`
+static void released(const void *lock, LockStats *stats, uint64_t now) {
+    // Usually the last one taken; locks are not always released in order
+    for (int i = held_count - 1; i >= 0; i--) {
+        if (held[i].lock != lock) continue;
+        uint64_t hold = now - held[i].since_ns;
+        memmove(&held[i], &held[i + 1], sizeof(HeldLock) * (held_count - i - 1));
+        held_count--;
+        STAT_ADD(stats->hold_ns, hold);
+        raise_max(&stats->hold_max_ns, hold);
+        STAT_ADD(stats->hold_buckets[stats_bucket_index(hold)], 1);
+        return;
+    }
+}
+
+void lock_stats_mutex_lock(pthread_mutex_t *mutex, LockStats *stats) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        acquired(mutex, stats, 0);
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_mutex_lock(mutex);
+    acquired(mutex, stats, start);
+}
+
+void lock_stats_mutex_unlock(pthread_mutex_t *mutex, LockStats *stats) {
+    uint64_t now = now_ns();
+    pthread_mutex_unlock(mutex);
+    released(mutex, stats, now);
+}
+
+void lock_stats_rdlock(pthread_rwlock_t *lock, LockStats *stats) {
+    if (pthread_rwlock_tryrdlock(lock) == 0) {
+        acquired(lock, stats, 0);
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_rwlock_rdlock(lock);
+    acquired(lock, stats, start);
+}
+
+void lock_stats_wrlock(pthread_rwlock_t *lock, LockStats *stats) {
+    if (pthread_rwlock_trywrlock(lock) == 0) {
+        acquired(lock, stats, 0);
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_rwlock_wrlock(lock);
+    acquired(lock, stats, start);
+}
+
+void lock_stats_rwlock_unlock(pthread_rwlock_t *lock, LockStats *stats) {
+    uint64_t now = now_ns();
+    pthread_rwlock_unlock(lock);
+    released(lock, stats, now);
+}
+
+void lock_stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, LockStats *stats) {
+    released(mutex, stats, now_ns());
+    pthread_cond_wait(cond, mutex);
+    if (held_count < LOCK_STATS_MAX_HELD) held[held_count++] = (HeldLock){ mutex, now_ns() };
+}
+
+static double percentile_us(const uint64_t *buckets, uint64_t max_ns, double p) {
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) total += buckets[b];
+    if (total == 0) return 0.0;
+    uint64_t rank = (uint64_t)(p * total + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            uint64_t value = stats_bucket_value(b);
+            return (value < max_ns ? value : max_ns) / 1000.0;
+        }
+    }
+    return max_ns / 1000.0;
+}
+
+// A consistent-enough copy of `from` for reporting
+static void snapshot(const LockStats *from, LockStats *into) {
+    into->name = from->name;
+    into->acquisitions = STAT_READ(from->acquisitions);
+    into->contended = STAT_READ(from->contended);
+    into->wait_ns = STAT_READ(from->wait_ns);
+    into->hold_ns = STAT_READ(from->hold_ns);
+    into->wait_max_ns = STAT_READ(from->wait_max_ns);
+    into->hold_max_ns = STAT_READ(from->hold_max_ns);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        into->wait_buckets[b] = STAT_READ(from->wait_buckets[b]);
+        into->hold_buckets[b] = STAT_READ(from->hold_buckets[b]);
+    }
+}
+
+static int format_line(const LockStats *s, char *buffer, size_t size) {
+    return snprintf(buffer, size, "lock %s %llu %llu %.3f %.3f %.3f %.3f %.3f %.3f\n", s->name,
+                    (unsigned long long)s->acquisitions, (unsigned long long)s->contended,
+                    percentile_us(s->wait_buckets, s->wait_max_ns, 0.50),
+                    percentile_us(s->wait_buckets, s->wait_max_ns, 0.99), s->wait_max_ns / 1000.0,
+                    percentile_us(s->hold_buckets, s->hold_max_ns, 0.50),
+                    percentile_us(s->hold_buckets, s->hold_max_ns, 0.99), s->hold_max_ns / 1000.0);
+}
+
+int lock_stats_summary(char *buffer, size_t size) {
+    LockStats *copy = malloc(sizeof(LockStats));
+    if (!copy) return 0;
+    size_t pos = 0;
+    for (LockStats *s = __atomic_load_n(&locks, __ATOMIC_ACQUIRE); s && pos < size; s = s->next) {
+        snapshot(s, copy);
+        pos += format_line(copy, buffer + pos, size - pos);
+    }
+    free(copy);
+    return pos < size ? (int)pos : (int)size;
+}
+
+// Histogram bounds exported to Prometheus, in nanoseconds
+static const uint64_t export_bounds_ns[] = { 1000, 5000, 25000, 100000, 500000, 2500000, 10000000,
+                                             50000000, 250000000, 1000000000 };
+
+static void write_histogram(FILE *out, const char *metric, const char *lock, const uint64_t *buckets,
+                            uint64_t count, uint64_t sum_ns) {
+    int bound_count = sizeof(export_bounds_ns) / sizeof(export_bounds_ns[0]);
+    uint64_t cumulative = 0;
+    int b = 0;
+    for (int i = 0; i < bound_count; i++) {
+        while (b < STATS_BUCKETS && stats_bucket_value(b) <= export_bounds_ns[i]) cumulative += buckets[b++];
+        fprintf(out, "%s_bucket{lock=\"%s\",le=\"%g\"} %llu\n", metric, lock, export_bounds_ns[i] / 1e9,
+                (unsigned long long)cumulative);
+    }
+    while (b < STATS_BUCKETS) cumulative += buckets[b++];
+    fprintf(out, "%s_bucket{lock=\"%s\",le=\"+Inf\"} %llu\n", metric, lock, (unsigned long long)cumulative);
+    fprintf(out, "%s_sum{lock=\"%s\"} %.9f\n", metric, lock, sum_ns / 1e9);
+    fprintf(out, "%s_count{lock=\"%s\"} %llu\n", metric, lock, (unsigned long long)count);
+}
+
+void lock_stats_write_prometheus(FILE *out) {
+    LockStats *first = __atomic_load_n(&locks, __ATOMIC_ACQUIRE);
+    LockStats *copy = malloc(sizeof(LockStats));
+    if (!first || !copy) {
+        free(copy);
+        return;
+    }
+
+    fprintf(out, "# HELP docs_lock_acquisitions_total Acquisitions of a profiled lock.\n"
+                 "# TYPE docs_lock_acquisitions_total counter\n");
+    for (LockStats *s = first; s; s = s->next) {
+        fprintf(out, "docs_lock_acquisitions_total{lock=\"%s\"} %llu\n", s->name,
+                (unsigned long long)STAT_READ(s->acquisitions));
+    }
+    fprintf(out, "# HELP docs_lock_contended_total Acquisitions that had to wait for the lock.\n"
+                 "# TYPE docs_lock_contended_total counter\n");
+    for (LockStats *s = first; s; s = s->next) {
+        fprintf(out, "docs_lock_contended_total{lock=\"%s\"} %llu\n", s->name,
+                (unsigned long long)STAT_READ(s->contended));
+    }
+    fprintf(out, "# HELP docs_lock_wait_seconds Time spent waiting to acquire a lock.\n"
+                 "# TYPE docs_lock_wait_seconds histogram\n");
+    for (LockStats *s = first; s; s = s->next) {
+        snapshot(s, copy);
+        write_histogram(out, "docs_lock_wait_seconds", copy->name, copy->wait_buckets, copy->acquisitions,
+                        copy->wait_ns);
+    }
+    fprintf(out, "# HELP docs_lock_hold_seconds Time a lock was held.\n"
+                 "# TYPE docs_lock_hold_seconds histogram\n");
+    for (LockStats *s = first; s; s = s->next) {
+        snapshot(s, copy);
+        uint64_t holds = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) holds += copy->hold_buckets[b];
+        write_histogram(out, "docs_lock_hold_seconds", copy->name, copy->hold_buckets, holds, copy->hold_ns);
+    }
+    free(copy);
+}
+
+void lock_stats_log() {
+    LockStats *copy = malloc(sizeof(LockStats));
+    if (!copy) return;
+    log_formatted(LOG_INFO, "Lock stats: name acquisitions contended wait_p50_us wait_p99_us wait_max_us "
+                            "hold_p50_us hold_p99_us hold_max_us");
+    for (LockStats *s = __atomic_load_n(&locks, __ATOMIC_ACQUIRE); s; s = s->next) {
+        char line[256];
+        snapshot(s, copy);
+        int length = format_line(copy, line, sizeof(line));
+        if (length > 0 && line[length - 1] == '\n') line[length - 1] = '\0';
+        log_formatted(LOG_INFO, "%s", line);
+    }
+    free(copy);
+}
+
+static void on_exit_signal(int signo) {
+    unsigned char byte = (unsigned char)signo;
+    if (write(report_pipe[1], &byte, 1) != 1) _exit(128 + signo);
+}
+
+// Reports from a thread of its own, since a signal handler cannot log,
+// then exits the way the signal would have
+static void* reporter_main(void *arg) {
+    (void)arg;
+    unsigned char signo;
+    while (read(report_pipe[0], &signo, 1) != 1) {
+        if (errno != EINTR) return NULL;
+    }
+    lock_stats_log();
+    close_logger();
+    signal(signo, SIG_DFL);
+    raise(signo);
+    return NULL;
+}
+
+void lock_stats_init() {
+    if (report_pipe[0] >= 0 || pipe(report_pipe) < 0) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reporter_main, NULL) != 0) return;
+    pthread_detach(thread);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_exit_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    log_formatted(LOG_INFO, "Lock profiling on; reporting on SIGINT and SIGTERM");
+}
+
+#else
+
+void lock_stats_init() {
+}
+
+int lock_stats_summary(char *buffer, size_t size) {
+    if (size) buffer[0] = '\0';
+    return 0;
+}
+
+void lock_stats_write_prometheus(FILE *out) {
+    (void)out;
+}
+
+void lock_stats_log() {
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+
+#include "common.h"
+#include <stdint.h>
+
+// Contention profiling for the server locks, compiled in with
+// `make clean && make LOCK_STATS=1` (-DLOCK_STATS). Each profiled lock has a
+// named LockStats, shared by every lock of that kind (all SS socket pools,
+// every shard's cache), which counts acquisitions, the ones that had to wait,
+// and histograms of the time spent waiting and holding the lock.
+//
+// Call sites use the macros below instead of the pthread calls. Without
+// LOCK_STATS they are the pthread calls, the LockStats hold only a name and
+// the reports are empty. With it, an uncontended acquisition costs a trylock
+// and two clock reads.
+//
+// The counts are part of MSG_STATS and the metrics port, and are logged when
+// the server exits; instrumented servers also log them on SIGINT and SIGTERM
+// before exiting as they would have.
+
+#define LOCK_STATS_MAX_HELD 16      // Locks one thread holds at once and gets hold times for
+
+#ifdef LOCK_STATS
+
+#include "stats.h"
+
+typedef struct LockStats {
+    const char *name;
+    int listed;
+    struct LockStats *next;
+    uint64_t acquisitions;
+    uint64_t contended;              // Acquisitions that found the lock taken
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_max_ns;
+    uint64_t wait_buckets[STATS_BUCKETS];   // Nanoseconds, log-linear as in stats.h
+    uint64_t hold_buckets[STATS_BUCKETS];
+} LockStats;
+
+void lock_stats_mutex_lock(pthread_mutex_t *mutex, LockStats *stats);
+void lock_stats_mutex_unlock(pthread_mutex_t *mutex, LockStats *stats);
+void lock_stats_rdlock(pthread_rwlock_t *lock, LockStats *stats);
+void lock_stats_wrlock(pthread_rwlock_t *lock, LockStats *stats);
+void lock_stats_rwlock_unlock(pthread_rwlock_t *lock, LockStats *stats);
+void lock_stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, LockStats *stats);
+
+#define MUTEX_LOCK(mutex, stats) lock_stats_mutex_lock((mutex), (stats))
+#define MUTEX_UNLOCK(mutex, stats) lock_stats_mutex_unlock((mutex), (stats))
+#define RWLOCK_RDLOCK(lock, stats) lock_stats_rdlock((lock), (stats))
+#define RWLOCK_WRLOCK(lock, stats) lock_stats_wrlock((lock), (stats))
+#define RWLOCK_UNLOCK(lock, stats) lock_stats_rwlock_unlock((lock), (stats))
+// Time blocked on the condition counts as neither holding nor waiting
+#define COND_WAIT(cond, mutex, stats) lock_stats_cond_wait((cond), (mutex), (stats))
+
+#else
+
+typedef struct LockStats {
+    const char *name;
+} LockStats;
+
+#define MUTEX_LOCK(mutex, stats) ((void)(stats), pthread_mutex_lock(mutex))
+#define MUTEX_UNLOCK(mutex, stats) ((void)(stats), pthread_mutex_unlock(mutex))
+#define RWLOCK_RDLOCK(lock, stats) ((void)(stats), pthread_rwlock_rdlock(lock))
+#define RWLOCK_WRLOCK(lock, stats) ((void)(stats), pthread_rwlock_wrlock(lock))
+#define RWLOCK_UNLOCK(lock, stats) ((void)(stats), pthread_rwlock_unlock(lock))
+#define COND_WAIT(cond, mutex, stats) ((void)(stats), pthread_cond_wait((cond), (mutex)))
+
+#endif
+
+// A LockStats named `name` ("nm.ss_mutex"); it is listed on first use
+#define LOCK_STATS_DEFINE(var, lock_name) static LockStats var = { .name = lock_name }
+
+// Report the instrumented locks on SIGINT and SIGTERM (no-op without
+// LOCK_STATS). Call once from main after init_logger.
+void lock_stats_init();
+
+// One line per lock used so far, "lock name acquisitions contended
+// wait_p50_us wait_p99_us wait_max_us hold_p50_us hold_p99_us hold_max_us".
+// Returns the length written, truncated to `size`.
+int lock_stats_summary(char *buffer, size_t size);
+
+void lock_stats_write_prometheus(FILE *out);
+
+// Log the summary lines at LOG_INFO
+void lock_stats_log();
+
+#endif // LOCK_STATS_H
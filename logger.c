@@ -1,9 +1,52 @@
 #include "logger.h"
 #include <stdarg.h>
+#include <stdint.h>
+#include <strings.h>
 
-static FILE *log_file = NULL;
-static FILE *common_log = NULL;  // Common logs.txt for all instances
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOG_BATCH_BYTES (64 * 1024)
+
+// A line in a thread's ring: this header, then `length` bytes of text,
+// padded to 8 bytes. A header with level LOG_WRAP (or no room left for a
+// header) sends the reader back to the start of the buffer.
+typedef struct {
+    uint64_t seq;                // Global order the line was logged in
+    int64_t when;
+    int32_t level;
+    int32_t length;
+} LogRecord;
+
+#define LOG_WRAP -1
+#define RECORD_BYTES(length) ((sizeof(LogRecord) + (length) + 7) & ~(size_t)7)
+
+// One thread's lines: only the owning thread advances head, only the
+// writer advances tail (both count bytes). A ring outlives its thread and
+// is handed to the next thread that starts logging.
+typedef struct LogRing {
+    char buffer[LOG_RING_BYTES];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;            // Lines that did not fit (owner only)
+    uint64_t skipped;            // Owner only: end of buffer skipped by the line being logged
+    uint64_t dropped_reported;   // Writer only
+    uint64_t limit;              // Writer only: head when this drain began
+    int owned;
+    struct LogRing *next;
+} LogRing;
+
+static LogRing *rings = NULL;               // Pushed without a lock, never removed
+static __thread LogRing *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int log_fd = -1;
+static int common_fd = -1;                  // Common logs.txt for all instances
+static int writer_running = 0;
+static pthread_t writer_thread;
+static pthread_mutex_t lifecycle_mutex = PTHREAD_MUTEX_INITIALIZER;   // Opening and closing only
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static unsigned level_mask = LOG_ALL_LEVELS;
+static uint64_t next_seq = 0;
 static char instance_name[64] = "UNKNOWN";  // Store instance name (NM, SS_xxx, Client_xxx)
 
 const char* log_level_str(LogLevel level) {
@@ -18,121 +61,353 @@ const char* log_level_str(LogLevel level) {
     }
 }
 
+// ---------------------------------------------------------------------------
+// Producers
+// ---------------------------------------------------------------------------
+
+static void release_ring(void *ring) {
+    __atomic_store_n(&((LogRing*)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void make_ring_key() {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static LogRing* thread_ring() {
+    if (my_ring) return my_ring;
+    pthread_once(&ring_key_once, make_ring_key);
+
+    // Reuse the ring of a thread that has exited before growing the list
+    for (LogRing *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r && !my_ring; r = r->next) {
+        int unowned = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            my_ring = r;
+        }
+    }
+    if (!my_ring) {
+        LogRing *r = calloc(1, sizeof(LogRing));
+        if (!r) return NULL;
+        r->owned = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        my_ring = r;
+    }
+    pthread_setspecific(ring_key, my_ring);
+    return my_ring;
+}
+
+// Room for a line of up to LOG_LINE_MAX in this thread's ring, or NULL if
+// the ring is too full; the text goes right after the returned header
+static LogRecord* claim_record(LogLevel level) {
+    LogRing *r = thread_ring();
+    if (!r) return NULL;
+
+    // A line never wraps: skip what is left at the end if it may not fit
+    size_t offset = r->head % LOG_RING_BYTES;
+    size_t skip = LOG_RING_BYTES - offset < RECORD_BYTES(LOG_LINE_MAX) ? LOG_RING_BYTES - offset : 0;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (r->head + skip + RECORD_BYTES(LOG_LINE_MAX) - tail > LOG_RING_BYTES) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (skip) {
+        if (skip >= sizeof(LogRecord)) ((LogRecord*)(r->buffer + offset))->level = LOG_WRAP;
+        offset = 0;
+    }
+    r->skipped = skip;    // Published with the line
+
+    LogRecord *record = (LogRecord*)(r->buffer + offset);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    record->when = now.tv_sec;
+    record->level = level;
+    return record;
+}
+
+static void publish_record(LogRecord *record, int length) {
+    if (length < 0) length = 0;
+    if (length >= LOG_LINE_MAX) length = LOG_LINE_MAX - 1;
+    record->length = length;
+    record->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+
+    LogRing *r = my_ring;
+    uint64_t added = r->skipped + RECORD_BYTES(length);
+    uint64_t used = r->head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->head, r->head + added, __ATOMIC_RELEASE);
+
+    // Past half full, get the writer going rather than wait out its sleep
+    if (used < LOG_RING_BYTES / 2 && used + added >= LOG_RING_BYTES / 2) {
+        pthread_cond_signal(&wake_cond);
+    }
+}
+
+static char* record_text(LogRecord *record) {
+    return (char*)(record + 1);
+}
+
+// ---------------------------------------------------------------------------
+// Writer
+// ---------------------------------------------------------------------------
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (fd >= 0 && length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        length -= n;
+    }
+}
+
+typedef struct {
+    char *data;
+    size_t used;
+    time_t stamp_second;
+    char stamp[32];
+} Batch;
+
+static void flush_batch(Batch *batch) {
+    // Whole lines in one write each, so appends from other processes to
+    // logs.txt never split a line
+    write_all(log_fd, batch->data, batch->used);
+    write_all(common_fd, batch->data, batch->used);
+    batch->used = 0;
+}
+
+static void append_line(Batch *batch, time_t when, LogLevel level, const char *text, int length) {
+    if (batch->used + LOG_LINE_MAX + 128 > LOG_BATCH_BYTES) flush_batch(batch);
+    if (when != batch->stamp_second) {
+        struct tm tm_info;
+        localtime_r(&when, &tm_info);
+        strftime(batch->stamp, sizeof(batch->stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+        batch->stamp_second = when;
+    }
+    batch->used += snprintf(batch->data + batch->used, LOG_BATCH_BYTES - batch->used, "[%s] [%s] [%s] %.*s\n",
+                            batch->stamp, instance_name, log_level_str(level), length, text);
+}
+
+// The ring's oldest unwritten line, stepping over a wrap; NULL if none
+static LogRecord* oldest_record(LogRing *r) {
+    while (r->tail != r->limit) {
+        size_t offset = r->tail % LOG_RING_BYTES;
+        LogRecord *record = (LogRecord*)(r->buffer + offset);
+        if (LOG_RING_BYTES - offset >= sizeof(LogRecord) && record->level != LOG_WRAP) return record;
+        __atomic_store_n(&r->tail, r->tail + (LOG_RING_BYTES - offset), __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Write out every line published so far, merged across threads in the
+// order they were logged; returns how many
+static int drain(Batch *batch) {
+    LogRing *list = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (LogRing *r = list; r; r = r->next) {
+        r->limit = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->dropped_reported) {
+            char note[64];
+            int length = snprintf(note, sizeof(note), "%llu log lines dropped: the writer fell behind",
+                                  (unsigned long long)(dropped - r->dropped_reported));
+            append_line(batch, time(NULL), LOG_WARNING, note, length);
+            r->dropped_reported = dropped;
+        }
+    }
+
+    int count = 0;
+    while (1) {
+        LogRing *next = NULL;
+        LogRecord *next_record = NULL;
+        for (LogRing *r = list; r; r = r->next) {
+            LogRecord *record = oldest_record(r);
+            if (record && (!next_record || record->seq < next_record->seq)) {
+                next = r;
+                next_record = record;
+            }
+        }
+        if (!next) break;
+
+        append_line(batch, next_record->when, next_record->level, record_text(next_record), next_record->length);
+        __atomic_store_n(&next->tail, next->tail + RECORD_BYTES(next_record->length), __ATOMIC_RELEASE);
+        count++;
+    }
+    flush_batch(batch);
+    return count;
+}
+
+static void* writer_main(void *arg) {
+    (void)arg;
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.data = malloc(LOG_BATCH_BYTES);
+    if (!batch.data) return NULL;
+
+    while (1) {
+        int running = __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE);
+        drain(&batch);
+        if (!running) break;
+
+        // Batch up until the next tick, or until a ring fills past half
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&wake_mutex);
+        pthread_cond_timedwait(&wake_cond, &wake_mutex, &until);
+        pthread_mutex_unlock(&wake_mutex);
+    }
+    free(batch.data);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Lifetime and filtering
+// ---------------------------------------------------------------------------
+
+static unsigned parse_levels(const char *spec) {
+    if (!spec || !*spec) return LOG_ALL_LEVELS;
+    unsigned mask = 0;
+    char copy[128];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    char *save = NULL;
+    for (char *token = strtok_r(copy, ", ", &save); token; token = strtok_r(NULL, ", ", &save)) {
+        if (strcasecmp(token, "all") == 0) return LOG_ALL_LEVELS;
+        for (int level = LOG_INFO; level <= LOG_RESPONSE; level++) {
+            if (strcasecmp(token, log_level_str(level)) == 0) mask |= 1u << level;
+        }
+    }
+    return mask;
+}
+
+static void write_marker(int fd, const char *format, const char *name) {
+    char line[256];
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+    int length = name ? snprintf(line, sizeof(line), format, name, stamp) : snprintf(line, sizeof(line), format, stamp);
+    write_all(fd, line, length);
+}
+
 int init_logger(const char *log_filename) {
-    pthread_mutex_lock(&log_mutex);
-    
+    pthread_mutex_lock(&lifecycle_mutex);
+    if (writer_running) {
+        pthread_mutex_unlock(&lifecycle_mutex);
+        return 0;
+    }
+
     // Open instance-specific log file
-    log_file = fopen(log_filename, "a");
-    if (!log_file) {
-        pthread_mutex_unlock(&log_mutex);
+    log_fd = open(log_filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) {
+        pthread_mutex_unlock(&lifecycle_mutex);
         return -1;
     }
-    
+
     // Open common logs.txt (append mode, created if doesn't exist)
-    common_log = fopen("logs.txt", "a");
-    if (!common_log) {
-        fclose(log_file);
-        log_file = NULL;
-        pthread_mutex_unlock(&log_mutex);
+    common_fd = open("logs.txt", O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (common_fd < 0) {
+        close(log_fd);
+        log_fd = -1;
+        pthread_mutex_unlock(&lifecycle_mutex);
+        return -1;
+    }
+
+    write_marker(log_fd, "\n=== Log Started at %s ===\n", NULL);
+    write_marker(common_fd, "\n=== %s Log Started at %s ===\n", instance_name);
+
+    set_log_levels(parse_levels(getenv("DOCS_LOG_LEVELS")));
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+        close(log_fd);
+        close(common_fd);
+        log_fd = common_fd = -1;
+        pthread_mutex_unlock(&lifecycle_mutex);
         return -1;
     }
-    
-    fprintf(log_file, "\n=== Log Started at %s ===\n", get_timestamp());
-    fflush(log_file);
-    
-    fprintf(common_log, "\n=== %s Log Started at %s ===\n", instance_name, get_timestamp());
-    fflush(common_log);
-    
-    pthread_mutex_unlock(&log_mutex);
+
+    pthread_mutex_unlock(&lifecycle_mutex);
     return 0;
 }
 
 void set_instance_name(const char *name) {
-    pthread_mutex_lock(&log_mutex);
+    // Set before init_logger; the writer reads it
     strncpy(instance_name, name, sizeof(instance_name) - 1);
     instance_name[sizeof(instance_name) - 1] = '\0';
-    pthread_mutex_unlock(&log_mutex);
 }
 
 void close_logger() {
-    pthread_mutex_lock(&log_mutex);
-    
-    if (log_file) {
-        fprintf(log_file, "=== Log Closed at %s ===\n\n", get_timestamp());
-        fclose(log_file);
-        log_file = NULL;
-    }
-    
-    if (common_log) {
-        fprintf(common_log, "=== %s Log Closed at %s ===\n\n", instance_name, get_timestamp());
-        fclose(common_log);
-        common_log = NULL;
+    pthread_mutex_lock(&lifecycle_mutex);
+    if (!writer_running) {
+        pthread_mutex_unlock(&lifecycle_mutex);
+        return;
     }
-    
-    pthread_mutex_unlock(&log_mutex);
+
+    // The writer drains once more after seeing this
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&wake_cond);
+    pthread_join(writer_thread, NULL);
+
+    write_marker(log_fd, "=== Log Closed at %s ===\n\n", NULL);
+    write_marker(common_fd, "=== %s Log Closed at %s ===\n\n", instance_name);
+    close(log_fd);
+    close(common_fd);
+    log_fd = common_fd = -1;
+
+    pthread_mutex_unlock(&lifecycle_mutex);
 }
 
-void log_message(LogLevel level, const char *ip, int port, 
-                 const char *username, const char *operation, 
+void set_log_levels(unsigned mask) {
+    __atomic_store_n(&level_mask, mask, __ATOMIC_RELAXED);
+}
+
+int log_enabled(LogLevel level) {
+    return __atomic_load_n(&writer_running, __ATOMIC_RELAXED) &&
+           (__atomic_load_n(&level_mask, __ATOMIC_RELAXED) & (1u << level));
+}
+
+// ---------------------------------------------------------------------------
+// Logging calls
+// ---------------------------------------------------------------------------
+
+void log_message(LogLevel level, const char *ip, int port,
+                 const char *username, const char *operation,
                  const char *status, const char *details) {
-    pthread_mutex_lock(&log_mutex);
-    
-    char log_entry[MAX_BUFFER * 2];
-    snprintf(log_entry, sizeof(log_entry),
-             "[%s] [%s] [%s] [%s:%d] [User: %s] [Op: %s] [Status: %s] %s",
-             get_timestamp(),
-             instance_name,
-             log_level_str(level),
-             ip ? ip : "N/A",
-             port,
-             username ? username : "N/A",
-             operation ? operation : "N/A",
-             status ? status : "N/A",
-             details ? details : "");
-    
-    if (log_file) {
-        fprintf(log_file, "%s\n", log_entry);
-        fflush(log_file);
-    }
-    
-    if (common_log) {
-        fprintf(common_log, "%s\n", log_entry);
-        fflush(common_log);
-    }
-    
-    pthread_mutex_unlock(&log_mutex);
+    if (!log_enabled(level)) return;
+    LogRecord *record = claim_record(level);
+    if (!record) return;
+
+    int length = snprintf(record_text(record), LOG_LINE_MAX,
+                          "[%s:%d] [User: %s] [Op: %s] [Status: %s] %s",
+                          ip ? ip : "N/A",
+                          port,
+                          username ? username : "N/A",
+                          operation ? operation : "N/A",
+                          status ? status : "N/A",
+                          details ? details : "");
+    publish_record(record, length);
 }
 
 void log_formatted(LogLevel level, const char *format, ...) {
-    pthread_mutex_lock(&log_mutex);
-    
-    char message[MAX_BUFFER];
+    if (!log_enabled(level)) return;
+    LogRecord *record = claim_record(level);
+    if (!record) return;
+
     va_list args;
     va_start(args, format);
-    vsnprintf(message, sizeof(message), format, args);
+    int length = vsnprintf(record_text(record), LOG_LINE_MAX, format, args);
     va_end(args);
-    
-    char log_entry[MAX_BUFFER * 2];
-    snprintf(log_entry, sizeof(log_entry), "[%s] [%s] [%s] %s",
-             get_timestamp(), instance_name, log_level_str(level), message);
-    
-    if (log_file) {
-        fprintf(log_file, "%s\n", log_entry);
-        fflush(log_file);
-    }
-    
-    if (common_log) {
-        fprintf(common_log, "%s\n", log_entry);
-        fflush(common_log);
-    }
-    
-    pthread_mutex_unlock(&log_mutex);
+    publish_record(record, length);
 }
 
 void display_and_log(const char *message) {
     char formatted_msg[MAX_BUFFER * 2];
     snprintf(formatted_msg, sizeof(formatted_msg), "[%s] %s", instance_name, message);
-    
+
     printf("%s\n", formatted_msg);
     log_formatted(LOG_INFO, "%s", message);
 }
@@ -3,6 +3,22 @@
 
 #include "common.h"
 
+// Logging is asynchronous: a call formats its message into a ring owned by
+// the calling thread, without a lock, and a writer thread appends what the
+// rings hold to the instance's log and the shared logs.txt every
+// LOG_FLUSH_MS (sooner once a ring is half full), in the order the lines
+// were logged. A thread that logs faster than the writer drains loses the
+// lines that do not fit (the log says how many), so memory stays bounded
+// under bursts. Lines longer than LOG_LINE_MAX are cut short, and a process
+// killed outright loses what it logged in its last LOG_FLUSH_MS.
+//
+// DOCS_LOG_LEVELS (e.g. "ERROR,WARN") keeps only the listed levels; a
+// filtered-out call returns before formatting anything.
+
+#define LOG_RING_BYTES (128 * 1024) // Per thread, for lines waiting for the writer
+#define LOG_LINE_MAX 512
+#define LOG_FLUSH_MS 20
+
 typedef enum {
     LOG_INFO,
     LOG_WARNING,
@@ -12,18 +28,24 @@ typedef enum {
     LOG_RESPONSE
 } LogLevel;
 
+#define LOG_ALL_LEVELS 0x3f
+
 // Initialize logger with filename
 int init_logger(const char *log_filename);
 
 // Set instance name (NM, SS_xxxx, Client_xxxx)
 void set_instance_name(const char *name);
 
-// Close logger
+// Close logger, writing out everything logged so far
 void close_logger();
 
+// Levels written, one bit per LogLevel; DOCS_LOG_LEVELS sets the initial mask
+void set_log_levels(unsigned mask);
+int log_enabled(LogLevel level);
+
 // Log a message
-void log_message(LogLevel level, const char *ip, int port, 
-                 const char *username, const char *operation, 
+void log_message(LogLevel level, const char *ip, int port,
+                 const char *username, const char *operation,
                  const char *status, const char *details);
 
 // Log with format string
@@ -32,4 +54,4 @@ void log_formatted(LogLevel level, const char *format, ...);
 // Display message to console and log
 void display_and_log(const char *message);
 
-#endif // LOGGER_H
\ No newline at end of file
+#endif // LOGGER_H
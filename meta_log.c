@@ -0,0 +1,1256 @@
+#include "meta_log.h"
+#include "logger.h"
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define META_VERSION 1
+#define SEGMENT_MAGIC "DOCSWAL1"
+#define SNAPSHOT_MAGIC "DOCSSNP1"
+#define RECORD_HEADER 8                 // Payload length and CRC-32, both u32
+#define SNAPSHOT_FLUSH_BYTES (1 << 20)  // Snapshot records buffered before a write
+#define SHIP_MAX_BYTES (64 << 20)       // Unsent records before a standby is dropped
+#define FOLLOW_BUFFER (256 * 1024)
+#define WRITE_RETRY_MS 1000             // Between attempts to write a batch that failed
+
+// Log shipping records that never reach a file
+#define STREAM_SYNC_DONE 100            // The full copy is complete
+#define STREAM_PING 101                 // Nothing new; the primary is alive
+// Upper bound on one encoded record (a folder with a full ACL is the largest)
+#define META_MAX_RECORD (sizeof(FolderMetadata) + MAX_PATH + 512)
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} MetaBuffer;
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int reserved;
+} SegmentHeader;
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int reserved;
+    unsigned long long replay_from;   // First log segment the snapshot does not cover
+    unsigned long long record_count;
+} SnapshotHeader;
+
+struct MetaSnapshot {
+    FILE *fp;
+    MetaBuffer buf;
+    long long records;
+    long long bytes;
+    int failed;
+};
+
+static struct {
+    int open;
+    char dir[MAX_PATH];
+    int fd;                           // Current segment, -1 once sealed (io_mutex)
+    unsigned long long segment;
+    int fsync_enabled;
+
+    MetaBuffer pending;               // Appended, not yet written (mutex)
+    MetaBuffer writing;               // Being written, or failed to write (io_mutex)
+    unsigned long long writing_lsn;   // Last record in `writing` (io_mutex)
+    unsigned long long appended_lsn;  // Records appended so far (mutex)
+    unsigned long long durable_lsn;   // Records known to be on disk (mutex)
+    unsigned long long failed_lsn;    // Last record of a batch that could not be written (mutex)
+    int unwritten;                    // `writing` holds a failed batch to retry (mutex)
+    unsigned long long snapshot_lsn;  // appended_lsn when the last snapshot started
+    long long log_bytes;              // Size of the current segment, pending included
+    long long syncs;
+    long long snapshots;
+
+    pthread_mutex_t mutex;
+    pthread_mutex_t io_mutex;         // Segment writes and rotation
+    pthread_mutex_t snapshot_mutex;   // One snapshot at a time
+    pthread_cond_t flush_cond;        // Something to write
+    pthread_cond_t durable_cond;      // durable_lsn moved
+    pthread_cond_t snapshot_cond;
+    volatile int running;
+    pthread_t flusher_tid;
+    pthread_t snapshot_tid;
+
+    int snapshot_interval;
+    long long snapshot_wal_bytes;
+    MetaDumpFn dump;
+    void *dump_ctx;
+
+    // Log shipping (mutex)
+    int shipping;                     // A standby is attached
+    int ship_failed;                  // Its connection broke or it fell behind
+    MetaBuffer ship;                  // Appended, not yet sent to it
+    unsigned long long ship_base_lsn; // appended_lsn when it attached
+    unsigned long long standby_lsn;   // Last record it confirmed
+    int standby_synced;               // It has the full copy; commits wait for it
+    pthread_cond_t ship_cond;
+} wal = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .io_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .snapshot_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .flush_cond = PTHREAD_COND_INITIALIZER,
+    .durable_cond = PTHREAD_COND_INITIALIZER,
+    .snapshot_cond = PTHREAD_COND_INITIALIZER,
+    .ship_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// Last record the calling thread appended, for meta_log_commit
+static __thread unsigned long long my_lsn = 0;
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static unsigned int crc32_of(const void *data, size_t len) {
+    pthread_once(&crc_once, make_crc_table);
+    const unsigned char *p = data;
+    unsigned int c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+static double elapsed_ms(const struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+// ---- Encoding ----
+
+static int buffer_reserve(MetaBuffer *b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap * 2 : 64 * 1024;
+    while (cap < b->len + extra) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+// The put_* helpers write into space reserved by begin_record
+static void put_bytes(MetaBuffer *b, const void *p, size_t n) {
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put_u8(MetaBuffer *b, unsigned char v) { put_bytes(b, &v, 1); }
+static void put_u16(MetaBuffer *b, unsigned short v) { put_bytes(b, &v, 2); }
+static void put_i32(MetaBuffer *b, int v) { put_bytes(b, &v, 4); }
+static void put_i64(MetaBuffer *b, long long v) { put_bytes(b, &v, 8); }
+
+static void put_str(MetaBuffer *b, const char *s, size_t max) {
+    unsigned short n = (unsigned short)strnlen(s, max - 1);
+    put_u16(b, n);
+    put_bytes(b, s, n);
+}
+
+static void put_acl(MetaBuffer *b, const ACLEntry *acl, int count) {
+    if (count < 0) count = 0;
+    if (count > MAX_ACL_ENTRIES) count = MAX_ACL_ENTRIES;
+    put_u16(b, (unsigned short)count);
+    for (int i = 0; i < count; i++) {
+        put_str(b, acl[i].username, MAX_USERNAME);
+        put_u8(b, (unsigned char)acl[i].access);
+    }
+}
+
+// Start a record; returns its offset, or -1 when out of memory
+static long begin_record(MetaBuffer *b, MetaRecordType type) {
+    if (buffer_reserve(b, META_MAX_RECORD) < 0) return -1;
+    long start = (long)b->len;
+    b->len += RECORD_HEADER;
+    put_u8(b, (unsigned char)type);
+    return start;
+}
+
+static void end_record(MetaBuffer *b, long start) {
+    unsigned int len = (unsigned int)(b->len - start - RECORD_HEADER);
+    unsigned int crc = crc32_of(b->data + start + RECORD_HEADER, len);
+    memcpy(b->data + start, &len, 4);
+    memcpy(b->data + start + 4, &crc, 4);
+}
+
+static void encode_file(MetaBuffer *b, const FileMetadata *meta) {
+    long start = begin_record(b, META_FILE_PUT);
+    if (start < 0) return;
+    put_str(b, meta->filename, MAX_FILENAME);
+    put_str(b, meta->folder_path, MAX_PATH);
+    put_str(b, meta->owner, MAX_USERNAME);
+    put_i32(b, meta->ss_id);
+    int backups = meta->backup_count < 0 ? 0 : meta->backup_count > MAX_BACKUPS ? MAX_BACKUPS : meta->backup_count;
+    put_u8(b, (unsigned char)backups);
+    for (int i = 0; i < backups; i++) put_i32(b, meta->backup_ids[i]);
+    put_i32(b, meta->stale_mask);
+    put_i64(b, (long long)meta->size);
+    put_i32(b, meta->word_count);
+    put_i32(b, meta->char_count);
+    put_i64(b, meta->created);
+    put_i64(b, meta->modified);
+    put_i64(b, meta->accessed);
+    put_str(b, meta->last_accessed_by, MAX_USERNAME);
+    put_acl(b, meta->acl, meta->acl_count);
+    end_record(b, start);
+}
+
+static void encode_key(MetaBuffer *b, MetaRecordType type, const char *key) {
+    long start = begin_record(b, type);
+    if (start < 0) return;
+    put_str(b, key, MAX_PATH);
+    end_record(b, start);
+}
+
+static void encode_touch(MetaBuffer *b, const char *filename, time_t accessed, const char *username) {
+    long start = begin_record(b, META_FILE_TOUCH);
+    if (start < 0) return;
+    put_str(b, filename, MAX_PATH);
+    put_i64(b, accessed);
+    put_str(b, username, MAX_USERNAME);
+    end_record(b, start);
+}
+
+static void encode_folder(MetaBuffer *b, const char *path, const FolderMetadata *meta) {
+    long start = begin_record(b, META_FOLDER_PUT);
+    if (start < 0) return;
+    put_str(b, path, MAX_PATH);
+    put_str(b, meta->foldername, MAX_FILENAME);
+    put_str(b, meta->parent_path, MAX_PATH);
+    put_str(b, meta->owner, MAX_USERNAME);
+    put_i64(b, meta->created);
+    put_i32(b, meta->ss_id);
+    put_acl(b, meta->acl, meta->acl_count);
+    end_record(b, start);
+}
+
+static void encode_user(MetaBuffer *b, const RegisteredUser *user) {
+    long start = begin_record(b, META_USER_PUT);
+    if (start < 0) return;
+    put_str(b, user->username, MAX_USERNAME);
+    put_i64(b, user->first_registered);
+    put_i64(b, user->last_seen);
+    end_record(b, start);
+}
+
+static void encode_request(MetaBuffer *b, MetaRecordType type, const AccessRequest *req) {
+    long start = begin_record(b, type);
+    if (start < 0) return;
+    put_str(b, req->username, MAX_USERNAME);
+    put_str(b, req->filename, MAX_FILENAME);
+    put_u8(b, (unsigned char)req->requested_access);
+    put_i64(b, req->request_time);
+    end_record(b, start);
+}
+
+// ---- Decoding ----
+
+typedef struct {
+    const unsigned char *p;
+    size_t left;
+    int bad;
+} Reader;
+
+static void get_bytes(Reader *r, void *out, size_t n) {
+    if (r->bad || r->left < n) {
+        r->bad = 1;
+        memset(out, 0, n);
+        return;
+    }
+    memcpy(out, r->p, n);
+    r->p += n;
+    r->left -= n;
+}
+
+static unsigned char get_u8(Reader *r) { unsigned char v; get_bytes(r, &v, 1); return v; }
+static unsigned short get_u16(Reader *r) { unsigned short v; get_bytes(r, &v, 2); return v; }
+static int get_i32(Reader *r) { int v; get_bytes(r, &v, 4); return v; }
+static long long get_i64(Reader *r) { long long v; get_bytes(r, &v, 8); return v; }
+
+static void get_str(Reader *r, char *out, size_t size) {
+    unsigned short n = get_u16(r);
+    if (n >= size) {
+        r->bad = 1;
+        out[0] = '\0';
+        return;
+    }
+    get_bytes(r, out, n);
+    out[r->bad ? 0 : n] = '\0';
+}
+
+static int get_acl(Reader *r, ACLEntry *acl) {
+    int count = get_u16(r);
+    if (count > MAX_ACL_ENTRIES) {
+        r->bad = 1;
+        return 0;
+    }
+    for (int i = 0; i < count && !r->bad; i++) {
+        get_str(r, acl[i].username, MAX_USERNAME);
+        acl[i].access = (AccessType)get_u8(r);
+    }
+    return count;
+}
+
+static int decode_record(const unsigned char *payload, size_t len, MetaRecord *rec) {
+    Reader r = { payload, len, 0 };
+    rec->type = (MetaRecordType)get_u8(&r);
+
+    switch (rec->type) {
+        case META_FILE_PUT: {
+            FileMetadata *f = &rec->file;
+            get_str(&r, f->filename, MAX_FILENAME);
+            get_str(&r, f->folder_path, MAX_PATH);
+            get_str(&r, f->owner, MAX_USERNAME);
+            f->ss_id = get_i32(&r);
+            f->backup_count = get_u8(&r);
+            if (f->backup_count > MAX_BACKUPS) return -1;
+            for (int i = 0; i < f->backup_count; i++) f->backup_ids[i] = get_i32(&r);
+            f->stale_mask = get_i32(&r);
+            f->size = (size_t)get_i64(&r);
+            f->word_count = get_i32(&r);
+            f->char_count = get_i32(&r);
+            f->created = (time_t)get_i64(&r);
+            f->modified = (time_t)get_i64(&r);
+            f->accessed = (time_t)get_i64(&r);
+            get_str(&r, f->last_accessed_by, MAX_USERNAME);
+            f->acl_count = get_acl(&r, f->acl);
+            strcpy(rec->key, f->filename);
+            break;
+        }
+        case META_FILE_DELETE:
+        case META_FOLDER_DELETE:
+            get_str(&r, rec->key, MAX_PATH);
+            break;
+        case META_FILE_TOUCH:
+            get_str(&r, rec->key, MAX_PATH);
+            rec->file.accessed = (time_t)get_i64(&r);
+            get_str(&r, rec->file.last_accessed_by, MAX_USERNAME);
+            break;
+        case META_FOLDER_PUT: {
+            FolderMetadata *d = &rec->folder;
+            get_str(&r, rec->key, MAX_PATH);
+            get_str(&r, d->foldername, MAX_FILENAME);
+            get_str(&r, d->parent_path, MAX_PATH);
+            get_str(&r, d->owner, MAX_USERNAME);
+            d->created = (time_t)get_i64(&r);
+            d->ss_id = get_i32(&r);
+            d->acl_count = get_acl(&r, d->acl);
+            break;
+        }
+        case META_USER_PUT:
+            get_str(&r, rec->user.username, MAX_USERNAME);
+            rec->user.first_registered = (time_t)get_i64(&r);
+            rec->user.last_seen = (time_t)get_i64(&r);
+            rec->user.active_session = 0;
+            rec->user.client_sock = -1;
+            break;
+        case META_REQUEST_ADD:
+        case META_REQUEST_DELETE:
+            get_str(&r, rec->request.username, MAX_USERNAME);
+            get_str(&r, rec->request.filename, MAX_FILENAME);
+            rec->request.requested_access = (AccessType)get_u8(&r);
+            rec->request.request_time = (time_t)get_i64(&r);
+            break;
+        case META_SYNC_START:
+            break;
+        default:
+            return -1;
+    }
+    return r.bad || r.left != 0 ? -1 : 0;
+}
+
+// Apply the well-formed records at the start of [data, data + size).
+// Returns the bytes they take up; anything after is torn or corrupt.
+static size_t walk_records(const unsigned char *data, size_t size, MetaApplyFn apply, void *ctx,
+                           MetaRecord *rec, long long *count) {
+    size_t off = 0;
+    while (off + RECORD_HEADER <= size) {
+        unsigned int len, crc;
+        memcpy(&len, data + off, 4);
+        memcpy(&crc, data + off + 4, 4);
+        if (len == 0 || len > META_MAX_RECORD || off + RECORD_HEADER + len > size) break;
+
+        const unsigned char *payload = data + off + RECORD_HEADER;
+        if (crc32_of(payload, len) != crc || decode_record(payload, len, rec) < 0) break;
+
+        apply(rec, ctx);
+        (*count)++;
+        off += RECORD_HEADER + len;
+    }
+    return off;
+}
+
+// ---- Files ----
+
+static void segment_path(const char *dir, unsigned long long seq, char *path, size_t size) {
+    snprintf(path, size, "%s/wal.%012llu", dir, seq);
+}
+
+static int compare_seqs(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+// Sequence numbers of the log segments in `dir`, ascending; caller frees
+static int list_segments(const char *dir, unsigned long long **seqs) {
+    *seqs = NULL;
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+
+    int count = 0, cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        unsigned long long seq;
+        char extra;
+        if (sscanf(entry->d_name, "wal.%llu%c", &seq, &extra) != 1) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            unsigned long long *grown = realloc(*seqs, sizeof(unsigned long long) * cap);
+            if (!grown) break;
+            *seqs = grown;
+        }
+        (*seqs)[count++] = seq;
+    }
+    closedir(d);
+    qsort(*seqs, count, sizeof(unsigned long long), compare_seqs);
+    return count;
+}
+
+static void sync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Map a file read-only; returns NULL for a missing or empty file
+static const unsigned char* map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    const unsigned char *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            data = m;
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return data;
+}
+
+static unsigned long long snapshot_replay_from(const char *dir) {
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/snapshot", dir);
+
+    SnapshotHeader header;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+             memcmp(header.magic, SNAPSHOT_MAGIC, 8) == 0 && header.version == META_VERSION;
+    fclose(fp);
+    return ok ? header.replay_from : 0;
+}
+
+int meta_log_recover(const char *dir, MetaApplyFn apply, void *ctx, MetaRecoveryStats *stats) {
+    memset(stats, 0, sizeof(MetaRecoveryStats));
+    mkdir(dir, 0755);
+
+    MetaRecord *rec = malloc(sizeof(MetaRecord));
+    if (!rec) return -1;
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    int result = 0;
+    unsigned long long replay_from = 0;
+
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/snapshot", dir);
+    size_t size = 0;
+    const unsigned char *data = map_file(path, &size);
+    if (data) {
+        SnapshotHeader header;
+        if (size < sizeof(header)) {
+            result = -1;
+        } else {
+            memcpy(&header, data, sizeof(header));
+            if (memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 || header.version != META_VERSION) {
+                result = -1;
+            } else {
+                walk_records(data + sizeof(header), size - sizeof(header), apply, ctx,
+                             rec, &stats->snapshot_records);
+                if ((unsigned long long)stats->snapshot_records != header.record_count) result = -1;
+                replay_from = header.replay_from;
+            }
+        }
+        munmap((void*)data, size);
+        if (result < 0) {
+            log_formatted(LOG_ERROR, "Metadata snapshot %s is damaged (%lld records read)",
+                         path, stats->snapshot_records);
+        }
+    }
+
+    unsigned long long *seqs;
+    int seq_count = list_segments(dir, &seqs);
+    for (int i = 0; i < seq_count; i++) {
+        segment_path(dir, seqs[i], path, sizeof(path));
+        if (seqs[i] < replay_from) {
+            // Already in the snapshot; left over from a crash mid-cleanup
+            unlink(path);
+            continue;
+        }
+
+        size = 0;
+        data = map_file(path, &size);
+        if (!data) continue;
+
+        SegmentHeader header;
+        if (size >= sizeof(header)) {
+            memcpy(&header, data, sizeof(header));
+        }
+        if (size < sizeof(header) || memcmp(header.magic, SEGMENT_MAGIC, 8) != 0 ||
+            header.version != META_VERSION) {
+            log_formatted(LOG_ERROR, "Skipping unreadable metadata log %s", path);
+            munmap((void*)data, size);
+            continue;
+        }
+
+        size_t body = size - sizeof(header);
+        size_t used = walk_records(data + sizeof(header), body, apply, ctx, rec, &stats->log_records);
+        if (used < body) {
+            // A crash mid-write leaves a partial record at the end
+            stats->torn_records++;
+            log_formatted(LOG_WARNING, "Metadata log %s ends with %zu unreadable bytes", path, body - used);
+        }
+        munmap((void*)data, size);
+    }
+    free(seqs);
+    free(rec);
+
+    stats->map_ms = elapsed_ms(&start);
+    return result;
+}
+
+// Create log segment `seq` and make its name durable
+static int create_segment(unsigned long long seq) {
+    char path[MAX_PATH];
+    segment_path(wal.dir, seq, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) return -1;
+
+    SegmentHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEGMENT_MAGIC, 8);
+    header.version = META_VERSION;
+    if (write_all(fd, (const char*)&header, sizeof(header)) < 0 || fsync(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    sync_dir(wal.dir);
+    return fd;
+}
+
+// ---- Appending ----
+
+static void ship_record(const char *data, size_t len);
+
+// Encode under the mutex so records land in the order callers made them
+#define APPEND(encode_call) do {                                 \
+        if (!wal.open) return;                                   \
+        pthread_mutex_lock(&wal.mutex);                          \
+        size_t before = wal.pending.len;                         \
+        MetaBuffer *b = &wal.pending;                            \
+        encode_call;                                             \
+        if (wal.pending.len > before) {                          \
+            wal.log_bytes += wal.pending.len - before;           \
+            my_lsn = ++wal.appended_lsn;                         \
+            pthread_cond_signal(&wal.flush_cond);                \
+            if (wal.shipping) {                                  \
+                ship_record(wal.pending.data + before,           \
+                            wal.pending.len - before);           \
+            }                                                    \
+        }                                                        \
+        pthread_mutex_unlock(&wal.mutex);                        \
+    } while (0)
+
+void meta_log_put_file(const FileMetadata *meta) {
+    APPEND(encode_file(b, meta));
+}
+
+void meta_log_delete_file(const char *filename) {
+    APPEND(encode_key(b, META_FILE_DELETE, filename));
+}
+
+void meta_log_touch_file(const char *filename, time_t accessed, const char *username) {
+    APPEND(encode_touch(b, filename, accessed, username));
+}
+
+void meta_log_put_folder(const char *path, const FolderMetadata *meta) {
+    APPEND(encode_folder(b, path, meta));
+}
+
+void meta_log_delete_folder(const char *path) {
+    APPEND(encode_key(b, META_FOLDER_DELETE, path));
+}
+
+void meta_log_put_user(const RegisteredUser *user) {
+    APPEND(encode_user(b, user));
+}
+
+void meta_log_add_request(const AccessRequest *req) {
+    APPEND(encode_request(b, META_REQUEST_ADD, req));
+}
+
+void meta_log_delete_request(const AccessRequest *req) {
+    APPEND(encode_request(b, META_REQUEST_DELETE, req));
+}
+
+int meta_log_commit() {
+    if (!wal.open) return 0;
+    pthread_mutex_lock(&wal.mutex);
+    while ((wal.durable_lsn < my_lsn || (wal.standby_synced && wal.standby_lsn < my_lsn)) &&
+           !(wal.durable_lsn < my_lsn && wal.failed_lsn >= my_lsn) && wal.running) {
+        pthread_cond_wait(&wal.durable_cond, &wal.mutex);
+    }
+    int result = wal.durable_lsn < my_lsn && wal.failed_lsn >= my_lsn ? -1 : 0;
+    pthread_mutex_unlock(&wal.mutex);
+    return result;
+}
+
+// Move what was appended into `writing`, after a batch that failed earlier,
+// and return the last record it then holds. Caller holds io_mutex.
+static unsigned long long take_pending() {
+    pthread_mutex_lock(&wal.mutex);
+    if (wal.writing.len == 0) {
+        MetaBuffer swap = wal.writing;
+        wal.writing = wal.pending;
+        wal.pending = swap;
+        wal.pending.len = 0;
+        wal.writing_lsn = wal.appended_lsn;
+    } else if (wal.pending.len > 0 && buffer_reserve(&wal.writing, wal.pending.len) == 0) {
+        memcpy(wal.writing.data + wal.writing.len, wal.pending.data, wal.pending.len);
+        wal.writing.len += wal.pending.len;
+        wal.pending.len = 0;
+        wal.writing_lsn = wal.appended_lsn;
+    }
+    unsigned long long target = wal.writing_lsn;
+    pthread_mutex_unlock(&wal.mutex);
+    return target;
+}
+
+// Write `writing` to the current segment with one write and one fsync. A
+// failure may leave a torn record, which recovery stops at, so that segment
+// is sealed and the whole batch is written again at the start of a fresh one
+// (replaying its first records twice is harmless). Returns 0 once the batch
+// is durable; otherwise it stays in `writing`. Caller holds io_mutex.
+static int write_batch() {
+    if (wal.writing.len == 0) return 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (wal.fd < 0) {
+            int fd = create_segment(wal.segment + 1);
+            if (fd < 0) {
+                log_formatted(LOG_ERROR, "Cannot start metadata log segment %llu: %s",
+                             wal.segment + 1, strerror(errno));
+                return -1;
+            }
+            pthread_mutex_lock(&wal.mutex);
+            wal.fd = fd;
+            wal.segment++;
+            wal.log_bytes = sizeof(SegmentHeader) + wal.writing.len + wal.pending.len;
+            pthread_mutex_unlock(&wal.mutex);
+        }
+        if (write_all(wal.fd, wal.writing.data, wal.writing.len) == 0 &&
+            (!wal.fsync_enabled || fdatasync(wal.fd) == 0)) {
+            wal.writing.len = 0;
+            return 0;
+        }
+        log_formatted(LOG_ERROR, "Metadata log write to segment %llu failed, sealing it: %s",
+                     wal.segment, strerror(errno));
+        close(wal.fd);
+        wal.fd = -1;
+    }
+    return -1;
+}
+
+// Release the commits waiting for records up to `target`: as durable, or as
+// failed, in which case the batch is retried and may still reach the disk
+static void batch_done(unsigned long long target, int written) {
+    pthread_mutex_lock(&wal.mutex);
+    if (written) {
+        if (target > wal.durable_lsn) wal.durable_lsn = target;
+        wal.unwritten = 0;
+    } else {
+        if (target > wal.failed_lsn) wal.failed_lsn = target;
+        wal.unwritten = 1;
+    }
+    wal.syncs++;
+    pthread_cond_broadcast(&wal.durable_cond);
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+// Write out everything appended so far; every thread waiting in
+// meta_log_commit meanwhile is released together
+static void flush_pending() {
+    pthread_mutex_lock(&wal.io_mutex);
+    unsigned long long target = take_pending();
+    if (wal.writing.len > 0) batch_done(target, write_batch() == 0);
+    pthread_mutex_unlock(&wal.io_mutex);
+}
+
+static void* flusher_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&wal.mutex);
+    while (wal.running || wal.pending.len > 0) {
+        if (wal.pending.len == 0 && !wal.unwritten) {
+            pthread_cond_wait(&wal.flush_cond, &wal.mutex);
+            continue;
+        }
+        if (wal.pending.len == 0) {
+            // Retry a failed batch after a pause, or as soon as more arrives
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += WRITE_RETRY_MS / 1000;
+            deadline.tv_nsec += (WRITE_RETRY_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wal.flush_cond, &wal.mutex, &deadline);
+        }
+        pthread_mutex_unlock(&wal.mutex);
+        flush_pending();
+        pthread_mutex_lock(&wal.mutex);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return NULL;
+}
+
+// ---- Snapshots ----
+
+static void snapshot_flush(MetaSnapshot *snap) {
+    if (snap->buf.len == 0) return;
+    if (fwrite(snap->buf.data, 1, snap->buf.len, snap->fp) != snap->buf.len) snap->failed = 1;
+    snap->bytes += snap->buf.len;
+    snap->buf.len = 0;
+}
+
+static void snapshot_record_done(MetaSnapshot *snap, size_t before) {
+    if (snap->buf.len > before) {
+        snap->records++;
+    } else {
+        snap->failed = 1;
+    }
+    if (snap->buf.len >= SNAPSHOT_FLUSH_BYTES) snapshot_flush(snap);
+}
+
+void meta_snapshot_file(MetaSnapshot *snap, const FileMetadata *meta) {
+    size_t before = snap->buf.len;
+    encode_file(&snap->buf, meta);
+    snapshot_record_done(snap, before);
+}
+
+void meta_snapshot_folder(MetaSnapshot *snap, const char *path, const FolderMetadata *meta) {
+    size_t before = snap->buf.len;
+    encode_folder(&snap->buf, path, meta);
+    snapshot_record_done(snap, before);
+}
+
+void meta_snapshot_user(MetaSnapshot *snap, const RegisteredUser *user) {
+    size_t before = snap->buf.len;
+    encode_user(&snap->buf, user);
+    snapshot_record_done(snap, before);
+}
+
+void meta_snapshot_request(MetaSnapshot *snap, const AccessRequest *req) {
+    size_t before = snap->buf.len;
+    encode_request(&snap->buf, META_REQUEST_ADD, req);
+    snapshot_record_done(snap, before);
+}
+
+// Make the current segment durable and switch appends to a new one. A batch
+// that cannot be written stays queued and goes to the new segment first.
+static int rotate_segment(unsigned long long *new_seq) {
+    pthread_mutex_lock(&wal.io_mutex);
+
+    unsigned long long target = take_pending();
+    if (wal.writing.len > 0) batch_done(target, write_batch() == 0);
+
+    int fd = create_segment(wal.segment + 1);
+    if (fd < 0) {
+        pthread_mutex_unlock(&wal.io_mutex);
+        log_formatted(LOG_ERROR, "Cannot start metadata log segment %llu: %s", wal.segment + 1, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&wal.mutex);
+    int old_fd = wal.fd;
+    wal.fd = fd;
+    wal.segment++;
+    wal.log_bytes = sizeof(SegmentHeader) + wal.writing.len + wal.pending.len;
+    wal.snapshot_lsn = wal.appended_lsn;
+    *new_seq = wal.segment;
+    pthread_mutex_unlock(&wal.mutex);
+
+    if (old_fd >= 0) close(old_fd);
+    pthread_mutex_unlock(&wal.io_mutex);
+    return 0;
+}
+
+int meta_log_snapshot() {
+    if (!wal.open || !wal.dump) return -1;
+    pthread_mutex_lock(&wal.snapshot_mutex);
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    // Changes from here on go to the new segment; the dump below sees at
+    // least everything before it. Replaying a record the snapshot already
+    // has is harmless.
+    unsigned long long replay_from;
+    if (rotate_segment(&replay_from) < 0) {
+        pthread_mutex_unlock(&wal.snapshot_mutex);
+        return -1;
+    }
+
+    char tmp_path[MAX_PATH], path[MAX_PATH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/snapshot.tmp", wal.dir);
+    snprintf(path, sizeof(path), "%s/snapshot", wal.dir);
+
+    MetaSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    snap.fp = fopen(tmp_path, "wb");
+    if (!snap.fp) {
+        pthread_mutex_unlock(&wal.snapshot_mutex);
+        log_formatted(LOG_ERROR, "Cannot write metadata snapshot: %s", strerror(errno));
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = META_VERSION;
+    header.replay_from = replay_from;
+    if (fwrite(&header, sizeof(header), 1, snap.fp) != 1) snap.failed = 1;
+
+    wal.dump(&snap, wal.dump_ctx);
+    snapshot_flush(&snap);
+    free(snap.buf.data);
+
+    header.record_count = snap.records;
+    if (fseek(snap.fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, snap.fp) != 1 ||
+        fflush(snap.fp) != 0 || fsync(fileno(snap.fp)) != 0) {
+        snap.failed = 1;
+    }
+    fclose(snap.fp);
+
+    if (snap.failed || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        pthread_mutex_unlock(&wal.snapshot_mutex);
+        log_formatted(LOG_ERROR, "Metadata snapshot failed");
+        return -1;
+    }
+    sync_dir(wal.dir);
+
+    // Segments before the new one are covered by the snapshot now
+    unsigned long long *seqs;
+    int seq_count = list_segments(wal.dir, &seqs);
+    for (int i = 0; i < seq_count && seqs[i] < replay_from; i++) {
+        segment_path(wal.dir, seqs[i], path, sizeof(path));
+        unlink(path);
+    }
+    free(seqs);
+
+    pthread_mutex_lock(&wal.mutex);
+    wal.snapshots++;
+    pthread_mutex_unlock(&wal.mutex);
+    pthread_mutex_unlock(&wal.snapshot_mutex);
+
+    log_formatted(LOG_INFO, "Metadata snapshot: %lld records, %.1f KB in %.1f ms (log continues in segment %llu)",
+                 snap.records, snap.bytes / 1024.0, elapsed_ms(&start), replay_from);
+    return 0;
+}
+
+// Snapshot every snapshot_interval seconds if anything changed, or early
+// once the current segment outgrows snapshot_wal_bytes
+static void* snapshot_thread(void *arg) {
+    (void)arg;
+    time_t last = time(NULL);
+
+    pthread_mutex_lock(&wal.mutex);
+    while (wal.running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&wal.snapshot_cond, &wal.mutex, &deadline);
+        if (!wal.running) break;
+
+        time_t now = time(NULL);
+        int changed = wal.appended_lsn > wal.snapshot_lsn;
+        int due = (wal.snapshot_interval > 0 && changed && now - last >= wal.snapshot_interval) ||
+                  (wal.snapshot_wal_bytes > 0 && wal.log_bytes >= wal.snapshot_wal_bytes);
+        if (!due) continue;
+
+        pthread_mutex_unlock(&wal.mutex);
+        meta_log_snapshot();
+        last = time(NULL);
+        pthread_mutex_lock(&wal.mutex);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return NULL;
+}
+
+int meta_log_open(const char *dir, int fsync_enabled, int snapshot_interval,
+                  long long snapshot_wal_bytes, MetaDumpFn dump, void *ctx) {
+    if (wal.open) return 0;
+    mkdir(dir, 0755);
+
+    strncpy(wal.dir, dir, sizeof(wal.dir) - 1);
+    wal.fsync_enabled = fsync_enabled;
+    wal.snapshot_interval = snapshot_interval;
+    wal.snapshot_wal_bytes = snapshot_wal_bytes;
+    wal.dump = dump;
+    wal.dump_ctx = ctx;
+
+    // Continue after both the newest segment and what the snapshot covers
+    unsigned long long next = snapshot_replay_from(dir);
+    unsigned long long *seqs;
+    int seq_count = list_segments(dir, &seqs);
+    if (seq_count > 0 && seqs[seq_count - 1] >= next) next = seqs[seq_count - 1] + 1;
+    free(seqs);
+    if (next == 0) next = 1;
+
+    wal.fd = create_segment(next);
+    if (wal.fd < 0) {
+        log_formatted(LOG_ERROR, "Cannot open metadata log in %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    wal.segment = next;
+    wal.log_bytes = sizeof(SegmentHeader);
+    // LSNs keep counting across a close and reopen, so a thread's last
+    // append never looks newer than the log
+    wal.snapshot_lsn = wal.appended_lsn;
+    wal.running = 1;
+    wal.open = 1;
+
+    if (pthread_create(&wal.flusher_tid, NULL, flusher_thread, NULL) != 0) {
+        wal.open = 0;
+        wal.running = 0;
+        close(wal.fd);
+        return -1;
+    }
+    if (pthread_create(&wal.snapshot_tid, NULL, snapshot_thread, NULL) != 0) {
+        wal.snapshot_tid = 0;
+    }
+
+    log_formatted(LOG_INFO, "Metadata log open in %s (segment %llu, fsync %s)",
+                 dir, next, fsync_enabled ? "on" : "off");
+    return 0;
+}
+
+void meta_log_close() {
+    if (!wal.open) return;
+
+    pthread_mutex_lock(&wal.mutex);
+    wal.running = 0;
+    pthread_cond_broadcast(&wal.flush_cond);
+    pthread_cond_broadcast(&wal.ship_cond);
+    pthread_cond_broadcast(&wal.snapshot_cond);
+    pthread_cond_broadcast(&wal.durable_cond);
+    pthread_mutex_unlock(&wal.mutex);
+
+    pthread_join(wal.flusher_tid, NULL);
+    if (wal.snapshot_tid) pthread_join(wal.snapshot_tid, NULL);
+
+    wal.open = 0;
+    pthread_mutex_lock(&wal.io_mutex);
+    if (wal.writing.len > 0) {
+        log_formatted(LOG_ERROR, "Closing the metadata log with %zu bytes that could not be written",
+                     wal.writing.len);
+    }
+    if (wal.fd >= 0) {
+        if (wal.fsync_enabled) fdatasync(wal.fd);
+        close(wal.fd);
+        wal.fd = -1;
+    }
+    pthread_mutex_unlock(&wal.io_mutex);
+
+    free(wal.pending.data);
+    free(wal.writing.data);
+    memset(&wal.pending, 0, sizeof(MetaBuffer));
+    memset(&wal.writing, 0, sizeof(MetaBuffer));
+}
+
+void meta_log_get_stats(MetaLogStats *stats) {
+    pthread_mutex_lock(&wal.mutex);
+    stats->appended = (long long)wal.appended_lsn;
+    stats->syncs = wal.syncs;
+    stats->snapshots = wal.snapshots;
+    stats->log_bytes = wal.log_bytes;
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+// ---- Log shipping ----
+
+// Called from APPEND with the mutex held
+static void ship_record(const char *data, size_t len) {
+    if (wal.ship_failed) return;
+    if (wal.ship.len + len > SHIP_MAX_BYTES || buffer_reserve(&wal.ship, len) < 0) {
+        // The standby reconnects and starts over from a full copy
+        wal.ship_failed = 1;
+    } else {
+        memcpy(wal.ship.data + wal.ship.len, data, len);
+        wal.ship.len += len;
+    }
+    pthread_cond_signal(&wal.ship_cond);
+}
+
+static int send_marker(int sock, int type) {
+    MetaBuffer b;
+    memset(&b, 0, sizeof(b));
+    long start = begin_record(&b, (MetaRecordType)type);
+    if (start < 0) return -1;
+    end_record(&b, start);
+    int result = write_all(sock, b.data, b.len);
+    free(b.data);
+    return result;
+}
+
+static void standby_gone() {
+    pthread_mutex_lock(&wal.mutex);
+    wal.ship_failed = 1;
+    wal.standby_synced = 0;
+    pthread_cond_broadcast(&wal.ship_cond);
+    pthread_cond_broadcast(&wal.durable_cond);
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+// Reads the standby's confirmations: the count of streamed records it has
+// applied and made durable
+static void* ack_reader(void *arg) {
+    int sock = *(int*)arg;
+    unsigned long long applied;
+    while (1) {
+        ssize_t n = recv(sock, &applied, sizeof(applied), MSG_WAITALL);
+        if (n != (ssize_t)sizeof(applied)) break;
+
+        pthread_mutex_lock(&wal.mutex);
+        wal.standby_lsn = wal.ship_base_lsn + applied;
+        if (!wal.standby_synced) {
+            wal.standby_synced = 1;
+            log_formatted(LOG_INFO, "Standby caught up; commits now wait for it");
+        }
+        pthread_cond_broadcast(&wal.durable_cond);
+        pthread_mutex_unlock(&wal.mutex);
+    }
+    standby_gone();
+    return NULL;
+}
+
+int meta_log_ship(int sock, int lease_ms) {
+    if (!wal.open || !wal.dump) return -1;
+
+    pthread_mutex_lock(&wal.mutex);
+    if (wal.shipping) {
+        pthread_mutex_unlock(&wal.mutex);
+        return -1;
+    }
+    wal.shipping = 1;
+    wal.ship_failed = 0;
+    wal.ship.len = 0;
+    wal.ship_base_lsn = wal.appended_lsn;
+    wal.standby_lsn = wal.appended_lsn;
+    wal.standby_synced = 0;
+    pthread_mutex_unlock(&wal.mutex);
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    struct timeval tv = { lease_ms / 1000, (lease_ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // The full copy first. Changes made meanwhile are buffered and follow
+    // it; replaying one the copy already has is harmless.
+    int failed = send_marker(sock, META_SYNC_START) < 0;
+    MetaSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    int copy_fd = failed ? -1 : dup(sock);
+    snap.fp = copy_fd >= 0 ? fdopen(copy_fd, "w") : NULL;
+    if (snap.fp) {
+        wal.dump(&snap, wal.dump_ctx);
+        snapshot_flush(&snap);
+        if (fflush(snap.fp) != 0) snap.failed = 1;
+        fclose(snap.fp);
+    } else {
+        if (copy_fd >= 0) close(copy_fd);
+        snap.failed = 1;
+    }
+    free(snap.buf.data);
+    if (snap.failed || send_marker(sock, STREAM_SYNC_DONE) < 0) failed = 1;
+
+    pthread_t ack_tid;
+    int acking = !failed && pthread_create(&ack_tid, NULL, ack_reader, &sock) == 0;
+    if (acking) {
+        log_formatted(LOG_INFO, "Sent standby a full copy: %lld records, %.1f KB in %.1f ms",
+                     snap.records, snap.bytes / 1024.0, elapsed_ms(&start));
+    }
+
+    MetaBuffer out;
+    memset(&out, 0, sizeof(out));
+    int ping_ms = lease_ms / 4 > 0 ? lease_ms / 4 : 1;
+    while (acking) {
+        pthread_mutex_lock(&wal.mutex);
+        if (wal.ship.len == 0 && !wal.ship_failed && wal.running) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += ping_ms / 1000;
+            deadline.tv_nsec += (long)(ping_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wal.ship_cond, &wal.mutex, &deadline);
+        }
+        if (wal.ship_failed || !wal.running) {
+            pthread_mutex_unlock(&wal.mutex);
+            break;
+        }
+        MetaBuffer swap = out;
+        out = wal.ship;
+        wal.ship = swap;
+        wal.ship.len = 0;
+        pthread_mutex_unlock(&wal.mutex);
+
+        int result = out.len > 0 ? write_all(sock, out.data, out.len) : send_marker(sock, STREAM_PING);
+        out.len = 0;
+        if (result < 0) break;
+    }
+    free(out.data);
+
+    standby_gone();
+    shutdown(sock, SHUT_RDWR);
+    if (acking) pthread_join(ack_tid, NULL);
+
+    pthread_mutex_lock(&wal.mutex);
+    wal.shipping = 0;
+    free(wal.ship.data);
+    memset(&wal.ship, 0, sizeof(MetaBuffer));
+    pthread_mutex_unlock(&wal.mutex);
+
+    log_formatted(LOG_WARNING, "Standby detached");
+    return 0;
+}
+
+MetaFollowEnd meta_log_follow(int sock, MetaApplyFn apply, void *ctx, int lease_ms, int *synced) {
+    *synced = 0;
+    struct timeval tv = { lease_ms / 1000, (lease_ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    unsigned char *buf = malloc(FOLLOW_BUFFER);
+    MetaRecord *rec = malloc(sizeof(MetaRecord));
+    if (!buf || !rec) {
+        free(buf);
+        free(rec);
+        return META_FOLLOW_CLOSED;
+    }
+
+    size_t have = 0;
+    unsigned long long applied = 0;     // Records after the full copy
+    long long copied = 0;
+    MetaFollowEnd end = META_FOLLOW_CLOSED;
+
+    while (1) {
+        ssize_t n = recv(sock, buf + have, FOLLOW_BUFFER - have, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            end = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? META_FOLLOW_LAPSED : META_FOLLOW_CLOSED;
+            break;
+        }
+        have += n;
+
+        size_t off = 0;
+        int bad = 0;
+        while (off + RECORD_HEADER <= have) {
+            unsigned int len, crc;
+            memcpy(&len, buf + off, 4);
+            memcpy(&crc, buf + off + 4, 4);
+            if (len == 0 || len > META_MAX_RECORD) {
+                bad = 1;
+                break;
+            }
+            if (off + RECORD_HEADER + len > have) break;
+
+            const unsigned char *payload = buf + off + RECORD_HEADER;
+            off += RECORD_HEADER + len;
+            if (crc32_of(payload, len) != crc) {
+                bad = 1;
+                break;
+            }
+            if (payload[0] == STREAM_PING) continue;
+            if (payload[0] == STREAM_SYNC_DONE) {
+                *synced = 1;
+                log_formatted(LOG_INFO, "Received the primary's full copy (%lld records)", copied);
+                continue;
+            }
+            if (decode_record(payload, len, rec) < 0) {
+                bad = 1;
+                break;
+            }
+            apply(rec, ctx);
+            if (*synced) applied++;
+            else copied++;
+        }
+        if (bad) {
+            log_formatted(LOG_ERROR, "Corrupt record in the primary's log stream");
+            end = META_FOLLOW_CORRUPT;
+            break;
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+
+        // Confirm only what is durable here too. If it cannot be made so,
+        // drop the stream: the primary stops waiting for this standby.
+        if (*synced) {
+            if (meta_log_commit() < 0) {
+                log_formatted(LOG_ERROR, "Cannot make the primary's records durable here");
+                break;
+            }
+            if (write_all(sock, (const char*)&applied, sizeof(applied)) < 0) break;
+        }
+    }
+
+    free(buf);
+    free(rec);
+    return end;
+}
@@ -0,0 +1,132 @@
+#ifndef META_LOG_H
+#define META_LOG_H
+
+#include "common.h"
+
+// Durable name server metadata: files, folders, registered users and pending
+// access requests.
+//
+// Every change is appended to a write-ahead log as a compact binary record
+// holding the entry's new value (or its key, for deletes), so replaying a
+// record twice is harmless. A flusher thread writes and fsyncs whatever has
+// accumulated since its last fsync in one go (group commit); a thread that
+// must not acknowledge a change before it is durable calls meta_log_commit().
+//
+// Every so often the log is rotated to a new segment and the whole state is
+// written out as a snapshot: a header followed by records in the same
+// format, which a restart maps into memory and walks without parsing text.
+// Recovery applies the snapshot, then the segments written since it.
+//
+// A standby NM follows the same records over a socket: a full copy in
+// snapshot order, then every record as it is appended. Once the standby has
+// caught up, meta_log_commit() also waits for it to confirm, so a change
+// acknowledged to a client survives a takeover.
+//
+// Layout of the metadata directory:
+//   snapshot          latest snapshot (written as snapshot.tmp, then renamed)
+//   wal.NNNNNNNNNNNN  log segments, replayed in order
+
+#define META_DIR_DEFAULT "nm_meta"         // NM_META_DIR ("" turns persistence off)
+#define META_SNAPSHOT_INTERVAL 60          // Seconds between snapshots (NM_SNAPSHOT_INTERVAL)
+#define META_SNAPSHOT_WAL_MB 64            // Log size that forces an early snapshot (NM_SNAPSHOT_WAL_MB)
+
+typedef enum {
+    META_FILE_PUT = 1,
+    META_FILE_DELETE,
+    META_FILE_TOUCH,       // Only accessed/last_accessed_by changed
+    META_FOLDER_PUT,
+    META_FOLDER_DELETE,
+    META_USER_PUT,
+    META_REQUEST_ADD,
+    META_REQUEST_DELETE,
+    META_SYNC_START        // Log shipping only: drop everything, a full copy follows
+} MetaRecordType;
+
+// One decoded record. `key` is the file name or folder path; the other
+// fields are filled according to the type.
+typedef struct {
+    MetaRecordType type;
+    char key[MAX_PATH];
+    FileMetadata file;        // META_FILE_PUT, and accessed/last_accessed_by for META_FILE_TOUCH
+    FolderMetadata folder;    // META_FOLDER_PUT
+    RegisteredUser user;      // META_USER_PUT
+    AccessRequest request;    // META_REQUEST_ADD / META_REQUEST_DELETE
+} MetaRecord;
+
+typedef struct {
+    long long snapshot_records;
+    long long log_records;
+    long long torn_records;        // Unreadable records skipped at a segment's end
+    double map_ms;                 // Time spent walking and decoding records
+} MetaRecoveryStats;
+
+typedef struct {
+    long long appended;            // Records appended since open
+    long long syncs;               // fsyncs by the flusher (each covers a group of records)
+    long long snapshots;
+    long long log_bytes;           // In the current segment
+} MetaLogStats;
+
+// Why meta_log_follow() returned
+typedef enum {
+    META_FOLLOW_CLOSED,            // The primary closed the stream
+    META_FOLLOW_LAPSED,            // Nothing arrived for a whole lease
+    META_FOLLOW_CORRUPT            // A record failed its checksum
+} MetaFollowEnd;
+
+typedef struct MetaSnapshot MetaSnapshot;
+
+// Called with each recovered record, in log order
+typedef void (*MetaApplyFn)(MetaRecord *rec, void *ctx);
+
+// Called to write out the whole state through the meta_snapshot_* functions
+typedef void (*MetaDumpFn)(MetaSnapshot *snap, void *ctx);
+
+// Apply the snapshot in `dir` and then every later log segment. Returns 0,
+// or -1 if the snapshot was unreadable (what could be read was applied).
+int meta_log_recover(const char *dir, MetaApplyFn apply, void *ctx, MetaRecoveryStats *stats);
+
+// Start logging to a new segment in `dir`, with the flusher and snapshot
+// threads. `fsync_enabled` 0 leaves durability to the page cache.
+int meta_log_open(const char *dir, int fsync_enabled, int snapshot_interval,
+                  long long snapshot_wal_bytes, MetaDumpFn dump, void *ctx);
+
+// Flush, fsync and stop the background threads
+void meta_log_close();
+
+// Append a change. Cheap and non-blocking; no-ops while the log is closed.
+void meta_log_put_file(const FileMetadata *meta);
+void meta_log_delete_file(const char *filename);
+void meta_log_touch_file(const char *filename, time_t accessed, const char *username);
+void meta_log_put_folder(const char *path, const FolderMetadata *meta);
+void meta_log_delete_folder(const char *path);
+void meta_log_put_user(const RegisteredUser *user);
+void meta_log_add_request(const AccessRequest *req);
+void meta_log_delete_request(const AccessRequest *req);
+
+// Wait until every change the calling thread appended is on disk. Returns -1
+// if writing one of them failed: the change must not be acknowledged (the log
+// keeps retrying it, so it may still become durable later).
+int meta_log_commit();
+
+// Rotate the log and write a snapshot now; returns 0 on success
+int meta_log_snapshot();
+
+void meta_log_get_stats(MetaLogStats *stats);
+
+// Primary side: stream the log to a standby on `sock` until it disconnects,
+// stops confirming for `lease_ms`, or falls too far behind. One standby at a
+// time; returns -1 if another is attached.
+int meta_log_ship(int sock, int lease_ms);
+
+// Standby side: apply the stream from a primary. Pings arrive at least every
+// quarter lease. `synced` is set once the full copy has been applied.
+MetaFollowEnd meta_log_follow(int sock, MetaApplyFn apply, void *ctx, int lease_ms, int *synced);
+
+// Used by the dump callback, once per entry
+void meta_snapshot_file(MetaSnapshot *snap, const FileMetadata *meta);
+void meta_snapshot_folder(MetaSnapshot *snap, const char *path, const FolderMetadata *meta);
+void meta_snapshot_user(MetaSnapshot *snap, const RegisteredUser *user);
+void meta_snapshot_request(MetaSnapshot *snap, const AccessRequest *req);
+
+#endif // META_LOG_H
@@ -0,0 +1,141 @@
+#include "name_index.h"
+
+NameIndexNode* create_index_node(const char *key, int level) {
+    NameIndexNode *node = malloc(sizeof(NameIndexNode) + level * sizeof(NameIndexNode*));
+    node->key = key ? strdup(key) : NULL;
+    node->level = level;
+    for (int i = 0; i < level; i++) {
+        node->next[i] = NULL;
+    }
+    return node;
+}
+
+NameIndex* init_name_index() {
+    NameIndex *index = malloc(sizeof(NameIndex));
+    index->head = create_index_node(NULL, NAME_INDEX_MAX_LEVEL);
+    index->level = 1;
+    index->size = 0;
+    index->seed = 0x9e3779b9u;
+    pthread_rwlock_init(&index->lock, NULL);
+    return index;
+}
+
+void free_name_index(NameIndex *index) {
+    if (!index) return;
+
+    NameIndexNode *node = index->head->next[0];
+    while (node) {
+        NameIndexNode *next = node->next[0];
+        free(node->key);
+        free(node);
+        node = next;
+    }
+    free(index->head);
+    pthread_rwlock_destroy(&index->lock);
+    free(index);
+}
+
+// Each level up is taken with probability 1/4 (xorshift; caller holds the
+// write lock)
+int random_level(NameIndex *index) {
+    int level = 1;
+    while (level < NAME_INDEX_MAX_LEVEL) {
+        index->seed ^= index->seed << 13;
+        index->seed ^= index->seed >> 17;
+        index->seed ^= index->seed << 5;
+        if ((index->seed & 3) != 0) break;
+        level++;
+    }
+    return level;
+}
+
+// Last node before `key` on every level
+void find_predecessors(NameIndex *index, const char *key, NameIndexNode **update) {
+    NameIndexNode *node = index->head;
+    for (int i = index->level - 1; i >= 0; i--) {
+        while (node->next[i] && strcmp(node->next[i]->key, key) < 0) {
+            node = node->next[i];
+        }
+        update[i] = node;
+    }
+}
+
+int name_index_insert(NameIndex *index, const char *key) {
+    if (strlen(key) >= NAME_INDEX_MAX_KEY) return -1;
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    NameIndexNode *update[NAME_INDEX_MAX_LEVEL];
+    find_predecessors(index, key, update);
+    NameIndexNode *found = update[0]->next[0];
+    if (found && strcmp(found->key, key) == 0) {
+        pthread_rwlock_unlock(&index->lock);
+        return 1;
+    }
+
+    int level = random_level(index);
+    for (int i = index->level; i < level; i++) {
+        update[i] = index->head;
+    }
+    if (level > index->level) index->level = level;
+
+    NameIndexNode *node = create_index_node(key, level);
+    for (int i = 0; i < level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    index->size++;
+
+    pthread_rwlock_unlock(&index->lock);
+    return 0;
+}
+
+int name_index_remove(NameIndex *index, const char *key) {
+    pthread_rwlock_wrlock(&index->lock);
+
+    NameIndexNode *update[NAME_INDEX_MAX_LEVEL];
+    find_predecessors(index, key, update);
+    NameIndexNode *node = update[0]->next[0];
+    if (!node || strcmp(node->key, key) != 0) {
+        pthread_rwlock_unlock(&index->lock);
+        return 1;
+    }
+
+    for (int i = 0; i < node->level; i++) {
+        update[i]->next[i] = node->next[i];
+    }
+    while (index->level > 1 && index->head->next[index->level - 1] == NULL) {
+        index->level--;
+    }
+    index->size--;
+
+    pthread_rwlock_unlock(&index->lock);
+    free(node->key);
+    free(node);
+    return 0;
+}
+
+int name_index_scan(NameIndex *index, const char *prefix, NameVisitFn visit, void *ctx) {
+    size_t prefix_len = strlen(prefix);
+    int visited = 0;
+
+    pthread_rwlock_rdlock(&index->lock);
+
+    NameIndexNode *update[NAME_INDEX_MAX_LEVEL];
+    find_predecessors(index, prefix, update);
+    for (NameIndexNode *node = update[0]->next[0]; node; node = node->next[0]) {
+        if (strncmp(node->key, prefix, prefix_len) != 0) break;
+        visited++;
+        if (visit(node->key, ctx)) break;
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+    return visited;
+}
+
+int name_index_size(NameIndex *index) {
+    pthread_rwlock_rdlock(&index->lock);
+    int size = index->size;
+    pthread_rwlock_unlock(&index->lock);
+    return size;
+}
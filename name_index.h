@@ -0,0 +1,44 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include "common.h"
+
+// Ordered set of strings (a skip list), for listing every key that starts
+// with a prefix in sorted order without walking the whole set.
+
+#define NAME_INDEX_MAX_LEVEL 24
+#define NAME_INDEX_MAX_KEY (MAX_PATH + MAX_FILENAME)
+
+// Called for each key in order; return nonzero to stop the scan
+typedef int (*NameVisitFn)(const char *key, void *ctx);
+
+typedef struct NameIndexNode {
+    char *key;
+    int level;
+    struct NameIndexNode *next[];
+} NameIndexNode;
+
+typedef struct {
+    NameIndexNode *head;
+    int level;                // Highest level in use
+    int size;
+    unsigned int seed;        // Level generator state (write lock)
+    pthread_rwlock_t lock;
+} NameIndex;
+
+NameIndex* init_name_index();
+void free_name_index(NameIndex *index);
+
+// Returns 0 if added, 1 if already present, -1 if the key is too long
+int name_index_insert(NameIndex *index, const char *key);
+
+// Returns 0 if removed, 1 if it was not there
+int name_index_remove(NameIndex *index, const char *key);
+
+// Visit keys starting with `prefix`, in order, under the read lock.
+// Returns how many were visited.
+int name_index_scan(NameIndex *index, const char *prefix, NameVisitFn visit, void *ctx);
+
+int name_index_size(NameIndex *index);
+
+#endif // NAME_INDEX_H
@@ -2,30 +2,118 @@
 #include "common.h"
 #include "logger.h"
 #include "trie.h"
-#include "cache.h"
+#include "file_store.h"
+#include "access_tracker.h"
+#include "reactor.h"
+#include "placement.h"
+#include "meta_log.h"
+#include "lease.h"
+#include "capture.h"
+#include "stats.h"
+#include "trace.h"
+#include "lock_stats.h"
 #include <ctype.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
 
 // #define NM_SS_PORT 8080
 // #define NM_CLIENT_PORT 8081
-#define HEARTBEAT_TIMEOUT 15
+#define HEARTBEAT_TIMEOUT_MS 15000  // Silence before an SS is declared dead (NM_HEARTBEAT_TIMEOUT_MS)
+#define HEARTBEAT_GRACE_MS 60000    // Allowed a new SS to open its heartbeat channel (NM_HEARTBEAT_GRACE_MS)
+#define HEARTBEAT_CHECK_MS 5000     // Between heartbeat monitor passes (NM_HEARTBEAT_CHECK_MS)
+#define NM_MAX_SESSIONS 65536     // Concurrent client sessions held by the reactor
+#define NM_MAX_USERS 65536        // Distinct usernames ever registered
+#define NM_SS_POOL_MAX 16         // Command connections accepted per SS
+#define NM_DEFAULT_REPLICAS 2     // Copies of each new file, primary included (NM_REPLICAS)
+#define NM_REPL_RETRY_INTERVAL 2  // Seconds between retries of unfinished replica repairs
+#define NM_STALE_REPORTS 1024     // Stale-backup reports queued for the repair thread
+#define NM_HOT_SLOTS 4096         // Files whose request rate is tracked (power of two)
+#define NM_MIGRATE_INTERVAL 10    // Seconds between hot-file balancing passes (NM_MIGRATE_INTERVAL)
+#define NM_HOT_MIN_RATE 5.0       // Requests per second before a file or server counts as hot
+#define NM_HOT_IMBALANCE 1.5      // Busiest server's rate over the mean that triggers a move
+#define NM_MIGRATE_COOLDOWN 60    // Seconds before a moved file may move again
+#define NM_DRAIN_BATCH 16         // File copies moved off draining servers per pass
+#define NM_PLAN_BATCH 64          // File copies moved to their ring servers per pass (chash)
+#define NM_HANDOFF_ATTEMPTS 20    // Tries to hand a primary over while its sentences are locked
+#define NM_HANDOFF_RETRY_MS 100
+#define NM_LEASE_MS 2000          // Silence on the log stream before a standby takes over (NM_LEASE_MS)
+#define NM_PEER_IDLE_MAX 8        // Idle connections kept open to each other shard
+#define NM_PEER_TIMEOUT 10        // Seconds to wait on another shard's reply
 
+// This shard's port for one of the NM_*_PORT bases
+#define SHARD_PORT(base) nm_shard_port(base, nm.shard)
+
+// Command connections to one SS. Guarded by that SS's ss_sock_mutexes entry.
+typedef struct {
+    int socks[NM_SS_POOL_MAX];
+    int busy[NM_SS_POOL_MAX];
+    int count;
+    int generation;               // Bumped whenever the pool is torn down
+    pthread_cond_t available;
+} SSCommandPool;
+
+// Routed requests per file, for finding hot files
+typedef struct {
+    char filename[MAX_FILENAME];
+    int used;
+    int hits;                     // Requests in the current window
+    double rate;                  // Smoothed requests per second
+    time_t last_moved;
+} HotFile;
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int backup_id;
+} StaleReport;
+
+// Connections to another name server shard's peer port
 typedef struct {
-    Trie *file_trie;
+    pthread_mutex_t lock;
+    int idle[NM_PEER_IDLE_MAX];
+    int idle_count;
+} ShardPeer;
+
+typedef struct {
+    FileStore *files;          // File metadata, sharded by name
     FolderTrie *folder_trie;
-    LRUCache *cache;
     
     StorageServerInfo ss_list[MAX_SS];
     int ss_count;
     pthread_mutex_t ss_mutex;
-    pthread_mutex_t ss_sock_mutexes[MAX_SS];  // One mutex per SS socket - N
-    int next_ss_id;
+    pthread_mutex_t ss_sock_mutexes[MAX_SS];  // One mutex per SS socket pool - N
+    SSCommandPool ss_pools[MAX_SS];
+    SSLoad ss_loads[MAX_SS];   // Last load report per SS slot (ss_mutex)
+    Placement placement;       // Placement policy state (ss_mutex)
+    int planned_ring;          // Ring generation the transfer planner last ran for
+    int ss_config_dirty[MAX_SS];  // SS re-registered: resend its replica sets (ss_mutex)
+    int ss_draining[MAX_SS];      // SS asked to be emptied (ss_mutex)
+
+    int replicas;              // Copies kept of each new file
+    unsigned int read_cursor;  // Spreads reads over a file's replicas
+    pthread_mutex_t repl_mutex;
+    pthread_cond_t repl_cond;
+    int repl_pending;          // Replica repair pass requested (repl_mutex)
+    StaleReport stale_reports[NM_STALE_REPORTS];  // Applied by the repair thread (repl_mutex)
+    int stale_report_count;
+
+    HotFile *hot_files;        // Open-addressed by filename hash (hot_mutex)
+    pthread_mutex_t hot_mutex;
+    struct timeval hot_window_start;
+    int migrate_interval;      // 0 disables hot-file balancing
+
+    unsigned char lease_key[LEASE_KEY_BYTES];  // Signs route leases; shared with our SSs
+    int lease_ttl_ms;          // 0 turns route leases off (NM_ROUTE_LEASE_MS)
+
+    int hb_timeout_ms;
+    int hb_grace_ms;
+    int hb_check_ms;
     
-    RegisteredUser registered_users[MAX_CLIENTS * 10];
+    RegisteredUser registered_users[NM_MAX_USERS];
     int registered_user_count;
     pthread_mutex_t registered_users_mutex;
 
-    ClientInfo client_list[MAX_CLIENTS];
+    ClientInfo client_list[NM_MAX_SESSIONS];
     int client_count;
     pthread_mutex_t client_mutex;
     
@@ -37,166 +125,1441 @@ typedef struct {
     AccessRequest access_requests[MAX_FILES * 10];  // Queue of access requests
     int request_count;
     pthread_mutex_t request_mutex;
+
+    long long recovered_records;  // Read back from NM_META_DIR at startup
+
+    int shard;                 // Slice of the namespace this NM owns (NM_SHARD)
+    int shards;                // Name servers the namespace is split over (NM_SHARDS)
+    char shard_hosts[MAX_NM_SHARDS][INET_ADDRSTRLEN];  // From NM_SHARD_HOSTS
+    ShardPeer peers[MAX_NM_SHARDS];
 } NameServer;
 
 NameServer nm;
 
-// Function declarations (same as before)
-void* handle_ss_connection(void* arg);
-void* handle_client_connection(void* arg);
-void* ss_listener(void* arg);
-void* client_listener(void* arg);
-void* heartbeat_monitor(void* arg);
-int find_ss_for_file(const char *filename);
-int get_next_ss_round_robin();
-void handle_view(int client_sock, Message *msg);
-void handle_info(int client_sock, Message *msg);
-void handle_list(int client_sock, Message *msg);
-void handle_create(int client_sock, Message *msg);
-void handle_delete(int client_sock, Message *msg);
-void handle_access(int client_sock, Message *msg);
-void handle_exec(int client_sock, Message *msg);
-int check_access(const char *filename, const char *username, AccessType required);
+LOCK_STATS_DEFINE(ss_lock_stats, "nm.ss_mutex");
+LOCK_STATS_DEFINE(ss_sock_lock_stats, "nm.ss_sock_mutexes");
+LOCK_STATS_DEFINE(registered_users_lock_stats, "nm.registered_users_mutex");
+
+// Function declarations (same as before)
+int on_ss_frame(Connection *conn, Message *msg);
+int on_client_frame(Connection *conn, Message *msg);
+void on_client_close(Connection *conn);
+void dispatch_client_request(int client_sock, Message *msg);
+int ss_command(int ss_idx, Message *request, Message *response);
+void retire_ss_pool(int idx);
+void* heartbeat_monitor(void* arg);
+int find_ss_for_file(const char *filename);
+int choose_ss_for_placement(const char *key);
+void request_replica_repair();
+void* replica_repair_thread(void* arg);
+void apply_access_update(const char *filename, time_t accessed, const char *username, int hits, void *ctx);
+void handle_view(int client_sock, Message *msg);
+void handle_info(int client_sock, Message *msg);
+void handle_list(int client_sock, Message *msg);
+void handle_create(int client_sock, Message *msg);
+void handle_delete(int client_sock, Message *msg);
+void handle_access(int client_sock, Message *msg);
+void handle_exec(int client_sock, Message *msg);
+int check_access(const char *filename, const char *username, AccessType required);
+
+// Added new function declarations for heartbeat handling - N
+int on_ss_heartbeat_frame(Connection *conn, Message *msg);
+void on_ss_heartbeat_close(Connection *conn);
+void recover_metadata();
+
+// Name server shards
+static __thread int serving_peer = 0;   // This thread answers another shard: no fan-out
+int shard_request(int shard, Message *msg, Message *response);
+int gather_from_shards(Message *msg, char *buffer, int pos, int cap);
+int folder_exists(const char *path);
+
+// Which slice of the namespace this NM serves, and where the other slices
+// live: NM_SHARD of NM_SHARDS, with NM_SHARD_HOSTS listing each shard's IP
+// (all on this machine by default). Shard k uses the NM ports plus
+// k * NM_SHARD_PORT_STRIDE.
+void init_shards() {
+    nm.shards = get_env_int("NM_SHARDS", 1);
+    nm.shard = get_env_int("NM_SHARD", 0);
+    if (nm.shards < 1 || nm.shards > MAX_NM_SHARDS || nm.shard < 0 || nm.shard >= nm.shards) {
+        fprintf(stderr, "[NM] NM_SHARD=%d / NM_SHARDS=%d is out of range (at most %d shards)\n",
+                nm.shard, nm.shards, MAX_NM_SHARDS);
+        exit(1);
+    }
+
+    const char *hosts = getenv("NM_SHARD_HOSTS");
+    char list[MAX_NM_SHARDS * (INET_ADDRSTRLEN + 1)] = "";
+    if (hosts) strncpy(list, hosts, sizeof(list) - 1);
+    char *save = NULL;
+    char *host = strtok_r(list, ",", &save);
+    for (int i = 0; i < nm.shards; i++) {
+        strncpy(nm.shard_hosts[i], host ? host : "127.0.0.1", INET_ADDRSTRLEN - 1);
+        if (host) host = strtok_r(NULL, ",", &save);
+
+        pthread_mutex_init(&nm.peers[i].lock, NULL);
+        nm.peers[i].idle_count = 0;
+    }
+}
+
+void init_name_server() {
+    init_shards();
+    nm.files = init_file_store(get_env_int("NM_STORE_SHARDS", FILE_STORE_SHARDS), CACHE_SIZE);
+    nm.folder_trie = init_folder_trie();
+    nm.ss_count = 0;
+    nm.client_count = 0;
+    nm.running = 1;
+    memset(nm.ss_loads, 0, sizeof(nm.ss_loads));
+
+    const char *policy_name = getenv("NM_PLACEMENT");
+    int policy = placement_policy_from_name(policy_name ? policy_name : PLACEMENT_DEFAULT);
+    if (policy < 0) {
+        fprintf(stderr, "[NM] Unknown NM_PLACEMENT '%s', using %s\n", policy_name, PLACEMENT_DEFAULT);
+        policy = placement_policy_from_name(PLACEMENT_DEFAULT);
+    }
+    placement_init(&nm.placement, policy, (unsigned int)time(NULL));
+    nm.placement.vnodes = get_env_int("NM_VNODES", PLACEMENT_VNODES);
+    nm.planned_ring = 0;
+
+    nm.replicas = get_env_int("NM_REPLICAS", NM_DEFAULT_REPLICAS);
+    if (nm.replicas < 1) nm.replicas = 1;
+    if (nm.replicas > MAX_REPLICAS) nm.replicas = MAX_REPLICAS;
+    nm.read_cursor = 0;
+    nm.repl_pending = 0;
+    nm.stale_report_count = 0;
+    memset(nm.ss_config_dirty, 0, sizeof(nm.ss_config_dirty));
+    memset(nm.ss_draining, 0, sizeof(nm.ss_draining));
+    pthread_mutex_init(&nm.repl_mutex, NULL);
+    pthread_cond_init(&nm.repl_cond, NULL);
+
+    nm.hot_files = calloc(NM_HOT_SLOTS, sizeof(HotFile));
+    pthread_mutex_init(&nm.hot_mutex, NULL);
+    gettimeofday(&nm.hot_window_start, NULL);
+    nm.migrate_interval = get_env_int("NM_MIGRATE_INTERVAL", NM_MIGRATE_INTERVAL);
+
+    // A new key each start: leases from an earlier NM (or the primary a
+    // standby replaced) stop verifying once the SSs register again
+    lease_generate_key(nm.lease_key);
+    nm.lease_ttl_ms = get_env_int("NM_ROUTE_LEASE_MS", LEASE_TTL_MS);
+
+    nm.hb_timeout_ms = get_env_int("NM_HEARTBEAT_TIMEOUT_MS", HEARTBEAT_TIMEOUT_MS);
+    nm.hb_grace_ms = get_env_int("NM_HEARTBEAT_GRACE_MS", HEARTBEAT_GRACE_MS);
+    nm.hb_check_ms = get_env_int("NM_HEARTBEAT_CHECK_MS", HEARTBEAT_CHECK_MS);
+    if (nm.hb_check_ms < 1) nm.hb_check_ms = 1;
+    
+    pthread_mutex_init(&nm.ss_mutex, NULL);
+    pthread_mutex_init(&nm.client_mutex, NULL);
+    pthread_mutex_init(&nm.request_mutex, NULL);
+    pthread_mutex_init(&nm.registered_users_mutex, NULL);
+    nm.registered_user_count = 0;
+    nm.request_count = 0;
+    
+    // Initialize registered users array
+    for (int i = 0; i < NM_MAX_USERS; i++) {
+        nm.registered_users[i].active_session = 0;
+        nm.registered_users[i].client_sock = -1;
+    }
+    
+    // Initialize per-SS socket mutexes
+    for (int i = 0; i < MAX_SS; i++) {
+        pthread_mutex_init(&nm.ss_sock_mutexes[i], NULL);
+        pthread_cond_init(&nm.ss_pools[i].available, NULL);
+        nm.ss_pools[i].count = 0;
+        nm.ss_pools[i].generation = 0;
+        nm.ss_list[i].hb_sock = -1;
+    }
+    
+    set_instance_name("NM");
+    if (nm.shards > 1) {
+        // Shards sharing a directory keep separate logs
+        char log_file[64];
+        snprintf(log_file, sizeof(log_file), "nm_%d.log", nm.shard);
+        init_logger(log_file);
+    } else {
+        init_logger("nm.log");
+    }
+
+    recover_metadata();
+
+    if (access_tracker_init(apply_access_update, NULL) != 0) {
+        log_formatted(LOG_WARNING, "Access tracker unavailable, access times are applied inline");
+    }
+    
+    printf("[NM] Name Server initialized\n");
+    printf("[NM] SS Port: %d\n", SHARD_PORT(NM_SS_PORT));
+    printf("[NM] Placement policy: %s\n", placement_policy_name(nm.placement.policy));
+    if (nm.placement.policy == PLACEMENT_CHASH) {
+        printf("[NM] Ring points per server: %d\n", nm.placement.vnodes);
+    }
+    printf("[NM] Replicas per file: %d\n", nm.replicas);
+    if (nm.placement.policy == PLACEMENT_CHASH) {
+        printf("[NM] Hot-file balancing off: the ring decides where files live\n");
+    } else if (nm.migrate_interval > 0) {
+        printf("[NM] Hot-file balancing every %d s\n", nm.migrate_interval);
+    } else {
+        printf("[NM] Hot-file balancing disabled\n");
+    }
+    printf("[NM] Client Port: %d\n", SHARD_PORT(NM_CLIENT_PORT));
+    if (nm.shards > 1) {
+        printf("[NM] Namespace shard %d of %d\n", nm.shard, nm.shards);
+    }
+}
+
+// Trie change hooks: every change to the file and folder tries goes to the
+// metadata log, in the order the tries applied them
+void log_file_change(TrieChange change, const char *key, const void *meta, void *ctx) {
+    (void)ctx;
+    const FileMetadata *file = meta;
+    switch (change) {
+        case TRIE_CHANGE_PUT: meta_log_put_file(file); break;
+        case TRIE_CHANGE_DELETE: meta_log_delete_file(key); break;
+        case TRIE_CHANGE_TOUCH: meta_log_touch_file(key, file->accessed, file->last_accessed_by); break;
+    }
+}
+
+void log_folder_change(TrieChange change, const char *key, const void *meta, void *ctx) {
+    (void)ctx;
+    if (change == TRIE_CHANGE_DELETE) {
+        meta_log_delete_folder(key);
+    } else {
+        meta_log_put_folder(key, meta);
+    }
+}
+
+void snapshot_file(const char *key, const void *meta, void *ctx) {
+    (void)key;
+    meta_snapshot_file(ctx, meta);
+}
+
+void snapshot_folder(const char *key, const void *meta, void *ctx) {
+    meta_snapshot_folder(ctx, key, meta);
+}
+
+// Write the whole metadata state into a snapshot
+void dump_metadata(MetaSnapshot *snap, void *ctx) {
+    (void)ctx;
+    file_store_for_each(nm.files, snapshot_file, snap);
+    folder_trie_for_each(nm.folder_trie, snapshot_folder, snap);
+
+    MUTEX_LOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+    for (int i = 0; i < nm.registered_user_count; i++) {
+        meta_snapshot_user(snap, &nm.registered_users[i]);
+    }
+    MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+
+    pthread_mutex_lock(&nm.request_mutex);
+    for (int i = 0; i < nm.request_count; i++) {
+        meta_snapshot_request(snap, &nm.access_requests[i]);
+    }
+    pthread_mutex_unlock(&nm.request_mutex);
+}
+
+int find_access_request(const AccessRequest *req) {
+    for (int i = 0; i < nm.request_count; i++) {
+        if (strcmp(nm.access_requests[i].username, req->username) == 0 &&
+            strcmp(nm.access_requests[i].filename, req->filename) == 0 &&
+            nm.access_requests[i].requested_access == req->requested_access) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    char **keys;
+    int count;
+    int cap;
+} KeyList;
+
+void collect_key(const char *key, const void *meta, void *ctx) {
+    (void)meta;
+    KeyList *list = ctx;
+    if (list->count == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 256;
+        char **grown = realloc(list->keys, sizeof(char*) * cap);
+        if (!grown) return;
+        list->keys = grown;
+        list->cap = cap;
+    }
+    list->keys[list->count++] = strdup(key);
+}
+
+// A standby (re)syncing from the primary starts from nothing
+void forget_metadata() {
+    KeyList files = { NULL, 0, 0 }, folders = { NULL, 0, 0 };
+    file_store_for_each(nm.files, collect_key, &files);
+    for (int i = 0; i < files.count; i++) {
+        file_store_delete(nm.files, files.keys[i]);
+        free(files.keys[i]);
+    }
+    free(files.keys);
+
+    folder_trie_for_each(nm.folder_trie, collect_key, &folders);
+    for (int i = 0; i < folders.count; i++) {
+        folder_trie_delete(nm.folder_trie, folders.keys[i]);
+        free(folders.keys[i]);
+    }
+    free(folders.keys);
+
+    MUTEX_LOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+    nm.registered_user_count = 0;
+    MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+
+    pthread_mutex_lock(&nm.request_mutex);
+    for (int i = 0; i < nm.request_count; i++) {
+        meta_log_delete_request(&nm.access_requests[i]);
+    }
+    nm.request_count = 0;
+    pthread_mutex_unlock(&nm.request_mutex);
+}
+
+// Apply one record, recovered at startup or streamed from the primary to a
+// standby. Trie changes reach this NM's own log through the hooks; the rest
+// is logged here (a no-op during recovery, before the log is open).
+void apply_meta_record(MetaRecord *rec, void *ctx) {
+    (void)ctx;
+    switch (rec->type) {
+        case META_FILE_PUT:
+            file_store_insert(nm.files, rec->key, &rec->file);
+            break;
+        case META_FILE_DELETE:
+            file_store_delete(nm.files, rec->key);
+            break;
+        case META_FILE_TOUCH:
+            file_store_touch(nm.files, rec->key, rec->file.accessed, rec->file.last_accessed_by);
+            break;
+        case META_FOLDER_PUT:
+            folder_trie_insert(nm.folder_trie, rec->key, &rec->folder);
+            break;
+        case META_FOLDER_DELETE:
+            folder_trie_delete(nm.folder_trie, rec->key);
+            break;
+        case META_USER_PUT: {
+            MUTEX_LOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+            int i = 0;
+            while (i < nm.registered_user_count && strcmp(nm.registered_users[i].username, rec->user.username) != 0) i++;
+            if (i < NM_MAX_USERS) {
+                if (i == nm.registered_user_count) nm.registered_user_count++;
+                nm.registered_users[i] = rec->user;
+                meta_log_put_user(&rec->user);
+            }
+            MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+            break;
+        }
+        case META_REQUEST_ADD:
+            pthread_mutex_lock(&nm.request_mutex);
+            if (find_access_request(&rec->request) < 0 && nm.request_count < MAX_FILES * 10) {
+                nm.access_requests[nm.request_count++] = rec->request;
+                meta_log_add_request(&rec->request);
+            }
+            pthread_mutex_unlock(&nm.request_mutex);
+            break;
+        case META_REQUEST_DELETE: {
+            pthread_mutex_lock(&nm.request_mutex);
+            int i = find_access_request(&rec->request);
+            if (i >= 0) {
+                meta_log_delete_request(&rec->request);
+                for (; i < nm.request_count - 1; i++) {
+                    nm.access_requests[i] = nm.access_requests[i + 1];
+                }
+                nm.request_count--;
+            }
+            pthread_mutex_unlock(&nm.request_mutex);
+            break;
+        }
+        case META_SYNC_START:
+            forget_metadata();
+            break;
+    }
+}
+
+// Rebuild the metadata from the last snapshot and log, then log every change
+// from here on. Files, owners and ACLs survive a restart; storage servers
+// re-registering only fill in what was never recorded.
+void recover_metadata() {
+    const char *dir = getenv("NM_META_DIR");
+    char shard_dir[64];
+    if (!dir && nm.shards > 1) {
+        snprintf(shard_dir, sizeof(shard_dir), "%s_%d", META_DIR_DEFAULT, nm.shard);
+        dir = shard_dir;
+    } else if (!dir) {
+        dir = META_DIR_DEFAULT;
+    }
+    if (dir[0] == '\0') {
+        printf("[NM] Metadata persistence disabled\n");
+        return;
+    }
+
+    MetaRecoveryStats stats;
+    if (meta_log_recover(dir, apply_meta_record, NULL, &stats) < 0) {
+        fprintf(stderr, "[NM] Metadata snapshot in %s is damaged; see nm.log\n", dir);
+    }
+    nm.recovered_records = stats.snapshot_records + stats.log_records;
+    log_formatted(LOG_INFO, "Recovered metadata from %s: %lld snapshot + %lld log records in %.1f ms",
+                 dir, stats.snapshot_records, stats.log_records, stats.map_ms);
+    printf("[NM] Recovered %lld snapshot + %lld log records from %s in %.1f ms (%d users, %d pending requests)\n",
+           stats.snapshot_records, stats.log_records, dir, stats.map_ms,
+           nm.registered_user_count, nm.request_count);
+
+    file_store_set_change_hook(nm.files, log_file_change, NULL);
+    folder_trie_set_change_hook(nm.folder_trie, log_folder_change, NULL);
+
+    long long wal_bytes = (long long)get_env_int("NM_SNAPSHOT_WAL_MB", META_SNAPSHOT_WAL_MB) << 20;
+    if (meta_log_open(dir, get_env_int("NM_WAL_FSYNC", 1),
+                      get_env_int("NM_SNAPSHOT_INTERVAL", META_SNAPSHOT_INTERVAL),
+                      wal_bytes, dump_metadata, NULL) < 0) {
+        fprintf(stderr, "[NM] Cannot open metadata log in %s; changes will not survive a restart\n", dir);
+    }
+}
+
+void register_user_persistent(const char *username, int client_sock, int *is_duplicate) {
+    MUTEX_LOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+    
+    *is_duplicate = 0;
+    
+    // Check if user already exists
+    for (int i = 0; i < nm.registered_user_count; i++) {
+        if (strcmp(nm.registered_users[i].username, username) == 0) {
+            // Check if user already has an active session
+            if (nm.registered_users[i].active_session) {
+                log_formatted(LOG_WARNING, "User %s attempted duplicate login (already connected on socket %d)", 
+                             username, nm.registered_users[i].client_sock);
+                *is_duplicate = 1;
+                MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+                return;
+            }
+            
+            // User exists but no active session - allow reconnection
+            nm.registered_users[i].last_seen = time(NULL);
+            nm.registered_users[i].active_session = 1;
+            nm.registered_users[i].client_sock = client_sock;
+            meta_log_put_user(&nm.registered_users[i]);
+            MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+            log_formatted(LOG_INFO, "User %s reconnected on socket %d", username, client_sock);
+            return;
+        }
+    }
+    
+    // Add new user
+    if (nm.registered_user_count < NM_MAX_USERS) {
+        strcpy(nm.registered_users[nm.registered_user_count].username, username);
+        nm.registered_users[nm.registered_user_count].first_registered = time(NULL);
+        nm.registered_users[nm.registered_user_count].last_seen = time(NULL);
+        nm.registered_users[nm.registered_user_count].active_session = 1;
+        nm.registered_users[nm.registered_user_count].client_sock = client_sock;
+        meta_log_put_user(&nm.registered_users[nm.registered_user_count]);
+        nm.registered_user_count++;
+        log_formatted(LOG_INFO, "New user registered: %s on socket %d (total: %d)", 
+                     username, client_sock, nm.registered_user_count);
+    } else {
+        log_formatted(LOG_ERROR, "Cannot register user %s: registry full", username);
+        *is_duplicate = 1;  // Treat as failure
+    }
+    
+    MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+}
+
+void deregister_active_session(const char *username, int client_sock) {
+    MUTEX_LOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+    
+    for (int i = 0; i < nm.registered_user_count; i++) {
+        if (strcmp(nm.registered_users[i].username, username) == 0) {
+            if (nm.registered_users[i].client_sock == client_sock) {
+                nm.registered_users[i].active_session = 0;
+                nm.registered_users[i].client_sock = -1;
+                nm.registered_users[i].last_seen = time(NULL);
+                log_formatted(LOG_INFO, "User %s session ended (socket %d)", username, client_sock);
+            }
+            break;
+        }
+    }
+    
+    MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
+}
+
+// Copy of a file's metadata, through the cache; caller frees
+FileMetadata* lookup_file_meta(const char *filename) {
+    return file_store_get(nm.files, filename);
+}
+
+int find_ss_for_file(const char *filename) {
+    FileMetadata *meta = lookup_file_meta(filename);
+    
+    if (meta) {
+        int ss_id = meta->ss_id;
+        free(meta);
+        return ss_id;
+    }
+    
+    return -1;
+}
+
+unsigned int hash_filename(const char *str) {
+    unsigned int hash = 5381;
+    int c;
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+// Slot of a file in a hot-file table, claiming a free one if `create`.
+// NULL when the file is not tracked (or the table is full).
+HotFile* hot_file_slot(HotFile *table, const char *filename, int create) {
+    unsigned int slot = hash_filename(filename) & (NM_HOT_SLOTS - 1);
+    for (int probe = 0; probe < NM_HOT_SLOTS; probe++) {
+        HotFile *entry = &table[(slot + probe) & (NM_HOT_SLOTS - 1)];
+        if (!entry->used) {
+            if (!create) return NULL;
+            memset(entry, 0, sizeof(HotFile));
+            strncpy(entry->filename, filename, MAX_FILENAME - 1);
+            entry->used = 1;
+            return entry;
+        }
+        if (strcmp(entry->filename, filename) == 0) return entry;
+    }
+    return NULL;
+}
+
+void record_file_hits(const char *filename, int hits) {
+    if (!nm.hot_files) return;
+    pthread_mutex_lock(&nm.hot_mutex);
+    HotFile *entry = hot_file_slot(nm.hot_files, filename, 1);
+    if (entry) entry->hits += hits;
+    pthread_mutex_unlock(&nm.hot_mutex);
+}
+
+// Flusher callback: apply one coalesced access-time update. The hit count
+// feeds the request rates the migration pass looks at.
+void apply_access_update(const char *filename, time_t accessed, const char *username, int hits, void *ctx) {
+    (void)ctx;
+    file_store_touch(nm.files, filename, accessed, username);
+    record_file_hits(filename, hits);
+}
+
+// Lease an idle command connection to SS slot `idx`, waiting while all of
+// them are busy. Returns -1 if the SS has no command connections.
+int lease_ss_socket(int idx, int *generation) {
+    SSCommandPool *pool = &nm.ss_pools[idx];
+
+    MUTEX_LOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+    while (pool->count > 0) {
+        for (int i = 0; i < pool->count; i++) {
+            if (!pool->busy[i]) {
+                pool->busy[i] = 1;
+                *generation = pool->generation;
+                int sock = pool->socks[i];
+                MUTEX_UNLOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+                return sock;
+            }
+        }
+        COND_WAIT(&pool->available, &nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+    }
+    MUTEX_UNLOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+    return -1;
+}
+
+void release_ss_socket(int idx, int sock, int generation, int broken) {
+    SSCommandPool *pool = &nm.ss_pools[idx];
+
+    MUTEX_LOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+    if (generation != pool->generation) {
+        // The pool was torn down while this connection was out
+        close(sock);
+    } else {
+        for (int i = 0; i < pool->count; i++) {
+            if (pool->socks[i] != sock) continue;
+
+            if (broken) {
+                // A failed exchange leaves the stream out of sync: drop it
+                close(sock);
+                pool->count--;
+                pool->socks[i] = pool->socks[pool->count];
+                pool->busy[i] = pool->busy[pool->count];
+                log_formatted(LOG_WARNING, "Dropped broken command connection to SS %d (%d left)",
+                             nm.ss_list[idx].id, pool->count);
+            } else {
+                pool->busy[i] = 0;
+            }
+            break;
+        }
+    }
+    pthread_cond_broadcast(&pool->available);
+    MUTEX_UNLOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+}
+
+// Caller holds ss_sock_mutexes[idx]. Idle connections are closed now, leased
+// ones are shut down so their holder fails fast and closes them on release.
+void reset_ss_pool_locked(int idx) {
+    SSCommandPool *pool = &nm.ss_pools[idx];
+
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->busy[i]) {
+            shutdown(pool->socks[i], SHUT_RDWR);
+        } else {
+            close(pool->socks[i]);
+        }
+    }
+    pool->count = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->available);
+}
+
+int add_ss_pool_socket_locked(int idx, int sock) {
+    SSCommandPool *pool = &nm.ss_pools[idx];
+
+    if (pool->count >= NM_SS_POOL_MAX) {
+        return -1;
+    }
+    pool->socks[pool->count] = sock;
+    pool->busy[pool->count] = 0;
+    pool->count++;
+    pthread_cond_broadcast(&pool->available);
+    return 0;
+}
+
+// Close every command connection of an SS that has gone away. Safe to call
+// with ss_mutex held.
+void retire_ss_pool(int idx) {
+    MUTEX_LOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+    if (nm.ss_pools[idx].count > 0) {
+        reset_ss_pool_locked(idx);
+        log_formatted(LOG_INFO, "Closed command connections for SS %d", nm.ss_list[idx].id);
+    }
+    nm.ss_list[idx].sock = -1;
+    MUTEX_UNLOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+}
+
+// Send one command to an SS over a pooled connection and wait for its reply.
+// On failure `response` carries ERR_SS_UNAVAILABLE.
+int ss_command(int ss_idx, Message *request, Message *response) {
+    int generation;
+    int sock = lease_ss_socket(ss_idx, &generation);
+    if (sock < 0) {
+        init_message(response);
+        response->status = ERR_SS_UNAVAILABLE;
+        return -1;
+    }
+
+    if (!request->trace_id) request->trace_id = trace_current();
+    TraceSpan span;
+    trace_begin(&span, "call SS");
+    int broken = send_message(sock, request) < 0 || recv_message(sock, response) < 0;
+    trace_end(&span);
+    release_ss_socket(ss_idx, sock, generation, broken);
+
+    if (broken) {
+        init_message(response);
+        response->status = ERR_SS_UNAVAILABLE;
+        return -1;
+    }
+    return 0;
+}
+
+// Load snapshot of every SS slot; only live, non-draining servers count as
+// active. Caller holds ss_mutex.
+void fill_placement_loads_locked(SSLoad *loads) {
+    for (int i = 0; i < nm.ss_count; i++) {
+        loads[i] = nm.ss_loads[i];
+        loads[i].ss_id = nm.ss_list[i].id;
+        loads[i].active = nm.ss_list[i].active && !nm.ss_draining[i];
+    }
+}
+
+// Pick up to `want` distinct live servers for the new file or folder `key`
+// from the last load reports (or the ring), primary first. Returns how many
+// were found.
+int choose_replica_set(const char *key, int *ss_ids, int want) {
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    SSLoad loads[MAX_SS];
+    fill_placement_loads_locked(loads);
+
+    int chosen[MAX_REPLICAS];
+    int found = placement_choose_key(&nm.placement, key, loads, nm.ss_count, want, chosen);
+    for (int i = 0; i < found; i++) {
+        // Counted until the SS's next report includes the new file
+        nm.ss_loads[chosen[i]].pending++;
+        ss_ids[i] = nm.ss_list[chosen[i]].id;
+    }
+
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    return found;
+}
+
+// Pick the SS for a new folder. Returns -1 when no SS is alive.
+int choose_ss_for_placement(const char *key) {
+    int ss_id;
+    return choose_replica_set(key, &ss_id, 1) == 1 ? ss_id : -1;
+}
+
+// Slot of a registered SS, or -1. Caller holds ss_mutex.
+int ss_index_locked(int ss_id) {
+    for (int i = 0; i < nm.ss_count; i++) {
+        if (nm.ss_list[i].id == ss_id) return i;
+    }
+    return -1;
+}
+
+int ss_is_active(int ss_id) {
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    int idx = ss_index_locked(ss_id);
+    int active = idx >= 0 && nm.ss_list[idx].active;
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    return active;
+}
+
+// "id@ip:port" of an active SS's client port. Caller holds ss_mutex.
+int format_replica_target_locked(int ss_id, char *buf, size_t size) {
+    int idx = ss_index_locked(ss_id);
+    if (idx < 0 || !nm.ss_list[idx].active) return 0;
+    snprintf(buf, size, "%d@%s:%d", ss_id, nm.ss_list[idx].ip, nm.ss_list[idx].client_port);
+    return 1;
+}
+
+// Write back a file's replica fields onto its current metadata, so an ACL
+// change made meanwhile is not lost. The cached copy is dropped. Returns -1
+// if the change could not be made durable.
+int store_replica_fields(const FileMetadata *replicas) {
+    FileMetadata *meta = file_store_get(nm.files, replicas->filename);
+    if (!meta) return -1;
+
+    meta->ss_id = replicas->ss_id;
+    memcpy(meta->backup_ids, replicas->backup_ids, sizeof(meta->backup_ids));
+    meta->backup_count = replicas->backup_count;
+    meta->stale_mask = replicas->stale_mask;
+    file_store_update(nm.files, meta->filename, meta);
+    free(meta);
+
+    // Copies are deleted on the strength of this; it must survive a restart
+    return meta_log_commit();
+}
+
+// Tell a file's primary which backups to ship updates to: the in-sync ones
+// on live servers
+int push_replica_config(const FileMetadata *meta) {
+    Message request;
+    init_message(&request);
+    request.type = MSG_REPL_CONFIG;
+    strcpy(request.filename, meta->filename);
+
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    int primary_idx = ss_index_locked(meta->ss_id);
+    int primary_active = primary_idx >= 0 && nm.ss_list[primary_idx].active;
+    for (int i = 0; i < meta->backup_count; i++) {
+        char target[64];
+        if (meta->stale_mask & (1 << i)) continue;
+        if (!format_replica_target_locked(meta->backup_ids[i], target, sizeof(target))) continue;
+        if (request.data[0]) strcat(request.data, ",");
+        strcat(request.data, target);
+    }
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    if (!primary_active) return -1;
+
+    Message response;
+    if (ss_command(primary_idx, &request, &response) < 0 || response.status != SUCCESS) {
+        return -1;
+    }
+    return 0;
+}
+
+// Have the primary copy a file to stale backup `b` and ship to it again
+int sync_backup(const FileMetadata *meta, int b) {
+    Message request;
+    init_message(&request);
+    request.type = MSG_REPL_SYNC;
+    strcpy(request.filename, meta->filename);
+
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    int primary_idx = ss_index_locked(meta->ss_id);
+    int ready = primary_idx >= 0 && nm.ss_list[primary_idx].active &&
+                format_replica_target_locked(meta->backup_ids[b], request.data, sizeof(request.data));
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    if (!ready) return -1;
+
+    Message response;
+    if (ss_command(primary_idx, &request, &response) < 0 || response.status != SUCCESS) {
+        log_formatted(LOG_WARNING, "Resync of %s to SS %d failed", meta->filename, meta->backup_ids[b]);
+        return -1;
+    }
+    log_formatted(LOG_INFO, "Backup SS %d of %s is back in sync", meta->backup_ids[b], meta->filename);
+    return 0;
+}
+
+void apply_stale_report(const char *filename, int backup_id) {
+    FileMetadata *meta = file_store_get(nm.files, filename);
+    if (!meta) return;
+
+    for (int i = 0; i < meta->backup_count; i++) {
+        if (meta->backup_ids[i] == backup_id && !(meta->stale_mask & (1 << i))) {
+            meta->stale_mask |= 1 << i;
+            store_replica_fields(meta);
+            log_formatted(LOG_WARNING, "Backup SS %d of %s marked stale", backup_id, filename);
+            break;
+        }
+    }
+    free(meta);
+}
+
+// A primary could not ship an update to one of its backups. Replica fields
+// are only rewritten by the repair thread, so the report is queued for it.
+void mark_backup_stale(const char *filename, int backup_id) {
+    pthread_mutex_lock(&nm.repl_mutex);
+    int queued = nm.stale_report_count < NM_STALE_REPORTS;
+    if (queued) {
+        StaleReport *report = &nm.stale_reports[nm.stale_report_count++];
+        strncpy(report->filename, filename, MAX_FILENAME - 1);
+        report->filename[MAX_FILENAME - 1] = '\0';
+        report->backup_id = backup_id;
+        nm.repl_pending = 1;
+        pthread_cond_signal(&nm.repl_cond);
+    }
+    pthread_mutex_unlock(&nm.repl_mutex);
+
+    if (!queued) {
+        log_formatted(LOG_WARNING, "Stale report queue full, applying inline");
+        apply_stale_report(filename, backup_id);
+        request_replica_repair();
+    }
+}
+
+void apply_stale_reports() {
+    StaleReport *reports = malloc(sizeof(StaleReport) * NM_STALE_REPORTS);
+    if (!reports) return;
+
+    pthread_mutex_lock(&nm.repl_mutex);
+    int count = nm.stale_report_count;
+    memcpy(reports, nm.stale_reports, sizeof(StaleReport) * count);
+    nm.stale_report_count = 0;
+    pthread_mutex_unlock(&nm.repl_mutex);
+
+    for (int i = 0; i < count; i++) {
+        apply_stale_report(reports[i].filename, reports[i].backup_id);
+    }
+    free(reports);
+}
+
+void request_replica_repair() {
+    pthread_mutex_lock(&nm.repl_mutex);
+    nm.repl_pending = 1;
+    pthread_cond_signal(&nm.repl_cond);
+    pthread_mutex_unlock(&nm.repl_mutex);
+}
+
+int id_in_list(int id, const int *ids, int count) {
+    for (int i = 0; i < count; i++) {
+        if (ids[i] == id) return 1;
+    }
+    return 0;
+}
+
+// One pass over every replicated file:
+//  - backups on down or re-registered servers are marked stale
+//  - a file whose primary is down gets its first in-sync backup promoted
+//  - stale backups are resynced once both ends are up
+//  - primaries are told their current in-sync backups
+// Returns how many files still need work.
+int repair_replicas() {
+    int dirty_ids[MAX_SS];
+    int dirty_count = 0;
+
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    for (int i = 0; i < nm.ss_count; i++) {
+        if (nm.ss_config_dirty[i] && nm.ss_list[i].active) {
+            dirty_ids[dirty_count++] = nm.ss_list[i].id;
+            nm.ss_config_dirty[i] = 0;
+        }
+    }
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    FileMetadata **files = malloc(sizeof(FileMetadata*) * MAX_FILES);
+    int file_count = file_store_get_all(nm.files, files, MAX_FILES);
+    int unresolved = 0;
+
+    for (int f = 0; f < file_count; f++) {
+        FileMetadata *meta = files[f];
+        if (meta->backup_count == 0) {
+            free(meta);
+            continue;
+        }
+
+        int changed = 0;
+        int push = id_in_list(meta->ss_id, dirty_ids, dirty_count);
+
+        for (int b = 0; b < meta->backup_count; b++) {
+            int bit = 1 << b;
+            if (meta->stale_mask & bit) continue;
+            if (!ss_is_active(meta->backup_ids[b]) || id_in_list(meta->backup_ids[b], dirty_ids, dirty_count)) {
+                // Down, or back from being down: it may miss or have missed updates
+                meta->stale_mask |= bit;
+                changed = push = 1;
+            }
+        }
+
+        if (!ss_is_active(meta->ss_id)) {
+            int promoted = 0;
+            for (int b = 0; b < meta->backup_count; b++) {
+                if (meta->stale_mask & (1 << b)) continue;
+
+                int old_primary = meta->ss_id;
+                meta->ss_id = meta->backup_ids[b];
+                meta->backup_ids[b] = old_primary;
+                meta->stale_mask |= 1 << b;
+                changed = push = promoted = 1;
+                log_formatted(LOG_WARNING, "Promoted SS %d to primary of %s (SS %d down)",
+                             meta->ss_id, meta->filename, old_primary);
+                break;
+            }
+            if (!promoted) {
+                // No in-sync copy is reachable; wait for a server to return
+                unresolved++;
+            }
+        }
+
+        if (changed) {
+            store_replica_fields(meta);
+        }
+
+        if (ss_is_active(meta->ss_id)) {
+            if (push && push_replica_config(meta) < 0) {
+                unresolved++;
+            }
+
+            for (int b = 0; b < meta->backup_count; b++) {
+                int bit = 1 << b;
+                if (!(meta->stale_mask & bit) || !ss_is_active(meta->backup_ids[b])) continue;
+                if (sync_backup(meta, b) == 0) {
+                    meta->stale_mask &= ~bit;
+                    store_replica_fields(meta);
+                } else {
+                    unresolved++;
+                }
+            }
+        }
+
+        free(meta);
+    }
+
+    free(files);
+    return unresolved;
+}
+
+// Best effort: drop a file's copy from one server
+void delete_replica_copy(int ss_id, const char *filename) {
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    int idx = ss_index_locked(ss_id);
+    int active = idx >= 0 && nm.ss_list[idx].active;
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    if (!active) return;
+
+    Message request, response;
+    init_message(&request);
+    request.type = MSG_DELETE;
+    strcpy(request.filename, filename);
+    ss_command(idx, &request, &response);
+}
+
+// Make the MOVE a file's primary just applied on each of its backups. One
+// that cannot do it is marked stale, so the repair thread resyncs it.
+void move_backup_copies(const FileMetadata *meta, Message *move) {
+    for (int b = 0; b < meta->backup_count; b++) {
+        int backup_id = meta->backup_ids[b];
+        MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+        int idx = ss_index_locked(backup_id);
+        int active = idx >= 0 && nm.ss_list[idx].active;
+        MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+        Message response;
+        if (!active || ss_command(idx, move, &response) < 0 || response.status != SUCCESS) {
+            log_formatted(LOG_WARNING, "Backup SS %d of %s missed a move", backup_id, meta->filename);
+            mark_backup_stale(meta->filename, backup_id);
+        }
+    }
+}
+
+void remove_backup_slot(FileMetadata *meta, int b) {
+    for (int i = b; i < meta->backup_count - 1; i++) {
+        meta->backup_ids[i] = meta->backup_ids[i + 1];
+    }
+    int low = meta->stale_mask & ((1 << b) - 1);
+    int high = (meta->stale_mask >> (b + 1)) << b;
+    meta->stale_mask = low | high;
+    meta->backup_count--;
+}
+
+// Ask a file's primary to stop taking writes so backup `to_id` can take
+// over. Retried for a while when a sentence is locked.
+int handoff_primary(const FileMetadata *meta, int to_id) {
+    Message request;
+    init_message(&request);
+    request.type = MSG_REPL_HANDOFF;
+    strcpy(request.filename, meta->filename);
+
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    int primary_idx = ss_index_locked(meta->ss_id);
+    int ready = primary_idx >= 0 && nm.ss_list[primary_idx].active &&
+                format_replica_target_locked(to_id, request.data, sizeof(request.data));
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    if (!ready) return ERR_SS_UNAVAILABLE;
+
+    Message response;
+    for (int attempt = 0; attempt < NM_HANDOFF_ATTEMPTS; attempt++) {
+        ss_command(primary_idx, &request, &response);
+        if (response.status != ERR_FILE_LOCKED) break;
+        usleep(NM_HANDOFF_RETRY_MS * 1000);
+    }
+    return response.status;
+}
+
+// Move a file's copy from SS `from_id` to SS `to_id` without blocking reads.
+// The new copy joins as a backup and is filled in the background, after which
+// the primary ships it every commit. The old copy is then dropped; if it was
+// the primary, it first hands its writes over, which it only does once no
+// sentence is locked and the new copy has every commit. A `from_id` of -1
+// only adds the copy. Runs on the repair thread, which owns the replica
+// fields.
+int migrate_replica(const char *filename, int from_id, int to_id) {
+    FileMetadata *meta = file_store_get(nm.files, filename);
+    if (!meta) return -1;
+
+    int from_backup = -1;
+    for (int b = 0; b < meta->backup_count; b++) {
+        if (meta->backup_ids[b] == from_id) from_backup = b;
+    }
+    if ((from_id >= 0 && meta->ss_id != from_id && from_backup < 0) || meta->ss_id == to_id ||
+        id_in_list(to_id, meta->backup_ids, meta->backup_count) ||
+        meta->backup_count >= MAX_BACKUPS || !ss_is_active(meta->ss_id)) {
+        free(meta);
+        return -1;
+    }
+
+    // Not read from or shipped to until it is in sync
+    int k = meta->backup_count++;
+    meta->backup_ids[k] = to_id;
+    meta->stale_mask |= 1 << k;
+    store_replica_fields(meta);
+
+    int status = sync_backup(meta, k) == 0 ? SUCCESS : ERR_SS_UNAVAILABLE;
+    if (status == SUCCESS) {
+        meta->stale_mask &= ~(1 << k);
+        store_replica_fields(meta);
+
+        if (from_id >= 0 && from_backup < 0) {
+            status = handoff_primary(meta, to_id);
+        }
+    }
+
+    if (status != SUCCESS) {
+        // Drop the new copy; the old one stays where it was
+        remove_backup_slot(meta, k);
+        store_replica_fields(meta);
+        push_replica_config(meta);
+        delete_replica_copy(to_id, filename);
+        log_formatted(LOG_WARNING, "Moving %s from SS %d to SS %d failed: status=%d",
+                     filename, from_id, to_id, status);
+        free(meta);
+        return -1;
+    }
+
+    if (from_id < 0) {
+        log_formatted(LOG_INFO, "Added a copy of %s on SS %d", filename, to_id);
+        free(meta);
+        return 0;
+    }
+
+    if (from_backup >= 0) {
+        remove_backup_slot(meta, from_backup);
+    } else {
+        // The new copy becomes the primary; the old one goes away
+        meta->ss_id = to_id;
+        remove_backup_slot(meta, k);
+    }
+    int durable = store_replica_fields(meta) == 0;
+
+    if (push_replica_config(meta) < 0 && meta->backup_count > 0) {
+        // Backups may have missed commits since; resync them
+        meta->stale_mask = (1 << meta->backup_count) - 1;
+        store_replica_fields(meta);
+        request_replica_repair();
+    }
+    if (durable) {
+        delete_replica_copy(from_id, filename);
+    } else {
+        // A restart may still list the old copy; leave it in place
+        log_formatted(LOG_WARNING, "Keeping %s on SS %d: its removal is not durable", filename, from_id);
+    }
+
+    log_formatted(LOG_INFO, "Moved %s %s from SS %d to SS %d", filename,
+                 from_backup >= 0 ? "backup" : "primary", from_id, to_id);
+    free(meta);
+    return 0;
+}
+
+int file_on_server(const FileMetadata *meta, int ss_id) {
+    return meta->ss_id == ss_id || id_in_list(ss_id, meta->backup_ids, meta->backup_count);
+}
+
+// Where to move a copy of a file: a live, non-draining server that does not
+// hold the file yet, by the placement policy. -1 if there is none.
+int choose_migration_target(const FileMetadata *meta) {
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    SSLoad loads[MAX_SS];
+    fill_placement_loads_locked(loads);
+    for (int i = 0; i < nm.ss_count; i++) {
+        if (file_on_server(meta, nm.ss_list[i].id)) loads[i].active = 0;
+    }
+
+    int target = -1;
+    int idx = placement_choose(&nm.placement, loads, nm.ss_count);
+    if (idx >= 0) {
+        nm.ss_loads[idx].pending++;
+        target = nm.ss_list[idx].id;
+    }
+
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    return target;
+}
+
+// Move file copies off servers that report draining, a batch per pass.
+// Returns how many copies are still waiting to move.
+int drain_servers() {
+    int draining_ids[MAX_SS];
+    int draining_count = 0;
+
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    for (int i = 0; i < nm.ss_count; i++) {
+        if (nm.ss_list[i].active && nm.ss_draining[i]) {
+            draining_ids[draining_count++] = nm.ss_list[i].id;
+        }
+    }
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    if (draining_count == 0) return 0;
+
+    FileMetadata **files = malloc(sizeof(FileMetadata*) * MAX_FILES);
+    int file_count = file_store_get_all(nm.files, files, MAX_FILES);
+    int moved = 0, remaining = 0;
+
+    for (int f = 0; f < file_count; f++) {
+        for (int d = 0; d < draining_count; d++) {
+            if (!file_on_server(files[f], draining_ids[d])) continue;
+
+            int target = moved < NM_DRAIN_BATCH ? choose_migration_target(files[f]) : -1;
+            if (target >= 0 && migrate_replica(files[f]->filename, draining_ids[d], target) == 0) {
+                moved++;
+            } else {
+                remaining++;
+            }
+            break;
+        }
+        free(files[f]);
+    }
+    free(files);
+
+    if (moved > 0) {
+        log_formatted(LOG_INFO, "Draining: moved %d file copies, %d left", moved, remaining);
+    }
+    return remaining;
+}
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    Transfer transfer;
+} PlannedTransfer;
+
+// Consistent-hash placement: once servers join, leave or start draining,
+// bring every file's copies in line with the ring. Only files next to the
+// changed servers' ring points have a transfer planned, and each transfer
+// copies the file once (see placement_plan_file). Runs NM_PLAN_BATCH
+// transfers per pass; returns how many are still waiting, including those
+// for files with no live primary yet.
+int rebalance_ring(int force) {
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    SSLoad loads[MAX_SS];
+    fill_placement_loads_locked(loads);
+    placement_sync_ring(&nm.placement, loads, nm.ss_count);
+    int generation = nm.placement.ring.generation;
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    int ring_changed = generation != nm.planned_ring;
+    if (!ring_changed && !force) return 0;
+    nm.planned_ring = generation;
+
+    FileMetadata **files = malloc(sizeof(FileMetadata*) * MAX_FILES);
+    int file_count = file_store_get_all(nm.files, files, MAX_FILES);
+    PlannedTransfer *plan = malloc(sizeof(PlannedTransfer) * (file_count > 0 ? file_count : 1) * MAX_REPLICAS);
+    int plan_count = 0, files_moving = 0, waiting = 0, members = 0;
+
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    members = nm.placement.ring.member_count;
+    for (int f = 0; f < file_count; f++) {
+        FileMetadata *meta = files[f];
+        int current[MAX_REPLICAS + 1];
+        current[0] = meta->ss_id;
+        memcpy(current + 1, meta->backup_ids, sizeof(int) * meta->backup_count);
+
+        int desired[MAX_REPLICAS];
+        int desired_count = ring_lookup(&nm.placement.ring, meta->filename, nm.replicas, desired);
+        Transfer transfers[MAX_REPLICAS];
+        int n = placement_plan_file(current, 1 + meta->backup_count, desired, desired_count, transfers);
+        if (n > 0) {
+            int primary_idx = ss_index_locked(meta->ss_id);
+            if (primary_idx < 0 || !nm.ss_list[primary_idx].active) {
+                // Nothing to copy from until a backup is promoted or it returns
+                waiting++;
+            } else {
+                files_moving++;
+                for (int t = 0; t < n; t++) {
+                    strcpy(plan[plan_count].filename, meta->filename);
+                    plan[plan_count++].transfer = transfers[t];
+                }
+            }
+        }
+        free(meta);
+    }
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    free(files);
+
+    if (ring_changed) {
+        log_formatted(LOG_INFO, "Ring now has %d servers: %d of %d files need %d transfers (%d waiting for a primary)",
+                     members, files_moving, file_count, plan_count, waiting);
+    }
+
+    int moved = 0, failed = 0;
+    for (int i = 0; i < plan_count && moved < NM_PLAN_BATCH && nm.running; i++) {
+        if (migrate_replica(plan[i].filename, plan[i].transfer.from_id, plan[i].transfer.to_id) == 0) {
+            moved++;
+        } else {
+            failed++;
+        }
+    }
+    free(plan);
+
+    int remaining = plan_count - moved + waiting;
+    if (moved > 0 || failed > 0) {
+        log_formatted(LOG_INFO, "Ring transfers: %d done, %d failed, %d left", moved, failed, remaining);
+    }
+    return remaining;
+}
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    double rate;             // Estimated requests per second it puts on the server
+} HotCandidate;
+
+int compare_hot_candidates(const void *a, const void *b) {
+    double ra = ((const HotCandidate*)a)->rate;
+    double rb = ((const HotCandidate*)b)->rate;
+    return (ra < rb) - (ra > rb);
+}
+
+// Fold the window's hits into each file's smoothed rate and start a new
+// window. Files that went quiet (and were not moved lately) are forgotten.
+void age_hot_files() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&nm.hot_mutex);
+    double elapsed = (now.tv_sec - nm.hot_window_start.tv_sec) +
+                     (now.tv_usec - nm.hot_window_start.tv_usec) / 1e6;
+    nm.hot_window_start = now;
+
+    HotFile *fresh = calloc(NM_HOT_SLOTS, sizeof(HotFile));
+    for (int i = 0; i < NM_HOT_SLOTS && fresh && elapsed > 0; i++) {
+        HotFile *entry = &nm.hot_files[i];
+        if (!entry->used) continue;
 
-// Added new function declarations for heartbeat handling - N
-void* ss_hb_listener(void* arg);
-void* handle_ss_heartbeat(void* arg);
+        entry->rate = 0.5 * entry->rate + 0.5 * (entry->hits / elapsed);
+        entry->hits = 0;
+        if (entry->rate < 0.01 && now.tv_sec - entry->last_moved >= NM_MIGRATE_COOLDOWN) continue;
 
-void init_name_server() {
-    nm.file_trie = init_trie();
-    nm.folder_trie = init_folder_trie();
-    nm.cache = init_cache(CACHE_SIZE);
-    nm.ss_count = 0;
-    nm.client_count = 0;
-    nm.next_ss_id = 0;
-    nm.running = 1;
-    
-    pthread_mutex_init(&nm.ss_mutex, NULL);
-    pthread_mutex_init(&nm.client_mutex, NULL);
-    pthread_mutex_init(&nm.request_mutex, NULL);
-    pthread_mutex_init(&nm.registered_users_mutex, NULL);
-    nm.registered_user_count = 0;
-    nm.request_count = 0;
-    
-    // Initialize registered users array
-    for (int i = 0; i < MAX_CLIENTS * 10; i++) {
-        nm.registered_users[i].active_session = 0;
-        nm.registered_users[i].client_sock = -1;
+        HotFile *slot = hot_file_slot(fresh, entry->filename, 1);
+        if (slot) *slot = *entry;
     }
-    
-    // Initialize per-SS socket mutexes
-    for (int i = 0; i < MAX_SS; i++) {
-        pthread_mutex_init(&nm.ss_sock_mutexes[i], NULL);
-        nm.ss_list[i].hb_sock = -1;
+    if (fresh && elapsed > 0) {
+        free(nm.hot_files);
+        nm.hot_files = fresh;
+    } else {
+        free(fresh);
     }
-    
-    set_instance_name("NM");
-    init_logger("nm.log");
-    
-    printf("[NM] Name Server initialized\n");
-    printf("[NM] SS Port: %d\n", NM_SS_PORT);
-    printf("[NM] Client Port: %d\n", NM_CLIENT_PORT);
+    pthread_mutex_unlock(&nm.hot_mutex);
 }
 
-void register_user_persistent(const char *username, int client_sock, int *is_duplicate) {
-    pthread_mutex_lock(&nm.registered_users_mutex);
-    
-    *is_duplicate = 0;
-    
-    // Check if user already exists
-    for (int i = 0; i < nm.registered_user_count; i++) {
-        if (strcmp(nm.registered_users[i].username, username) == 0) {
-            // Check if user already has an active session
-            if (nm.registered_users[i].active_session) {
-                log_formatted(LOG_WARNING, "User %s attempted duplicate login (already connected on socket %d)", 
-                             username, nm.registered_users[i].client_sock);
-                *is_duplicate = 1;
-                pthread_mutex_unlock(&nm.registered_users_mutex);
-                return;
+// When the busiest server carries well above the mean request rate, move
+// the copy of one hot file off it to the least busy server, provided that
+// server then stays below what the busiest one carries now (so a server
+// pinned by one file is left alone). One file per pass: the next load
+// reports show the effect before anything else moves.
+void balance_hot_files() {
+    age_hot_files();
+
+    int ids[MAX_SS];
+    double rates[MAX_SS];
+    int count = 0;
+    double total = 0.0;
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    for (int i = 0; i < nm.ss_count; i++) {
+        if (!nm.ss_list[i].active || nm.ss_draining[i]) continue;
+        ids[count] = nm.ss_list[i].id;
+        rates[count] = nm.ss_loads[i].request_rate;
+        total += rates[count++];
+    }
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    if (count < 2) return;
+
+    int src = 0;
+    for (int i = 1; i < count; i++) {
+        if (rates[i] > rates[src]) src = i;
+    }
+    double mean = total / count;
+    if (rates[src] < NM_HOT_MIN_RATE || rates[src] < NM_HOT_IMBALANCE * mean) return;
+
+    // Hot files with a copy on the busiest server. Reads are spread over a
+    // file's in-sync copies, so each carries its share of the file's rate.
+    HotCandidate *candidates = malloc(sizeof(HotCandidate) * NM_HOT_SLOTS);
+    int candidate_count = 0;
+    double tracked = 0.0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&nm.hot_mutex);
+    HotFile *hot = malloc(sizeof(HotFile) * NM_HOT_SLOTS);
+    memcpy(hot, nm.hot_files, sizeof(HotFile) * NM_HOT_SLOTS);
+    pthread_mutex_unlock(&nm.hot_mutex);
+
+    for (int i = 0; i < NM_HOT_SLOTS; i++) {
+        if (!hot[i].used || hot[i].rate <= 0.0) continue;
+        FileMetadata *meta = lookup_file_meta(hot[i].filename);
+        if (!meta) continue;
+
+        if (file_on_server(meta, ids[src])) {
+            int copies = 1;
+            for (int b = 0; b < meta->backup_count; b++) {
+                if (!(meta->stale_mask & (1 << b))) copies++;
+            }
+            double share = hot[i].rate / copies;
+            tracked += share;
+            if (now - hot[i].last_moved >= NM_MIGRATE_COOLDOWN) {
+                strcpy(candidates[candidate_count].filename, hot[i].filename);
+                candidates[candidate_count++].rate = share;
             }
-            
-            // User exists but no active session - allow reconnection
-            nm.registered_users[i].last_seen = time(NULL);
-            nm.registered_users[i].active_session = 1;
-            nm.registered_users[i].client_sock = client_sock;
-            pthread_mutex_unlock(&nm.registered_users_mutex);
-            log_formatted(LOG_INFO, "User %s reconnected on socket %d", username, client_sock);
-            return;
         }
+        free(meta);
     }
-    
-    // Add new user
-    if (nm.registered_user_count < MAX_CLIENTS * 10) {
-        strcpy(nm.registered_users[nm.registered_user_count].username, username);
-        nm.registered_users[nm.registered_user_count].first_registered = time(NULL);
-        nm.registered_users[nm.registered_user_count].last_seen = time(NULL);
-        nm.registered_users[nm.registered_user_count].active_session = 1;
-        nm.registered_users[nm.registered_user_count].client_sock = client_sock;
-        nm.registered_user_count++;
-        log_formatted(LOG_INFO, "New user registered: %s on socket %d (total: %d)", 
-                     username, client_sock, nm.registered_user_count);
-    } else {
-        log_formatted(LOG_ERROR, "Cannot register user %s: registry full", username);
-        *is_duplicate = 1;  // Treat as failure
+    free(hot);
+
+    // Scale routed requests to the server's own request count
+    double scale = tracked > 0.0 ? rates[src] / tracked : 0.0;
+    qsort(candidates, candidate_count, sizeof(HotCandidate), compare_hot_candidates);
+
+    for (int c = 0; c < candidate_count; c++) {
+        double rate = candidates[c].rate * scale;
+        if (rate < NM_HOT_MIN_RATE) break;
+
+        FileMetadata *meta = lookup_file_meta(candidates[c].filename);
+        if (!meta) continue;
+
+        int dst = -1;
+        for (int i = 0; i < count; i++) {
+            if (i == src || file_on_server(meta, ids[i])) continue;
+            if (dst < 0 || rates[i] < rates[dst]) dst = i;
+        }
+        free(meta);
+
+        if (dst < 0 || rates[dst] + rate >= rates[src]) continue;
+
+        if (migrate_replica(candidates[c].filename, ids[src], ids[dst]) == 0) {
+            pthread_mutex_lock(&nm.hot_mutex);
+            HotFile *entry = hot_file_slot(nm.hot_files, candidates[c].filename, 0);
+            if (entry) entry->last_moved = now;
+            pthread_mutex_unlock(&nm.hot_mutex);
+
+            log_formatted(LOG_INFO, "Hot file %s (~%.1f req/s) moved off SS %d (%.1f req/s, mean %.1f) to SS %d",
+                         candidates[c].filename, rate, ids[src], rates[src], mean, ids[dst]);
+        }
+        break;
     }
-    
-    pthread_mutex_unlock(&nm.registered_users_mutex);
+    free(candidates);
 }
 
-void deregister_active_session(const char *username, int client_sock) {
-    pthread_mutex_lock(&nm.registered_users_mutex);
-    
-    for (int i = 0; i < nm.registered_user_count; i++) {
-        if (strcmp(nm.registered_users[i].username, username) == 0) {
-            if (nm.registered_users[i].client_sock == client_sock) {
-                nm.registered_users[i].active_session = 0;
-                nm.registered_users[i].client_sock = -1;
-                nm.registered_users[i].last_seen = time(NULL);
-                log_formatted(LOG_INFO, "User %s session ended (socket %d)", username, client_sock);
-            }
-            break;
+// Runs a repair pass whenever a server joins, leaves or reports a stale
+// backup, and retries unfinished work every NM_REPL_RETRY_INTERVAL seconds.
+// Between repairs it drains servers and moves hot files, or under chash
+// moves files to their ring servers instead.
+void* replica_repair_thread(void* arg) {
+    (void)arg;
+    int retry = 0;
+    int ring_retry = 0;
+    time_t next_balance = time(NULL) + nm.migrate_interval;
+
+    while (nm.running) {
+        pthread_mutex_lock(&nm.repl_mutex);
+        if (!nm.repl_pending) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += NM_REPL_RETRY_INTERVAL;
+            pthread_cond_timedwait(&nm.repl_cond, &nm.repl_mutex, &deadline);
+        }
+        int run = nm.repl_pending || retry;
+        nm.repl_pending = 0;
+        pthread_mutex_unlock(&nm.repl_mutex);
+
+        apply_stale_reports();
+        if (run && nm.running) {
+            retry = repair_replicas() > 0;
+        }
+
+        if (nm.running && nm.placement.policy == PLACEMENT_CHASH) {
+            // Draining servers drop out of the ring, so this drains them too
+            ring_retry = rebalance_ring(ring_retry) > 0;
+            continue;
+        }
+        if (nm.running) {
+            drain_servers();
+        }
+        if (nm.running && nm.migrate_interval > 0 && time(NULL) >= next_balance) {
+            balance_hot_files();
+            next_balance = time(NULL) + nm.migrate_interval;
         }
     }
-    
-    pthread_mutex_unlock(&nm.registered_users_mutex);
+    return NULL;
 }
 
-int find_ss_for_file(const char *filename) {
-    FileMetadata *meta = cache_get(nm.cache, filename);
-    
-    if (!meta) {
-        meta = trie_search(nm.file_trie, filename);
-        if (meta) {
-            cache_put(nm.cache, filename, meta);
+// Address of the SS a client should use for a file: writes go to the
+// primary, reads to any in-sync replica on a live server. `ss_id` is set
+// to the chosen server.
+int route_file_request(const char *filename, MessageType type, char *address, size_t size, int *ss_id) {
+    FileMetadata *meta = lookup_file_meta(filename);
+    if (!meta) return ERR_FILE_NOT_FOUND;
+
+    int candidates[1 + MAX_BACKUPS];
+    int count = 0;
+    candidates[count++] = meta->ss_id;
+    if (type == MSG_READ || type == MSG_STREAM) {
+        for (int i = 0; i < meta->backup_count; i++) {
+            if (!(meta->stale_mask & (1 << i))) candidates[count++] = meta->backup_ids[i];
         }
     }
-    
-    if (meta) {
-        int ss_id = meta->ss_id;
-        free(meta);
-        return ss_id;
-    }
-    
-    return -1;
-}
+    free(meta);
 
-int get_next_ss_round_robin() {
-    pthread_mutex_lock(&nm.ss_mutex);
-    
-    if (nm.ss_count == 0) {
-        pthread_mutex_unlock(&nm.ss_mutex);
-        return -1;
+    unsigned int start = __sync_fetch_and_add(&nm.read_cursor, 1);
+    int status = ERR_SS_UNAVAILABLE;
+
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    for (int k = 0; k < count; k++) {
+        int idx = ss_index_locked(candidates[(start + k) % count]);
+        if (idx >= 0 && nm.ss_list[idx].active) {
+            snprintf(address, size, "%s:%d", nm.ss_list[idx].ip, nm.ss_list[idx].client_port);
+            *ss_id = nm.ss_list[idx].id;
+            status = SUCCESS;
+            break;
+        }
     }
-    
-    int ss_id = nm.next_ss_id % nm.ss_count;
-    nm.next_ss_id++;
-    
-    pthread_mutex_unlock(&nm.ss_mutex);
-    return nm.ss_list[ss_id].id;
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+    return status;
 }
 
 int check_access(const char *filename, const char *username, AccessType required) {
-    FileMetadata *meta = trie_search(nm.file_trie, filename);
+    FileMetadata *meta = file_store_get(nm.files, filename);
     if (!meta) return 0;
     
     // Owner has all access
@@ -246,7 +1609,7 @@ void handle_createfolder(int client_sock, Message *msg) {
     }
     
     // Get SS for folder
-    int ss_id = get_next_ss_round_robin();
+    int ss_id = choose_ss_for_placement(full_path);
     if (ss_id < 0) {
         response.status = ERR_SS_UNAVAILABLE;
         send_message(client_sock, &response);
@@ -254,7 +1617,7 @@ void handle_createfolder(int client_sock, Message *msg) {
     }
     
     // Forward to SS
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     int ss_idx = -1;
     for (int i = 0; i < nm.ss_count; i++) {
         if (nm.ss_list[i].id == ss_id && nm.ss_list[i].active) {
@@ -262,7 +1625,7 @@ void handle_createfolder(int client_sock, Message *msg) {
             break;
         }
     }
-    pthread_mutex_unlock(&nm.ss_mutex);
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
     
     if (ss_idx < 0) {
         response.status = ERR_SS_UNAVAILABLE;
@@ -276,12 +1639,8 @@ void handle_createfolder(int client_sock, Message *msg) {
     strcpy(ss_msg.foldername, msg->foldername);
     strcpy(ss_msg.target_path, full_path);
     
-    pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-    send_message(nm.ss_list[ss_idx].sock, &ss_msg);
-    
     Message ss_response;
-    recv_message(nm.ss_list[ss_idx].sock, &ss_response);
-    pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
+    ss_command(ss_idx, &ss_msg, &ss_response);
     
     if (ss_response.status == SUCCESS) {
         // Add to folder trie
@@ -302,6 +1661,7 @@ void handle_createfolder(int client_sock, Message *msg) {
         response.status = ss_response.status;
     }
     
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
@@ -310,7 +1670,7 @@ void handle_requestaccess(int client_sock, Message *msg) {
     init_message(&response);
     
     // Check if file exists
-    FileMetadata *meta = trie_search(nm.file_trie, msg->filename);
+    FileMetadata *meta = file_store_get(nm.files, msg->filename);
     if (!meta) {
         response.status = ERR_FILE_NOT_FOUND;
         send_message(client_sock, &response);
@@ -346,6 +1706,7 @@ void handle_requestaccess(int client_sock, Message *msg) {
         strcpy(nm.access_requests[nm.request_count].filename, msg->filename);
         nm.access_requests[nm.request_count].requested_access = msg->access;
         nm.access_requests[nm.request_count].request_time = time(NULL);
+        meta_log_add_request(&nm.access_requests[nm.request_count]);
         nm.request_count++;
         response.status = SUCCESS;
         log_formatted(LOG_INFO, "Access request from %s for %s (access type: %d)", 
@@ -357,6 +1718,7 @@ void handle_requestaccess(int client_sock, Message *msg) {
     
     pthread_mutex_unlock(&nm.request_mutex);
     free(meta);
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
@@ -367,24 +1729,23 @@ void handle_viewrequests(int client_sock, Message *msg) {
     
     char buffer[MAX_BUFFER] = "";
     int pos = 0;
-    int found = 0;
     
     pthread_mutex_lock(&nm.request_mutex);
     
     for (int i = 0; i < nm.request_count; i++) {
         // Check if sender owns the file
-        FileMetadata *meta = trie_search(nm.file_trie, nm.access_requests[i].filename);
+        FileMetadata *meta = file_store_get(nm.files, nm.access_requests[i].filename);
         if (meta && strcmp(meta->owner, msg->sender) == 0) {
-            found = 1;
             char time_str[32];
             struct tm *tm_info = localtime(&nm.access_requests[i].request_time);
             strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
             
             const char *access_str = (nm.access_requests[i].requested_access == ACCESS_READ) ? "READ" : "WRITE";
             
+            // Ids are unique across shards: local index * shards + shard
             pos += snprintf(buffer + pos, MAX_BUFFER - pos, 
                           "[%d] User: %s, File: %s, Access: %s, Time: %s\n",
-                          i, nm.access_requests[i].username, 
+                          i * nm.shards + nm.shard, nm.access_requests[i].username, 
                           nm.access_requests[i].filename,
                           access_str, time_str);
         }
@@ -392,8 +1753,12 @@ void handle_viewrequests(int client_sock, Message *msg) {
     }
     
     pthread_mutex_unlock(&nm.request_mutex);
+
+    if (!serving_peer && nm.shards > 1) {
+        pos = gather_from_shards(msg, buffer, pos, MAX_BUFFER);
+    }
     
-    if (!found) {
+    if (pos == 0 && !serving_peer) {
         strcpy(buffer, "No pending access requests for your files.\n");
     }
     
@@ -407,6 +1772,7 @@ void handle_approverequest(int client_sock, Message *msg) {
     init_message(&response);
     
     int request_id = msg->sentence_index;  // Reuse field for request ID
+    if (nm.shards > 1) request_id = request_id >= 0 ? request_id / nm.shards : -1;
     
     pthread_mutex_lock(&nm.request_mutex);
     
@@ -420,7 +1786,7 @@ void handle_approverequest(int client_sock, Message *msg) {
     AccessRequest *req = &nm.access_requests[request_id];
     
     // Verify ownership
-    FileMetadata *meta = trie_search(nm.file_trie, req->filename);
+    FileMetadata *meta = file_store_get(nm.files, req->filename);
     if (!meta || strcmp(meta->owner, msg->sender) != 0) {
         pthread_mutex_unlock(&nm.request_mutex);
         if (meta) free(meta);
@@ -445,10 +1811,10 @@ void handle_approverequest(int client_sock, Message *msg) {
         meta->acl_count++;
     }
     
-    trie_update(nm.file_trie, req->filename, meta);
-    cache_put(nm.cache, req->filename, meta);
+    file_store_update(nm.files, req->filename, meta);
     
     // Remove request
+    meta_log_delete_request(req);
     for (int i = request_id; i < nm.request_count - 1; i++) {
         nm.access_requests[i] = nm.access_requests[i + 1];
     }
@@ -461,6 +1827,7 @@ void handle_approverequest(int client_sock, Message *msg) {
                  req->username, req->filename);
     
     free(meta);
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
@@ -469,6 +1836,7 @@ void handle_denyrequest(int client_sock, Message *msg) {
     init_message(&response);
     
     int request_id = msg->sentence_index;  // Reuse field for request ID
+    if (nm.shards > 1) request_id = request_id >= 0 ? request_id / nm.shards : -1;
     
     pthread_mutex_lock(&nm.request_mutex);
     
@@ -482,7 +1850,7 @@ void handle_denyrequest(int client_sock, Message *msg) {
     AccessRequest *req = &nm.access_requests[request_id];
     
     // Verify ownership
-    FileMetadata *meta = trie_search(nm.file_trie, req->filename);
+    FileMetadata *meta = file_store_get(nm.files, req->filename);
     if (!meta || strcmp(meta->owner, msg->sender) != 0) {
         pthread_mutex_unlock(&nm.request_mutex);
         if (meta) free(meta);
@@ -495,6 +1863,7 @@ void handle_denyrequest(int client_sock, Message *msg) {
     log_formatted(LOG_INFO, "Denied access request for %s to %s", 
                  req->username, req->filename);
     
+    meta_log_delete_request(req);
     for (int i = request_id; i < nm.request_count - 1; i++) {
         nm.access_requests[i] = nm.access_requests[i + 1];
     }
@@ -504,6 +1873,7 @@ void handle_denyrequest(int client_sock, Message *msg) {
     
     free(meta);
     response.status = SUCCESS;
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
@@ -512,7 +1882,7 @@ void handle_move(int client_sock, Message *msg) {
     init_message(&response);
     
     // Check if file exists
-    FileMetadata *file_meta = trie_search(nm.file_trie, msg->filename);
+    FileMetadata *file_meta = file_store_get(nm.files, msg->filename);
     if (!file_meta) {
         response.status = ERR_FILE_NOT_FOUND;
         send_message(client_sock, &response);
@@ -528,22 +1898,22 @@ void handle_move(int client_sock, Message *msg) {
         return;
     }
     
-    // Check if target folder exists (unless moving to root)
+    // Check if target folder exists (unless moving to root); it may live
+    // on another shard
     if (strlen(msg->target_path) > 0 && strcmp(msg->target_path, "/") != 0) {
-        FolderMetadata *folder_meta = folder_trie_search(nm.folder_trie, msg->target_path);
-        if (!folder_meta) {
+        int exists = folder_exists(msg->target_path);
+        if (exists <= 0) {
             free(file_meta);
-            response.status = ERR_FILE_NOT_FOUND;
+            response.status = exists < 0 ? ERR_SERVER_ERROR : ERR_FILE_NOT_FOUND;
             send_message(client_sock, &response);
             return;
         }
-        free(folder_meta);
     }
     
     int ss_id = file_meta->ss_id;
     
     // Forward to SS
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     int ss_idx = -1;
     for (int i = 0; i < nm.ss_count; i++) {
         if (nm.ss_list[i].id == ss_id && nm.ss_list[i].active) {
@@ -551,7 +1921,7 @@ void handle_move(int client_sock, Message *msg) {
             break;
         }
     }
-    pthread_mutex_unlock(&nm.ss_mutex);
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
     
     if (ss_idx < 0) {
         free(file_meta);
@@ -567,18 +1937,14 @@ void handle_move(int client_sock, Message *msg) {
     strcpy(ss_msg.target_path, msg->target_path);
     strcpy(ss_msg.data, file_meta->folder_path);  // Old path (may be empty for root)
     
-    pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-    send_message(nm.ss_list[ss_idx].sock, &ss_msg);
-    
     Message ss_response;
-    recv_message(nm.ss_list[ss_idx].sock, &ss_response);
-    pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
+    ss_command(ss_idx, &ss_msg, &ss_response);
     
     if (ss_response.status == SUCCESS) {
         // Update file metadata with new path
         strcpy(file_meta->folder_path, msg->target_path);
-        trie_update(nm.file_trie, msg->filename, file_meta);
-        cache_put(nm.cache, msg->filename, file_meta);
+        file_store_update(nm.files, msg->filename, file_meta);
+        move_backup_copies(file_meta, &ss_msg);
         response.status = SUCCESS;
         log_formatted(LOG_INFO, "Moved file %s from '%s' to '%s'", 
                      msg->filename, 
@@ -589,9 +1955,26 @@ void handle_move(int client_sock, Message *msg) {
     }
     
     free(file_meta);
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
+typedef struct {
+    const char *user;
+    char buffer[MAX_BUFFER];
+    int pos;
+} FolderListing;
+
+// Listing visitor: add the files the user may read, until the reply is full
+int add_to_listing(const char *filename, void *ctx) {
+    FolderListing *listing = ctx;
+    if (!check_access(filename, listing->user, ACCESS_READ)) return 0;
+    int len = strlen(filename) + 1;
+    if (listing->pos + len >= MAX_BUFFER) return 1;
+    listing->pos += snprintf(listing->buffer + listing->pos, MAX_BUFFER - listing->pos, "%s\n", filename);
+    return 0;
+}
+
 void handle_viewfolder(int client_sock, Message *msg) {
     Message response;
     init_message(&response);
@@ -601,47 +1984,31 @@ void handle_viewfolder(int client_sock, Message *msg) {
     int viewing_root = (strlen(msg->target_path) == 0 || strcmp(msg->target_path, "/") == 0);
     printf("ROOT? : %d\n", viewing_root);
 
-    if (!viewing_root) {
+    // The folder's own shard checks it; the others only list their files
+    if (!viewing_root && !serving_peer) {
         // Check if folder exists
         printf("Fetching folder data.....\n");
         FolderMetadata *folder_meta = folder_trie_search(nm.folder_trie, msg->target_path);
         if (!folder_meta) {
             response.status = ERR_FILE_NOT_FOUND;
             send_message(client_sock, &response);
-            free(folder_meta);
             return;
         }
+        free(folder_meta);
     }
     
-    // Get all files
-    printf("Fetching all files....\n");
-    FileMetadata *files[MAX_FILES];
-    int file_count = trie_get_all_files(nm.file_trie, files, MAX_FILES);
-    printf("Found %d files!\n", file_count);
-    
-    char buffer[MAX_BUFFER] = "";
-    int pos = 0;
+    // The folder index lists just this folder's files, in order
+    FolderListing listing = { msg->sender, "", 0 };
+    file_store_list_folder(nm.files, viewing_root ? "" : msg->target_path, add_to_listing, &listing);
     
-    // Filter files in this folder
-    for (int i = 0; i < file_count; i++) {
-        int matches = 0;
-        
-        if (viewing_root) {
-            // Show files with empty folder_path
-            matches = (strlen(files[i]->folder_path) == 0);
-        } else {
-            // Show files in specified folder
-            printf("Found match!\n");
-            matches = (strcmp(files[i]->folder_path, msg->target_path) == 0);
-        }
-        
-        if (matches && check_access(files[i]->filename, msg->sender, ACCESS_READ)) {
-            pos += snprintf(buffer + pos, MAX_BUFFER - pos, "%s\n", files[i]->filename);
-        }
-        free(files[i]);
+    char *buffer = listing.buffer;
+    int pos = listing.pos;
+
+    if (!serving_peer && nm.shards > 1) {
+        pos = gather_from_shards(msg, buffer, pos, MAX_BUFFER);
     }
     
-    if (pos == 0) {
+    if (pos == 0 && !serving_peer) {
         strcpy(buffer, "(empty folder)\n");
     }
     
@@ -670,7 +2037,7 @@ void handle_checkpoint_request(int client_sock, Message *msg) {
         return;
     }
     
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     int ss_idx = -1;
     for (int i = 0; i < nm.ss_count; i++) {
         if (nm.ss_list[i].id == ss_id && nm.ss_list[i].active) {
@@ -678,7 +2045,7 @@ void handle_checkpoint_request(int client_sock, Message *msg) {
             break;
         }
     }
-    pthread_mutex_unlock(&nm.ss_mutex);
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
     
     if (ss_idx < 0) {
         response.status = ERR_SS_UNAVAILABLE;
@@ -687,10 +2054,7 @@ void handle_checkpoint_request(int client_sock, Message *msg) {
     }
     
     // Forward to SS
-    pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-    send_message(nm.ss_list[ss_idx].sock, msg);
-    recv_message(nm.ss_list[ss_idx].sock, &response);
-    pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
+    ss_command(ss_idx, msg, &response);
     
     send_message(client_sock, &response);
     
@@ -731,14 +2095,14 @@ void handle_view(int client_sock, Message *msg) {
     }
     
     FileMetadata *files[MAX_FILES];
-    int file_count = trie_get_all_files(nm.file_trie, files, MAX_FILES);
+    int file_count = file_store_get_all(nm.files, files, MAX_FILES);
     
     // Fetch metadata for files if needed - N
     if (show_details) {
         for (int i = 0; i < file_count; i++) {
             int ss_id = files[i]->ss_id;
             
-            pthread_mutex_lock(&nm.ss_mutex);
+            MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
             int ss_idx = -1;
             for (int j = 0; j < nm.ss_count; j++) {
                 if (nm.ss_list[j].id == ss_id && nm.ss_list[j].active) {
@@ -746,7 +2110,7 @@ void handle_view(int client_sock, Message *msg) {
                     break;
                 }
             }
-            pthread_mutex_unlock(&nm.ss_mutex);
+            MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
             
             if (ss_idx >= 0) {
                 Message ss_req;
@@ -754,11 +2118,8 @@ void handle_view(int client_sock, Message *msg) {
                 ss_req.type = MSG_SS_INFO;
                 strcpy(ss_req.filename, files[i]->filename);
                 
-                pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-                send_message(nm.ss_list[ss_idx].sock, &ss_req);
-                
                 Message ss_resp;
-                if (recv_message(nm.ss_list[ss_idx].sock, &ss_resp) == 0 && 
+                if (ss_command(ss_idx, &ss_req, &ss_resp) == 0 && 
                     ss_resp.status == SUCCESS) {
                     //printf("Reached here! with %s\n", ss_resp.data);
                     // Changed delimiting to ; to avoid conflict - N
@@ -768,10 +2129,8 @@ void handle_view(int client_sock, Message *msg) {
                         &files[i]->modified, &files[i]->accessed);
                     
                     // Update in trie and cache
-                    trie_update(nm.file_trie, files[i]->filename, files[i]);
-                    cache_put(nm.cache, files[i]->filename, files[i]);
+                    file_store_update(nm.files, files[i]->filename, files[i]);
                 }
-                pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
             }
         }
     }
@@ -785,7 +2144,7 @@ void handle_view(int client_sock, Message *msg) {
     memset(buffer, 0, MAX_BUFFER);
     int pos = 0;
     
-    if (show_details) {
+    if (show_details && !serving_peer) {
         pos += sprintf(buffer + pos, "%-20s %-8s %-8s %-20s %-10s\n", 
                       "Filename", "Words", "Chars", "Last Access", "Owner");
         pos += sprintf(buffer + pos, "%s\n", 
@@ -817,6 +2176,11 @@ void handle_view(int client_sock, Message *msg) {
         }
         free(files[i]);
     }
+
+    // The other shards list their own files
+    if (!serving_peer && nm.shards > 1) {
+        pos = gather_from_shards(msg, buffer, pos, MAX_BUFFER);
+    }
     
     strncpy(response.data, buffer, MAX_BUFFER - 1);
     send_message(client_sock, &response);
@@ -825,7 +2189,10 @@ void handle_view(int client_sock, Message *msg) {
 }
 
 void handle_info(int client_sock, Message *msg) {
-    FileMetadata *meta = trie_search(nm.file_trie, msg->filename);
+    // Make pending access-time updates visible before reporting them
+    access_tracker_flush();
+
+    FileMetadata *meta = file_store_get(nm.files, msg->filename);
     
     Message response;
     init_message(&response);
@@ -840,7 +2207,7 @@ void handle_info(int client_sock, Message *msg) {
     // Get updated info from SS
     int ss_id = find_ss_for_file(msg->filename);
     if (ss_id >= 0) {
-        pthread_mutex_lock(&nm.ss_mutex);
+        MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
         int ss_idx = -1;
         for (int i = 0; i < nm.ss_count; i++) {
             if (nm.ss_list[i].id == ss_id) {
@@ -848,7 +2215,7 @@ void handle_info(int client_sock, Message *msg) {
                 break;
             }
         }
-        pthread_mutex_unlock(&nm.ss_mutex); // Unlock early and use specific SS mutex instead - N
+        MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats); // Unlock early and use specific SS mutex instead - N
         
         if (ss_idx >= 0) {
             Message ss_req;
@@ -856,18 +2223,13 @@ void handle_info(int client_sock, Message *msg) {
             ss_req.type = MSG_SS_INFO;
             strcpy(ss_req.filename, msg->filename);
             
-            // FIXED: Lock the specific SS socket - N
-            pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-            send_message(nm.ss_list[ss_idx].sock, &ss_req);
-            
             Message ss_resp;
-            if (recv_message(nm.ss_list[ss_idx].sock, &ss_resp) == 0 && 
+            if (ss_command(ss_idx, &ss_req, &ss_resp) == 0 && 
                 ss_resp.status == SUCCESS) {
                 sscanf(ss_resp.data, "%zu|%d|%d|%ld|%ld",
                        &meta->size, &meta->word_count, &meta->char_count,
                        &meta->modified, &meta->accessed);
             }
-            pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
         }
     }
     
@@ -929,13 +2291,13 @@ void handle_list(int client_sock, Message *msg) {
     
     // Show all registered users
     pos += snprintf(buffer + pos, MAX_BUFFER - pos, "\n=== All Registered Users ===\n");
-    pthread_mutex_lock(&nm.registered_users_mutex);
+    MUTEX_LOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
     for (int i = 0; i < nm.registered_user_count; i++) {
         pos += snprintf(buffer + pos, MAX_BUFFER - pos, "%s\n", 
                        nm.registered_users[i].username);
         if (pos >= MAX_BUFFER - 100) break;
     }
-    pthread_mutex_unlock(&nm.registered_users_mutex);
+    MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
     
     strncpy(response.data, buffer, MAX_BUFFER - 1);
     send_message(client_sock, &response);
@@ -948,7 +2310,7 @@ void handle_create(int client_sock, Message *msg) {
     init_message(&response);
     
     // Check if file already exists
-    FileMetadata *existing = trie_search(nm.file_trie, msg->filename);
+    FileMetadata *existing = file_store_get(nm.files, msg->filename);
     if (existing) {
         free(existing);
         response.status = ERR_FILE_EXISTS;
@@ -957,16 +2319,18 @@ void handle_create(int client_sock, Message *msg) {
         return;
     }
     
-    // Get SS to store file (round-robin)
-    int ss_id = get_next_ss_round_robin();
-    if (ss_id < 0) {
+    // Get the servers to store the file on (load-aware placement)
+    int replica_ids[MAX_REPLICAS];
+    int replica_count = choose_replica_set(msg->filename, replica_ids, nm.replicas);
+    if (replica_count <= 0) {
         response.status = ERR_SS_UNAVAILABLE;
         send_message(client_sock, &response);
         return;
     }
+    int ss_id = replica_ids[0];
     
     // Forward create request to SS
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     int ss_idx = -1;
     for (int i = 0; i < nm.ss_count; i++) {
         if (nm.ss_list[i].id == ss_id) {
@@ -974,7 +2338,7 @@ void handle_create(int client_sock, Message *msg) {
             break;
         }
     }
-    pthread_mutex_unlock(&nm.ss_mutex); // Unlock early and use specific SS mutex instead - N
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats); // Unlock early and use specific SS mutex instead - N
     
     if (ss_idx < 0) {
         response.status = ERR_SS_UNAVAILABLE;
@@ -988,12 +2352,8 @@ void handle_create(int client_sock, Message *msg) {
     strcpy(ss_msg.filename, msg->filename);
     
     // Lock the specific SS socket - N
-    pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-    send_message(nm.ss_list[ss_idx].sock, &ss_msg);
-    
     Message ss_response;
-    recv_message(nm.ss_list[ss_idx].sock, &ss_response);
-    pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
+    ss_command(ss_idx, &ss_msg, &ss_response);
     
     if (ss_response.status == SUCCESS) {
         // Add to trie
@@ -1008,17 +2368,40 @@ void handle_create(int client_sock, Message *msg) {
         meta.accessed = meta.created;
         strcpy(meta.last_accessed_by, msg->sender);
         meta.acl_count = 0;
+
+        // Backups start from an empty copy too; one that can't create it is
+        // left out, and a leftover copy is resynced
+        for (int r = 1; r < replica_count; r++) {
+            MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+            int backup_idx = ss_index_locked(replica_ids[r]);
+            MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+            Message backup_response;
+            if (backup_idx < 0 || ss_command(backup_idx, &ss_msg, &backup_response) < 0) continue;
+            if (backup_response.status == ERR_FILE_EXISTS) {
+                meta.stale_mask |= 1 << meta.backup_count;
+            } else if (backup_response.status != SUCCESS) {
+                continue;
+            }
+            meta.backup_ids[meta.backup_count++] = replica_ids[r];
+        }
         
-        trie_insert(nm.file_trie, msg->filename, &meta);
-        cache_put(nm.cache, msg->filename, &meta);
+        file_store_insert(nm.files, msg->filename, &meta);
+
+        if (meta.backup_count > 0) {
+            push_replica_config(&meta);
+            if (meta.stale_mask) request_replica_repair();
+        }
         
         response.status = SUCCESS;
-        log_formatted(LOG_INFO, "Created file %s by %s on SS %d", 
-                     msg->filename, msg->sender, ss_id);
+        log_formatted(LOG_INFO, "Created file %s by %s on SS %d (%d backups)", 
+                     msg->filename, msg->sender, ss_id, meta.backup_count);
     } else {
         response.status = ss_response.status;
     }
     
+    // Acknowledge only once the change is durable
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
@@ -1026,7 +2409,7 @@ void handle_delete(int client_sock, Message *msg) {
     Message response;
     init_message(&response);
     
-    FileMetadata *meta = trie_search(nm.file_trie, msg->filename);
+    FileMetadata *meta = file_store_get(nm.files, msg->filename);
     if (!meta) {
         response.status = ERR_FILE_NOT_FOUND;
         send_message(client_sock, &response);
@@ -1042,10 +2425,13 @@ void handle_delete(int client_sock, Message *msg) {
     }
     
     int ss_id = meta->ss_id;
+    int backup_ids[MAX_BACKUPS];
+    int backup_count = meta->backup_count;
+    memcpy(backup_ids, meta->backup_ids, sizeof(backup_ids));
     free(meta);
     
     // Forward delete to SS
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     int ss_idx = -1;
     for (int i = 0; i < nm.ss_count; i++) {
         if (nm.ss_list[i].id == ss_id) {
@@ -1053,7 +2439,7 @@ void handle_delete(int client_sock, Message *msg) {
             break;
         }
     }
-    pthread_mutex_unlock(&nm.ss_mutex); // Unlock early and use specific SS mutex instead - N
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats); // Unlock early and use specific SS mutex instead - N
     
     if (ss_idx < 0) {
         response.status = ERR_SS_UNAVAILABLE;
@@ -1066,14 +2452,10 @@ void handle_delete(int client_sock, Message *msg) {
     lock_check.type = MSG_CHECK_LOCKS;
     strcpy(lock_check.filename, msg->filename);
     
-    pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-    send_message(nm.ss_list[ss_idx].sock, &lock_check);
-    
     Message lock_response;
-    recv_message(nm.ss_list[ss_idx].sock, &lock_response);
+    ss_command(ss_idx, &lock_check, &lock_response);
     
     if (lock_response.status == ERR_FILE_LOCKED) {
-        pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
         response.status = ERR_FILE_LOCKED;
         send_message(client_sock, &response);
         log_formatted(LOG_WARNING, "Cannot delete %s - file has active locks", 
@@ -1086,36 +2468,37 @@ void handle_delete(int client_sock, Message *msg) {
     ss_msg.type = MSG_DELETE;
     strcpy(ss_msg.filename, msg->filename);
     
-    // FIXED: Lock the specific SS socket - N
-    send_message(nm.ss_list[ss_idx].sock, &ss_msg);
-    
     Message ss_response;
-    recv_message(nm.ss_list[ss_idx].sock, &ss_response);
-    pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
+    ss_command(ss_idx, &ss_msg, &ss_response);
     
     if (ss_response.status == SUCCESS) {
-        trie_delete(nm.file_trie, msg->filename);
-        cache_remove(nm.cache, msg->filename);
+        file_store_delete(nm.files, msg->filename);
+
+        // Best effort: a backup that is down keeps an orphaned copy
+        for (int b = 0; b < backup_count; b++) {
+            delete_replica_copy(backup_ids[b], msg->filename);
+        }
         response.status = SUCCESS;
         log_formatted(LOG_INFO, "Deleted file %s by %s", msg->filename, msg->sender);
     } else {
         response.status = ss_response.status;
     }
     
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
 int user_exists(const char *username) {
-    pthread_mutex_lock(&nm.registered_users_mutex);
+    MUTEX_LOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
     
     for (int i = 0; i < nm.registered_user_count; i++) {
         if (strcmp(nm.registered_users[i].username, username) == 0) {
-            pthread_mutex_unlock(&nm.registered_users_mutex);
+            MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
             return 1;
         }
     }
     
-    pthread_mutex_unlock(&nm.registered_users_mutex);
+    MUTEX_UNLOCK(&nm.registered_users_mutex, &registered_users_lock_stats);
     return 0;
 }
 
@@ -1123,7 +2506,7 @@ void handle_access(int client_sock, Message *msg) {
     Message response;
     init_message(&response);
     
-    FileMetadata *meta = trie_search(nm.file_trie, msg->filename);
+    FileMetadata *meta = file_store_get(nm.files, msg->filename);
     if (!meta) {
         response.status = ERR_FILE_NOT_FOUND;
         send_message(client_sock, &response);
@@ -1174,8 +2557,7 @@ void handle_access(int client_sock, Message *msg) {
             meta->acl_count++;
         }
         
-        trie_update(nm.file_trie, msg->filename, meta);
-        cache_put(nm.cache, msg->filename, meta);
+        file_store_update(nm.files, msg->filename, meta);
         response.status = SUCCESS;
         
         log_formatted(LOG_INFO, "Added access for %s to %s (access: %d)", 
@@ -1194,8 +2576,7 @@ void handle_access(int client_sock, Message *msg) {
             }
         }
         
-        trie_update(nm.file_trie, msg->filename, meta);
-        cache_put(nm.cache, msg->filename, meta);
+        file_store_update(nm.files, msg->filename, meta);
         response.status = SUCCESS;
         
         log_formatted(LOG_INFO, "Removed access for %s from %s", 
@@ -1203,6 +2584,7 @@ void handle_access(int client_sock, Message *msg) {
     }
     
     free(meta);
+    if (meta_log_commit() < 0) response.status = ERR_SERVER_ERROR;
     send_message(client_sock, &response);
 }
 
@@ -1225,7 +2607,7 @@ void handle_exec(int client_sock, Message *msg) {
         return;
     }
     
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     int ss_idx = -1;
     for (int i = 0; i < nm.ss_count; i++) {
         if (nm.ss_list[i].id == ss_id) {
@@ -1233,7 +2615,7 @@ void handle_exec(int client_sock, Message *msg) {
             break;
         }
     }
-    pthread_mutex_unlock(&nm.ss_mutex); // Unlock early and use specific SS mutex instead - N
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats); // Unlock early and use specific SS mutex instead - N
     
     if (ss_idx < 0) {
         response.status = ERR_SS_UNAVAILABLE;
@@ -1248,12 +2630,8 @@ void handle_exec(int client_sock, Message *msg) {
     strcpy(ss_msg.data, "READ_CONTENT");
     
     // FIXED: Lock the specific SS socket - N
-    pthread_mutex_lock(&nm.ss_sock_mutexes[ss_idx]);
-    send_message(nm.ss_list[ss_idx].sock, &ss_msg);
-    
     Message ss_response;
-    recv_message(nm.ss_list[ss_idx].sock, &ss_response);
-    pthread_mutex_unlock(&nm.ss_sock_mutexes[ss_idx]);
+    ss_command(ss_idx, &ss_msg, &ss_response);
 
     //printf("SS Response Dtaa: %s\n", ss_response.data); // Debug line
     
@@ -1283,121 +2661,166 @@ void handle_exec(int client_sock, Message *msg) {
     log_formatted(LOG_INFO, "Executed file %s for %s", msg->filename, msg->sender);
 }
 
-// handles heartbeats explcitly - N
-void* ss_hb_listener(void* arg) {
-    (void) arg;
+// Connection kinds registered with the reactor
+#define CONN_SS 1
+#define CONN_SS_HB 2
+#define CONN_CLIENT 3
 
-    nm.ss_hb_sock = socket(AF_INET, SOCK_STREAM, 0);
-    int opt = 1;
-    setsockopt(nm.ss_hb_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(NM_SS_HB_PORT);
-    
-    bind(nm.ss_hb_sock, (struct sockaddr*)&addr, sizeof(addr));
-    listen(nm.ss_hb_sock, MAX_SS);
-    
-    printf("[NM] Listening for SS heartbeats on port %d\n", NM_SS_HB_PORT);
-    
-    while (nm.running) {
-        int *hb_sock = malloc(sizeof(int));
-        *hb_sock = accept(nm.ss_hb_sock, NULL, NULL);
-        
-        if (*hb_sock < 0) {
-            free(hb_sock);
-            continue;
+// Per-connection state for client sessions
+typedef struct {
+    char username[MAX_USERNAME];
+    int registered;
+    uint32_t capture_id;         // This connection in the request capture (NM_CAPTURE)
+} ClientSession;
+
+// Per-connection state for SS heartbeat channels
+typedef struct {
+    int ss_id;
+} HeartbeatSession;
+
+// heartbeat frames - N
+int on_ss_heartbeat_frame(Connection *conn, Message *msg) {
+    HeartbeatSession *hb = conn->ctx;
+
+    // First message identifies the SS - N
+    if (!hb) {
+        if (msg->type != MSG_ACK) {
+            return REACTOR_CLOSE;
         }
-        
-        pthread_t tid;
-        pthread_create(&tid, NULL, handle_ss_heartbeat, hb_sock);
-        pthread_detach(tid);
+
+        hb = malloc(sizeof(HeartbeatSession));
+        hb->ss_id = msg->ss_id;
+        conn->ctx = hb;
+        log_formatted(LOG_INFO, "SS %d heartbeat connection established", hb->ss_id);
+
+        MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+        for (int i = 0; i < nm.ss_count; i++) {
+            if (nm.ss_list[i].id == hb->ss_id) {
+                nm.ss_list[i].hb_sock = conn->fd;
+                nm.ss_list[i].last_heartbeat_ms = lease_now_ms();
+                break;
+            }
+        }
+        MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+        return REACTOR_KEEP;
     }
-    
-    return NULL;
-}
 
-// thread attribute function: heartbeat handler - N
-void* handle_ss_heartbeat(void* arg) {
-    int hb_sock = *((int*)arg);
-    free(arg);
-    
-    Message msg;
-    
-    // First message identifies the SS - N
-    if (recv_message(hb_sock, &msg) < 0 || msg.type != MSG_ACK) {
-        close(hb_sock);
-        return NULL;
+    if (msg->type == MSG_REPL_STALE) {
+        mark_backup_stale(msg->filename, atoi(msg->data));
+        return REACTOR_KEEP;
     }
-    
-    int my_ss_id = msg.ss_id;
-    log_formatted(LOG_INFO, "SS %d heartbeat connection established", my_ss_id);
 
-    pthread_mutex_lock(&nm.ss_mutex);
-    for (int i = 0; i < nm.ss_count; i++) {
-        if (nm.ss_list[i].id == my_ss_id) {
-            nm.ss_list[i].hb_sock = hb_sock;
-            nm.ss_list[i].last_heartbeat = time(NULL);
-            break;
+    // "HEARTBEAT|files|bytes|req_rate|p99_ms|locks|draining" - the load fields are optional
+    if (msg->type == MSG_ACK && strncmp(msg->data, "HEARTBEAT", 9) == 0) {
+        SSLoad report;
+        memset(&report, 0, sizeof(report));
+        int draining = 0;
+        int fields = sscanf(msg->data, "HEARTBEAT|%d|%lld|%lf|%lf|%d|%d",
+                            &report.file_count, &report.bytes_used, &report.request_rate,
+                            &report.p99_ms, &report.locks_held, &draining);
+        int has_load = fields >= 5;
+
+        MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+        for (int i = 0; i < nm.ss_count; i++) {
+            if (nm.ss_list[i].id == hb->ss_id) {
+                nm.ss_list[i].last_heartbeat_ms = lease_now_ms();
+                if (has_load) {
+                    nm.ss_loads[i] = report;
+                }
+                if (draining != nm.ss_draining[i]) {
+                    nm.ss_draining[i] = draining;
+                    log_formatted(LOG_INFO, "SS %d %s draining", hb->ss_id, draining ? "started" : "stopped");
+                }
+                log_formatted(LOG_DEBUG, "Heartbeat from SS %d (files=%d bytes=%lld rate=%.1f p99=%.2fms locks=%d)",
+                             hb->ss_id, report.file_count, report.bytes_used,
+                             report.request_rate, report.p99_ms, report.locks_held);
+                break;
+            }
         }
+        MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
     }
-    pthread_mutex_unlock(&nm.ss_mutex);
-    
-    // Receive heartbeats - N
-    while (nm.running) {
-        if (recv_message(hb_sock, &msg) < 0) {
-            log_formatted(LOG_WARNING, "SS %d heartbeat connection lost", my_ss_id);
-            break;
-        }
-        
-        if (msg.type == MSG_ACK && strcmp(msg.data, "HEARTBEAT") == 0) {
-            pthread_mutex_lock(&nm.ss_mutex);
-            for (int i = 0; i < nm.ss_count; i++) {
-                if (nm.ss_list[i].id == my_ss_id) {
-                    nm.ss_list[i].last_heartbeat = time(NULL);
-                    log_formatted(LOG_DEBUG, "Heartbeat from SS %d", my_ss_id);
-                    break;
-                }
+
+    return REACTOR_KEEP;
+}
+
+void on_ss_heartbeat_close(Connection *conn) {
+    HeartbeatSession *hb = conn->ctx;
+    if (!hb) return;
+
+    log_formatted(LOG_WARNING, "SS %d heartbeat connection lost", hb->ss_id);
+
+    // Heartbeat lost - mark as inactive, unless this channel was already
+    // replaced by a reconnect or retired by the monitor - N
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
+    for (int i = 0; i < nm.ss_count; i++) {
+        if (nm.ss_list[i].id == hb->ss_id) {
+            if (nm.ss_list[i].hb_sock == conn->fd) {
+                nm.ss_list[i].hb_sock = -1;
+                nm.ss_list[i].active = 0;
+                retire_ss_pool(i);
+                request_replica_repair();
+                log_formatted(LOG_ERROR, "SS %d marked INACTIVE due to heartbeat failure", hb->ss_id);
             }
-            pthread_mutex_unlock(&nm.ss_mutex);
+            break;
         }
     }
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    free(hb);
+    conn->ctx = NULL;
+}
+
+// An additional command connection from an already registered SS
+int attach_ss_pool_connection(Connection *conn, Message *msg) {
+    Message response;
+    init_message(&response);
+    response.status = ERR_SS_UNAVAILABLE;
 
-    // Heartbeat lost - mark as inactive - N
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     for (int i = 0; i < nm.ss_count; i++) {
-        if (nm.ss_list[i].id == my_ss_id) {
-            nm.ss_list[i].hb_sock = -1;
-            nm.ss_list[i].active = 0;  // THIS triggers cleanup in handle_ss_connection
-            log_formatted(LOG_ERROR, "SS %d marked INACTIVE due to heartbeat failure", my_ss_id);
+        if (nm.ss_list[i].id == msg->ss_id && nm.ss_list[i].active) {
+            MUTEX_LOCK(&nm.ss_sock_mutexes[i], &ss_sock_lock_stats);
+            if (add_ss_pool_socket_locked(i, conn->fd) == 0) {
+                response.status = SUCCESS;
+                log_formatted(LOG_INFO, "SS %d command pool now has %d connections",
+                             msg->ss_id, nm.ss_pools[i].count);
+            }
+            MUTEX_UNLOCK(&nm.ss_sock_mutexes[i], &ss_sock_lock_stats);
             break;
         }
     }
-    pthread_mutex_unlock(&nm.ss_mutex);
-    
-    close(hb_sock);
-    return NULL;
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+
+    // The SS checks route leases with our key from now on
+    if (response.status == SUCCESS && nm.lease_ttl_ms > 0) {
+        lease_key_to_hex(nm.lease_key, response.data);
+    }
+
+    // Not registered yet (the SS retries) or the pool is full
+    send_message(conn->fd, &response);
+    return response.status == SUCCESS ? REACTOR_DETACH : REACTOR_CLOSE;
 }
 
-void* handle_ss_connection(void* arg) {
-    int ss_sock = *((int*)arg);
-    free(arg);
-    
-    Message msg;
-    if (recv_message(ss_sock, &msg) < 0 || msg.type != MSG_REG_SS) {
-        close(ss_sock);
-        return NULL;
+// SS registration arrives on the command port; after that the socket is
+// driven synchronously by handlers, so it is detached from the reactor
+int on_ss_frame(Connection *conn, Message *msg) {
+    int ss_sock = conn->fd;
+
+    if (msg->type == MSG_SS_POOL_CONN) {
+        return attach_ss_pool_connection(conn, msg);
+    }
+    if (msg->type != MSG_REG_SS) {
+        return REACTOR_CLOSE;
     }
     
-    pthread_mutex_lock(&nm.ss_mutex);
+    MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
     
     // Check if this SS ID already exists (reconnection scenario) - N
     int existing_idx = -1;
     for (int i = 0; i < nm.ss_count; i++) {
-        if (nm.ss_list[i].id == msg.ss_id) {
+        if (nm.ss_list[i].id == msg->ss_id) {
             existing_idx = i;
-            log_formatted(LOG_INFO, "SS %d reconnecting - replacing old connection", msg.ss_id);
+            log_formatted(LOG_INFO, "SS %d reconnecting - replacing old connection", msg->ss_id);
             break;
         }
     }
@@ -1410,69 +2833,77 @@ void* handle_ss_connection(void* arg) {
         // Mark old connection as dead immediately - N
         nm.ss_list[idx].active = 0;
         
-        // Close old sockets - N
-        if (nm.ss_list[idx].sock >= 0) {
-            close(nm.ss_list[idx].sock);
-        }
+        // Old command connections are closed when the pool is reset below - N
+
+        // The heartbeat socket belongs to the reactor: shut it down and let
+        // its close handler release it - N
         if (nm.ss_list[idx].hb_sock >= 0) {
-            close(nm.ss_list[idx].hb_sock);
+            shutdown(nm.ss_list[idx].hb_sock, SHUT_RDWR);
         }
         
-        log_formatted(LOG_INFO, "Closed old sockets for SS %d", msg.ss_id);
+        log_formatted(LOG_INFO, "Closed old sockets for SS %d", msg->ss_id);
     } else {
         // New SS: check capacity - N
         if (nm.ss_count >= MAX_SS) {
-            pthread_mutex_unlock(&nm.ss_mutex);
-            close(ss_sock);
-            log_formatted(LOG_ERROR, "Cannot accept SS %d: max capacity reached", msg.ss_id);
-            return NULL;
+            MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
+            log_formatted(LOG_ERROR, "Cannot accept SS %d: max capacity reached", msg->ss_id);
+            return REACTOR_CLOSE;
         }
         idx = nm.ss_count;
         nm.ss_count++;
     }
     
-    nm.ss_list[idx].id = msg.ss_id;
-    strcpy(nm.ss_list[idx].ip, msg.sender);
-    nm.ss_list[idx].nm_port = msg.nm_port;
-    nm.ss_list[idx].client_port = msg.client_port;  // Use proper field - N
+    nm.ss_list[idx].id = msg->ss_id;
+    strcpy(nm.ss_list[idx].ip, msg->sender);
+    nm.ss_list[idx].nm_port = msg->nm_port;
+    nm.ss_list[idx].client_port = msg->client_port;  // Use proper field - N
     printf("[NM] Registered SS ID: %d, IP: %s, NM Port: %d, Client Port: %d\n", 
-           msg.ss_id, msg.sender, msg.nm_port, msg.client_port);
+           msg->ss_id, msg->sender, msg->nm_port, msg->client_port);
+    // The registration socket is the first member of a fresh command pool;
+    // the SS adds more with MSG_SS_POOL_CONN - N
+    MUTEX_LOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
+    reset_ss_pool_locked(idx);
+    add_ss_pool_socket_locked(idx, ss_sock);
     nm.ss_list[idx].sock = ss_sock;
+    MUTEX_UNLOCK(&nm.ss_sock_mutexes[idx], &ss_sock_lock_stats);
     nm.ss_list[idx].hb_sock = -1;  // Initialize, will be set later - N
     nm.ss_list[idx].active = 1;
-    // nm.ss_list[idx].last_heartbeat = time(NULL);
     nm.ss_list[idx].file_count = 0;
     
     // Parse file list
-    char *file_list = strdup(msg.data);
+    char *file_list = strdup(msg->data);
     char *token = strtok(file_list, ",");
     while (token && nm.ss_list[idx].file_count < MAX_FILES) {
         strcpy(nm.ss_list[idx].files[nm.ss_list[idx].file_count], token);
         
         // Check if file already exists in trie - N
-        FileMetadata *existing = trie_search(nm.file_trie, token);
+        FileMetadata *existing = file_store_get(nm.files, token);
     
         // This means we have a reconnecting SS, so preserve metadata - N
         if (existing) {
             log_formatted(LOG_INFO, "Preserving metadata for existing file: %s (owner: %s)", 
                         token, existing->owner);
         
-            existing->ss_id = msg.ss_id;
-            trie_update(nm.file_trie, token, existing);
+            // A replicated file keeps its primary; the repair pass resyncs
+            // this copy if it is a backup
+            if (existing->backup_count == 0) {
+                existing->ss_id = msg->ss_id;
+                file_store_update(nm.files, token, existing);
+            }
             free(existing);
         } else {
             // The usual, create new - N
             FileMetadata meta;
             memset(&meta, 0, sizeof(FileMetadata));
             strcpy(meta.filename, token);
-            meta.ss_id = msg.ss_id;
+            meta.ss_id = msg->ss_id;
             strcpy(meta.owner, "system");
             meta.created = time(NULL);
             meta.modified = meta.created;
             meta.accessed = meta.created;
             meta.acl_count = 0;
             
-            trie_insert(nm.file_trie, token, &meta);
+            file_store_insert(nm.files, token, &meta);
             log_formatted(LOG_INFO, "Registered new file: %s", token);
         }
         
@@ -1481,358 +2912,716 @@ void* handle_ss_connection(void* arg) {
     }
     free(file_list);
 
-    nm.ss_list[idx].last_heartbeat = time(NULL); // Moved here to give more time for the heartbeat and initialization - N
+    // Start from the registered file list until the first load report
+    memset(&nm.ss_loads[idx], 0, sizeof(SSLoad));
+    nm.ss_loads[idx].file_count = nm.ss_list[idx].file_count;
+
+    nm.ss_list[idx].last_heartbeat_ms = lease_now_ms(); // Moved here to give more time for the heartbeat and initialization - N
+
+    // Its replica sets were lost with the old process
+    nm.ss_config_dirty[idx] = 1;
+    request_replica_repair();
     
-    int my_ss_id = msg.ss_id;
-    // nm.ss_count++;
-    pthread_mutex_unlock(&nm.ss_mutex);
+    MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
     
     log_formatted(LOG_INFO, "SS %d registered with %d files", 
-                 msg.ss_id, nm.ss_list[idx].file_count);
-    printf("[NM] Storage Server %d connected from %s\n", msg.ss_id, msg.sender);
-    
-    while (nm.running) {
-        pthread_mutex_lock(&nm.ss_mutex);
-        int still_active = 0;
-        for (int i = 0; i < nm.ss_count; i++) {
-            if (nm.ss_list[i].id == my_ss_id) {
-                still_active = nm.ss_list[i].active;
-                break;
-            }
-        }
-        pthread_mutex_unlock(&nm.ss_mutex);
-            
-        if (!still_active) {
-            log_formatted(LOG_INFO, "SS %d marked inactive by heartbeat monitor", my_ss_id);
-            break;
-        }
-            
-        sleep(3); // I set it to 3, we can decide on a suitable value later - N
-    }
-        
-    // Cleanup when heartbeat declares it dead
-    close(ss_sock);
-    log_formatted(LOG_INFO, "Closed command socket for SS %d", my_ss_id);
-    return NULL;
+                 msg->ss_id, nm.ss_list[idx].file_count);
+    printf("[NM] Storage Server %d connected from %s\n", msg->ss_id, msg->sender);
+
+    // The heartbeat monitor retires the pool when the SS goes silent
+    return REACTOR_DETACH;
 }
 
-void* handle_client_connection(void* arg) {
-    int client_sock = *((int*)arg);
-    free(arg);
-    
-    Message msg;
-    if (recv_message(client_sock, &msg) < 0 || msg.type != MSG_REG_CLIENT) {
-        close(client_sock);
-        return NULL;
+// Registration handshake: the first frame on a client connection
+int register_client_session(Connection *conn, Message *msg) {
+    int client_sock = conn->fd;
+    Message response;
+    init_message(&response);
+
+    if (msg->type != MSG_REG_CLIENT) {
+        return REACTOR_CLOSE;
     }
     
     int is_duplicate = 0;
-    register_user_persistent(msg.sender, client_sock, &is_duplicate);
+    register_user_persistent(msg->sender, client_sock, &is_duplicate);
     
     if (is_duplicate) {
         // Send error response
-        Message response;
-        init_message(&response);
         response.status = ERR_INVALID_OPERATION;
         strcpy(response.data, "User already logged in from another session");
         send_message(client_sock, &response);
         
-        log_formatted(LOG_WARNING, "Rejected duplicate login attempt for user %s", msg.sender);
-        close(client_sock);
-        return NULL;
+        log_formatted(LOG_WARNING, "Rejected duplicate login attempt for user %s", msg->sender);
+        return REACTOR_CLOSE;
     }
 
     pthread_mutex_lock(&nm.client_mutex);
     
-    if (nm.client_count >= MAX_CLIENTS) {
+    if (nm.client_count >= NM_MAX_SESSIONS) {
         pthread_mutex_unlock(&nm.client_mutex);
-        deregister_active_session(msg.sender, client_sock);
-        close(client_sock);
-        return NULL;
+        deregister_active_session(msg->sender, client_sock);
+        log_formatted(LOG_WARNING, "Rejected client %s: session limit reached", msg->sender);
+        return REACTOR_CLOSE;
     }
     
     int idx = nm.client_count;
-    strcpy(nm.client_list[idx].username, msg.sender);
-    strcpy(nm.client_list[idx].ip, msg.data);
+    strcpy(nm.client_list[idx].username, msg->sender);
+    strcpy(nm.client_list[idx].ip, msg->data);
     nm.client_list[idx].sock = client_sock;
     nm.client_list[idx].connected = time(NULL);
     nm.client_count++;
     
     pthread_mutex_unlock(&nm.client_mutex);
+
+    ClientSession *session = conn->ctx;
+    strcpy(session->username, msg->sender);
+    session->registered = 1;
     
-    log_formatted(LOG_INFO, "Client %s connected from %s", msg.sender, msg.data);
-    printf("[NM] Client %s connected\n", msg.sender);
+    log_formatted(LOG_INFO, "Client %s connected from %s", msg->sender, msg->data);
+    printf("[NM] Client %s connected\n", msg->sender);
     
-    // Send ACK
-    Message response;
-    init_message(&response);
+    // Send ACK, with the shard map when the namespace is partitioned:
+    // "SHARDS <this shard> <ip:port>,<ip:port>,..."
     response.status = SUCCESS;
+    if (nm.shards > 1) {
+        int pos = snprintf(response.data, sizeof(response.data), "SHARDS %d ", nm.shard);
+        for (int k = 0; k < nm.shards; k++) {
+            pos += snprintf(response.data + pos, sizeof(response.data) - pos, "%s%s:%d",
+                            k > 0 ? "," : "", nm.shard_hosts[k], nm_shard_port(NM_CLIENT_PORT, k));
+        }
+    }
     send_message(client_sock, &response);
+    return REACTOR_KEEP;
+}
+
+// Handle one request from a registered client
+void dispatch_client_request(int client_sock, Message *msg) {
+    log_formatted(LOG_REQUEST, "Request from %s: type=%d, file=%s", 
+                 msg->sender, msg->type, msg->filename);
     
-    // Handle client requests
-    while (nm.running) {
-        if (recv_message(client_sock, &msg) < 0) {
+    Message response;
+    init_message(&response);
+
+    switch (msg->type) {
+        case MSG_REQUESTACCESS:
+            handle_requestaccess(client_sock, msg);
             break;
-        }
-        
-        log_formatted(LOG_REQUEST, "Request from %s: type=%d, file=%s", 
-                     msg.sender, msg.type, msg.filename);
-        
-        switch (msg.type) {
-            case MSG_REQUESTACCESS:
-                handle_requestaccess(client_sock, &msg);
-                break;
-            case MSG_VIEWREQUESTS:
-                handle_viewrequests(client_sock, &msg);
-                break;
-            case MSG_APPROVEREQUEST:
-                handle_approverequest(client_sock, &msg);
-                break;
-            case MSG_DENYREQUEST:
-                handle_denyrequest(client_sock, &msg);
-                break;
-            case MSG_CHECKPOINT:
-            case MSG_VIEWCHECKPOINT:
-            case MSG_REVERT:
-            case MSG_LISTCHECKPOINTS:
-                handle_checkpoint_request(client_sock, &msg);
-                break;
-            case MSG_CREATEFOLDER:
-                handle_createfolder(client_sock, &msg);
-                break;
-            case MSG_MOVE:
-                handle_move(client_sock, &msg);
-                break;
-            case MSG_VIEWFOLDER:
-                handle_viewfolder(client_sock, &msg);
-                break;
-            case MSG_VIEW:
-                handle_view(client_sock, &msg);
-                break;
-            case MSG_INFO:
-                handle_info(client_sock, &msg);
-                break;
-            case MSG_LIST:
-                handle_list(client_sock, &msg);
-                break;
-            case MSG_CREATE:
-                handle_create(client_sock, &msg);
-                break;
-            case MSG_DELETE:
-                handle_delete(client_sock, &msg);
-                break;
-            case MSG_ADDACCESS:
-            case MSG_REMACCESS:
-                handle_access(client_sock, &msg);
-                break;
-            case MSG_EXEC:
-                handle_exec(client_sock, &msg);
-                break;
-            case MSG_READ:
-            case MSG_WRITE:
-            case MSG_STREAM:
-            case MSG_UNDO: {
-                // Return SS info for direct connection
-                response.type = MSG_DATA;
-                
-                if (msg.type == MSG_WRITE || msg.type == MSG_UNDO) {
-                    if (!check_access(msg.filename, msg.sender, ACCESS_WRITE)) {
-                        response.status = ERR_ACCESS_DENIED;
-                        send_message(client_sock, &response);
-                        break;
-                    }
-                } else {
-                    if (!check_access(msg.filename, msg.sender, ACCESS_READ)) {
-                        response.status = ERR_ACCESS_DENIED;
-                        send_message(client_sock, &response);
-                        break;
-                    }
-                }
-                
-                int ss_id = find_ss_for_file(msg.filename);
-                if (ss_id < 0) {
-                    response.status = ERR_FILE_NOT_FOUND;
+        case MSG_VIEWREQUESTS:
+            handle_viewrequests(client_sock, msg);
+            break;
+        case MSG_APPROVEREQUEST:
+            handle_approverequest(client_sock, msg);
+            break;
+        case MSG_DENYREQUEST:
+            handle_denyrequest(client_sock, msg);
+            break;
+        case MSG_CHECKPOINT:
+        case MSG_VIEWCHECKPOINT:
+        case MSG_REVERT:
+        case MSG_LISTCHECKPOINTS:
+            handle_checkpoint_request(client_sock, msg);
+            break;
+        case MSG_CREATEFOLDER:
+            handle_createfolder(client_sock, msg);
+            break;
+        case MSG_MOVE:
+            handle_move(client_sock, msg);
+            break;
+        case MSG_VIEWFOLDER:
+            handle_viewfolder(client_sock, msg);
+            break;
+        case MSG_VIEW:
+            handle_view(client_sock, msg);
+            break;
+        case MSG_INFO:
+            handle_info(client_sock, msg);
+            break;
+        case MSG_LIST:
+            handle_list(client_sock, msg);
+            break;
+        case MSG_CREATE:
+            handle_create(client_sock, msg);
+            break;
+        case MSG_DELETE:
+            handle_delete(client_sock, msg);
+            break;
+        case MSG_ADDACCESS:
+        case MSG_REMACCESS:
+            handle_access(client_sock, msg);
+            break;
+        case MSG_EXEC:
+            handle_exec(client_sock, msg);
+            break;
+        case MSG_STATS:
+            response.status = SUCCESS;
+            stats_summary(response.data, sizeof(response.data));
+            send_message(client_sock, &response);
+            break;
+        case MSG_READ:
+        case MSG_WRITE:
+        case MSG_STREAM:
+        case MSG_UNDO: {
+            // Return SS info for direct connection
+            response.type = MSG_DATA;
+            
+            if (msg->type == MSG_WRITE || msg->type == MSG_UNDO) {
+                if (!check_access(msg->filename, msg->sender, ACCESS_WRITE)) {
+                    response.status = ERR_ACCESS_DENIED;
                     send_message(client_sock, &response);
                     break;
                 }
-                
-                pthread_mutex_lock(&nm.ss_mutex);
-                for (int i = 0; i < nm.ss_count; i++) {
-                    if (nm.ss_list[i].id == ss_id) {
-                        sprintf(response.data, "%s:%d", 
-                               nm.ss_list[i].ip, nm.ss_list[i].client_port);
-                        //printf("SS Info sent to client: %s\n", response.data); // Debug line
-                        response.status = SUCCESS;
-                        break;
-                    }
+            } else {
+                if (!check_access(msg->filename, msg->sender, ACCESS_READ)) {
+                    response.status = ERR_ACCESS_DENIED;
+                    send_message(client_sock, &response);
+                    break;
                 }
-                pthread_mutex_unlock(&nm.ss_mutex);
-
-                FileMetadata *meta = trie_search(nm.file_trie, msg.filename);
-                if (meta) {
-                    meta->accessed = time(NULL);
-                    strcpy(meta->last_accessed_by, msg.sender);
-                    trie_update(nm.file_trie, msg.filename, meta);
-                    cache_put(nm.cache, msg.filename, meta);
-                    free(meta);
-                    log_formatted(LOG_INFO, "Updated access time for %s (accessed by %s)", 
-                                msg.filename, msg.sender);
+            }
+            
+            int ss_id = -1;
+            response.status = route_file_request(msg->filename, msg->type,
+                                                 response.data, sizeof(response.data), &ss_id);
+
+            // The client may reuse this route until the lease runs out
+            if (response.status == SUCCESS && nm.lease_ttl_ms > 0) {
+                RouteLease lease;
+                lease.ss_id = ss_id;
+                lease.expires_ms = lease_now_ms() + nm.lease_ttl_ms;
+                lease.access = (msg->type == MSG_WRITE || msg->type == MSG_UNDO) ? ACCESS_WRITE : ACCESS_READ;
+                lease_sign(nm.lease_key, msg->sender, msg->filename, &lease);
+                lease_format(&lease, response.lease, sizeof(response.lease));
+            }
+
+            // Access time is applied later in a coalesced batch, so
+            // routing never takes the trie write lock
+            if (response.status == SUCCESS) {
+                access_tracker_record(msg->filename, msg->sender);
+            }
+            
+            send_message(client_sock, &response);
+            break;
+        }
+        default:
+            response.status = ERR_INVALID_OPERATION;
+            send_message(client_sock, &response);
+            break;
+    }
+}
+
+int on_client_frame(Connection *conn, Message *msg) {
+    if (!conn->ctx) {
+        conn->ctx = calloc(1, sizeof(ClientSession));
+        ((ClientSession*)conn->ctx)->capture_id = capture_session();
+    }
+
+    ClientSession *session = conn->ctx;
+    capture_message(session->capture_id, msg);
+    if (!session->registered) {
+        return register_client_session(conn, msg);
+    }
+
+    // A client with a stale or wrong shard map must not create a second
+    // copy of a name on the wrong shard
+    int owner = shard_for_message(msg, nm.shards);
+    if (owner != nm.shard) {
+        Message response;
+        init_message(&response);
+        response.status = ERR_WRONG_SHARD;
+        snprintf(response.data, sizeof(response.data), "Belongs to name server shard %d", owner);
+        send_message(conn->fd, &response);
+        return REACTOR_KEEP;
+    }
+
+    StatsTimer timer;
+    TraceSpan span;
+    stats_begin(conn->frame_len + (int)sizeof(int), &timer);
+    trace_set_current(msg->trace_id);
+    trace_received(msg->trace_id, conn->queued_us, conn->dequeued_us);
+    trace_begin(&span, message_type_name(msg->type));
+    dispatch_client_request(conn->fd, msg);
+    trace_end(&span);
+    trace_set_current(0);
+    stats_end(msg->type, &timer);
+    return nm.running ? REACTOR_KEEP : REACTOR_CLOSE;
+}
+
+void on_client_close(Connection *conn) {
+    ClientSession *session = conn->ctx;
+    if (!session) return;
+    capture_end(session->capture_id);
+
+    if (session->registered) {
+        pthread_mutex_lock(&nm.client_mutex);
+        for (int i = 0; i < nm.client_count; i++) {
+            if (nm.client_list[i].sock == conn->fd) {
+                for (int j = i; j < nm.client_count - 1; j++) {
+                    nm.client_list[j] = nm.client_list[j + 1];
                 }
-                
-                send_message(client_sock, &response);
+                nm.client_count--;
                 break;
             }
-            default:
-                response.status = ERR_INVALID_OPERATION;
-                send_message(client_sock, &response);
-                break;
         }
+        pthread_mutex_unlock(&nm.client_mutex);
+        
+        // Deregister the active session
+        deregister_active_session(session->username, conn->fd);
     }
-    
-     char username[MAX_USERNAME];
-    strcpy(username, nm.client_list[idx].username);
-    
-    pthread_mutex_lock(&nm.client_mutex);
-    for (int i = 0; i < nm.client_count; i++) {
-        if (nm.client_list[i].sock == client_sock) {
-            for (int j = i; j < nm.client_count - 1; j++) {
-                nm.client_list[j] = nm.client_list[j + 1];
-            }
-            nm.client_count--;
-            break;
+
+    free(session);
+    conn->ctx = NULL;
+}
+
+// ---- Shards ----
+
+// Another shard's requests: listings and lookups of what this shard holds.
+// They never fan out again, so shards waiting on each other cannot deadlock.
+void* serve_peer(void *arg) {
+    int sock = *(int*)arg;
+    free(arg);
+    serving_peer = 1;
+
+    Message msg;
+    while (nm.running && recv_message(sock, &msg) == 0) {
+        TraceSpan span;
+        trace_set_current(msg.trace_id);
+        trace_begin(&span, message_type_name(msg.type));
+        if (msg.type == MSG_FOLDER_LOOKUP) {
+            Message response;
+            init_message(&response);
+            FolderMetadata *folder = folder_trie_search(nm.folder_trie, msg.target_path);
+            response.status = folder ? SUCCESS : ERR_FILE_NOT_FOUND;
+            free(folder);
+            send_message(sock, &response);
+        } else {
+            dispatch_client_request(sock, &msg);
         }
+        trace_end(&span);
+        trace_set_current(0);
     }
-    pthread_mutex_unlock(&nm.client_mutex);
-    
-    // Deregister the active session
-    deregister_active_session(username, client_sock);
-    
-    close(client_sock);
+    close(sock);
     return NULL;
 }
 
-void* ss_listener(void* arg) {
-    (void) arg;
-
-    nm.ss_sock = socket(AF_INET, SOCK_STREAM, 0);
+void* peer_listener(void *arg) {
+    (void)arg;
+    int port = SHARD_PORT(NM_PEER_PORT);
+    int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
     int opt = 1;
-    setsockopt(nm.ss_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(NM_SS_PORT);
-    
-    bind(nm.ss_sock, (struct sockaddr*)&addr, sizeof(addr));
-    listen(nm.ss_sock, MAX_SS);
-    
-    printf("[NM] Listening for Storage Servers on port %d\n", NM_SS_PORT);
-    
+    addr.sin_port = htons(port);
+
+    while (bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && nm.running) {
+        usleep(200000);
+    }
+    if (listen(listen_sock, 64) < 0) {
+        log_formatted(LOG_ERROR, "Cannot listen for other shards on port %d", port);
+        close(listen_sock);
+        return NULL;
+    }
+    printf("[NM] Listening for other shards on port %d\n", port);
+
     while (nm.running) {
-        int *ss_sock = malloc(sizeof(int));
-        *ss_sock = accept(nm.ss_sock, NULL, NULL);
-        
-        if (*ss_sock < 0) {
-            free(ss_sock);
-            continue;
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            break;
         }
-        
+        int *arg_sock = malloc(sizeof(int));
+        *arg_sock = sock;
         pthread_t tid;
-        pthread_create(&tid, NULL, handle_ss_connection, ss_sock);
+        if (pthread_create(&tid, NULL, serve_peer, arg_sock) != 0) {
+            free(arg_sock);
+            close(sock);
+            continue;
+        }
         pthread_detach(tid);
     }
-    
+    close(listen_sock);
     return NULL;
 }
 
-void* client_listener(void* arg) {
-    (void) arg;
-    nm.client_sock = socket(AF_INET, SOCK_STREAM, 0);
+static int connect_to_shard(int shard) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(nm_shard_port(NM_PEER_PORT, shard));
+    inet_pton(AF_INET, nm.shard_hosts[shard], &addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    set_socket_timeouts(sock, NM_PEER_TIMEOUT, NM_PEER_TIMEOUT);
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return sock;
+}
+
+// Send `msg` to another shard and wait for its reply, over an idle
+// connection if there is one. Returns 0, or -1 if the shard is unreachable.
+int shard_request(int shard, Message *msg, Message *response) {
+    ShardPeer *peer = &nm.peers[shard];
+    if (!msg->trace_id) msg->trace_id = trace_current();
+    TraceSpan span;
+    trace_begin(&span, "call NM shard");
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int sock = -1;
+        pthread_mutex_lock(&peer->lock);
+        if (attempt == 0 && peer->idle_count > 0) sock = peer->idle[--peer->idle_count];
+        pthread_mutex_unlock(&peer->lock);
+        if (sock < 0) sock = connect_to_shard(shard);
+        if (sock < 0) return -1;
+
+        if (send_message(sock, msg) == 0 && recv_message(sock, response) == 0) {
+            trace_end(&span);
+            pthread_mutex_lock(&peer->lock);
+            if (peer->idle_count < NM_PEER_IDLE_MAX) {
+                peer->idle[peer->idle_count++] = sock;
+                sock = -1;
+            }
+            pthread_mutex_unlock(&peer->lock);
+            if (sock >= 0) close(sock);
+            return 0;
+        }
+        // An idle connection may have been closed by a restarted shard
+        close(sock);
+    }
+    return -1;
+}
+
+// Append every other shard's answer to a listing request to `buffer`
+int gather_from_shards(Message *msg, char *buffer, int pos, int cap) {
+    for (int k = 0; k < nm.shards; k++) {
+        if (k == nm.shard) continue;
+        Message response;
+        if (shard_request(k, msg, &response) < 0) {
+            log_formatted(LOG_WARNING, "Shard %d unreachable for a listing", k);
+            pos += snprintf(buffer + pos, cap - pos, "(name server shard %d unreachable)\n", k);
+        } else if (response.status == SUCCESS) {
+            pos += snprintf(buffer + pos, cap - pos, "%s", response.data);
+        }
+        if (pos >= cap) return cap - 1;
+    }
+    return pos;
+}
+
+// 1 if the folder exists on whichever shard owns it, 0 if not, -1 if that
+// shard cannot be asked
+int folder_exists(const char *path) {
+    int owner = shard_of_key(path, nm.shards);
+    if (owner == nm.shard) {
+        FolderMetadata *folder = folder_trie_search(nm.folder_trie, path);
+        free(folder);
+        return folder != NULL;
+    }
+
+    Message msg, response;
+    init_message(&msg);
+    msg.type = MSG_FOLDER_LOOKUP;
+    strncpy(msg.target_path, path, MAX_PATH - 1);
+    if (shard_request(owner, &msg, &response) < 0) return -1;
+    return response.status == SUCCESS;
+}
+
+// ---- Hot standby ----
+
+// Serve standbys on NM_STANDBY_PORT, one at a time: each gets a full copy of
+// the metadata and then every change as it is logged
+void* standby_listener(void* arg) {
+    (void)arg;
+    int lease_ms = get_env_int("NM_LEASE_MS", NM_LEASE_MS);
+
+    int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
     int opt = 1;
-    setsockopt(nm.client_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
     struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(NM_CLIENT_PORT);
-    
-   // printf("Client listener binding to port %d\n", NM_CLIENT_PORT);
-    bind(nm.client_sock, (struct sockaddr*)&addr, sizeof(addr));
-    listen(nm.client_sock, MAX_CLIENTS);
-    
-    printf("[NM] Listening for Clients on port %d\n", NM_CLIENT_PORT);
-    
+    addr.sin_port = htons(SHARD_PORT(NM_STANDBY_PORT));
+
+    // A primary that is still shutting down may hold the port for a moment
+    while (bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && nm.running) {
+        usleep(200000);
+    }
+    if (listen(listen_sock, 4) < 0) {
+        log_formatted(LOG_ERROR, "Cannot listen for standbys on port %d", SHARD_PORT(NM_STANDBY_PORT));
+        close(listen_sock);
+        return NULL;
+    }
+    printf("[NM] Listening for a standby on port %d\n", SHARD_PORT(NM_STANDBY_PORT));
+
     while (nm.running) {
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = accept(nm.client_sock, NULL, NULL);
-        
-        if (*client_sock < 0) {
-            free(client_sock);
-            continue;
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int sock = accept(listen_sock, (struct sockaddr*)&peer, &len);
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            break;
         }
-        
-        pthread_t tid;
-        pthread_create(&tid, NULL, handle_client_connection, client_sock);
-        pthread_detach(tid);
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+        log_formatted(LOG_INFO, "Standby connected from %s", ip);
+        printf("[NM] Standby connected from %s\n", ip);
+
+        if (meta_log_ship(sock, lease_ms) < 0) {
+            log_formatted(LOG_WARNING, "Refused standby %s: metadata log not open or already shipping", ip);
+        } else {
+            printf("[NM] Standby %s detached\n", ip);
+        }
+        close(sock);
     }
-    
+    close(listen_sock);
     return NULL;
 }
 
+int connect_to_primary(const char *ip, int port, int timeout_ms) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Follow the primary's metadata log, keeping the tries and cache warm, until
+// the primary is gone; then return so this process takes over its ports.
+// A stream that merely broke (the primary dropped us, or was restarted) is
+// resynced instead, as long as the primary still answers on its client port.
+void run_standby(const char *primary_ip) {
+    int lease_ms = get_env_int("NM_LEASE_MS", NM_LEASE_MS);
+    int have_copy = nm.recovered_records > 0;
+    printf("[NM] Standby for %s: following its metadata log (lease %d ms)\n", primary_ip, lease_ms);
+    log_formatted(LOG_INFO, "Standby for %s (lease %d ms)", primary_ip, lease_ms);
+
+    while (1) {
+        MetaFollowEnd end = META_FOLLOW_CLOSED;
+        int sock = connect_to_primary(primary_ip, SHARD_PORT(NM_STANDBY_PORT), lease_ms);
+        if (sock >= 0) {
+            int synced = 0;
+            end = meta_log_follow(sock, apply_meta_record, NULL, lease_ms, &synced);
+            close(sock);
+            if (synced) {
+                have_copy = 1;
+                log_formatted(LOG_WARNING, "Primary's log stream %s",
+                             end == META_FOLLOW_LAPSED ? "went silent for a whole lease" : "ended");
+            }
+        }
+
+        if (have_copy) {
+            if (end == META_FOLLOW_LAPSED) break;
+            int probe = connect_to_primary(primary_ip, SHARD_PORT(NM_CLIENT_PORT), lease_ms / 2);
+            if (probe < 0) break;
+            close(probe);
+        }
+        // A dying primary closes the stream a moment before its listeners,
+        // so look again soon once there is a copy to take over with
+        usleep(have_copy ? lease_ms * 50 : lease_ms * 250);
+    }
+
+    log_formatted(LOG_WARNING, "Primary %s is gone; taking over", primary_ip);
+    printf("[NM] Primary %s is gone; taking over\n", primary_ip);
+}
+
+// The old primary's ports may take a moment to free up
+int listen_retrying(Reactor *reactor, int port, int kind, FrameHandler on_frame, CloseHandler on_close,
+                    int retry_ms) {
+    int fd;
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    while ((fd = reactor_listen(reactor, port, kind, on_frame, on_close)) < 0) {
+        gettimeofday(&now, NULL);
+        long waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+        if (waited >= retry_ms) break;
+        usleep(50000);
+    }
+    return fd;
+}
+
 void* heartbeat_monitor(void* arg) {
     (void) arg;
     
     while (nm.running) {
-        sleep(5);
+        usleep(nm.hb_check_ms * 1000);
         
-        time_t now = time(NULL);
-        pthread_mutex_lock(&nm.ss_mutex);
+        long long now = lease_now_ms();
+        MUTEX_LOCK(&nm.ss_mutex, &ss_lock_stats);
         
         for (int i = 0; i < nm.ss_count; i++) {
             if (nm.ss_list[i].active) {
-                time_t idle = now - nm.ss_list[i].last_heartbeat;
+                long long idle = now - nm.ss_list[i].last_heartbeat_ms;
                 
-                // Give extra grace period (60 seconds) for initial connection - N
-                // The grace value can be adjusted as needed - N
-                int timeout = (idle < 60) ? 60 : HEARTBEAT_TIMEOUT;
+                // Give extra grace period for initial connection, until the
+                // heartbeat channel is up - N
+                int timeout = nm.ss_list[i].hb_sock < 0 ? nm.hb_grace_ms : nm.hb_timeout_ms;
                 
                 if (idle > timeout) {
-                    log_formatted(LOG_WARNING, "SS %d heartbeat timeout (last: %ld sec ago)", 
+                    log_formatted(LOG_WARNING, "SS %d heartbeat timeout (last: %lld ms ago)", 
                                  nm.ss_list[i].id, idle);
                     nm.ss_list[i].active = 0;
                     
+                    // The reactor owns the heartbeat fd; shutting it down
+                    // makes its close handler run - N
                     if (nm.ss_list[i].hb_sock >= 0) {
-                        close(nm.ss_list[i].hb_sock);
+                        shutdown(nm.ss_list[i].hb_sock, SHUT_RDWR);
                         nm.ss_list[i].hb_sock = -1;
                     }
+
+                    retire_ss_pool(i);
+                    request_replica_repair();
                 }
             }
         }
         
-        pthread_mutex_unlock(&nm.ss_mutex);
+        MUTEX_UNLOCK(&nm.ss_mutex, &ss_lock_stats);
     }
     
     return NULL;
 }
 
-int main() {
+// Let the reactor hold one descriptor per session
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        log_formatted(LOG_INFO, "File descriptor limit: %ld", (long)rl.rlim_cur);
+    }
+}
+
+static long cache_hits(void) {
+    long hits, misses;
+    file_store_cache_stats(nm.files, &hits, &misses);
+    return hits;
+}
+
+static long cache_misses(void) {
+    long hits, misses;
+    file_store_cache_stats(nm.files, &hits, &misses);
+    return misses;
+}
+
+static long registered_clients(void) {
+    pthread_mutex_lock(&nm.client_mutex);
+    long count = nm.client_count;
+    pthread_mutex_unlock(&nm.client_mutex);
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    const char *primary_ip = NULL;
+    if (argc == 3 && strcmp(argv[1], "--standby") == 0) {
+        primary_ip = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [--standby <primary_ip>]\n", argv[0]);
+        return 1;
+    }
+
+    // A standby that goes away mid-write must not take the NM with it
+    signal(SIGPIPE, SIG_IGN);
+
     init_name_server();
+    raise_fd_limit();
+    stats_init("nm", nm.shard);
+    char trace_name[32];
+    snprintf(trace_name, sizeof(trace_name), "nm %d", nm.shard);
+    trace_init(trace_name);
+    lock_stats_init();
+    stats_register("docs_cache_hits_total", "counter", "File metadata cache hits", cache_hits);
+    stats_register("docs_cache_misses_total", "counter", "File metadata cache misses", cache_misses);
+    stats_register("docs_clients_registered", "gauge", "Registered client sessions", registered_clients);
+    const char *capture_path = getenv("NM_CAPTURE");
+    if (capture_path && *capture_path) capture_open(capture_path, CAPTURE_NM, nm.shard);
+
+    // Returns once the primary is gone
+    if (primary_ip) run_standby(primary_ip);
+    struct timeval takeover_start;
+    gettimeofday(&takeover_start, NULL);
+
+    Reactor *reactor = reactor_create(get_env_int("NM_WORKERS", 0));
+    if (!reactor) {
+        log_formatted(LOG_ERROR, "Failed to create reactor");
+        return 1;
+    }
+
+    int retry_ms = primary_ip ? get_env_int("NM_LEASE_MS", NM_LEASE_MS) * 5 : 0;
+    nm.ss_sock = listen_retrying(reactor, SHARD_PORT(NM_SS_PORT), CONN_SS, on_ss_frame, NULL, retry_ms);
+    nm.ss_hb_sock = listen_retrying(reactor, SHARD_PORT(NM_SS_HB_PORT), CONN_SS_HB,
+                                    on_ss_heartbeat_frame, on_ss_heartbeat_close, retry_ms);
+    nm.client_sock = listen_retrying(reactor, SHARD_PORT(NM_CLIENT_PORT), CONN_CLIENT,
+                                     on_client_frame, on_client_close, retry_ms);
+    if (nm.ss_sock < 0 || nm.ss_hb_sock < 0 || nm.client_sock < 0) {
+        log_formatted(LOG_ERROR, "Failed to bind name server ports");
+        fprintf(stderr, "[NM] Failed to bind ports %d/%d/%d\n",
+                SHARD_PORT(NM_SS_PORT), SHARD_PORT(NM_SS_HB_PORT), SHARD_PORT(NM_CLIENT_PORT));
+        return 1;
+    }
+
+    printf("[NM] Listening for Storage Servers on port %d\n", SHARD_PORT(NM_SS_PORT));
+    printf("[NM] Listening for SS heartbeats on port %d\n", SHARD_PORT(NM_SS_HB_PORT));
+    printf("[NM] Listening for Clients on port %d\n", SHARD_PORT(NM_CLIENT_PORT));
+    if (primary_ip) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        double ms = (now.tv_sec - takeover_start.tv_sec) * 1000.0 + (now.tv_usec - takeover_start.tv_usec) / 1000.0;
+        log_formatted(LOG_INFO, "Took over the name server ports in %.1f ms", ms);
+        printf("[NM] Took over the name server ports in %.1f ms\n", ms);
+    }
+
+    // Bound only now, so a standby does not contend with the primary for it
+    int metrics_port = get_env_int("NM_METRICS_PORT", 0);
+    if (metrics_port > 0) {
+        metrics_port = SHARD_PORT(metrics_port);
+        if (stats_serve(metrics_port) == 0) {
+            printf("[NM] Serving metrics on 127.0.0.1:%d\n", metrics_port);
+        } else {
+            log_formatted(LOG_WARNING, "Cannot serve metrics on port %d", metrics_port);
+        }
+    }
     
-    pthread_t ss_thread, ss_hb_thread, client_thread, hb_thread;  // ss_hb_thread - N
-    pthread_create(&ss_thread, NULL, ss_listener, NULL);
-    pthread_create(&ss_hb_thread, NULL, ss_hb_listener, NULL);     // create and join the threads as necessary - N
-    pthread_create(&client_thread, NULL, client_listener, NULL);
+    pthread_t hb_thread, repl_thread, standby_thread;
     pthread_create(&hb_thread, NULL, heartbeat_monitor, NULL);
+    pthread_create(&repl_thread, NULL, replica_repair_thread, NULL);
+    pthread_create(&standby_thread, NULL, standby_listener, NULL);
+    pthread_detach(standby_thread);
+    if (nm.shards > 1) {
+        pthread_t peer_thread;
+        pthread_create(&peer_thread, NULL, peer_listener, NULL);
+        pthread_detach(peer_thread);
+    }
     
     printf("[NM] Name Server running. Press Ctrl+C to stop.\n");
-    
-    pthread_join(ss_thread, NULL);
-    pthread_join(ss_hb_thread, NULL);  // join the heartbeat listener thread - N
-    pthread_join(client_thread, NULL);
+
+    // The calling thread becomes the event loop
+    reactor_run(reactor);
+
+    nm.running = 0;
+    reactor_stop(reactor);
     pthread_join(hb_thread, NULL);
-    
-    free_trie(nm.file_trie);
-    free_cache(nm.cache);
+    request_replica_repair();
+    pthread_join(repl_thread, NULL);
+    
+    access_tracker_shutdown();
+    capture_close();
+    meta_log_close();
+    free_file_store(nm.files);
+    lock_stats_log();
     close_logger();
     
     return 0;
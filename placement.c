@@ -0,0 +1,334 @@
+#include "placement.h"
+
+// Relative weight of each reported dimension in the load score
+#define WEIGHT_FILES 1.0
+#define WEIGHT_BYTES 1.0
+#define WEIGHT_RATE 1.0
+#define WEIGHT_P99 0.5
+#define WEIGHT_LOCKS 0.25
+
+typedef struct {
+    double files;
+    double bytes;
+    double rate;
+    double p99;
+    double locks;
+    double bytes_per_file;
+} ClusterMeans;
+
+void placement_init(Placement *p, PlacementPolicy policy, unsigned int seed) {
+    p->policy = policy;
+    p->seed = seed;
+    p->next = 0;
+    p->vnodes = PLACEMENT_VNODES;
+    memset(&p->ring, 0, sizeof(HashRing));
+}
+
+int placement_policy_from_name(const char *name) {
+    if (strcmp(name, "round_robin") == 0 || strcmp(name, "rr") == 0) return PLACEMENT_ROUND_ROBIN;
+    if (strcmp(name, "p2c") == 0) return PLACEMENT_P2C;
+    if (strcmp(name, "weighted") == 0) return PLACEMENT_WEIGHTED;
+    if (strcmp(name, "chash") == 0) return PLACEMENT_CHASH;
+    return -1;
+}
+
+const char* placement_policy_name(PlacementPolicy policy) {
+    switch (policy) {
+        case PLACEMENT_ROUND_ROBIN: return "round_robin";
+        case PLACEMENT_P2C: return "p2c";
+        case PLACEMENT_WEIGHTED: return "weighted";
+        case PLACEMENT_CHASH: return "chash";
+    }
+    return "unknown";
+}
+
+static void cluster_means(const SSLoad *loads, int count, ClusterMeans *m) {
+    memset(m, 0, sizeof(ClusterMeans));
+    int live = 0;
+    long long files = 0, bytes = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (!loads[i].active) continue;
+        live++;
+        files += loads[i].file_count;
+        bytes += loads[i].bytes_used;
+        m->rate += loads[i].request_rate;
+        m->p99 += loads[i].p99_ms;
+        m->locks += loads[i].locks_held;
+    }
+    if (live == 0) return;
+
+    m->bytes_per_file = files > 0 ? (double)bytes / files : 0.0;
+    for (int i = 0; i < count; i++) {
+        if (!loads[i].active) continue;
+        m->files += loads[i].file_count + loads[i].pending;
+        m->bytes += loads[i].bytes_used + loads[i].pending * m->bytes_per_file;
+    }
+    m->files /= live;
+    m->bytes /= live;
+    m->rate /= live;
+    m->p99 /= live;
+    m->locks /= live;
+}
+
+// Each dimension is scaled by the cluster mean, so a dimension nobody is
+// using yet contributes nothing
+static double ratio(double value, double mean) {
+    return mean > 0.0 ? value / mean : 0.0;
+}
+
+static double score_with_means(const SSLoad *load, const ClusterMeans *m) {
+    // Files placed since the last report count as average-sized files
+    double files = load->file_count + load->pending;
+    double bytes = load->bytes_used + load->pending * m->bytes_per_file;
+
+    double score = WEIGHT_FILES * ratio(files, m->files) +
+                   WEIGHT_BYTES * ratio(bytes, m->bytes) +
+                   WEIGHT_RATE * ratio(load->request_rate, m->rate) +
+                   WEIGHT_P99 * ratio(load->p99_ms, m->p99) +
+                   WEIGHT_LOCKS * ratio(load->locks_held, m->locks);
+    return score / (WEIGHT_FILES + WEIGHT_BYTES + WEIGHT_RATE + WEIGHT_P99 + WEIGHT_LOCKS);
+}
+
+double placement_score(const SSLoad *load, const SSLoad *loads, int count) {
+    ClusterMeans m;
+    cluster_means(loads, count, &m);
+    return score_with_means(load, &m);
+}
+
+static int choose_round_robin(Placement *p, const SSLoad *loads, int count) {
+    for (int tried = 0; tried < count; tried++) {
+        int idx = (p->next + tried) % count;
+        if (loads[idx].active) {
+            p->next = idx + 1;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static int choose_p2c(Placement *p, const SSLoad *loads, int count) {
+    int live_idx[MAX_SS];
+    int n = 0;
+    for (int i = 0; i < count && n < MAX_SS; i++) {
+        if (loads[i].active) live_idx[n++] = i;
+    }
+    if (n == 1) return live_idx[0];
+
+    int a = live_idx[rand_r(&p->seed) % n];
+    int b = live_idx[rand_r(&p->seed) % (n - 1)];
+    if (b == a) b = live_idx[n - 1];
+
+    ClusterMeans m;
+    cluster_means(loads, count, &m);
+    return score_with_means(&loads[a], &m) <= score_with_means(&loads[b], &m) ? a : b;
+}
+
+static int choose_weighted(Placement *p, const SSLoad *loads, int count) {
+    ClusterMeans m;
+    cluster_means(loads, count, &m);
+
+    double weights[MAX_SS];
+    double total = 0.0;
+    for (int i = 0; i < count && i < MAX_SS; i++) {
+        weights[i] = 0.0;
+        if (!loads[i].active) continue;
+        // Lightly loaded servers get a much larger share
+        double s = 0.25 + score_with_means(&loads[i], &m);
+        weights[i] = 1.0 / (s * s);
+        total += weights[i];
+    }
+
+    double r = ((double)rand_r(&p->seed) / RAND_MAX) * total;
+    int last = -1;
+    for (int i = 0; i < count && i < MAX_SS; i++) {
+        if (weights[i] <= 0.0) continue;
+        last = i;
+        if (r < weights[i]) return i;
+        r -= weights[i];
+    }
+    return last;
+}
+
+int placement_choose(Placement *p, const SSLoad *loads, int count) {
+    int live = 0;
+    for (int i = 0; i < count; i++) {
+        if (loads[i].active) live++;
+    }
+    if (live == 0) return -1;
+
+    switch (p->policy) {
+        case PLACEMENT_ROUND_ROBIN:
+            return choose_round_robin(p, loads, count);
+        case PLACEMENT_WEIGHTED:
+            return choose_weighted(p, loads, count);
+        case PLACEMENT_CHASH:      // Needs a key; without one, spread by load
+        case PLACEMENT_P2C:
+        default:
+            return choose_p2c(p, loads, count);
+    }
+}
+
+int placement_choose_many(Placement *p, const SSLoad *loads, int count, int want, int *chosen) {
+    SSLoad remaining[MAX_SS];
+    if (count > MAX_SS) count = MAX_SS;
+    memcpy(remaining, loads, sizeof(SSLoad) * count);
+
+    int found = 0;
+    while (found < want) {
+        int idx = placement_choose(p, remaining, count);
+        if (idx < 0) break;
+        chosen[found++] = idx;
+        remaining[idx].active = 0;
+    }
+    return found;
+}
+
+// FNV-1a, then a 64-bit finalizer so nearby names land far apart
+static unsigned long long hash_key(const char *key) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (const unsigned char *c = (const unsigned char*)key; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b) {
+    const RingPoint *pa = a, *pb = b;
+    if (pa->point != pb->point) return pa->point < pb->point ? -1 : 1;
+    return pa->ss_id - pb->ss_id;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+int ring_build(HashRing *ring, const int *ss_ids, int count, int vnodes) {
+    if (count > MAX_SS) count = MAX_SS;
+    if (vnodes < 1) vnodes = 1;
+
+    RingPoint *points = count > 0 ? malloc(sizeof(RingPoint) * count * vnodes) : NULL;
+    if (count > 0 && !points) return -1;
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        for (int v = 0; v < vnodes; v++) {
+            char label[32];
+            snprintf(label, sizeof(label), "ss-%d#%d", ss_ids[i], v);
+            points[n].point = hash_key(label);
+            points[n].ss_id = ss_ids[i];
+            n++;
+        }
+    }
+    qsort(points, n, sizeof(RingPoint), compare_points);
+
+    free(ring->points);
+    ring->points = points;
+    ring->count = n;
+    memcpy(ring->members, ss_ids, sizeof(int) * count);
+    ring->member_count = count;
+    qsort(ring->members, count, sizeof(int), compare_ids);
+    ring->generation++;
+    return 0;
+}
+
+void ring_free(HashRing *ring) {
+    free(ring->points);
+    memset(ring, 0, sizeof(HashRing));
+}
+
+int ring_lookup(const HashRing *ring, const char *key, int want, int *ss_ids) {
+    if (ring->count == 0) return 0;
+    if (want > ring->member_count) want = ring->member_count;
+
+    // First point at or after the key's hash
+    unsigned long long h = hash_key(key);
+    int lo = 0, hi = ring->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring->points[mid].point < h) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int found = 0;
+    for (int step = 0; step < ring->count && found < want; step++) {
+        int id = ring->points[(lo + step) % ring->count].ss_id;
+        int seen = 0;
+        for (int j = 0; j < found; j++) {
+            if (ss_ids[j] == id) seen = 1;
+        }
+        if (!seen) ss_ids[found++] = id;
+    }
+    return found;
+}
+
+int placement_sync_ring(Placement *p, const SSLoad *loads, int count) {
+    int live[MAX_SS];
+    int n = 0;
+    for (int i = 0; i < count && i < MAX_SS; i++) {
+        if (loads[i].active) live[n++] = loads[i].ss_id;
+    }
+    qsort(live, n, sizeof(int), compare_ids);
+
+    if (p->ring.points && n == p->ring.member_count &&
+        memcmp(live, p->ring.members, sizeof(int) * n) == 0) {
+        return 0;
+    }
+    if (n == 0 && p->ring.member_count == 0) return 0;
+    return ring_build(&p->ring, live, n, p->vnodes) == 0;
+}
+
+int placement_choose_key(Placement *p, const char *key, const SSLoad *loads, int count,
+                         int want, int *chosen) {
+    if (p->policy != PLACEMENT_CHASH) {
+        return placement_choose_many(p, loads, count, want, chosen);
+    }
+
+    placement_sync_ring(p, loads, count);
+
+    int ids[MAX_SS];
+    if (want > MAX_SS) want = MAX_SS;
+    int found = ring_lookup(&p->ring, key, want, ids);
+    for (int i = 0; i < found; i++) {
+        for (int j = 0; j < count; j++) {
+            if (loads[j].ss_id == ids[i]) {
+                chosen[i] = j;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+static int id_listed(int id, const int *ids, int count) {
+    for (int i = 0; i < count; i++) {
+        if (ids[i] == id) return 1;
+    }
+    return 0;
+}
+
+int placement_plan_file(const int *current, int current_count,
+                        const int *desired, int desired_count, Transfer *out) {
+    int undesired[MAX_SS];
+    int undesired_count = 0;
+    for (int i = 0; i < current_count; i++) {
+        if (!id_listed(current[i], desired, desired_count)) {
+            undesired[undesired_count++] = current[i];
+        }
+    }
+
+    int n = 0;
+    for (int i = 0; i < desired_count; i++) {
+        if (id_listed(desired[i], current, current_count)) continue;
+        out[n].to_id = desired[i];
+        out[n].from_id = n < undesired_count ? undesired[n] : -1;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,105 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "common.h"
+
+// Placement engine: picks the storage server for a new file or folder from
+// the load each SS last reported on its heartbeat. Dead servers are never
+// chosen. Policies are selected at startup (NM_PLACEMENT).
+//
+// The chash policy ignores load and hashes the name onto a ring of live
+// servers instead, so when a server joins or leaves only the names next to
+// its points change hands (about 1/N of them).
+
+#define PLACEMENT_DEFAULT "p2c"
+#define PLACEMENT_VNODES 128     // Ring points per server (NM_VNODES)
+
+typedef enum {
+    PLACEMENT_ROUND_ROBIN,   // Next live server in turn
+    PLACEMENT_P2C,           // Power of two choices: lower load of two random picks
+    PLACEMENT_WEIGHTED,      // Random, weighted by spare capacity
+    PLACEMENT_CHASH          // Consistent hashing of the name over live servers
+} PlacementPolicy;
+
+// Load snapshot of one storage server
+typedef struct {
+    int ss_id;
+    int active;
+    int file_count;          // Files on disk (reported)
+    long long bytes_used;    // Bytes on disk (reported)
+    double request_rate;     // Client requests per second (reported)
+    double p99_ms;           // p99 client request latency (reported)
+    int locks_held;          // Sentence locks currently held (reported)
+    int pending;             // Placed by the NM since the last report
+} SSLoad;
+
+typedef struct {
+    unsigned long long point;
+    int ss_id;
+} RingPoint;
+
+// Consistent-hash ring, sorted by point
+typedef struct {
+    RingPoint *points;
+    int count;
+    int members[MAX_SS];     // Server ids it was built from, ascending
+    int member_count;
+    int generation;          // Bumped on every rebuild
+} HashRing;
+
+// State carried between placement calls
+typedef struct {
+    PlacementPolicy policy;
+    unsigned int seed;
+    int next;                // Round-robin cursor
+    int vnodes;              // Ring points per server (chash)
+    HashRing ring;           // Live servers (chash)
+} Placement;
+
+// One copy to make: `to_id` gets the file from its primary, and the copy on
+// `from_id` is dropped afterwards (-1: nothing to drop)
+typedef struct {
+    int from_id;
+    int to_id;
+} Transfer;
+
+void placement_init(Placement *p, PlacementPolicy policy, unsigned int seed);
+
+// Parse a policy name ("round_robin", "p2c", "weighted", "chash"); -1 if unknown
+int placement_policy_from_name(const char *name);
+const char* placement_policy_name(PlacementPolicy policy);
+
+// Relative load of one server against the live servers in `loads`
+// (1.0 is an average server)
+double placement_score(const SSLoad *load, const SSLoad *loads, int count);
+
+// Index into `loads` of the chosen server, or -1 if none is alive
+int placement_choose(Placement *p, const SSLoad *loads, int count);
+
+// Choose up to `want` distinct live servers (e.g. a file's replicas, primary
+// first) into `chosen`; returns how many were found
+int placement_choose_many(Placement *p, const SSLoad *loads, int count, int want, int *chosen);
+
+// As placement_choose_many, for the file or folder called `key`. Under chash
+// the ring decides; the other policies ignore the key.
+int placement_choose_key(Placement *p, const char *key, const SSLoad *loads, int count,
+                         int want, int *chosen);
+
+// Rebuild the ring if the live servers in `loads` changed; returns 1 if it did
+int placement_sync_ring(Placement *p, const SSLoad *loads, int count);
+
+// Build a ring with `vnodes` points per server; returns -1 on allocation failure
+int ring_build(HashRing *ring, const int *ss_ids, int count, int vnodes);
+void ring_free(HashRing *ring);
+
+// The first `want` distinct servers clockwise from `key`'s hash
+int ring_lookup(const HashRing *ring, const char *key, int want, int *ss_ids);
+
+// Fewest transfers that make a file held by `current` held by `desired`: one
+// per desired server that lacks a copy, each paired with an undesired holder
+// to drop while there are any. Holders that are kept need no transfer.
+// Returns the number written to `out` (at most `desired_count`).
+int placement_plan_file(const int *current, int current_count,
+                        const int *desired, int desired_count, Transfer *out);
+
+#endif // PLACEMENT_H
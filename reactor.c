@@ -0,0 +1,396 @@
+#define _GNU_SOURCE   // accept4()
+#include "reactor.h"
+#include "logger.h"
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+typedef struct Listener {
+    int is_listener;             // Always 1
+    int fd;
+    int kind;
+    FrameHandler on_frame;
+    CloseHandler on_close;
+} Listener;
+
+typedef enum {
+    JOB_FRAME,
+    JOB_CLOSE
+} JobType;
+
+typedef struct Job {
+    JobType type;
+    Connection *conn;
+    char *body;                  // Serialized frame (JOB_FRAME only)
+    struct Job *next;
+} Job;
+
+// A lane is a job queue with its own workers, so slow operations routed
+// to one lane cannot occupy the workers of another
+typedef struct Lane {
+    struct Reactor *reactor;
+
+    pthread_t *workers;
+    int worker_count;
+
+    Job *head;
+    Job *tail;
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+} Lane;
+
+struct Reactor {
+    int epfd;
+    volatile int running;
+
+    Lane lanes[REACTOR_MAX_LANES];
+    int lane_count;
+    LaneSelector select_lane;
+
+    pthread_mutex_t count_mutex;
+    int connection_count;
+
+    int spare_fd;                // Released to shed connections on EMFILE
+};
+
+static long long wall_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void enqueue_job(Reactor *r, int lane_idx, JobType type, Connection *conn, char *body) {
+    Lane *lane = &r->lanes[lane_idx];
+    Job *job = malloc(sizeof(Job));
+    job->type = type;
+    job->conn = conn;
+    job->body = body;
+    job->next = NULL;
+
+    pthread_mutex_lock(&lane->queue_mutex);
+    if (lane->tail) {
+        lane->tail->next = job;
+    } else {
+        lane->head = job;
+    }
+    lane->tail = job;
+    pthread_cond_signal(&lane->queue_cond);
+    pthread_mutex_unlock(&lane->queue_mutex);
+}
+
+static void rearm(Connection *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->reactor->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        // Cannot wait on it any more: treat as a disconnect
+        enqueue_job(conn->reactor, 0, JOB_CLOSE, conn, NULL);
+    }
+}
+
+static void release_connection(Connection *conn, int close_fd) {
+    Reactor *r = conn->reactor;
+
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (close_fd) close(conn->fd);
+    free(conn->body);
+    free(conn);
+
+    pthread_mutex_lock(&r->count_mutex);
+    r->connection_count--;
+    pthread_mutex_unlock(&r->count_mutex);
+}
+
+static void* worker_main(void *arg) {
+    Lane *lane = arg;
+    Reactor *r = lane->reactor;
+    Message msg;
+
+    while (1) {
+        pthread_mutex_lock(&lane->queue_mutex);
+        while (!lane->head && r->running) {
+            pthread_cond_wait(&lane->queue_cond, &lane->queue_mutex);
+        }
+        if (!lane->head) {
+            pthread_mutex_unlock(&lane->queue_mutex);
+            break;
+        }
+        Job *job = lane->head;
+        lane->head = job->next;
+        if (!lane->head) lane->tail = NULL;
+        pthread_mutex_unlock(&lane->queue_mutex);
+
+        Connection *conn = job->conn;
+        Listener *l = conn->listener;
+
+        if (job->type == JOB_CLOSE) {
+            if (l->on_close) l->on_close(conn);
+            release_connection(conn, 1);
+        } else {
+            conn->dequeued_us = wall_us();
+            deserialize_message(job->body, &msg);
+            free(job->body);
+
+            int result = l->on_frame(conn, &msg);
+            if (result == REACTOR_KEEP) {
+                rearm(conn);
+            } else if (result == REACTOR_DETACH) {
+                release_connection(conn, 0);
+            } else {
+                if (l->on_close) l->on_close(conn);
+                release_connection(conn, 1);
+            }
+        }
+
+        free(job);
+    }
+
+    return NULL;
+}
+
+static int start_lane(Reactor *r, int workers) {
+    if (workers <= 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers < 2) workers = 2;
+    }
+
+    Lane *lane = &r->lanes[r->lane_count];
+    lane->reactor = r;
+    pthread_mutex_init(&lane->queue_mutex, NULL);
+    pthread_cond_init(&lane->queue_cond, NULL);
+
+    lane->workers = malloc(sizeof(pthread_t) * workers);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&lane->workers[i], NULL, worker_main, lane) != 0) {
+            break;
+        }
+        lane->worker_count++;
+    }
+    if (lane->worker_count == 0) {
+        free(lane->workers);
+        return -1;
+    }
+
+    log_formatted(LOG_INFO, "Reactor lane %d started with %d worker threads",
+                  r->lane_count, lane->worker_count);
+    return r->lane_count++;
+}
+
+Reactor* reactor_create(int workers) {
+    Reactor *r = calloc(1, sizeof(Reactor));
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->running = 1;
+    r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pthread_mutex_init(&r->count_mutex, NULL);
+
+    if (start_lane(r, workers) < 0) {
+        close(r->epfd);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+int reactor_add_lane(Reactor *r, int workers) {
+    if (r->lane_count >= REACTOR_MAX_LANES) return -1;
+    return start_lane(r, workers);
+}
+
+void reactor_set_lane_selector(Reactor *r, LaneSelector select_lane) {
+    r->select_lane = select_lane;
+}
+
+int reactor_listen(Reactor *r, int port, int kind, FrameHandler on_frame, CloseHandler on_close) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    Listener *l = calloc(1, sizeof(Listener));
+    l->is_listener = 1;
+    l->fd = fd;
+    l->kind = kind;
+    l->on_frame = on_frame;
+    l->on_close = on_close;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = l;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        free(l);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void accept_connections(Reactor *r, Listener *l) {
+    while (1) {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = accept4(l->fd, (struct sockaddr*)&peer, &peer_len, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EMFILE || errno == ENFILE) && r->spare_fd >= 0) {
+                // Out of descriptors: the pending connection would keep the
+                // listener readable forever, so accept and drop it
+                close(r->spare_fd);
+                int shed = accept(l->fd, NULL, NULL);
+                if (shed >= 0) close(shed);
+                r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                log_formatted(LOG_WARNING, "Descriptor limit reached, dropped connection on listener %d", l->kind);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_formatted(LOG_WARNING, "accept failed on listener %d (errno: %d)", l->kind, errno);
+            }
+            return;
+        }
+
+        // The socket stays blocking so workers can reply with send_message();
+        // the reactor itself only ever reads with MSG_DONTWAIT.
+        set_socket_timeouts(fd, REACTOR_SEND_TIMEOUT, 0);
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        conn->fd = fd;
+        conn->kind = l->kind;
+        conn->reactor = r;
+        conn->listener = l;
+        inet_ntop(AF_INET, &peer.sin_addr, conn->peer_ip, sizeof(conn->peer_ip));
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+
+        pthread_mutex_lock(&r->count_mutex);
+        r->connection_count++;
+        pthread_mutex_unlock(&r->count_mutex);
+    }
+}
+
+// Pull as much of the current frame as is available without blocking.
+// Returns 1 when a frame is complete, 0 when more data is needed, -1 on EOF/error.
+static int read_frame(Connection *conn) {
+    while (conn->hdr_got < (int)sizeof(int)) {
+        ssize_t n = recv(conn->fd, conn->hdr + conn->hdr_got,
+                         sizeof(int) - conn->hdr_got, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->hdr_got += n;
+    }
+
+    if (!conn->body) {
+        memcpy(&conn->frame_len, conn->hdr, sizeof(int));
+        if (conn->frame_len <= 0 || conn->frame_len >= MAX_BUFFER * 2) {
+            return -1;
+        }
+        conn->body = malloc(conn->frame_len + 1);
+        conn->body_got = 0;
+    }
+
+    while (conn->body_got < conn->frame_len) {
+        ssize_t n = recv(conn->fd, conn->body + conn->body_got,
+                         conn->frame_len - conn->body_got, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->body_got += n;
+    }
+
+    conn->body[conn->frame_len] = '\0';
+    return 1;
+}
+
+void reactor_run(Reactor *r) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (r->running) {
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_formatted(LOG_ERROR, "epoll_wait failed (errno: %d)", errno);
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (((Listener*)events[i].data.ptr)->is_listener) {
+                accept_connections(r, events[i].data.ptr);
+                continue;
+            }
+
+            Connection *conn = events[i].data.ptr;
+            int status = read_frame(conn);
+
+            if (status > 0) {
+                char *body = conn->body;
+                conn->body = NULL;
+                conn->hdr_got = 0;
+
+                // The message type is the first field of the frame
+                int lane = 0;
+                if (r->select_lane) {
+                    lane = r->select_lane(atoi(body));
+                    if (lane < 0 || lane >= r->lane_count) lane = 0;
+                }
+                conn->queued_us = wall_us();
+                enqueue_job(r, lane, JOB_FRAME, conn, body);
+            } else if (status == 0) {
+                rearm(conn);
+            } else {
+                enqueue_job(r, 0, JOB_CLOSE, conn, NULL);
+            }
+        }
+    }
+}
+
+void reactor_stop(Reactor *r) {
+    r->running = 0;
+
+    for (int l = 0; l < r->lane_count; l++) {
+        Lane *lane = &r->lanes[l];
+        pthread_mutex_lock(&lane->queue_mutex);
+        pthread_cond_broadcast(&lane->queue_cond);
+        pthread_mutex_unlock(&lane->queue_mutex);
+
+        for (int i = 0; i < lane->worker_count; i++) {
+            pthread_join(lane->workers[i], NULL);
+        }
+    }
+}
+
+int reactor_connection_count(Reactor *r) {
+    pthread_mutex_lock(&r->count_mutex);
+    int count = r->connection_count;
+    pthread_mutex_unlock(&r->count_mutex);
+    return count;
+}
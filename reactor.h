@@ -0,0 +1,73 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "common.h"
+
+// Event-driven front end: one epoll thread owns every accepted socket,
+// assembles length-prefixed frames without blocking, and hands complete
+// frames to a fixed pool of worker threads. A connection has at most one
+// frame in flight (EPOLLONESHOT), so per-connection ordering is preserved.
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_SEND_TIMEOUT 10      // Seconds a worker may block sending a reply
+#define REACTOR_MAX_LANES 4          // Independent worker pools per reactor
+
+// Frame handler results
+#define REACTOR_KEEP 0      // Re-arm the connection for the next frame
+#define REACTOR_CLOSE 1     // Tear the connection down (close handler runs)
+#define REACTOR_DETACH 2    // Handler now owns the fd; reactor forgets it
+
+typedef struct Reactor Reactor;
+
+typedef struct Connection {
+    int is_listener;             // Always 0 (shares layout tag with listeners)
+    int fd;
+    int kind;                    // Listener kind that accepted this connection
+    char peer_ip[INET_ADDRSTRLEN];
+    void *ctx;                   // Per-connection state owned by the handlers
+
+    // Receive state (reactor thread only)
+    char hdr[sizeof(int)];
+    int hdr_got;
+    int frame_len;
+    int body_got;
+    char *body;
+
+    // When the frame being handled was complete and when a worker took it
+    // (wall clock, us); valid during the frame handler
+    long long queued_us;
+    long long dequeued_us;
+
+    Reactor *reactor;
+    struct Listener *listener;
+} Connection;
+
+typedef int (*FrameHandler)(Connection *conn, Message *msg);
+typedef void (*CloseHandler)(Connection *conn);
+
+// Maps a frame's MessageType to a lane; connection teardown always runs on lane 0
+typedef int (*LaneSelector)(int msg_type);
+
+// Create a reactor with `workers` worker threads (<= 0 means one per core)
+// serving lane 0
+Reactor* reactor_create(int workers);
+
+// Add another lane with its own workers; returns the lane index or -1
+int reactor_add_lane(Reactor *r, int workers);
+
+// Route frames to lanes by message type (default: everything on lane 0)
+void reactor_set_lane_selector(Reactor *r, LaneSelector select_lane);
+
+// Bind a listening socket and route its connections to the given handlers
+int reactor_listen(Reactor *r, int port, int kind, FrameHandler on_frame, CloseHandler on_close);
+
+// Run the event loop on the calling thread until reactor_stop()
+void reactor_run(Reactor *r);
+
+// Ask the event loop and workers to exit
+void reactor_stop(Reactor *r);
+
+// Number of currently open connections
+int reactor_connection_count(Reactor *r);
+
+#endif // REACTOR_H
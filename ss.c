@@ -1,6 +1,12 @@
 #include "common.h"
 #include "logger.h"
 #include "file_ops.h"
+#include "reactor.h"
+#include "lease.h"
+#include "capture.h"
+#include "stats.h"
+#include "trace.h"
+#include "lock_stats.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -11,11 +17,44 @@
 #include <utime.h>
 
 #define SS_STORAGE_DIR "./ss_storage"
-#define HEARTBEAT_INTERVAL 5
+#define HEARTBEAT_INTERVAL_MS 5000  // Between heartbeats to the NM (SS_HEARTBEAT_MS)
 #define SENTENCE_CAPACITY 10
 #define SOCKET_TIMEOUT 10  
+#define SS_MAX_HELD_LOCKS 16      // Sentence locks tracked per client connection
+#define SS_STREAM_WORKERS 4       // Default workers reserved for STREAM
+#define SS_REPL_WORKERS 2         // Default workers applying updates from primaries
+#define SS_NM_POOL_SIZE 4         // Default command connections offered to the NM
+#define SS_NM_RETRY_MS 200        // First pause between attempts to reach a name server again
+#define SS_NM_RETRY_MAX_MS 3000   // Longest one, reached by doubling
+#define SS_LATENCY_SAMPLES 1024   // Request latencies kept per heartbeat interval
+#define SS_REPL_TIMEOUT 2         // Seconds a backup may take before it is reported stale
+
+// Client request lanes
+#define SS_LANE_SHORT 0           // READ, LOCK, WRITE, UNLOCK, UNDO
+#define SS_LANE_STREAM 1          // Long-running STREAM
+#define SS_LANE_REPL 2            // Updates from a primary SS
 
 static pthread_mutex_t nm_comm_mutex = PTHREAD_MUTEX_INITIALIZER; // Newly added to deal with heartbeats - N
+static pthread_mutex_t hb_send_mutex = PTHREAD_MUTEX_INITIALIZER;  // Heartbeats and stale-replica reports share the socket
+
+// The NM connection. When the NM goes away this SS keeps serving clients and
+// registers again with whichever name server answers (a standby that took
+// over, or the NM restarted).
+static pthread_mutex_t nm_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nm_state_cond = PTHREAD_COND_INITIALIZER;
+static int nm_generation = 0;        // Bumped on every registration (nm_state_mutex, hb_send_mutex)
+static int nm_connected = 0;
+
+// The key the NM signs route leases with, from its reply to our pool
+// connections. Without one (an NM with leases off, or no pool) requests are
+// served without a lease; a key outlives the NM session, so clients holding
+// leases keep reading while the NM is away.
+static pthread_mutex_t lease_key_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char lease_key[LEASE_KEY_BYTES];
+static int have_lease_key = 0;
+
+// Pause between streamed words (SS_STREAM_DELAY_US)
+static int stream_delay_us = STREAM_DELAY;
 
 typedef struct {
     int id;
@@ -47,12 +86,80 @@ FileCommitQueue commit_queues[MAX_FILE_QUEUES];
 int commit_queue_count = 0;
 pthread_mutex_t commit_queues_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+LOCK_STATS_DEFINE(locks_lock_stats, "ss.locks_mutex");
+LOCK_STATS_DEFINE(write_sessions_lock_stats, "ss.write_sessions_mutex");
+LOCK_STATS_DEFINE(commit_queues_lock_stats, "ss.commit_queues_mutex");
+
 StorageServer ss;
+Reactor *client_reactor = NULL;
+
+// Client load since the last heartbeat, reported to the NM for placement
+typedef struct {
+    pthread_mutex_t mutex;
+    long requests;
+    double latency_ms[SS_LATENCY_SAMPLES];
+    int sample_count;
+    struct timeval since;
+} LoadStats;
+
+LoadStats load_stats = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Toggled by SIGUSR1: while set the NM places nothing new here and moves
+// this server's files elsewhere. The signal is blocked in every thread and
+// taken by the heartbeat thread, so it never interrupts socket calls.
+static volatile int draining = 0;
+
+// Fault injection for recovery testing, off unless SS_FAULT names one:
+//   "drop-heartbeat" - each SIGUSR2 drops the heartbeat channel to the NM
+//   "slow-io:US"     - SIGUSR2 turns a US delay before every client request
+//                      on or off, as if the disk had become slow
+// SIGUSR2 is taken by the heartbeat thread, like SIGUSR1.
+typedef enum { FAULT_NONE, FAULT_DROP_HEARTBEAT, FAULT_SLOW_IO } FaultKind;
+static FaultKind fault_kind = FAULT_NONE;
+static int fault_delay_us = 0;
+static volatile int fault_active = 0;
+static int heartbeat_ms = HEARTBEAT_INTERVAL_MS;
+
+typedef struct {
+    int ss_id;
+    char ip[INET_ADDRSTRLEN];
+    int port;                    // Client port of the backup SS
+} ReplicaTarget;
+
+// Backups this SS ships a file's updates to while it is the file's primary.
+// The NM sets them (MSG_REPL_CONFIG) and only lists backups that are in sync.
+typedef struct {
+    char filename[MAX_FILENAME];
+    ReplicaTarget backups[MAX_BACKUPS];
+    int backup_count;
+    int handed_off;              // Another SS took over the file's writes (MSG_REPL_HANDOFF)
+} ReplicaSet;
+
+ReplicaSet replica_sets[MAX_FILES];
+int replica_set_count = 0;
+pthread_mutex_t replica_sets_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    char username[MAX_USERNAME];
+    int sent_idx;
+} HeldLock;
+
+// Per-connection state for client sessions
+typedef struct {
+    HeldLock held[SS_MAX_HELD_LOCKS];
+    int held_count;
+    uint32_t capture_id;         // This connection in the request capture (SS_CAPTURE)
+} ClientConnState;
 
 void* handle_nm_communication(void* arg);
-void* handle_client_request(void* arg);
+void process_client_request(int client_sock, Message *msg, ClientConnState *state);
+int on_client_frame(Connection *conn, Message *msg);
+void on_client_close(Connection *conn);
 void* client_listener(void* arg);
 void* heartbeat_thread(void* arg);
+void nm_connection_lost(int generation);
+int nm_session_alive();
 void scan_and_register_files();
 int create_file_ss(const char *filename);
 int delete_file_ss(const char *filename);
@@ -68,21 +175,23 @@ WriteSession* get_write_session(const char* filename, const char* username, int
 void remove_write_session(const char* filename, const char* username, int sent_idx);
 int commit_write_session_ss(const char* filename, const char* username, int sent_idx);
 int cancel_write_session_ss(const char* filename, const char* username, int sent_idx);
+void replicate_delta(const char *filename, unsigned long long base_hash, int base_count,
+                     int start, int replaced, Sentence *sentences, int count, int new_batch);
 
 FileCommitQueue* get_commit_queue(const char *filename) {
-    pthread_mutex_lock(&commit_queues_mutex);
+    MUTEX_LOCK(&commit_queues_mutex, &commit_queues_lock_stats);
     
     // Find existing queue
     for (int i = 0; i < commit_queue_count; i++) {
         if (strcmp(commit_queues[i].filename, filename) == 0) {
-            pthread_mutex_unlock(&commit_queues_mutex);
+            MUTEX_UNLOCK(&commit_queues_mutex, &commit_queues_lock_stats);
             return &commit_queues[i];
         }
     }
     
     // Create new queue
     if (commit_queue_count >= MAX_FILE_QUEUES) {
-        pthread_mutex_unlock(&commit_queues_mutex);
+        MUTEX_UNLOCK(&commit_queues_mutex, &commit_queues_lock_stats);
         return NULL;
     }
     
@@ -92,7 +201,7 @@ FileCommitQueue* get_commit_queue(const char *filename) {
     queue->tail = NULL;
     pthread_mutex_init(&queue->mutex, NULL);
     
-    pthread_mutex_unlock(&commit_queues_mutex);
+    MUTEX_UNLOCK(&commit_queues_mutex, &commit_queues_lock_stats);
     return queue;
 }
 
@@ -132,9 +241,13 @@ int process_commit_queue(const char *filename) {
     FileCommitQueue *queue = get_commit_queue(filename);
     if (!queue) return 0;
     
+    TraceSpan span;
+    trace_begin(&span, "commit queue wait");
     pthread_mutex_lock(&queue->mutex);
+    trace_end(&span);
     
     int processed = 0;
+    int new_batch = 1;   // Backups take their undo copy before the first delta
     char filepath[MAX_PATH];
     snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, filename);
     
@@ -152,6 +265,8 @@ int process_commit_queue(const char *filename) {
                       entry->filename, entry->username, entry->sentence_idx, entry->original_sentence_count);
         
         // Parse CURRENT main file state
+        trace_begin(&span, "merge");
+        unsigned long long base_hash = file_checksum(filepath);
         FileContent *main_fc = init_file_content();
         int main_parsed = (parse_file(filepath, main_fc) == 0);
         int current_sentence_count = main_parsed ? main_fc->sentence_count : 0;
@@ -215,6 +330,7 @@ int process_commit_queue(const char *filename) {
         // Build merged content
         int new_total;
         Sentence *new_sentences;
+        int delta_start, delta_replaced, delta_count;   // What the backups replay
         
         if (current_sentence_count == 0) {
             // Empty file case - just use temp file content directly
@@ -246,6 +362,10 @@ int process_commit_queue(const char *filename) {
             main_fc->sentences = new_sentences;
             main_fc->sentence_count = new_total;
             main_fc->capacity = new_total;
+
+            delta_start = 0;
+            delta_replaced = 0;
+            delta_count = new_total;
         } else {
             // Non-empty file - do normal merge
             new_total = current_sentence_count + sentence_expansion;
@@ -291,10 +411,19 @@ int process_commit_queue(const char *filename) {
             main_fc->sentences = new_sentences;
             main_fc->sentence_count = new_idx;
             main_fc->capacity = new_total;
+
+            delta_start = adjusted_idx;
+            delta_replaced = 1;
+            delta_count = new_idx - (current_sentence_count - 1);
         }
         
+        trace_end(&span);
+
         // Write back to disk
-        if (write_file_content(filepath, main_fc) != 0) {
+        trace_begin(&span, "disk write");
+        int written = write_file_content(filepath, main_fc);
+        trace_end(&span);
+        if (written != 0) {
             log_formatted(LOG_ERROR, "Failed to write merged content");
             free_file_content(main_fc);
             free_file_content(temp_fc);
@@ -310,6 +439,13 @@ int process_commit_queue(const char *filename) {
             times.modtime = time(NULL);
             utime(filepath, &times);
         }
+
+        // Backups apply the same sentences before the commit is acknowledged
+        trace_begin(&span, "replicate");
+        replicate_delta(filename, base_hash, current_sentence_count, delta_start, delta_replaced,
+                        main_fc->sentences + delta_start, delta_count, new_batch);
+        trace_end(&span);
+        new_batch = 0;
         
         free_file_content(main_fc);
         free_file_content(temp_fc);
@@ -333,7 +469,7 @@ int process_commit_queue(const char *filename) {
 }
 
 WriteSession* get_write_session(const char *filename, const char *username, int sent_idx, int create) {
-    pthread_mutex_lock(&write_sessions_mutex);
+    MUTEX_LOCK(&write_sessions_mutex, &write_sessions_lock_stats);
     
     // Search for existing session
     for (int i = 0; i < write_session_count; i++) {
@@ -341,7 +477,7 @@ WriteSession* get_write_session(const char *filename, const char *username, int
             strcmp(write_sessions[i].filename, filename) == 0 &&
             strcmp(write_sessions[i].username, username) == 0 &&
             write_sessions[i].sentence_idx == sent_idx) {
-            pthread_mutex_unlock(&write_sessions_mutex);
+            MUTEX_UNLOCK(&write_sessions_mutex, &write_sessions_lock_stats);
             return &write_sessions[i];
         }
     }
@@ -360,16 +496,16 @@ WriteSession* get_write_session(const char *filename, const char *username, int
         session->active = 1;
         write_session_count++;
         
-        pthread_mutex_unlock(&write_sessions_mutex);
+        MUTEX_UNLOCK(&write_sessions_mutex, &write_sessions_lock_stats);
         return session;
     }
     
-    pthread_mutex_unlock(&write_sessions_mutex);
+    MUTEX_UNLOCK(&write_sessions_mutex, &write_sessions_lock_stats);
     return NULL;
 }
 
 void remove_write_session(const char *filename, const char *username, int sent_idx) {
-    pthread_mutex_lock(&write_sessions_mutex);
+    MUTEX_LOCK(&write_sessions_mutex, &write_sessions_lock_stats);
     
     for (int i = 0; i < write_session_count; i++) {
         if (write_sessions[i].active &&
@@ -389,7 +525,7 @@ void remove_write_session(const char *filename, const char *username, int sent_i
         }
     }
     
-    pthread_mutex_unlock(&write_sessions_mutex);
+    MUTEX_UNLOCK(&write_sessions_mutex, &write_sessions_lock_stats);
 }
 
 // Updated start_write_session_ss function
@@ -468,7 +604,7 @@ int commit_write_session_ss(const char *filename, const char *username, int sent
     }
     
     // Remove write session (temp file will be cleaned up after queue processing)
-    pthread_mutex_lock(&write_sessions_mutex);
+    MUTEX_LOCK(&write_sessions_mutex, &write_sessions_lock_stats);
     for (int i = 0; i < write_session_count; i++) {
         if (write_sessions[i].active &&
             strcmp(write_sessions[i].filename, filename) == 0 &&
@@ -484,7 +620,7 @@ int commit_write_session_ss(const char *filename, const char *username, int sent
             break;
         }
     }
-    pthread_mutex_unlock(&write_sessions_mutex);
+    MUTEX_UNLOCK(&write_sessions_mutex, &write_sessions_lock_stats);
     
     // Process the entire commit queue for this file
     process_commit_queue(filename);
@@ -507,7 +643,7 @@ int cancel_write_session_ss(const char *filename, const char *username, int sent
 
 
 int check_file_locks(const char *filename) {
-    pthread_mutex_lock(&ss.locks_mutex);
+    MUTEX_LOCK(&ss.locks_mutex, &locks_lock_stats);
     
     // Find the file's lock structure
     for (int i = 0; i < ss.file_lock_count; i++) {
@@ -521,7 +657,7 @@ int check_file_locks(const char *filename) {
                 pthread_mutex_unlock(&lock->mutex);
                 
                 if (is_locked) {
-                    pthread_mutex_unlock(&ss.locks_mutex);
+                    MUTEX_UNLOCK(&ss.locks_mutex, &locks_lock_stats);
                     log_formatted(LOG_INFO, "File %s has locked sentence %d", filename, j);
                     return 1;  // File has locked sentences
                 }
@@ -530,7 +666,7 @@ int check_file_locks(const char *filename) {
         }
     }
     
-    pthread_mutex_unlock(&ss.locks_mutex);
+    MUTEX_UNLOCK(&ss.locks_mutex, &locks_lock_stats);
     return 0;  // No locks found
 }
 
@@ -586,6 +722,8 @@ void init_storage_server(const char *nm_ip, int nm_port, int client_port, int ss
     printf("[SS] System client port: %d\n", ss.client_port);
     ss.id = ss_id;
     ss.running = 1;
+    ss.nm_sock = -1;
+    ss.nm_hb_sock = -1;
     
     snprintf(ss.storage_path, sizeof(ss.storage_path), "%s_%d", SS_STORAGE_DIR, ss.id);
     
@@ -616,66 +754,69 @@ void init_storage_server(const char *nm_ip, int nm_port, int client_port, int ss
 }
 
 // Added doe to setup socket options for NM communication, might be unnecessary - N
-void setup_nm_socket_options() {
+void setup_nm_socket_options(int sock) {
     // Enable TCP keepalive to detect dead connections
     int keepalive = 1;
-    setsockopt(ss.nm_sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
     
     // Set keepalive parameters (Linux-specific)
     #ifdef __linux__
     int keepidle = 10;   // Start probes after 10 seconds of idle
     int keepintvl = 5;   // Send probes every 5 seconds
     int keepcnt = 3;     // Close after 3 failed probes
-    setsockopt(ss.nm_sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle));
-    setsockopt(ss.nm_sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
-    setsockopt(ss.nm_sock, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
     #endif
     
     log_formatted(LOG_INFO, "Socket keepalive configured");
 }
 
-void connect_to_nm(const char *nm_ip, int nm_port) {
-    // Command socket
-    ss.nm_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (ss.nm_sock < 0) {
-        perror("Socket creation failed");
-        exit(1);
-    }
-    
+static int connect_nm_port(const char *nm_ip, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
     struct sockaddr_in nm_addr;
+    memset(&nm_addr, 0, sizeof(nm_addr));
     nm_addr.sin_family = AF_INET;
-    nm_addr.sin_port = htons(nm_port);
+    nm_addr.sin_port = htons(port);
     inet_pton(AF_INET, nm_ip, &nm_addr.sin_addr);
-    
-    if (connect(ss.nm_sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
-        perror("Connection to NM failed");
-        exit(1);
+
+    if (connect(sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
+        close(sock);
+        return -1;
     }
-    setup_nm_socket_options();
-    
+    setup_nm_socket_options(sock);
+    return sock;
+}
+
+// Open the command and heartbeat sockets; returns 0, or -1 if the NM is not there
+int connect_to_nm(const char *nm_ip, int nm_port) {
+    // Command socket
+    int cmd_sock = connect_nm_port(nm_ip, nm_port);
+    if (cmd_sock < 0) return -1;
+
     // Heartbeat socket configs - N
-    ss.nm_hb_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (ss.nm_hb_sock < 0) {
-        perror("Heartbeat socket creation failed");
-        exit(1);
-    }
-    
-    struct sockaddr_in hb_addr;
-    hb_addr.sin_family = AF_INET;
-    hb_addr.sin_port = htons(NM_SS_HB_PORT);
-    inet_pton(AF_INET, nm_ip, &hb_addr.sin_addr);
-    
-    // Start collecting heartbeats from this - N
-    if (connect(ss.nm_hb_sock, (struct sockaddr*)&hb_addr, sizeof(hb_addr)) < 0) {
-        perror("Connection to NM heartbeat port failed");
-        close(ss.nm_sock);
-        exit(1);
+    // A name server shard's heartbeat port sits next to its command port
+    int hb_port = nm_port - NM_SS_PORT + NM_SS_HB_PORT;
+    int hb_sock = connect_nm_port(nm_ip, hb_port);
+    if (hb_sock < 0) {
+        close(cmd_sock);
+        return -1;
     }
+
+    // The previous command socket belongs to its thread, which closes it
+    ss.nm_sock = cmd_sock;
+    pthread_mutex_lock(&hb_send_mutex);
+    if (ss.nm_hb_sock >= 0) close(ss.nm_hb_sock);
+    ss.nm_hb_sock = hb_sock;
+    pthread_mutex_unlock(&hb_send_mutex);
     
     printf("[SS %d] Connected to Name Server at %s:%d (cmd) and %s:%d (hb)\n", 
-           ss.id, nm_ip, nm_port, nm_ip, NM_SS_HB_PORT);
+           ss.id, nm_ip, nm_port, nm_ip, hb_port);
     log_formatted(LOG_INFO, "Connected to NM at %s:%d (cmd) and %s:%d (hb)", 
-                  nm_ip, nm_port, nm_ip, NM_SS_HB_PORT);
+                  nm_ip, nm_port, nm_ip, hb_port);
+    return 0;
 }
 
 void scan_and_register_files() {
@@ -698,6 +839,7 @@ void scan_and_register_files() {
     struct dirent *entry;
     char file_list[MAX_BUFFER] = "";
     int file_count = 0;
+    int skipped = 0;
     
     while ((entry = readdir(dir)) != NULL) {
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
@@ -705,18 +847,29 @@ void scan_and_register_files() {
         }
         
         if (strstr(entry->d_name, ".undo") != NULL) continue;
+        if (strstr(entry->d_name, ".repl") != NULL) continue;   // Unfinished replica copy
         
         char filepath[MAX_PATH];
         snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, entry->d_name);
         
         struct stat st;
         if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode)) {
+            // The list must fit one message; files the NM already knows
+            // (from its metadata log) keep their mapping without it
+            size_t used = strlen(file_list);
+            if (used + strlen(entry->d_name) + 2 > sizeof(file_list)) {
+                skipped++;
+                continue;
+            }
             if (file_count > 0) strcat(file_list, ",");
             strcat(file_list, entry->d_name);
             file_count++;
         }
     }
     closedir(dir);
+    if (skipped > 0) {
+        log_formatted(LOG_WARNING, "%d files did not fit in the registration message", skipped);
+    }
     
     strcpy(msg.data, file_list);
     
@@ -725,9 +878,93 @@ void scan_and_register_files() {
     printf("[SS %d] Registered %d files with NM\n", ss.id, file_count);
 }
 
+// `hex` is the NM's lease key, or empty when it issues no leases
+void set_lease_key(const char *hex) {
+    unsigned char key[LEASE_KEY_BYTES];
+    int valid = lease_key_from_hex(hex, key) == 0;
+    pthread_mutex_lock(&lease_key_mutex);
+    if (valid) memcpy(lease_key, key, LEASE_KEY_BYTES);
+    have_lease_key = valid;
+    pthread_mutex_unlock(&lease_key_mutex);
+}
+
+// Copy the NM's lease key into `key`; returns whether we have one
+static int get_lease_key(unsigned char key[LEASE_KEY_BYTES]) {
+    pthread_mutex_lock(&lease_key_mutex);
+    int have = have_lease_key;
+    memcpy(key, lease_key, LEASE_KEY_BYTES);
+    pthread_mutex_unlock(&lease_key_mutex);
+    return have;
+}
+
+// A READ, STREAM, UNDO or LOCK needs a route lease from the NM granting
+// `needed` on this file to this user here, unless we have no key to check it.
+// Replica traffic needs a replica lease signed by another of its SSs.
+int check_route_lease(const Message *msg, AccessType needed) {
+    unsigned char key[LEASE_KEY_BYTES];
+    if (!get_lease_key(key)) return SUCCESS;
+    return lease_verify(key, msg->lease, msg->sender, msg->filename, ss.id, needed, lease_now_ms());
+}
+
+// Sign `msg` for the backup `target_id` so it accepts it as coming from a
+// storage server of our NM, not from whoever reached its client port
+void sign_replica_message(Message *msg, int target_id) {
+    unsigned char key[LEASE_KEY_BYTES];
+    msg->lease[0] = '\0';
+    if (!get_lease_key(key)) return;
+
+    RouteLease lease;
+    lease.ss_id = target_id;
+    lease.expires_ms = lease_now_ms() + LEASE_TTL_MS;
+    lease.access = LEASE_ACCESS_REPLICA;
+    lease_sign(key, msg->sender, msg->filename, &lease);
+    lease_format(&lease, msg->lease, sizeof(msg->lease));
+}
+
+// Open one extra command connection and hand it to the NM's pool. The NM
+// refuses it until our registration has been processed, so retry briefly.
+int open_nm_pool_connection(const char *nm_ip, int nm_port) {
+    for (int attempt = 0; attempt < 10; attempt++) {
+        // No point once the session it would join has died
+        if (!nm_session_alive()) return -1;
+
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+
+        struct sockaddr_in nm_addr;
+        memset(&nm_addr, 0, sizeof(nm_addr));
+        nm_addr.sin_family = AF_INET;
+        nm_addr.sin_port = htons(nm_port);
+        inet_pton(AF_INET, nm_ip, &nm_addr.sin_addr);
+
+        if (connect(sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
+            close(sock);
+            return -1;
+        }
+        setup_nm_socket_options(sock);
+        set_socket_timeouts(sock, SOCKET_TIMEOUT, SOCKET_TIMEOUT);
+
+        Message msg;
+        init_message(&msg);
+        msg.type = MSG_SS_POOL_CONN;
+        msg.ss_id = ss.id;
+
+        Message response;
+        if (send_message(sock, &msg) == 0 && recv_message(sock, &response) == 0 &&
+            response.status == SUCCESS) {
+            set_lease_key(response.data);
+            return sock;
+        }
+
+        close(sock);
+        usleep(200000);
+    }
+    return -1;
+}
+
 void init_file_locks(const char *filename, int sentence_count) {
     if (sentence_count == 0) sentence_count = 1;
-    pthread_mutex_lock(&ss.locks_mutex);
+    MUTEX_LOCK(&ss.locks_mutex, &locks_lock_stats);
     
     for (int i = 0; i < ss.file_lock_count; i++) {
         if (strcmp(ss.file_locks[i].filename, filename) == 0) {
@@ -740,7 +977,7 @@ void init_file_locks(const char *filename, int sentence_count) {
                 }
                 ss.file_locks[i].lock_count = sentence_count;
             }
-            pthread_mutex_unlock(&ss.locks_mutex);
+            MUTEX_UNLOCK(&ss.locks_mutex, &locks_lock_stats);
             return;
         }
     }
@@ -756,23 +993,23 @@ void init_file_locks(const char *filename, int sentence_count) {
     }
     
     ss.file_lock_count++;
-    pthread_mutex_unlock(&ss.locks_mutex);
+    MUTEX_UNLOCK(&ss.locks_mutex, &locks_lock_stats);
 }
 
 SentenceLock* get_sentence_lock(const char *filename, int sentence_idx) {
-    pthread_mutex_lock(&ss.locks_mutex);
+    MUTEX_LOCK(&ss.locks_mutex, &locks_lock_stats);
     for (int i = 0; i < ss.file_lock_count; i++) {
         if (strcmp(ss.file_locks[i].filename, filename) == 0) {
             if (sentence_idx >= 0 && sentence_idx < ss.file_locks[i].lock_count) {
                 SentenceLock *lock = &ss.file_locks[i].locks[sentence_idx];
-                pthread_mutex_unlock(&ss.locks_mutex);
+                MUTEX_UNLOCK(&ss.locks_mutex, &locks_lock_stats);
                 return lock;
             }
             break;
         }
     }
     
-    pthread_mutex_unlock(&ss.locks_mutex);
+    MUTEX_UNLOCK(&ss.locks_mutex, &locks_lock_stats);
     return NULL;
 }
 
@@ -1017,8 +1254,10 @@ int move_file_ss(const char *filename, const char *old_path, const char *new_pat
         snprintf(old_full, sizeof(old_full), "%s/%s", ss.storage_path, filename);
     }
     
-    // Handle new path (empty means root)
+    // Handle new path (empty means root). The folder may have been created
+    // on another SS (or by another name server shard), so make sure it exists
     if (strlen(new_path) > 0 && strcmp(new_path, "/") != 0) {
+        create_folder_ss(new_path);
         snprintf(new_full, sizeof(new_full), "%s%s/%s", ss.storage_path, new_path, filename);
     } else {
         snprintf(new_full, sizeof(new_full), "%s/%s", ss.storage_path, filename);
@@ -1087,7 +1326,7 @@ int stream_file_ss(int client_sock, const char *filename) {
                 return ERR_SERVER_ERROR;
             }
             
-            usleep(STREAM_DELAY);
+            if (stream_delay_us > 0) usleep(stream_delay_us);
         }
     }
     
@@ -1126,249 +1365,887 @@ int get_file_info_ss(const char *filename, FileMetadata *meta) {
     return SUCCESS;
 }
 
-void* handle_client_request(void* arg) {
-    int client_sock = *((int*)arg);
-    free(arg);
-    
-    // Set timeouts for client socket
-    set_socket_timeouts(client_sock, SOCKET_TIMEOUT, SOCKET_TIMEOUT);
-    
-    Message msg;
-    while (ss.running) {
-        if (recv_message(client_sock, &msg) < 0) {
-             //log_formatted(LOG_INFO, "Client disconnected (socket=%d)", client_sock);
+// Sentence locks a client connection currently holds, so they can be
+// released if the client disappears mid-write
+void track_held_lock(ClientConnState *state, const char *filename, const char *username, int sent_idx) {
+    if (state->held_count >= SS_MAX_HELD_LOCKS) {
+        log_formatted(LOG_WARNING, "Connection holds too many locks, not tracking %s[%d]", filename, sent_idx);
+        return;
+    }
 
-            //break;
-            continue; // Was break before - N
+    HeldLock *held = &state->held[state->held_count++];
+    strncpy(held->filename, filename, MAX_FILENAME - 1);
+    held->filename[MAX_FILENAME - 1] = '\0';
+    strncpy(held->username, username, MAX_USERNAME - 1);
+    held->username[MAX_USERNAME - 1] = '\0';
+    held->sent_idx = sent_idx;
+}
+
+void untrack_held_lock(ClientConnState *state, const char *filename, const char *username, int sent_idx) {
+    for (int i = 0; i < state->held_count; i++) {
+        HeldLock *held = &state->held[i];
+        if (held->sent_idx == sent_idx && strcmp(held->filename, filename) == 0 &&
+            strcmp(held->username, username) == 0) {
+            state->held[i] = state->held[--state->held_count];
+            return;
         }
+    }
+}
 
-        
-        
-        Message response;
-        init_message(&response);
-        response.type = MSG_ACK;
-        
-        log_formatted(LOG_REQUEST, "Client request: %d for file %s", msg.type, msg.filename);
-        
-        switch (msg.type) {
-            case MSG_READ: {
-                char buffer[MAX_BUFFER];
-                 response.status = read_file_ss(msg.filename, buffer);
-                if (response.status == SUCCESS) {
-                    strncpy(response.data, buffer, MAX_BUFFER - 1);
-                }
-                send_message(client_sock, &response);
+// "id@ip:port", as sent by the NM
+int parse_replica_target(const char *spec, ReplicaTarget *target) {
+    memset(target, 0, sizeof(ReplicaTarget));
+    return sscanf(spec, "%d@%15[^:]:%d", &target->ss_id, target->ip, &target->port) == 3;
+}
+
+// Replace a file's backups with a comma-separated target list; empty clears them.
+// Only a file's primary is configured, so this also ends a handoff.
+void set_replica_set(const char *filename, const char *config) {
+    ReplicaSet set;
+    memset(&set, 0, sizeof(set));
+    strncpy(set.filename, filename, MAX_FILENAME - 1);
+
+    char *list = strdup(config);
+    char *saveptr = NULL;
+    char *token = strtok_r(list, ",", &saveptr);
+    while (token && set.backup_count < MAX_BACKUPS) {
+        if (parse_replica_target(token, &set.backups[set.backup_count]) &&
+            set.backups[set.backup_count].ss_id != ss.id) {
+            set.backup_count++;
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    free(list);
+
+    pthread_mutex_lock(&replica_sets_mutex);
+    int idx = -1;
+    for (int i = 0; i < replica_set_count; i++) {
+        if (strcmp(replica_sets[i].filename, filename) == 0) {
+            idx = i;
+            break;
+        }
+    }
+
+    if (set.backup_count == 0) {
+        if (idx >= 0) replica_sets[idx] = replica_sets[--replica_set_count];
+    } else if (idx >= 0) {
+        replica_sets[idx] = set;
+    } else if (replica_set_count < MAX_FILES) {
+        replica_sets[replica_set_count++] = set;
+    } else {
+        log_formatted(LOG_ERROR, "Replica table full, %s will not be replicated", filename);
+    }
+    pthread_mutex_unlock(&replica_sets_mutex);
+
+    log_formatted(LOG_INFO, "Replica set for %s: %d backup(s)", filename, set.backup_count);
+}
+
+// Add (or remove, when `add` is 0) one backup of a file
+void update_replica_target(const char *filename, const ReplicaTarget *target, int add) {
+    pthread_mutex_lock(&replica_sets_mutex);
+
+    ReplicaSet *set = NULL;
+    for (int i = 0; i < replica_set_count; i++) {
+        if (strcmp(replica_sets[i].filename, filename) == 0) {
+            set = &replica_sets[i];
+            break;
+        }
+    }
+
+    if (!set && add && replica_set_count < MAX_FILES) {
+        set = &replica_sets[replica_set_count++];
+        memset(set, 0, sizeof(ReplicaSet));
+        strncpy(set->filename, filename, MAX_FILENAME - 1);
+    }
+
+    if (set) {
+        int found = -1;
+        for (int i = 0; i < set->backup_count; i++) {
+            if (set->backups[i].ss_id == target->ss_id) {
+                found = i;
                 break;
             }
-            
-            case MSG_LOCK_SENTENCE: {
-                /* Validate sentence index against current file content before
-                   attempting to create locks or start a write session. This
-                   prevents creating new sentence slots implicitly when the
-                   requested index is out of bounds. */
-                {
-                    char filepath[MAX_PATH];
-                    snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, msg.filename);
-                    FileContent *fc = init_file_content();
-                    int parsed = parse_file(filepath, fc);
-                    int scount = 0;
-                    if (parsed == 0) {
-                        scount = fc->sentence_count;
-                    } else {
-                        /* file missing or unreadable -> treat as empty */
-                        scount = 0;
-                    }
+        }
+        if (add && found < 0 && set->backup_count < MAX_BACKUPS) {
+            set->backups[set->backup_count++] = *target;
+        } else if (add && found >= 0) {
+            set->backups[found] = *target;
+        } else if (!add && found >= 0) {
+            set->backups[found] = set->backups[--set->backup_count];
+        }
+    }
 
-                    int invalid = 0;
-                    if (scount == 0) {
-                        if (msg.sentence_index != 0) invalid = 1;
-                    } else {
-                        /* Allow indices 0..scount, but if the client requests
-                           exactly scount (append), ensure the last sentence
-                           ends with a delimiter or explicit newline token; if
-                           not, appending a sentence isn't allowed until the
-                           user adds a delimiter. */
-                        if (msg.sentence_index < 0 || msg.sentence_index > scount) {
-                            invalid = 1;
-                        } else if (msg.sentence_index == scount) {
-                            /* check last token of last sentence */
-                            if (scount > 0) {
-                                Sentence *last_sent = &fc->sentences[scount - 1];
-                                if (last_sent->word_count == 0) {
+    pthread_mutex_unlock(&replica_sets_mutex);
+}
+
+int get_replica_targets(const char *filename, ReplicaTarget *targets) {
+    int count = 0;
+    pthread_mutex_lock(&replica_sets_mutex);
+    for (int i = 0; i < replica_set_count; i++) {
+        if (strcmp(replica_sets[i].filename, filename) == 0) {
+            count = replica_sets[i].backup_count;
+            memcpy(targets, replica_sets[i].backups, sizeof(ReplicaTarget) * count);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replica_sets_mutex);
+    return count;
+}
+
+// A backup missed an update: stop shipping to it and let the NM resync it
+void report_stale_replica(const char *filename, const ReplicaTarget *target) {
+    update_replica_target(filename, target, 0);
+
+    Message report;
+    init_message(&report);
+    report.type = MSG_REPL_STALE;
+    report.ss_id = ss.id;
+    strcpy(report.filename, filename);
+    snprintf(report.data, sizeof(report.data), "%d", target->ss_id);
+
+    pthread_mutex_lock(&hb_send_mutex);
+    send_message(ss.nm_hb_sock, &report);
+    pthread_mutex_unlock(&hb_send_mutex);
+
+    log_formatted(LOG_WARNING, "Backup SS %d of %s is stale", target->ss_id, filename);
+}
+
+int open_replica_connection(const ReplicaTarget *target) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    // The send timeout also bounds connect()
+    set_socket_timeouts(sock, SS_REPL_TIMEOUT, SS_REPL_TIMEOUT);
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(target->port);
+    inet_pton(AF_INET, target->ip, &addr.sin_addr);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int replica_exchange(int sock, int target_id, Message *request) {
+    Message response;
+    sign_replica_message(request, target_id);
+    if (!request->trace_id) request->trace_id = trace_current();
+    TraceSpan span;
+    trace_begin(&span, "call replica");
+    int failed = send_message(sock, request) < 0 || recv_message(sock, &response) < 0;
+    trace_end(&span);
+    if (failed) {
+        return -1;
+    }
+    return response.status;
+}
+
+// Send the whole file in chunks; the backup swaps it in after the last one.
+// `shipped_hash`, if given, receives the checksum of what was sent.
+int ship_full_copy(int sock, int target_id, const char *filename, unsigned long long *shipped_hash) {
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, filename);
+
+    FILE *file = fopen(filepath, "r");
+    if (!file) return ERR_FILE_NOT_FOUND;
+
+    Message chunk;
+    int status = SUCCESS;
+    unsigned long long hash = CHECKSUM_INIT;
+    for (int seq = 0; status == SUCCESS; seq++) {
+        init_message(&chunk);
+        chunk.type = MSG_REPL_PUT;
+        chunk.ss_id = ss.id;
+        strcpy(chunk.filename, filename);
+
+        size_t bytes = fread(chunk.data, 1, MAX_BUFFER - 1, file);
+        chunk.data[bytes] = '\0';
+        hash = checksum_update(hash, chunk.data, bytes);
+        chunk.sentence_index = seq;
+        chunk.word_index = (bytes < MAX_BUFFER - 1);   // Last chunk
+
+        status = replica_exchange(sock, target_id, &chunk);
+        if (chunk.word_index) break;
+    }
+
+    fclose(file);
+    if (shipped_hash) *shipped_hash = hash;
+    return status;
+}
+
+// Ship one merged commit to every in-sync backup. A backup whose copy no
+// longer matches the delta's base gets a full copy instead.
+void replicate_delta(const char *filename, unsigned long long base_hash, int base_count,
+                     int start, int replaced, Sentence *sentences, int count, int new_batch) {
+    ReplicaTarget targets[MAX_BACKUPS];
+    int target_count = get_replica_targets(filename, targets);
+    if (target_count == 0) return;
+
+    Message delta;
+    init_message(&delta);
+    delta.type = MSG_REPL_DELTA;
+    delta.ss_id = ss.id;
+    strcpy(delta.filename, filename);
+    int header = snprintf(delta.data, sizeof(delta.data), "%llx|%d|%d|%d|%d|%d|",
+                          base_hash, base_count, start, replaced, count, new_batch);
+    int encoded = encode_sentences(sentences, count, delta.data + header, sizeof(delta.data) - header);
+
+    for (int i = 0; i < target_count; i++) {
+        int status = -1;
+        int sock = open_replica_connection(&targets[i]);
+        if (sock >= 0) {
+            status = encoded >= 0 ? replica_exchange(sock, targets[i].ss_id, &delta) : ERR_REPLICA_DIVERGED;
+            if (status == ERR_REPLICA_DIVERGED) {
+                log_formatted(LOG_INFO, "Backup SS %d diverged on %s, sending full copy",
+                             targets[i].ss_id, filename);
+                status = ship_full_copy(sock, targets[i].ss_id, filename, NULL);
+            }
+            close(sock);
+        }
+
+        if (status != SUCCESS) {
+            report_stale_replica(filename, &targets[i]);
+        }
+    }
+}
+
+int is_handed_off(const char *filename) {
+    int handed_off = 0;
+    pthread_mutex_lock(&replica_sets_mutex);
+    for (int i = 0; i < replica_set_count; i++) {
+        if (strcmp(replica_sets[i].filename, filename) == 0) {
+            handed_off = replica_sets[i].handed_off;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replica_sets_mutex);
+    return handed_off;
+}
+
+void set_handed_off(const char *filename, int handed_off) {
+    pthread_mutex_lock(&replica_sets_mutex);
+    ReplicaSet *set = NULL;
+    for (int i = 0; i < replica_set_count; i++) {
+        if (strcmp(replica_sets[i].filename, filename) == 0) {
+            set = &replica_sets[i];
+            break;
+        }
+    }
+    if (!set && handed_off && replica_set_count < MAX_FILES) {
+        set = &replica_sets[replica_set_count++];
+        memset(set, 0, sizeof(ReplicaSet));
+        strncpy(set->filename, filename, MAX_FILENAME - 1);
+    }
+    if (set) set->handed_off = handed_off;
+    pthread_mutex_unlock(&replica_sets_mutex);
+}
+
+int undo_update(const char *filepath, const char *arg) {
+    (void)arg;
+    if (!undo_backup_exists(filepath)) return ERR_INVALID_OPERATION;
+    return restore_from_undo(filepath);
+}
+
+int revert_update(const char *filepath, const char *tag) {
+    return revert_to_checkpoint(filepath, tag);
+}
+
+// Apply an update that is not a sentence commit (UNDO, REVERT) under the
+// file's commit lock and push the whole file to every backup before the
+// lock is released, so a handoff cannot slip in between the two
+int update_and_replicate(const char *filename, int (*update)(const char*, const char*), const char *arg) {
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, filename);
+
+    FileCommitQueue *queue = get_commit_queue(filename);
+    if (!queue) return ERR_SERVER_ERROR;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (is_handed_off(filename)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return ERR_FILE_MOVED;
+    }
+
+    int status = update(filepath, arg);
+    if (status == SUCCESS) {
+        ReplicaTarget targets[MAX_BACKUPS];
+        int target_count = get_replica_targets(filename, targets);
+        for (int i = 0; i < target_count; i++) {
+            int shipped = -1;
+            int sock = open_replica_connection(&targets[i]);
+            if (sock >= 0) {
+                shipped = ship_full_copy(sock, targets[i].ss_id, filename, NULL);
+                close(sock);
+            }
+            if (shipped != SUCCESS) {
+                report_stale_replica(filename, &targets[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return status;
+}
+
+// Bring a stale or new backup up to date and start shipping to it. The
+// copy runs without the commit lock so writers are not held up; the lock
+// is then only held to check the backup got the current content (sending
+// it again if a commit landed meanwhile) and to add the target, so no
+// commit can slip in between the two.
+int sync_replica(const char *filename, const char *spec) {
+    ReplicaTarget target;
+    if (!parse_replica_target(spec, &target)) return ERR_INVALID_OPERATION;
+
+    FileCommitQueue *queue = get_commit_queue(filename);
+    if (!queue) return ERR_SERVER_ERROR;
+
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, filename);
+
+    int status = ERR_SS_UNAVAILABLE;
+    int caught_up = 0;
+    int sock = open_replica_connection(&target);
+    if (sock >= 0) {
+        unsigned long long shipped_hash = 0;
+        status = ship_full_copy(sock, target.ss_id, filename, &shipped_hash);
+
+        pthread_mutex_lock(&queue->mutex);
+        if (status == SUCCESS && file_checksum(filepath) != shipped_hash) {
+            // Edits committed during the copy: send the tail under the lock
+            caught_up = 1;
+            status = ship_full_copy(sock, target.ss_id, filename, NULL);
+        }
+        if (status == SUCCESS) {
+            update_replica_target(filename, &target, 1);
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        close(sock);
+    }
+
+    log_formatted(LOG_INFO, "Resync of %s to SS %d: status=%d%s", filename, target.ss_id, status,
+                 caught_up ? " (caught up on edits made during the copy)" : "");
+    return status;
+}
+
+// Give up the primary role for a file to one of its in-sync backups. Refused
+// while a sentence is locked (a write session would commit here after the
+// switch). Once handed off, new locks and UNDOs are turned away with
+// ERR_FILE_MOVED until the NM makes this SS primary again (MSG_REPL_CONFIG).
+int handoff_primary(const char *filename, const char *spec) {
+    ReplicaTarget target;
+    if (!parse_replica_target(spec, &target)) return ERR_INVALID_OPERATION;
+
+    FileCommitQueue *queue = get_commit_queue(filename);
+    if (!queue) return ERR_SERVER_ERROR;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    // The new primary must have received every commit so far
+    ReplicaTarget targets[MAX_BACKUPS];
+    int target_count = get_replica_targets(filename, targets);
+    int in_sync = 0;
+    for (int i = 0; i < target_count; i++) {
+        if (targets[i].ss_id == target.ss_id) in_sync = 1;
+    }
+
+    int status = ERR_REPLICA_DIVERGED;
+    if (in_sync) {
+        // Flag first, then look for locks: a concurrent LOCK_SENTENCE either
+        // shows up here or sees the flag
+        set_handed_off(filename, 1);
+        if (check_file_locks(filename)) {
+            set_handed_off(filename, 0);
+            status = ERR_FILE_LOCKED;
+        } else {
+            status = SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    log_formatted(LOG_INFO, "Handoff of %s to SS %d: status=%d", filename, target.ss_id, status);
+    return status;
+}
+
+// Backup side of MSG_REPL_DELTA: "base_hash|base_count|start|replaced|count|new_batch|sentences"
+int apply_replica_delta(Message *msg) {
+    unsigned long long base_hash;
+    int base_count, start, replaced, count, new_batch;
+    int consumed = 0;
+    if (sscanf(msg->data, "%llx|%d|%d|%d|%d|%d|%n", &base_hash, &base_count, &start,
+               &replaced, &count, &new_batch, &consumed) != 6 || consumed == 0) {
+        return ERR_INVALID_OPERATION;
+    }
+
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, msg->filename);
+
+    FileCommitQueue *queue = get_commit_queue(msg->filename);
+    if (!queue) return ERR_SERVER_ERROR;
+
+    pthread_mutex_lock(&queue->mutex);
+    int status = ERR_REPLICA_DIVERGED;
+    if (file_checksum(filepath) == base_hash) {
+        FileContent *fc = init_file_content();
+        parse_file(filepath, fc);
+        if (fc->sentence_count == base_count &&
+            apply_sentence_delta(fc, start, replaced, msg->data + consumed, count) == 0) {
+            if (new_batch) create_undo_backup(filepath);
+            status = write_file_content(filepath, fc) == 0 ? SUCCESS : ERR_SERVER_ERROR;
+        }
+        free_file_content(fc);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (status != SUCCESS) {
+        log_formatted(LOG_WARNING, "Delta for %s from SS %d not applied: status=%d",
+                     msg->filename, msg->ss_id, status);
+    }
+    return status;
+}
+
+// Backup side of MSG_REPL_PUT: chunks build up in "<file>.repl"
+int apply_replica_chunk(Message *msg) {
+    char filepath[MAX_PATH], temp_path[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, msg->filename);
+    snprintf(temp_path, sizeof(temp_path), "%s.repl", filepath);
+
+    FILE *file = fopen(temp_path, msg->sentence_index == 0 ? "w" : "a");
+    if (!file) return ERR_SERVER_ERROR;
+    size_t len = strlen(msg->data);
+    int ok = fwrite(msg->data, 1, len, file) == len;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) return ERR_SERVER_ERROR;
+
+    if (!msg->word_index) return SUCCESS;
+
+    FileCommitQueue *queue = get_commit_queue(msg->filename);
+    if (!queue) return ERR_SERVER_ERROR;
+
+    pthread_mutex_lock(&queue->mutex);
+    int status = rename(temp_path, filepath) == 0 ? SUCCESS : ERR_SERVER_ERROR;
+    pthread_mutex_unlock(&queue->mutex);
+
+    log_formatted(LOG_INFO, "Replaced %s with a full copy from SS %d", msg->filename, msg->ss_id);
+    return status;
+}
+
+void process_client_request(int client_sock, Message *msg, ClientConnState *state) {
+    Message response;
+    init_message(&response);
+    response.type = MSG_ACK;
+    
+    log_formatted(LOG_REQUEST, "Client request: %d for file %s", msg->type, msg->filename);
+    if (fault_active && fault_kind == FAULT_SLOW_IO) usleep(fault_delay_us);
+
+    AccessType needed = ACCESS_NONE;
+    if (msg->type == MSG_READ || msg->type == MSG_STREAM) needed = ACCESS_READ;
+    if (msg->type == MSG_LOCK_SENTENCE || msg->type == MSG_UNDO) needed = ACCESS_WRITE;
+    if (msg->type == MSG_REPL_DELTA || msg->type == MSG_REPL_PUT) needed = LEASE_ACCESS_REPLICA;
+    if (needed != ACCESS_NONE) {
+        response.status = check_route_lease(msg, needed);
+        if (response.status != SUCCESS) {
+            log_formatted(LOG_WARNING, "Refused %s on %s: no valid route lease", msg->sender, msg->filename);
+            send_message(client_sock, &response);
+            return;
+        }
+    }
+    
+    switch (msg->type) {
+        case MSG_READ: {
+            char buffer[MAX_BUFFER];
+             response.status = read_file_ss(msg->filename, buffer);
+            if (response.status == SUCCESS) {
+                strncpy(response.data, buffer, MAX_BUFFER - 1);
+            }
+            send_message(client_sock, &response);
+            break;
+        }
+        
+        case MSG_LOCK_SENTENCE: {
+            /* Validate sentence index against current file content before
+               attempting to create locks or start a write session. This
+               prevents creating new sentence slots implicitly when the
+               requested index is out of bounds. */
+            {
+                char filepath[MAX_PATH];
+                snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, msg->filename);
+                FileContent *fc = init_file_content();
+                int parsed = parse_file(filepath, fc);
+                int scount = 0;
+                if (parsed == 0) {
+                    scount = fc->sentence_count;
+                } else {
+                    /* file missing or unreadable -> treat as empty */
+                    scount = 0;
+                }
+
+                int invalid = 0;
+                if (scount == 0) {
+                    if (msg->sentence_index != 0) invalid = 1;
+                } else {
+                    /* Allow indices 0..scount, but if the client requests
+                       exactly scount (append), ensure the last sentence
+                       ends with a delimiter or explicit newline token; if
+                       not, appending a sentence isn't allowed until the
+                       user adds a delimiter. */
+                    if (msg->sentence_index < 0 || msg->sentence_index > scount) {
+                        invalid = 1;
+                    } else if (msg->sentence_index == scount) {
+                        /* check last token of last sentence */
+                        if (scount > 0) {
+                            Sentence *last_sent = &fc->sentences[scount - 1];
+                            if (last_sent->word_count == 0) {
+                                invalid = 1;
+                            } else {
+                                char *last_word = last_sent->words[last_sent->word_count - 1];
+                                int is_nl = (last_word[0] == '\n' && last_word[1] == '\0');
+                                if (!(is_delimiter(last_word[0]) || is_nl)) {
                                     invalid = 1;
-                                } else {
-                                    char *last_word = last_sent->words[last_sent->word_count - 1];
-                                    int is_nl = (last_word[0] == '\n' && last_word[1] == '\0');
-                                    if (!(is_delimiter(last_word[0]) || is_nl)) {
-                                        invalid = 1;
-                                    }
                                 }
-                            } else {
-                                invalid = 1;
                             }
+                        } else {
+                            invalid = 1;
                         }
                     }
-
-                    free_file_content(fc);
-
-                    if (invalid) {
-                        response.status = ERR_INVALID_INDEX;
-                        send_message(client_sock, &response);
-                        break;
-                    }
                 }
 
-                response.status = lock_sentence_ss(msg.filename, msg.sentence_index, msg.sender);
+                free_file_content(fc);
 
-                if (response.status == SUCCESS) {
-                    int session_status = start_write_session_ss(msg.filename, msg.sender, msg.sentence_index);
-                    if (session_status != SUCCESS) {
-                        // Failed to create session, unlock
-                        unlock_sentence_ss(msg.filename, msg.sentence_index, msg.sender);
-                        response.status = session_status;
-                        log_formatted(LOG_ERROR, "Failed to start write session, unlocking");
-                    } else {
-                        log_formatted(LOG_INFO, "Lock acquired and write session started");
-                    }
+                if (invalid) {
+                    response.status = ERR_INVALID_INDEX;
+                    send_message(client_sock, &response);
+                    break;
                 }
-                send_message(client_sock, &response);
-                break;
             }
-            
-            case MSG_WRITE: {
-                response.status = write_file_ss(msg.filename, msg.sender, msg.sentence_index, 
-                                               msg.word_index, msg.data);
-                send_message(client_sock, &response);
-                break;
+
+            TraceSpan span;
+            trace_begin(&span, "lock sentence");
+            response.status = lock_sentence_ss(msg->filename, msg->sentence_index, msg->sender);
+            trace_end(&span);
+
+            if (response.status == SUCCESS && is_handed_off(msg->filename)) {
+                unlock_sentence_ss(msg->filename, msg->sentence_index, msg->sender);
+                response.status = ERR_FILE_MOVED;
             }
-            
-            case MSG_UNLOCK_SENTENCE: {
-                int commit_status = commit_write_session_ss(msg.filename, msg.sender, msg.sentence_index);
 
-                if(commit_status == SUCCESS) {
-                    response.status = unlock_sentence_ss(msg.filename, msg.sentence_index, msg.sender);
-                    log_formatted(LOG_INFO, "Write commited and sentence unlocked");
-                }
-                else {
-                    response.status = commit_status;
-                    unlock_sentence_ss(msg.filename, msg.sentence_index, msg.sender);
-                    log_formatted(LOG_ERROR, "Commit failed but sentence unlocked");
+            if (response.status == SUCCESS) {
+                // Copies the whole file, so it grows with the document
+                trace_begin(&span, "copy to temp file");
+                int session_status = start_write_session_ss(msg->filename, msg->sender, msg->sentence_index);
+                trace_end(&span);
+                if (session_status != SUCCESS) {
+                    // Failed to create session, unlock
+                    unlock_sentence_ss(msg->filename, msg->sentence_index, msg->sender);
+                    response.status = session_status;
+                    log_formatted(LOG_ERROR, "Failed to start write session, unlocking");
+                } else {
+                    track_held_lock(state, msg->filename, msg->sender, msg->sentence_index);
+                    log_formatted(LOG_INFO, "Lock acquired and write session started");
                 }
-                //response.status = unlock_sentence_ss(msg.filename, msg.sentence_index, msg.sender);
-                send_message(client_sock, &response);
-                break;
             }
+            send_message(client_sock, &response);
+            break;
+        }
+        
+        case MSG_WRITE: {
+            response.status = write_file_ss(msg->filename, msg->sender, msg->sentence_index, 
+                                           msg->word_index, msg->data);
+            send_message(client_sock, &response);
+            break;
+        }
+        
+        case MSG_UNLOCK_SENTENCE: {
+            int commit_status = commit_write_session_ss(msg->filename, msg->sender, msg->sentence_index);
+            untrack_held_lock(state, msg->filename, msg->sender, msg->sentence_index);
 
-            case MSG_CANCEL_WRITE: {
-                cancel_write_session_ss(msg.filename, msg.sender, msg.sentence_index);
-                response.status = unlock_sentence_ss(msg.filename, msg.sentence_index, msg.sender);
-                send_message(client_sock, &response);
-                break;
+            if(commit_status == SUCCESS) {
+                response.status = unlock_sentence_ss(msg->filename, msg->sentence_index, msg->sender);
+                log_formatted(LOG_INFO, "Write commited and sentence unlocked");
             }
-            
-            
-            case MSG_STREAM: {
-                response.status = SUCCESS;
-                send_message(client_sock, &response);
-                stream_file_ss(client_sock, msg.filename);
-                break;
+            else {
+                response.status = commit_status;
+                unlock_sentence_ss(msg->filename, msg->sentence_index, msg->sender);
+                log_formatted(LOG_ERROR, "Commit failed but sentence unlocked");
             }
-            
-            case MSG_UNDO: {
-                char filepath[MAX_PATH];
-                snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, msg.filename);
-                
-                if (undo_backup_exists(filepath)) {
-                    //printf("[SS DEBUG] Undo backup exists for %s\n", filepath); // Debug line - N
-                    response.status = restore_from_undo(filepath);
-                } else {
-                    //printf("[SS DEBUG] No undo backup for %s\n", filepath); // Debug line - N
-                    response.status = ERR_INVALID_OPERATION;
-                }
-                send_message(client_sock, &response);
-                break;
-            }
-            
-            default:
-                response.status = ERR_INVALID_OPERATION;
-                send_message(client_sock, &response);
-                break;
+            //response.status = unlock_sentence_ss(msg->filename, msg->sentence_index, msg->sender);
+            send_message(client_sock, &response);
+            break;
+        }
+
+        case MSG_CANCEL_WRITE: {
+            cancel_write_session_ss(msg->filename, msg->sender, msg->sentence_index);
+            untrack_held_lock(state, msg->filename, msg->sender, msg->sentence_index);
+            response.status = unlock_sentence_ss(msg->filename, msg->sentence_index, msg->sender);
+            send_message(client_sock, &response);
+            break;
+        }
+        
+        
+        case MSG_STREAM: {
+            response.status = SUCCESS;
+            send_message(client_sock, &response);
+            stream_file_ss(client_sock, msg->filename);
+            break;
+        }
+        
+        case MSG_UNDO: {
+            response.status = update_and_replicate(msg->filename, undo_update, NULL);
+            send_message(client_sock, &response);
+            break;
         }
         
-        log_formatted(LOG_RESPONSE, "Response status: %d", response.status);
+        case MSG_REPL_DELTA:
+            response.status = apply_replica_delta(msg);
+            send_message(client_sock, &response);
+            break;
+
+        case MSG_REPL_PUT:
+            response.status = apply_replica_chunk(msg);
+            send_message(client_sock, &response);
+            break;
+
+        case MSG_STATS:
+            response.status = SUCCESS;
+            stats_summary(response.data, sizeof(response.data));
+            send_message(client_sock, &response);
+            break;
+        
+        default:
+            response.status = ERR_INVALID_OPERATION;
+            send_message(client_sock, &response);
+            break;
     }
     
-    close(client_sock);
-    return NULL;
+    log_formatted(LOG_RESPONSE, "Response status: %d", response.status);
+}
+
+// STREAMs hold a worker for the whole file, so they get their own lane.
+// Replication gets one too: a primary ships while holding a commit, and two
+// servers shipping to each other must not wait on each other's short lane.
+int select_client_lane(int msg_type) {
+    if (msg_type == MSG_STREAM) return SS_LANE_STREAM;
+    if (msg_type == MSG_REPL_DELTA || msg_type == MSG_REPL_PUT) return SS_LANE_REPL;
+    return SS_LANE_SHORT;
+}
+
+// Count a served request; STREAM latency is dominated by its pacing, so it
+// only counts towards the request rate
+void record_request_load(int msg_type, double elapsed_ms) {
+    pthread_mutex_lock(&load_stats.mutex);
+    load_stats.requests++;
+    if (msg_type != MSG_STREAM) {
+        if (load_stats.sample_count < SS_LATENCY_SAMPLES) {
+            load_stats.latency_ms[load_stats.sample_count++] = elapsed_ms;
+        } else {
+            load_stats.latency_ms[load_stats.requests % SS_LATENCY_SAMPLES] = elapsed_ms;
+        }
+    }
+    pthread_mutex_unlock(&load_stats.mutex);
+}
+
+int compare_latency(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Request rate and p99 latency since the last call, then start a new interval
+void take_request_load(double *rate, double *p99_ms) {
+    double samples[SS_LATENCY_SAMPLES];
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&load_stats.mutex);
+    double elapsed = (now.tv_sec - load_stats.since.tv_sec) +
+                     (now.tv_usec - load_stats.since.tv_usec) / 1000000.0;
+    long requests = load_stats.requests;
+    int count = load_stats.sample_count;
+    memcpy(samples, load_stats.latency_ms, sizeof(double) * count);
+    load_stats.requests = 0;
+    load_stats.sample_count = 0;
+    load_stats.since = now;
+    pthread_mutex_unlock(&load_stats.mutex);
+
+    *rate = elapsed > 0 ? requests / elapsed : 0.0;
+    *p99_ms = 0.0;
+    if (count > 0) {
+        qsort(samples, count, sizeof(double), compare_latency);
+        *p99_ms = samples[(int)(count * 0.99)];
+    }
+}
+
+// Files and bytes held, counted the same way as at registration
+void scan_storage_usage(int *file_count, long long *bytes_used) {
+    *file_count = 0;
+    *bytes_used = 0;
+
+    DIR *dir = opendir(ss.storage_path);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || strstr(entry->d_name, ".undo") != NULL ||
+            strstr(entry->d_name, ".repl") != NULL) continue;
+
+        char filepath[MAX_PATH];
+        snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, entry->d_name);
+
+        struct stat st;
+        if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode)) {
+            (*file_count)++;
+            *bytes_used += st.st_size;
+        }
+    }
+    closedir(dir);
+}
+
+int count_held_locks() {
+    int held = 0;
+    MUTEX_LOCK(&ss.locks_mutex, &locks_lock_stats);
+    for (int i = 0; i < ss.file_lock_count; i++) {
+        for (int j = 0; j < ss.file_locks[i].lock_count; j++) {
+            SentenceLock *lock = &ss.file_locks[i].locks[j];
+            pthread_mutex_lock(&lock->mutex);
+            held += lock->locked;
+            pthread_mutex_unlock(&lock->mutex);
+        }
+    }
+    MUTEX_UNLOCK(&ss.locks_mutex, &locks_lock_stats);
+    return held;
+}
+
+static long held_locks(void) {
+    return count_held_locks();
+}
+
+static long active_write_sessions(void) {
+    MUTEX_LOCK(&write_sessions_mutex, &write_sessions_lock_stats);
+    long count = write_session_count;
+    MUTEX_UNLOCK(&write_sessions_mutex, &write_sessions_lock_stats);
+    return count;
+}
+
+// Commits waiting in every file's queue
+static long commit_queue_depth(void) {
+    long depth = 0;
+    MUTEX_LOCK(&commit_queues_mutex, &commit_queues_lock_stats);
+    int count = commit_queue_count;
+    MUTEX_UNLOCK(&commit_queues_mutex, &commit_queues_lock_stats);
+    // Queues are never removed, so the first `count` stay valid
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&commit_queues[i].mutex);
+        for (CommitQueueEntry *entry = commit_queues[i].head; entry; entry = entry->next) depth++;
+        pthread_mutex_unlock(&commit_queues[i].mutex);
+    }
+    return depth;
+}
+
+// Heartbeat payload: "HEARTBEAT|files|bytes|req_rate|p99_ms|locks|draining"
+void build_heartbeat(char *data, size_t size) {
+    int file_count;
+    long long bytes_used;
+    double rate, p99_ms;
+
+    scan_storage_usage(&file_count, &bytes_used);
+    take_request_load(&rate, &p99_ms);
+    snprintf(data, size, "HEARTBEAT|%d|%lld|%.2f|%.3f|%d|%d",
+             file_count, bytes_used, rate, p99_ms, count_held_locks(), (int)draining);
+}
+
+int on_client_frame(Connection *conn, Message *msg) {
+    if (!conn->ctx) {
+        conn->ctx = calloc(1, sizeof(ClientConnState));
+        ((ClientConnState*)conn->ctx)->capture_id = capture_session();
+    }
+
+    // Replication traffic from other servers is not client load
+    int msg_type = msg->type;
+    if (msg_type < MSG_REPL_CONFIG || msg_type > MSG_REPL_HANDOFF) {
+        capture_message(((ClientConnState*)conn->ctx)->capture_id, msg);
+    }
+    struct timeval start, end;
+    StatsTimer timer;
+    TraceSpan span;
+    stats_begin(conn->frame_len + (int)sizeof(int), &timer);
+    trace_set_current(msg->trace_id);
+    trace_received(msg->trace_id, conn->queued_us, conn->dequeued_us);
+    trace_begin(&span, message_type_name(msg_type));
+    gettimeofday(&start, NULL);
+    process_client_request(conn->fd, msg, conn->ctx);
+    gettimeofday(&end, NULL);
+    trace_end(&span);
+    trace_set_current(0);
+    stats_end(msg_type, &timer);
+    record_request_load(msg_type, (end.tv_sec - start.tv_sec) * 1000.0 +
+                                  (end.tv_usec - start.tv_usec) / 1000.0);
+    return ss.running ? REACTOR_KEEP : REACTOR_CLOSE;
+}
+
+// Clean teardown: abandon any write the client left open
+void on_client_close(Connection *conn) {
+    ClientConnState *state = conn->ctx;
+    if (!state) return;
+    capture_end(state->capture_id);
+
+    for (int i = 0; i < state->held_count; i++) {
+        HeldLock *held = &state->held[i];
+        cancel_write_session_ss(held->filename, held->username, held->sent_idx);
+        unlock_sentence_ss(held->filename, held->sent_idx, held->username);
+        log_formatted(LOG_WARNING, "Client %s disconnected mid-write, released %s sentence %d",
+                      held->username, held->filename, held->sent_idx);
+    }
+
+    free(state);
+    conn->ctx = NULL;
 }
 
 void* client_listener(void* arg) {
     (void)arg;
 
-    ss.client_sock = socket(AF_INET, SOCK_STREAM, 0);
+    ss.client_sock = reactor_listen(client_reactor, ss.client_port, 0, on_client_frame, on_client_close);
     if (ss.client_sock < 0) {
-        perror("Client socket creation failed");
-        return NULL;
-    }
-    
-    int opt = 1;
-    setsockopt(ss.client_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(ss.client_port);
-    
-    if (bind(ss.client_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("Client socket bind failed");
         return NULL;
     }
     
-    if (listen(ss.client_sock, MAX_CLIENTS) < 0) {
-        perror("Client socket listen failed");
-        return NULL;
-    }
-    
     printf("[SS %d] Listening for clients on port %d\n", ss.id, ss.client_port);
     log_formatted(LOG_INFO, "Client listener started on port %d", ss.client_port);
-    
-    while (ss.running) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-        
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = accept(ss.client_sock, (struct sockaddr*)&client_addr, &addr_len);
-        
-        if (*client_sock < 0) {
-            free(client_sock);
-            continue;
-        }
-        
-        log_formatted(LOG_INFO, "Client connected from %s", inet_ntoa(client_addr.sin_addr));
-        
-        pthread_t tid;
-        pthread_create(&tid, NULL, handle_client_request, client_sock);
-        pthread_detach(tid);
-    }
-    
+
+    reactor_run(client_reactor);
     return NULL;
 }
 
 // Heavily edited - N
 void* handle_nm_communication(void* arg) {
-    (void)arg;
+    // NULL selects the registration socket; pool connections pass their own
+    int nm_sock = ss.nm_sock;
+    int is_primary = 1;
+    if (arg) {
+        nm_sock = *((int*)arg);
+        free(arg);
+        is_primary = 0;
+    }
+    pthread_mutex_lock(&nm_state_mutex);
+    int generation = nm_generation;
+    pthread_mutex_unlock(&nm_state_mutex);
+
     Message msg;
     
     // Set a reasonable timeout so we don't block forever
     struct timeval tv;
     tv.tv_sec = 30;  // 1 second timeout for receives
     tv.tv_usec = 0;
-    setsockopt(ss.nm_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(nm_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     
     log_formatted(LOG_INFO, "NM communication thread started");
     
     while (ss.running) {
-        int recv_result = recv_message(ss.nm_sock, &msg);
+        errno = 0;   // A closed connection leaves errno alone; don't mistake it for a timeout
+        int recv_result = recv_message(nm_sock, &msg);
         
         if (recv_result < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -1380,8 +2257,12 @@ void* handle_nm_communication(void* arg) {
                 continue;
             }
             
+            if (!is_primary) {
+                log_formatted(LOG_WARNING, "NM closed a pooled command connection (errno: %d)", errno);
+                break;
+            }
             log_formatted(LOG_ERROR, "Lost connection to NM (errno: %d)", errno);
-            ss.running = 0;
+            nm_connection_lost(generation);
             break;
         }
         
@@ -1392,6 +2273,9 @@ void* handle_nm_communication(void* arg) {
         response.ss_id = ss.id;
         
         log_formatted(LOG_REQUEST, "NM request: type=%d, file=%s", msg.type, msg.filename);
+        TraceSpan span;
+        trace_set_current(msg.trace_id);
+        trace_begin(&span, message_type_name(msg.type));
         
         switch (msg.type) {
             case MSG_CHECK_LOCKS: {
@@ -1431,9 +2315,7 @@ void* handle_nm_communication(void* arg) {
             }
             
             case MSG_REVERT: {
-                char filepath[MAX_PATH];
-                snprintf(filepath, sizeof(filepath), "%s/%s", ss.storage_path, msg.filename);
-                response.status = revert_to_checkpoint(filepath, msg.checkpoint_tag);
+                response.status = update_and_replicate(msg.filename, revert_update, msg.checkpoint_tag);
                 log_formatted(LOG_INFO, "REVERT %s to tag=%s: status=%d", 
                              msg.filename, msg.checkpoint_tag, response.status);
                 break;
@@ -1457,9 +2339,23 @@ void* handle_nm_communication(void* arg) {
                 
             case MSG_DELETE:
                 response.status = delete_file_ss(msg.filename);
+                set_replica_set(msg.filename, "");
                 log_formatted(LOG_INFO, "DELETE %s: status=%d", msg.filename, response.status);
                 break;
                 
+            case MSG_REPL_CONFIG:
+                set_replica_set(msg.filename, msg.data);
+                response.status = SUCCESS;
+                break;
+
+            case MSG_REPL_SYNC:
+                response.status = sync_replica(msg.filename, msg.data);
+                break;
+
+            case MSG_REPL_HANDOFF:
+                response.status = handoff_primary(msg.filename, msg.data);
+                break;
+
             case MSG_SS_INFO: {
                 FileMetadata meta;
                 memset(&meta, 0, sizeof(FileMetadata));
@@ -1499,13 +2395,16 @@ void* handle_nm_communication(void* arg) {
         }
         
         // NEW: No mutex needed, dedicated socket
-        int send_result = send_message(ss.nm_sock, &response);
+        int send_result = send_message(nm_sock, &response);
+        trace_end(&span);
+        trace_set_current(0);
         
         if (send_result < 0) {
             log_formatted(LOG_ERROR, "Failed to send response to NM (errno: %d)", errno);
             if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN) {
-                log_formatted(LOG_ERROR, "Connection to NM broken, shutting down");
-                ss.running = 0;
+                if (!is_primary) break;
+                log_formatted(LOG_ERROR, "Connection to NM broken");
+                nm_connection_lost(generation);
                 break;
             }
         } else {
@@ -1513,51 +2412,87 @@ void* handle_nm_communication(void* arg) {
         }
     }
     
+    close(nm_sock);
     log_formatted(LOG_INFO, "NM communication thread exiting");
     return NULL;
 }
 
 // Edited to handle heartbeat socket, checking alive connections and closing if they are not - N
-void* heartbeat_thread(void* arg) {
-    (void)arg;
-    
-    log_formatted(LOG_INFO, "Heartbeat thread started");
-    
+void send_heartbeat_hello() {
     // Send initial identification on heartbeat socket - N
     Message ident;
     init_message(&ident);
     ident.type = MSG_ACK;
     ident.ss_id = ss.id;
     strcpy(ident.data, "HB_INIT");
-    send_message(ss.nm_hb_sock, &ident);
 
     Message msg;
     init_message(&msg);
     msg.type = MSG_ACK;
     msg.ss_id = ss.id;
-    strcpy(msg.data, "HEARTBEAT");
+    build_heartbeat(msg.data, sizeof(msg.data));
+
+    pthread_mutex_lock(&hb_send_mutex);
+    send_message(ss.nm_hb_sock, &ident);
     send_message(ss.nm_hb_sock, &msg);
+    pthread_mutex_unlock(&hb_send_mutex);
+}
+
+// Edited to handle heartbeat socket, checking alive connections and closing if they are not - N
+void* heartbeat_thread(void* arg) {
+    (void)arg;
+    
+    log_formatted(LOG_INFO, "Heartbeat thread started");
+    send_heartbeat_hello();
     
+    sigset_t drain_signal;
+    sigemptyset(&drain_signal);
+    sigaddset(&drain_signal, SIGUSR1);
+    sigaddset(&drain_signal, SIGUSR2);
+
     while (ss.running) {
-        sleep(HEARTBEAT_INTERVAL);
+        // SIGUSR1 cuts the wait short so the NM hears about draining at once
+        struct timespec interval = { heartbeat_ms / 1000, (heartbeat_ms % 1000) * 1000000L };
+        int signo = sigtimedwait(&drain_signal, NULL, &interval);
+        if (signo == SIGUSR1) {
+            draining = !draining;
+            log_formatted(LOG_INFO, "Draining %s", draining ? "started" : "stopped");
+            printf("[SS %d] Draining %s\n", ss.id, draining ? "started" : "stopped");
+        } else if (signo == SIGUSR2 && fault_kind == FAULT_DROP_HEARTBEAT) {
+            // As if the connection had been reset: the main thread registers again
+            log_formatted(LOG_WARNING, "Fault injection: dropping the heartbeat channel");
+            pthread_mutex_lock(&hb_send_mutex);
+            int generation = nm_generation;
+            shutdown(ss.nm_hb_sock, SHUT_RDWR);
+            pthread_mutex_unlock(&hb_send_mutex);
+            nm_connection_lost(generation);
+            continue;
+        } else if (signo == SIGUSR2 && fault_kind == FAULT_SLOW_IO) {
+            fault_active = !fault_active;
+            log_formatted(LOG_WARNING, "Fault injection: slow I/O (%d us per request) %s",
+                          fault_delay_us, fault_active ? "on" : "off");
+        }
         
         Message msg;
         init_message(&msg);
         msg.type = MSG_ACK;
         msg.ss_id = ss.id;
-        strcpy(msg.data, "HEARTBEAT");
+        build_heartbeat(msg.data, sizeof(msg.data));
         
         log_formatted(LOG_DEBUG, "Sending heartbeat to NM");
         
-        // Use heartbeat socket, no mutex needed - N
+        // Use heartbeat socket; stale-replica reports share it
+        pthread_mutex_lock(&hb_send_mutex);
+        int generation = nm_generation;
         int result = send_message(ss.nm_hb_sock, &msg);
+        pthread_mutex_unlock(&hb_send_mutex);
         
-        // Kill off the connection if we get errors indicating it's dead - N
+        // A dead connection means the NM went away; the main thread reconnects - N
         if (result < 0) {
             if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN) {
                 log_formatted(LOG_ERROR, "Connection lost to NM (errno: %d)", errno);
-                ss.running = 0;
-                break;
+                nm_connection_lost(generation);
+                continue;
             }
             log_formatted(LOG_WARNING, "Heartbeat send failed (errno: %d), will retry", errno);
         } else {
@@ -1569,6 +2504,96 @@ void* heartbeat_thread(void* arg) {
     return NULL;
 }
 
+void nm_connection_lost(int generation) {
+    pthread_mutex_lock(&nm_state_mutex);
+    if (generation == nm_generation && nm_connected) {
+        nm_connected = 0;
+        pthread_cond_broadcast(&nm_state_cond);
+    }
+    pthread_mutex_unlock(&nm_state_mutex);
+}
+
+int nm_session_alive() {
+    pthread_mutex_lock(&nm_state_mutex);
+    int alive = nm_connected;
+    pthread_mutex_unlock(&nm_state_mutex);
+    return alive;
+}
+
+// Register over fresh sockets, then start the command threads: the one on
+// the registration socket, plus extra connections for the NM's pool
+int start_nm_session(const char *nm_ip, int nm_port) {
+    if (connect_to_nm(nm_ip, nm_port) < 0) return -1;
+    scan_and_register_files();
+
+    // Leases from an earlier NM stop verifying; the pool brings the new key
+    set_lease_key("");
+
+    pthread_mutex_lock(&nm_state_mutex);
+    pthread_mutex_lock(&hb_send_mutex);
+    nm_generation++;
+    pthread_mutex_unlock(&hb_send_mutex);
+    nm_connected = 1;
+    pthread_mutex_unlock(&nm_state_mutex);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, handle_nm_communication, NULL) != 0) {
+        log_formatted(LOG_ERROR, "Failed to create NM thread");
+        return -1;
+    }
+    pthread_detach(tid);
+    
+    // Extra command connections let the NM run commands for this SS in parallel
+    int pool_size = get_env_int("SS_NM_CONNECTIONS", SS_NM_POOL_SIZE);
+    for (int i = 1; i < pool_size; i++) {
+        int sock = open_nm_pool_connection(nm_ip, nm_port);
+        if (sock < 0) {
+            log_formatted(LOG_WARNING, "Could not open NM command connection %d of %d", i + 1, pool_size);
+            break;
+        }
+
+        int *arg = malloc(sizeof(int));
+        *arg = sock;
+        pthread_create(&tid, NULL, handle_nm_communication, arg);
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+// Runs on the main thread: whenever the NM connection is lost, register
+// again, trying the configured NM and NM_STANDBY_IP in turn with a growing,
+// jittered pause between attempts
+void maintain_nm_connection(const char *nm_ip, int nm_port) {
+    while (ss.running) {
+        pthread_mutex_lock(&nm_state_mutex);
+        while (nm_connected && ss.running) {
+            pthread_cond_wait(&nm_state_cond, &nm_state_mutex);
+        }
+        pthread_mutex_unlock(&nm_state_mutex);
+        if (!ss.running) break;
+
+        printf("[SS %d] Lost the Name Server; reconnecting\n", ss.id);
+        log_formatted(LOG_WARNING, "Lost the NM; reconnecting");
+        // Wakes the command thread still reading the old socket
+        shutdown(ss.nm_sock, SHUT_RDWR);
+
+        struct timeval start, now;
+        gettimeofday(&start, NULL);
+        for (int attempt = 0; ss.running; attempt++) {
+            const char *ip = nm_failover_ip(nm_ip, attempt);
+            if (start_nm_session(ip, nm_port) == 0) {
+                send_heartbeat_hello();
+                gettimeofday(&now, NULL);
+                double ms = (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+                printf("[SS %d] Registered again with %s after %.0f ms\n", ss.id, ip, ms);
+                log_formatted(LOG_INFO, "Registered again with NM %s after %.0f ms", ip, ms);
+                break;
+            }
+            usleep(nm_retry_delay_ms(attempt, SS_NM_RETRY_MS, SS_NM_RETRY_MAX_MS) * 1000);
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 5) {
         printf("Usage: %s <nm_ip> <nm_port> <client_port> <dir_name>\n", argv[0]);
@@ -1596,24 +2621,72 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    // Warn if not using standard ports (helpful for debugging)
-    if (nm_port != NM_SS_PORT) {
+    // Warn if not using standard ports (helpful for debugging); each name
+    // server shard has its own, and an SS serves the shard it registers with
+    int shard_offset = nm_port - NM_SS_PORT;
+    if (shard_offset < 0 || shard_offset % NM_SHARD_PORT_STRIDE != 0 ||
+        shard_offset / NM_SHARD_PORT_STRIDE >= MAX_NM_SHARDS) {
         printf("[SS] Warning: Connecting to NM on non-standard port %d (expected %d)\n", 
                nm_port, NM_SS_PORT);
     }
     
+    // Every thread inherits the mask; the heartbeat thread waits for them
+    sigset_t drain_signal;
+    sigemptyset(&drain_signal);
+    sigaddset(&drain_signal, SIGUSR1);
+    sigaddset(&drain_signal, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &drain_signal, NULL);
+
     init_storage_server(nm_ip, nm_port, client_port, ss_id);
-    connect_to_nm(nm_ip, nm_port);
-    scan_and_register_files();
-    
-    pthread_t nm_thread, client_thread, hb_thread;
+    gettimeofday(&load_stats.since, NULL);
+    stream_delay_us = get_env_int("SS_STREAM_DELAY_US", STREAM_DELAY);
+    heartbeat_ms = get_env_int("SS_HEARTBEAT_MS", HEARTBEAT_INTERVAL_MS);
+    if (heartbeat_ms < 1) heartbeat_ms = 1;
+    const char *fault = getenv("SS_FAULT");
+    if (fault && strcmp(fault, "drop-heartbeat") == 0) {
+        fault_kind = FAULT_DROP_HEARTBEAT;
+    } else if (fault && sscanf(fault, "slow-io:%d", &fault_delay_us) == 1 && fault_delay_us > 0) {
+        fault_kind = FAULT_SLOW_IO;
+    } else if (fault && *fault) {
+        log_formatted(LOG_WARNING, "Unknown SS_FAULT '%s' ignored", fault);
+    }
+    const char *capture_path = getenv("SS_CAPTURE");
+    if (capture_path && *capture_path) capture_open(capture_path, CAPTURE_SS, ss_id);
+    stats_init("ss", ss_id);
+    char trace_name[32];
+    snprintf(trace_name, sizeof(trace_name), "ss %d", ss_id);
+    trace_init(trace_name);
+    lock_stats_init();
+    stats_register("docs_commit_queue_depth", "gauge", "Commits queued or being applied", commit_queue_depth);
+    stats_register("docs_write_sessions_active", "gauge", "Open write sessions", active_write_sessions);
+    stats_register("docs_sentence_locks_held", "gauge", "Sentence locks currently held", held_locks);
+    int metrics_port = get_env_int("SS_METRICS_PORT", 0);
+    if (metrics_port > 0) {
+        // One base port for a whole host: each server adds its id
+        metrics_port += ss_id;
+        if (stats_serve(metrics_port) == 0) {
+            printf("[SS %d] Serving metrics on 127.0.0.1:%d\n", ss_id, metrics_port);
+        } else {
+            log_formatted(LOG_WARNING, "Cannot serve metrics on port %d", metrics_port);
+        }
+    }
     
-    // Robust checking - N
-    if (pthread_create(&nm_thread, NULL, handle_nm_communication, NULL) != 0) {
-        log_formatted(LOG_ERROR, "Failed to create NM thread");
+    client_reactor = reactor_create(get_env_int("SS_WORKERS", 0));
+    if (!client_reactor ||
+        reactor_add_lane(client_reactor, get_env_int("SS_STREAM_WORKERS", SS_STREAM_WORKERS)) != SS_LANE_STREAM ||
+        reactor_add_lane(client_reactor, get_env_int("SS_REPL_WORKERS", SS_REPL_WORKERS)) != SS_LANE_REPL) {
+        log_formatted(LOG_ERROR, "Failed to create client reactor");
         return 1;
     }
+    reactor_set_lane_selector(client_reactor, select_client_lane);
+
+    pthread_t client_thread, hb_thread;
     
+    if (start_nm_session(nm_ip, nm_port) < 0) {
+        perror("Connection to NM failed");
+        return 1;
+    }
+
     if (pthread_create(&client_thread, NULL, client_listener, NULL) != 0) {
         log_formatted(LOG_ERROR, "Failed to create client thread");
         return 1;
@@ -1630,13 +2703,15 @@ int main(int argc, char *argv[]) {
     printf("[SS %d] Storage Server running. Press Ctrl+C to stop.\n", ss.id);
     log_formatted(LOG_INFO, "All threads started successfully");
     
-    pthread_join(nm_thread, NULL);
+    maintain_nm_connection(nm_ip, nm_port);
+    reactor_stop(client_reactor);
     pthread_join(client_thread, NULL);
     pthread_join(hb_thread, NULL);
     
-    close(ss.nm_sock);
     close(ss.nm_hb_sock);
     close(ss.client_sock);
+    capture_close();
+    lock_stats_log();
     close_logger();
     
     return 0;
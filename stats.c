@@ -0,0 +1,311 @@
+#include "stats.h"
+#include "lock_stats.h"
+#include "logger.h"
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[STATS_BUCKETS];
+} OpCounters;
+
+// One thread's counters; written only by that thread
+typedef struct StatsShard {
+    OpCounters ops[MSG_TYPE_COUNT];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    struct StatsShard *next;
+} StatsShard;
+
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    long (*read)(void);
+} Probe;
+
+static StatsShard *shards = NULL;           // Pushed without a lock, never removed
+static __thread StatsShard *my_shard = NULL;
+static __thread int reply_status = SUCCESS;
+
+static const char *stats_role = "server";
+static int stats_id = 0;
+static time_t stats_started = 0;
+
+static pthread_mutex_t probes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Probe probes[STATS_MAX_PROBES];
+static int probe_count = 0;
+
+// Single-writer updates: a plain load and store, atomic only so that a
+// concurrent reader never sees a torn value
+#define SHARD_ADD(field, value) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (value), __ATOMIC_RELAXED)
+#define SHARD_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static StatsShard* shard() {
+    if (!my_shard) {
+        StatsShard *s = calloc(1, sizeof(StatsShard));
+        if (!s) return NULL;
+        s->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&shards, &s->next, s, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        my_shard = s;
+    }
+    return my_shard;
+}
+
+static void on_frame_sent(const Message *msg, int frame_bytes) {
+    StatsShard *s = shard();
+    if (!s) return;
+    SHARD_ADD(s->bytes_out, frame_bytes);
+    reply_status = msg->status;
+}
+
+void stats_init(const char *role, int id) {
+    stats_role = role;
+    stats_id = id;
+    stats_started = time(NULL);
+    send_message_hook = on_frame_sent;
+}
+
+void stats_register(const char *name, const char *type, const char *help, long (*read)(void)) {
+    pthread_mutex_lock(&probes_mutex);
+    if (probe_count < STATS_MAX_PROBES) {
+        probes[probe_count++] = (Probe){ name, type, help, read };
+    }
+    pthread_mutex_unlock(&probes_mutex);
+}
+
+void stats_begin(int frame_bytes, StatsTimer *timer) {
+    StatsShard *s = shard();
+    if (s) SHARD_ADD(s->bytes_in, frame_bytes);
+    reply_status = SUCCESS;
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+void stats_end(int msg_type, const StatsTimer *timer) {
+    StatsShard *s = shard();
+    if (!s || msg_type < 0 || msg_type >= MSG_TYPE_COUNT) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t us = (now.tv_sec - timer->start.tv_sec) * 1000000LL + (now.tv_nsec - timer->start.tv_nsec) / 1000;
+    if (us < 0) us = 0;
+
+    OpCounters *op = &s->ops[msg_type];
+    SHARD_ADD(op->count, 1);
+    if (reply_status != SUCCESS) SHARD_ADD(op->errors, 1);
+    SHARD_ADD(op->sum_us, us);
+    if ((uint64_t)us > SHARD_READ(op->max_us)) __atomic_store_n(&op->max_us, us, __ATOMIC_RELAXED);
+    SHARD_ADD(op->buckets[stats_bucket_index(us)], 1);
+}
+
+// All shards added up
+static void collect(OpCounters *ops, uint64_t *bytes_in, uint64_t *bytes_out) {
+    memset(ops, 0, sizeof(OpCounters) * MSG_TYPE_COUNT);
+    *bytes_in = *bytes_out = 0;
+    for (StatsShard *s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+        *bytes_in += SHARD_READ(s->bytes_in);
+        *bytes_out += SHARD_READ(s->bytes_out);
+        for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+            OpCounters *from = &s->ops[t], *into = &ops[t];
+            into->count += SHARD_READ(from->count);
+            into->errors += SHARD_READ(from->errors);
+            into->sum_us += SHARD_READ(from->sum_us);
+            uint64_t max = SHARD_READ(from->max_us);
+            if (max > into->max_us) into->max_us = max;
+            for (int b = 0; b < STATS_BUCKETS; b++) into->buckets[b] += SHARD_READ(from->buckets[b]);
+        }
+    }
+}
+
+static double percentile_ms(const OpCounters *op, double p) {
+    uint64_t total = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) total += op->buckets[b];
+    if (total == 0) return 0.0;
+    uint64_t rank = (uint64_t)(p * total + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += op->buckets[b];
+        if (seen >= rank) {
+            uint64_t value = stats_bucket_value(b);
+            return (value < op->max_us ? value : op->max_us) / 1000.0;
+        }
+    }
+    return op->max_us / 1000.0;
+}
+
+static int copy_probes(Probe *out) {
+    pthread_mutex_lock(&probes_mutex);
+    int count = probe_count;
+    memcpy(out, probes, sizeof(Probe) * count);
+    pthread_mutex_unlock(&probes_mutex);
+    return count;
+}
+
+void stats_summary(char *buffer, size_t size) {
+    OpCounters *ops = malloc(sizeof(OpCounters) * MSG_TYPE_COUNT);
+    if (!ops) {
+        snprintf(buffer, size, "Out of memory\n");
+        return;
+    }
+    uint64_t bytes_in, bytes_out;
+    collect(ops, &bytes_in, &bytes_out);
+
+    size_t pos = 0;
+#define APPEND(...) \
+    do { if (pos < size) pos += snprintf(buffer + pos, size - pos, __VA_ARGS__); } while (0)
+    APPEND("%s %d up %lds bytes_in %llu bytes_out %llu\n", stats_role, stats_id,
+           (long)(time(NULL) - stats_started), (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+    Probe snapshot[STATS_MAX_PROBES];
+    int count = copy_probes(snapshot);
+    for (int i = 0; i < count; i++) APPEND("%s %ld\n", snapshot[i].name, snapshot[i].read());
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        const OpCounters *op = &ops[t];
+        if (op->count == 0) continue;
+        APPEND("%s %llu %llu %.3f %.3f %.3f %.3f\n", message_type_name(t), (unsigned long long)op->count,
+               (unsigned long long)op->errors, percentile_ms(op, 0.50), percentile_ms(op, 0.99),
+               percentile_ms(op, 0.999), op->max_us / 1000.0);
+    }
+    if (pos < size) lock_stats_summary(buffer + pos, size - pos);
+#undef APPEND
+    free(ops);
+}
+
+// Histogram bounds exported to Prometheus, in microseconds; each HDR bucket
+// is counted under the first bound its upper edge does not exceed
+static const uint64_t export_bounds_us[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                             100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+
+void stats_write_prometheus(FILE *out) {
+    OpCounters *ops = malloc(sizeof(OpCounters) * MSG_TYPE_COUNT);
+    if (!ops) return;
+    uint64_t bytes_in, bytes_out;
+    collect(ops, &bytes_in, &bytes_out);
+
+    fprintf(out, "# HELP docs_uptime_seconds Seconds since the server started.\n"
+                 "# TYPE docs_uptime_seconds gauge\ndocs_uptime_seconds{role=\"%s\",id=\"%d\"} %ld\n",
+            stats_role, stats_id, (long)(time(NULL) - stats_started));
+    fprintf(out, "# HELP docs_bytes_received_total Bytes of request frames received.\n"
+                 "# TYPE docs_bytes_received_total counter\ndocs_bytes_received_total %llu\n",
+            (unsigned long long)bytes_in);
+    fprintf(out, "# HELP docs_bytes_sent_total Bytes of frames sent.\n"
+                 "# TYPE docs_bytes_sent_total counter\ndocs_bytes_sent_total %llu\n",
+            (unsigned long long)bytes_out);
+
+    Probe snapshot[STATS_MAX_PROBES];
+    int count = copy_probes(snapshot);
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %ld\n", snapshot[i].name, snapshot[i].help,
+                snapshot[i].name, snapshot[i].type, snapshot[i].name, snapshot[i].read());
+    }
+
+    fprintf(out, "# HELP docs_requests_total Requests handled, by message type.\n"
+                 "# TYPE docs_requests_total counter\n");
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        if (ops[t].count) fprintf(out, "docs_requests_total{type=\"%s\"} %llu\n", message_type_name(t),
+                                  (unsigned long long)ops[t].count);
+    }
+    fprintf(out, "# HELP docs_request_errors_total Requests answered with an error status.\n"
+                 "# TYPE docs_request_errors_total counter\n");
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        if (ops[t].count) fprintf(out, "docs_request_errors_total{type=\"%s\"} %llu\n", message_type_name(t),
+                                  (unsigned long long)ops[t].errors);
+    }
+    fprintf(out, "# HELP docs_request_duration_seconds Time to handle a request, by message type.\n"
+                 "# TYPE docs_request_duration_seconds histogram\n");
+    int bound_count = sizeof(export_bounds_us) / sizeof(export_bounds_us[0]);
+    for (int t = 0; t < MSG_TYPE_COUNT; t++) {
+        const OpCounters *op = &ops[t];
+        if (op->count == 0) continue;
+        const char *name = message_type_name(t);
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (int i = 0; i < bound_count; i++) {
+            while (b < STATS_BUCKETS && stats_bucket_value(b) <= export_bounds_us[i]) cumulative += op->buckets[b++];
+            fprintf(out, "docs_request_duration_seconds_bucket{type=\"%s\",le=\"%g\"} %llu\n", name,
+                    export_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+        }
+        fprintf(out, "docs_request_duration_seconds_bucket{type=\"%s\",le=\"+Inf\"} %llu\n", name,
+                (unsigned long long)op->count);
+        fprintf(out, "docs_request_duration_seconds_sum{type=\"%s\"} %.6f\n", name, op->sum_us / 1e6);
+        fprintf(out, "docs_request_duration_seconds_count{type=\"%s\"} %llu\n", name,
+                (unsigned long long)op->count);
+    }
+    lock_stats_write_prometheus(out);
+    free(ops);
+}
+
+static void* metrics_main(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    while (1) {
+        int sock = accept(listener, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            log_formatted(LOG_ERROR, "Metrics listener failed (errno: %d)", errno);
+            break;
+        }
+        set_socket_timeouts(sock, 2, 2);
+
+        // Any request gets the metrics; read it so the client sees a clean close
+        char request[1024];
+        int got = 0;
+        while (got < (int)sizeof(request) - 1) {
+            ssize_t n = recv(sock, request + got, sizeof(request) - 1 - got, 0);
+            if (n <= 0) break;
+            got += n;
+            request[got] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        }
+
+        char *body = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&body, &length);
+        if (out) {
+            stats_write_prometheus(out);
+            fclose(out);
+            char header[256];
+            int header_len = snprintf(header, sizeof(header),
+                                      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\nConnection: close\r\n\r\n", length);
+            send(sock, header, header_len, MSG_NOSIGNAL);
+            size_t sent = 0;
+            while (sent < length) {
+                ssize_t n = send(sock, body + sent, length - sent, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                sent += n;
+            }
+            free(body);
+        }
+        close(sock);
+    }
+    close(listener);
+    return NULL;
+}
+
+int stats_serve(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return -1;
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        log_formatted(LOG_ERROR, "Cannot serve metrics on port %d (errno: %d)", port, errno);
+        close(listener);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_main, (void*)(intptr_t)listener) != 0) {
+        close(listener);
+        return -1;
+    }
+    pthread_detach(thread);
+    log_formatted(LOG_INFO, "Serving metrics on 127.0.0.1:%d", port);
+    return 0;
+}
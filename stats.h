@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "common.h"
+#include <stdint.h>
+#include <time.h>
+
+// Request telemetry for the NM and SS: for every MessageType a request
+// count, an error count (the last reply sent while handling it was not
+// SUCCESS) and a latency histogram, plus bytes received and sent. Each
+// thread updates its own shard with plain stores, so recording a request
+// takes no lock and no atomic read-modify-write; readers add the shards up.
+//
+// Servers also register counters and gauges read when a snapshot is taken
+// (cache hits, held locks, ...). A snapshot is returned for MSG_STATS and
+// served in Prometheus text format on 127.0.0.1 when a metrics port is set
+// (NM_METRICS_PORT, SS_METRICS_PORT).
+//
+// Histograms are log-linear: exact below 16 us, then 8 buckets per power of
+// two (within 12.5%), up to over an hour.
+
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS 256
+#define STATS_MAX_PROBES 16
+
+typedef struct {
+    struct timespec start;
+} StatsTimer;
+
+static inline int stats_bucket_index(uint64_t value) {
+    if (value < (2 << STATS_SUB_BITS)) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+    int index = (shift << STATS_SUB_BITS) + (int)(value >> shift);
+    return index < STATS_BUCKETS ? index : STATS_BUCKETS - 1;
+}
+
+// Largest value that falls in bucket `index`
+static inline uint64_t stats_bucket_value(int index) {
+    if (index < (2 << STATS_SUB_BITS)) return index;
+    int shift = (index >> STATS_SUB_BITS) - 1;
+    uint64_t sub = (index & ((1 << STATS_SUB_BITS) - 1)) + (1 << STATS_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+// Register this process's role ("nm" or "ss") and start accounting sent
+// frames. Call once before the servers' threads start.
+void stats_init(const char *role, int id);
+
+// A named value read at snapshot time; `type` is "counter" or "gauge"
+void stats_register(const char *name, const char *type, const char *help, long (*read)(void));
+
+// Bracket the handling of one request that arrived in a frame of
+// `frame_bytes`
+void stats_begin(int frame_bytes, StatsTimer *timer);
+void stats_end(int msg_type, const StatsTimer *timer);
+
+// Compact text for MSG_STATS: a header, the registered values, one line per
+// message type seen, "type count errors p50_ms p99_ms p999_ms max_ms", then
+// the lock lines of lock_stats_summary. Truncated to `size`.
+void stats_summary(char *buffer, size_t size);
+
+// Everything in Prometheus text exposition format
+void stats_write_prometheus(FILE *out);
+
+// Serve stats_write_prometheus over HTTP on 127.0.0.1:`port` from a thread
+// of its own. Returns 0, or -1 if the port cannot be bound.
+int stats_serve(int port);
+
+#endif // STATS_H
@@ -0,0 +1,116 @@
+#include "trace.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#define TRACE_EVENT_MAX 512
+
+static int trace_fd = -1;
+static int trace_pid = 0;
+static int sample_every = TRACE_SAMPLE_EVERY;
+static unsigned long long id_seed = 0;
+static unsigned long long id_counter = 0;
+static unsigned long long sample_counter = 0;
+
+static __thread unsigned long long current_trace = 0;
+static __thread int thread_id = 0;
+
+long long trace_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void write_event(const char *event, int length) {
+    // One write per event: appends from several processes never interleave
+    if (write(trace_fd, event, length) != length) {
+        log_formatted(LOG_WARNING, "Trace event lost (errno: %d)", errno);
+    }
+}
+
+void trace_init(const char *name) {
+    const char *path = getenv("DOCS_TRACE");
+    if (!path || !*path || trace_fd >= 0) return;
+
+    // Whoever creates the file starts the JSON array; the viewers accept it
+    // left open, with a trailing comma
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+        if (write(fd, "[\n", 2) != 2) {
+            close(fd);
+            fd = -1;
+        }
+    } else if (errno == EEXIST) {
+        fd = open(path, O_WRONLY | O_APPEND);
+    }
+    if (fd < 0) {
+        log_formatted(LOG_ERROR, "Cannot open trace file %s (errno: %d)", path, errno);
+        return;
+    }
+
+    trace_pid = getpid();
+    sample_every = get_env_int("DOCS_TRACE_SAMPLE", TRACE_SAMPLE_EVERY);
+    id_seed = ((unsigned long long)trace_pid << 32) ^ (unsigned long long)trace_now_us();
+    trace_fd = fd;
+
+    // Names in the trace come from usernames; keep them valid JSON
+    char label[MAX_USERNAME + 32];
+    snprintf(label, sizeof(label), "%s", name);
+    for (char *c = label; *c; c++) {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) *c = '_';
+    }
+    char event[TRACE_EVENT_MAX];
+    int length = snprintf(event, sizeof(event),
+                          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                          trace_pid, label);
+    write_event(event, length);
+    log_formatted(LOG_INFO, "Tracing to %s, 1 in %d client operations", path, sample_every);
+}
+
+unsigned long long trace_sample() {
+    if (trace_fd < 0 || sample_every <= 0) return 0;
+    if (__atomic_fetch_add(&sample_counter, 1, __ATOMIC_RELAXED) % sample_every != 0) return 0;
+
+    // splitmix64 over a per-process seed: distinct across clients, never 0
+    unsigned long long z = id_seed + __atomic_add_fetch(&id_counter, 1, __ATOMIC_RELAXED) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+unsigned long long trace_current() {
+    return current_trace;
+}
+
+void trace_set_current(unsigned long long trace_id) {
+    current_trace = trace_id;
+}
+
+void trace_record(unsigned long long trace_id, const char *name, long long start_us, long long end_us) {
+    if (!trace_id || trace_fd < 0) return;
+    if (!thread_id) thread_id = (int)syscall(SYS_gettid);
+
+    char event[TRACE_EVENT_MAX];
+    int length = snprintf(event, sizeof(event),
+                          "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+                          "\"args\":{\"trace\":\"%016llx\"}},\n",
+                          name, start_us, end_us - start_us, trace_pid, thread_id, trace_id);
+    if (length > 0 && length < (int)sizeof(event)) write_event(event, length);
+}
+
+void trace_received(unsigned long long trace_id, long long queued_us, long long dequeued_us) {
+    if (!trace_id || trace_fd < 0) return;
+    trace_record(trace_id, "queue", queued_us, dequeued_us);
+    trace_record(trace_id, "parse", dequeued_us, trace_now_us());
+}
+
+void trace_begin(TraceSpan *span, const char *name) {
+    span->name = name;
+    span->start_us = (current_trace && trace_fd >= 0) ? trace_now_us() : 0;
+}
+
+void trace_end(TraceSpan *span) {
+    if (span->start_us) trace_record(current_trace, span->name, span->start_us, trace_now_us());
+}
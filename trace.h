@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+// End-to-end request tracing. libdocs gives 1 in DOCS_TRACE_SAMPLE
+// operations a trace id and sends it in every message the operation causes
+// (the NM route, each SS exchange of a write session). The NM passes it on
+// to the SSs and name server shards it calls, and a primary SS to its
+// backups, so one id ties together the work in every process.
+//
+// A process with DOCS_TRACE naming a file appends a span there for every
+// stage a traced request passes through: queueing for a worker, parsing,
+// handling, calls to other servers, and on the SS lock setup, the commit
+// queue, merging, the disk write and replication. Events are in Chrome trace
+// format (chrome://tracing, ui.perfetto.dev); each is one write() to a file
+// opened for appending, so every process can share a single file. Time not
+// covered by any server span was spent on the network.
+//
+// Untraced requests cost a thread-local read per span.
+
+#define TRACE_SAMPLE_EVERY 100      // Client operations per traced one (DOCS_TRACE_SAMPLE)
+
+typedef struct {
+    const char *name;
+    long long start_us;          // 0 when the span is not recorded
+} TraceSpan;
+
+// Open DOCS_TRACE, naming this process `name` in the trace. Without it no
+// spans are recorded and trace_sample() returns 0; ids are still passed on.
+void trace_init(const char *name);
+
+// A new trace id for an operation that is sampled, otherwise 0
+unsigned long long trace_sample();
+
+// The trace the calling thread is working for (0 for none); servers set it
+// while handling a request and stamp it on the requests they send
+unsigned long long trace_current();
+void trace_set_current(unsigned long long trace_id);
+
+// Wall clock in microseconds, the trace's time base
+long long trace_now_us();
+
+// Record a span of `trace_id` from `start_us` to `end_us`
+void trace_record(unsigned long long trace_id, const char *name, long long start_us, long long end_us);
+
+// The reactor stages of a request that arrived at `queued_us`: waiting for
+// a worker until `dequeued_us`, then decoding until now
+void trace_received(unsigned long long trace_id, long long queued_us, long long dequeued_us);
+
+// A span of the current trace, from begin to end
+void trace_begin(TraceSpan *span, const char *name);
+void trace_end(TraceSpan *span);
+
+#endif // TRACE_H
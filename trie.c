@@ -1,4 +1,8 @@
 #include "trie.h"
+#include "lock_stats.h"
+
+LOCK_STATS_DEFINE(trie_lock_stats, "trie.lock");
+LOCK_STATS_DEFINE(folder_trie_lock_stats, "folder_trie.lock");
 
 TrieNode* create_trie_node() {
     TrieNode *node = malloc(sizeof(TrieNode));
@@ -14,9 +18,18 @@ Trie* init_trie() {
     Trie *trie = malloc(sizeof(Trie));
     trie->root = create_trie_node();
     pthread_rwlock_init(&trie->lock, NULL);
+    trie->on_change = NULL;
+    trie->change_ctx = NULL;
     return trie;
 }
 
+void trie_set_change_hook(Trie *trie, TrieChangeFn fn, void *ctx) {
+    RWLOCK_WRLOCK(&trie->lock, &trie_lock_stats);
+    trie->on_change = fn;
+    trie->change_ctx = ctx;
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
+}
+
 void free_trie_node(TrieNode *node) {
     if (!node) return;
     
@@ -42,7 +55,7 @@ void free_trie(Trie *trie) {
 }
 
 int trie_insert(Trie *trie, const char *filename, FileMetadata *meta) {
-    pthread_rwlock_wrlock(&trie->lock);
+    RWLOCK_WRLOCK(&trie->lock, &trie_lock_stats);
     
     TrieNode *current = trie->root;
     
@@ -50,7 +63,7 @@ int trie_insert(Trie *trie, const char *filename, FileMetadata *meta) {
         int index = (unsigned char)filename[i];
         
         if (index >= ALPHABET_SIZE) {
-            pthread_rwlock_unlock(&trie->lock);
+            RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
             return -1;
         }
         
@@ -68,13 +81,14 @@ int trie_insert(Trie *trie, const char *filename, FileMetadata *meta) {
         current->file_meta = malloc(sizeof(FileMetadata));
     }
     memcpy(current->file_meta, meta, sizeof(FileMetadata));
+    if (trie->on_change) trie->on_change(TRIE_CHANGE_PUT, filename, current->file_meta, trie->change_ctx);
     
-    pthread_rwlock_unlock(&trie->lock);
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
     return 0;
 }
 
 FileMetadata* trie_search(Trie *trie, const char *filename) {
-    pthread_rwlock_rdlock(&trie->lock);
+    RWLOCK_RDLOCK(&trie->lock, &trie_lock_stats);
     
     TrieNode *current = trie->root;
     
@@ -82,7 +96,7 @@ FileMetadata* trie_search(Trie *trie, const char *filename) {
         int index = (unsigned char)filename[i];
         
         if (index >= ALPHABET_SIZE || !current->children[index]) {
-            pthread_rwlock_unlock(&trie->lock);
+            RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
             return NULL;
         }
         
@@ -95,7 +109,7 @@ FileMetadata* trie_search(Trie *trie, const char *filename) {
         memcpy(result, current->file_meta, sizeof(FileMetadata));
     }
     
-    pthread_rwlock_unlock(&trie->lock);
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
     return result;
 }
 
@@ -142,14 +156,15 @@ int trie_delete_helper(TrieNode *node, const char *filename, int depth) {
 }
 
 int trie_delete(Trie *trie, const char *filename) {
-    pthread_rwlock_wrlock(&trie->lock);
+    RWLOCK_WRLOCK(&trie->lock, &trie_lock_stats);
     trie_delete_helper(trie->root, filename, 0);
-    pthread_rwlock_unlock(&trie->lock);
+    if (trie->on_change) trie->on_change(TRIE_CHANGE_DELETE, filename, NULL, trie->change_ctx);
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
     return 0;
 }
 
 int trie_update(Trie *trie, const char *filename, FileMetadata *meta) {
-    pthread_rwlock_wrlock(&trie->lock);
+    RWLOCK_WRLOCK(&trie->lock, &trie_lock_stats);
     
     TrieNode *current = trie->root;
     
@@ -157,7 +172,7 @@ int trie_update(Trie *trie, const char *filename, FileMetadata *meta) {
         int index = (unsigned char)filename[i];
         
         if (index >= ALPHABET_SIZE || !current->children[index]) {
-            pthread_rwlock_unlock(&trie->lock);
+            RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
             return -1;
         }
         
@@ -166,11 +181,44 @@ int trie_update(Trie *trie, const char *filename, FileMetadata *meta) {
     
     if (current && current->is_end_of_word && current->file_meta) {
         memcpy(current->file_meta, meta, sizeof(FileMetadata));
-        pthread_rwlock_unlock(&trie->lock);
+        if (trie->on_change) trie->on_change(TRIE_CHANGE_PUT, filename, current->file_meta, trie->change_ctx);
+        RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
         return 0;
     }
     
-    pthread_rwlock_unlock(&trie->lock);
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
+    return -1;
+}
+
+int trie_touch(Trie *trie, const char *filename, time_t accessed, const char *username) {
+    RWLOCK_WRLOCK(&trie->lock, &trie_lock_stats);
+    
+    TrieNode *current = trie->root;
+    
+    for (int i = 0; filename[i] != '\0'; i++) {
+        int index = (unsigned char)filename[i];
+        
+        if (index >= ALPHABET_SIZE || !current->children[index]) {
+            RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
+            return -1;
+        }
+        
+        current = current->children[index];
+    }
+    
+    if (current && current->is_end_of_word && current->file_meta) {
+        // Never move the access time backwards when batches arrive late
+        if (accessed >= current->file_meta->accessed) {
+            current->file_meta->accessed = accessed;
+            strncpy(current->file_meta->last_accessed_by, username, MAX_USERNAME - 1);
+            current->file_meta->last_accessed_by[MAX_USERNAME - 1] = '\0';
+            if (trie->on_change) trie->on_change(TRIE_CHANGE_TOUCH, filename, current->file_meta, trie->change_ctx);
+        }
+        RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
+        return 0;
+    }
+    
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
     return -1;
 }
 
@@ -191,22 +239,61 @@ void trie_collect_files(TrieNode *node, FileMetadata **files, int *count, int ma
 }
 
 int trie_get_all_files(Trie *trie, FileMetadata **files, int max_files) {
-    pthread_rwlock_rdlock(&trie->lock);
+    RWLOCK_RDLOCK(&trie->lock, &trie_lock_stats);
     
     int count = 0;
     trie_collect_files(trie->root, files, &count, max_files);
     
-    pthread_rwlock_unlock(&trie->lock);
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
     return count;
 }
 
+// Depth-first walk; `key` holds the path down to `node`
+void trie_walk(TrieNode *node, char *key, int depth, int max_depth, TrieVisitFn visit, void *ctx) {
+    if (node->is_end_of_word && node->file_meta) {
+        key[depth] = '\0';
+        visit(key, node->file_meta, ctx);
+    }
+    if (depth >= max_depth) return;
+
+    for (int i = 0; i < ALPHABET_SIZE; i++) {
+        if (node->children[i]) {
+            key[depth] = (char)i;
+            trie_walk(node->children[i], key, depth + 1, max_depth, visit, ctx);
+        }
+    }
+}
+
+void trie_for_each(Trie *trie, TrieVisitFn visit, void *ctx) {
+    char key[MAX_PATH];
+    RWLOCK_RDLOCK(&trie->lock, &trie_lock_stats);
+    trie_walk(trie->root, key, 0, MAX_PATH - 1, visit, ctx);
+    RWLOCK_UNLOCK(&trie->lock, &trie_lock_stats);
+}
+
 FolderTrie* init_folder_trie() {
     FolderTrie *trie = malloc(sizeof(FolderTrie));
     trie->root = create_trie_node();
     pthread_rwlock_init(&trie->lock, NULL);
+    trie->on_change = NULL;
+    trie->change_ctx = NULL;
     return trie;
 }
 
+void folder_trie_set_change_hook(FolderTrie *trie, TrieChangeFn fn, void *ctx) {
+    RWLOCK_WRLOCK(&trie->lock, &folder_trie_lock_stats);
+    trie->on_change = fn;
+    trie->change_ctx = ctx;
+    RWLOCK_UNLOCK(&trie->lock, &folder_trie_lock_stats);
+}
+
+void folder_trie_for_each(FolderTrie *trie, TrieVisitFn visit, void *ctx) {
+    char key[MAX_PATH];
+    RWLOCK_RDLOCK(&trie->lock, &folder_trie_lock_stats);
+    trie_walk(trie->root, key, 0, MAX_PATH - 1, visit, ctx);
+    RWLOCK_UNLOCK(&trie->lock, &folder_trie_lock_stats);
+}
+
 void free_folder_trie(FolderTrie *trie) {
     if (!trie) return;
     free_trie_node(trie->root);
@@ -215,13 +302,13 @@ void free_folder_trie(FolderTrie *trie) {
 }
 
 int folder_trie_insert(FolderTrie *trie, const char *path, FolderMetadata *meta) {
-    pthread_rwlock_wrlock(&trie->lock);
+    RWLOCK_WRLOCK(&trie->lock, &folder_trie_lock_stats);
     
     TrieNode *current = trie->root;
     for (int i = 0; path[i] != '\0'; i++) {
         int index = (unsigned char)path[i];
         if (index >= ALPHABET_SIZE) {
-            pthread_rwlock_unlock(&trie->lock);
+            RWLOCK_UNLOCK(&trie->lock, &folder_trie_lock_stats);
             return -1;
         }
         if (!current->children[index]) {
@@ -236,19 +323,20 @@ int folder_trie_insert(FolderTrie *trie, const char *path, FolderMetadata *meta)
     }
     // Store folder metadata in file_meta (we'll reuse the structure)
     memcpy(current->file_meta, meta, sizeof(FolderMetadata));
+    if (trie->on_change) trie->on_change(TRIE_CHANGE_PUT, path, current->file_meta, trie->change_ctx);
     
-    pthread_rwlock_unlock(&trie->lock);
+    RWLOCK_UNLOCK(&trie->lock, &folder_trie_lock_stats);
     return 0;
 }
 
 FolderMetadata* folder_trie_search(FolderTrie *trie, const char *path) {
-    pthread_rwlock_rdlock(&trie->lock);
+    RWLOCK_RDLOCK(&trie->lock, &folder_trie_lock_stats);
     
     TrieNode *current = trie->root;
     for (int i = 0; path[i] != '\0'; i++) {
         int index = (unsigned char)path[i];
         if (index >= ALPHABET_SIZE || !current->children[index]) {
-            pthread_rwlock_unlock(&trie->lock);
+            RWLOCK_UNLOCK(&trie->lock, &folder_trie_lock_stats);
             return NULL;
         }
         current = current->children[index];
@@ -260,13 +348,14 @@ FolderMetadata* folder_trie_search(FolderTrie *trie, const char *path) {
         memcpy(result, current->file_meta, sizeof(FolderMetadata));
     }
     
-    pthread_rwlock_unlock(&trie->lock);
+    RWLOCK_UNLOCK(&trie->lock, &folder_trie_lock_stats);
     return result;
 }
 
 int folder_trie_delete(FolderTrie *trie, const char *path) {
-    pthread_rwlock_wrlock(&trie->lock);
+    RWLOCK_WRLOCK(&trie->lock, &folder_trie_lock_stats);
     trie_delete_helper(trie->root, path, 0);
-    pthread_rwlock_unlock(&trie->lock);
+    if (trie->on_change) trie->on_change(TRIE_CHANGE_DELETE, path, NULL, trie->change_ctx);
+    RWLOCK_UNLOCK(&trie->lock, &folder_trie_lock_stats);
     return 0;
 }
@@ -5,6 +5,20 @@
 
 #define ALPHABET_SIZE 128  // ASCII
 
+// What changed in a trie, for its change hook
+typedef enum {
+    TRIE_CHANGE_PUT,     // Inserted or replaced; meta is the new value
+    TRIE_CHANGE_DELETE,  // Removed; meta is NULL
+    TRIE_CHANGE_TOUCH    // Access time moved forward; meta is the new value
+} TrieChange;
+
+// Called with the trie's write lock held, so calls arrive in the order the
+// changes were made. `meta` is a FileMetadata or a FolderMetadata.
+typedef void (*TrieChangeFn)(TrieChange change, const char *key, const void *meta, void *ctx);
+
+// Called for every entry by the *_for_each walkers, under the read lock
+typedef void (*TrieVisitFn)(const char *key, const void *meta, void *ctx);
+
 typedef struct TrieNode {
     struct TrieNode *children[ALPHABET_SIZE];
     int is_end_of_word;
@@ -14,11 +28,15 @@ typedef struct TrieNode {
 typedef struct {
     TrieNode *root;
     pthread_rwlock_t lock;
+    TrieChangeFn on_change;
+    void *change_ctx;
 } Trie;
 
 typedef struct {
     TrieNode *root;
     pthread_rwlock_t lock;
+    TrieChangeFn on_change;
+    void *change_ctx;
 } FolderTrie;
 
 // Add function declarations:
@@ -27,6 +45,8 @@ void free_folder_trie(FolderTrie *trie);
 int folder_trie_insert(FolderTrie *trie, const char *path, FolderMetadata *meta);
 FolderMetadata* folder_trie_search(FolderTrie *trie, const char *path);
 int folder_trie_delete(FolderTrie *trie, const char *path);
+void folder_trie_for_each(FolderTrie *trie, TrieVisitFn visit, void *ctx);
+void folder_trie_set_change_hook(FolderTrie *trie, TrieChangeFn fn, void *ctx);
 
 // Initialize trie
 Trie* init_trie();
@@ -46,7 +66,16 @@ int trie_delete(Trie *trie, const char *filename);
 // Update file metadata in trie
 int trie_update(Trie *trie, const char *filename, FileMetadata *meta);
 
+// Update only the access time fields of a file's metadata
+int trie_touch(Trie *trie, const char *filename, time_t accessed, const char *username);
+
 // Get all files (for listing)
 int trie_get_all_files(Trie *trie, FileMetadata **files, int max_files);
 
+// Visit every file without copying it out
+void trie_for_each(Trie *trie, TrieVisitFn visit, void *ctx);
+
+// Report every later insert, update, delete and touch to `fn`
+void trie_set_change_hook(Trie *trie, TrieChangeFn fn, void *ctx);
+
 #endif // TRIE_H